@@ -0,0 +1,131 @@
+/*
+ * bench-data measures the throughput of writing and reading the contents of
+ * files in the simulated filesystem. A file is written sequentially by
+ * appending blocks, then overwritten with blocks at random offsets, then read
+ * sequentially and at random offsets through views, which hand out the bytes
+ * where they are kept instead of copying them. The megabytes per second of
+ * each pass are printed.
+ *
+ * usage: bench-data.x [megabytes] [block size]
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fs-sim.h"
+
+static double now(void);
+static void report(const char pass[], unsigned long bytes, double elapsed);
+static unsigned long read_all(Fs_sim *files, unsigned long offset,
+                              unsigned long length);
+
+int main(int argc, char *argv[])
+{
+  Fs_sim files;
+  unsigned long megabytes = argc > 1 ? atol(argv[1]) : 256;
+  unsigned long block = argc > 2 ? atol(argv[2]) : 4096;
+  unsigned long size, blocks, i, seed = 1, checksum = 0;
+  double start;
+  char *buffer;
+
+  if (megabytes == 0 || block == 0)
+    return 1;
+
+  size = megabytes << 20;
+  blocks = size / block;
+  buffer = malloc(block);
+  if (buffer == NULL)
+    return 1;
+  for (i = 0; i < block; i++)
+    buffer[i] = (char) i;
+
+  mkfs(&files);
+  touch(&files, "data");
+
+  printf("%lu MB in blocks of %lu bytes\n", megabytes, block);
+  printf("%-18s %10s\n", "pass", "MB/s");
+
+  start = now();
+  for (i = 0; i < blocks; i++)
+    append_file(&files, "data", buffer, block);
+  report("sequential write", blocks * block, now() - start);
+
+  start = now();
+  for (i = 0; i < blocks; i++)
+  {
+    seed = seed * 1103515245UL + 12345;
+    write_file(&files, "data", (seed >> 16) % blocks * block, buffer, block);
+  }
+  report("random write", blocks * block, now() - start);
+
+  start = now();
+  checksum += read_all(&files, 0, blocks * block);
+  report("sequential read", blocks * block, now() - start);
+
+  start = now();
+  for (i = 0; i < blocks; i++)
+  {
+    seed = seed * 1103515245UL + 12345;
+    checksum += read_all(&files, (seed >> 16) % blocks * block, block);
+  }
+  report("random read", blocks * block, now() - start);
+
+  /* printed so the reads are not optimized away */
+  printf("checksum %lu\n", checksum);
+
+  rmfs(&files);
+  free(buffer);
+
+  return 0;
+}
+
+/*
+ * now returns the time in seconds from an arbitrary starting point.
+ */
+static double now(void)
+{
+  struct timespec time;
+
+  clock_gettime(CLOCK_MONOTONIC, &time);
+
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/*
+ * report prints the throughput of one pass.
+ *
+ * pass: The name of the pass.
+ * bytes: The number of bytes the pass wrote or read.
+ * elapsed: The seconds the pass took.
+ */
+static void report(const char pass[], unsigned long bytes, double elapsed)
+{
+  printf("%-18s %10.1f\n", pass, bytes / elapsed / (1 << 20));
+}
+
+/*
+ * read_all reads part of the file through a view, and returns the sum of the
+ * first and last byte of every piece, so each piece is touched without being
+ * copied.
+ *
+ * files: The filesystem.
+ * offset: Where the part starts.
+ * length: The number of bytes of the part.
+ */
+static unsigned long read_all(Fs_sim *files, unsigned long offset,
+                              unsigned long length)
+{
+  Fs_view view;
+  const char *bytes;
+  size_t piece;
+  unsigned long sum = 0;
+
+  if (read_open(files, "data", offset, length, &view) == 1)
+    while ((bytes = read_next(&view, &piece)) != NULL)
+      sum += (unsigned char) bytes[0] + (unsigned char) bytes[piece - 1];
+
+  return sum;
+}
@@ -0,0 +1,154 @@
+/*
+ * bench-threads measures the throughput of the simulated filesystem with
+ * several threads working on one shared tree, each in its own session. Most
+ * operations move into a directory of a shared part of the tree and list it,
+ * and the rest create and remove files in a directory of the thread's own.
+ * The same work is done by 1, 2, 4 and 8 threads, and the operations per
+ * second and the speedup over a single thread are printed.
+ *
+ * usage: bench-threads.x [operations per thread]
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "fs-sim.h"
+
+#define SHARED_DIRECTORIES 64
+#define SHARED_FILES 64
+#define MAX_THREADS 8
+
+/*
+ * id: The number of the thread.
+ * operations: The number of operations the thread carries out.
+ * files: The filesystem.
+ * entries: The number of entries the thread listed, so the listing is not
+ *          optimized away.
+ */
+typedef struct worker {
+  int id;
+  long operations;
+  Fs_sim files;
+  unsigned long entries;
+} Worker;
+
+static double now(void);
+static void *work(void *arg);
+
+int main(int argc, char *argv[])
+{
+  Fs_sim files;
+  Worker workers[MAX_THREADS];
+  pthread_t threads[MAX_THREADS];
+  long operations = argc > 1 ? atol(argv[1]) : 200000;
+  double start, elapsed, base = 0;
+  char name[32];
+  int i, j, count;
+
+  mkfs(&files);
+  mkdir(&files, "shared");
+  for (i = 0; i < SHARED_DIRECTORIES; i++)
+  {
+    sprintf(name, "shared/d%02d", i);
+    mkdir(&files, name);
+    for (j = 0; j < SHARED_FILES; j++)
+    {
+      sprintf(name, "shared/d%02d/f%02d", i, j);
+      touch(&files, name);
+    }
+  }
+  for (i = 0; i < MAX_THREADS; i++)
+  {
+    sprintf(name, "t%d", i);
+    mkdir(&files, name);
+  }
+
+  printf("%8s %14s %8s\n", "threads", "ops/s", "speedup");
+
+  for (count = 1; count <= MAX_THREADS; count *= 2)
+  {
+    start = now();
+
+    for (i = 0; i < count; i++)
+    {
+      workers[i].id = i;
+      workers[i].operations = operations;
+      workers[i].files = files;
+      workers[i].entries = 0;
+      pthread_create(&threads[i], NULL, work, &workers[i]);
+    }
+    for (i = 0; i < count; i++)
+      pthread_join(threads[i], NULL);
+
+    elapsed = now() - start;
+    if (count == 1)
+      base = operations / elapsed;
+
+    printf("%8d %14.0f %8.2f\n", count, count * operations / elapsed,
+           count * operations / elapsed / base);
+  }
+
+  rmfs(&files);
+
+  return 0;
+}
+
+/*
+ * now returns the time in seconds from an arbitrary starting point.
+ */
+static double now(void)
+{
+  struct timespec time;
+
+  clock_gettime(CLOCK_MONOTONIC, &time);
+
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/*
+ * work carries out the operations of one thread: nine out of ten move into a
+ * random shared directory, list it through a cursor and move back, and the
+ * tenth creates or removes a file in the directory of the thread.
+ *
+ * arg: The Worker of the thread.
+ */
+static void *work(void *arg)
+{
+  Worker *worker = arg;
+  Fs_session *session = session_open(&worker->files);
+  Fs_cursor cursor;
+  unsigned long seed = worker->id * 2654435761UL + 1;
+  char name[32];
+  long i;
+
+  for (i = 0; i < worker->operations; i++)
+  {
+    seed = seed * 1103515245UL + 12345;
+
+    if (i % 10 != 9)
+    {
+      sprintf(name, "/shared/d%02lu", (seed >> 16) % SHARED_DIRECTORIES);
+      session_cd(session, name);
+      if (session_ls_open(session, ".", &cursor))
+      {
+        while (ls_next(&cursor, NULL) != NULL)
+          worker->entries++;
+        session_ls_close(session, &cursor);
+      }
+      session_cd(session, "/");
+    }
+    else
+    {
+      sprintf(name, "/t%d/f%lu", worker->id, (seed >> 16) % 256);
+      if (!session_rm(session, name))
+        session_touch(session, name);
+    }
+  }
+
+  session_close(session);
+
+  return NULL;
+}
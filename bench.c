@@ -0,0 +1,557 @@
+/*
+ * bench measures the simulated filesystem on synthetic trees, timing every
+ * call of touch, mkdir, cd, ls, pwd, rm and rmfs. Four workloads are run, each
+ * on a filesystem of its own:
+ *
+ * wide: Files and directories created in one flat directory, which is then
+ *       listed, moved through and emptied.
+ * deep: A chain of nested directories, created and moved down, with a file
+ *       and a pwd at every level, then moved back up and removed.
+ * fanout: A tree in which every directory gets a random number of
+ *         subdirectories, reached by absolute paths.
+ * zipf: Lookups of the entries of a flat directory, with names drawn from a
+ *       Zipf distribution, as when a few names are much more popular.
+ *
+ * One line of comma-separated values is printed per workload and operation:
+ * the number of calls, the calls per second, and the 50th, 99th and 99.9th
+ * percentile latencies in nanoseconds. What ls and pwd print is thrown away.
+ *
+ * usage: bench.x [-n entries] [-d depth] [-f fan-out] [-s exponent]
+ *                [-l lookups] [-r seed]
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "fs-sim.h"
+
+#define OPERATIONS 7
+#define TOUCH 0
+#define MKDIR 1
+#define CD 2
+#define LS 3
+#define PWD 4
+#define RM 5
+#define RMFS 6
+
+/* the most characters a long takes printed, with its sign */
+#define LONG_DIGITS 20
+
+/*
+ * latencies: The latency of every call timed, in nanoseconds.
+ * count: The number of calls timed.
+ * size: The number of latencies there is room for.
+ * total: The time taken by all of them, in seconds.
+ */
+typedef struct timing {
+  unsigned long *latencies;
+  unsigned long count;
+  unsigned long size;
+  double total;
+} Timing;
+
+static const char *names[OPERATIONS] = {
+  "touch", "mkdir", "cd", "ls", "pwd", "rm", "rmfs"
+};
+
+static Timing timings[OPERATIONS];
+static unsigned long seed = 1;
+static FILE *results;
+
+static double now(void);
+static void record(int operation, double start);
+static void report(const char workload[]);
+static unsigned long random_below(unsigned long limit);
+static int compare(const void *a, const void *b);
+static void wide(long entries);
+static void deep(long depth);
+static char *copy_path(const char path[]);
+static void fanout(long entries, int fan_out);
+static void zipf(long entries, double exponent, long lookups);
+
+/*
+ * The calls timed are written between TIME_START and TIME_END, which add the
+ * time taken to the timing of the operation.
+ */
+#define TIME_START start = now()
+#define TIME_END(operation) record(operation, start)
+
+int main(int argc, char *argv[])
+{
+  long entries = 20000, depth = 2000, lookups = 100000;
+  double exponent = 1.0;
+  int fan_out = 8, option;
+
+  while ((option = getopt(argc, argv, "n:d:f:s:l:r:")) != -1)
+  {
+    switch (option)
+    {
+      case 'n':
+        entries = atol(optarg);
+        break;
+      case 'd':
+        depth = atol(optarg);
+        break;
+      case 'f':
+        fan_out = atoi(optarg);
+        break;
+      case 's':
+        exponent = atof(optarg);
+        break;
+      case 'l':
+        lookups = atol(optarg);
+        break;
+      case 'r':
+        seed = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-n entries] [-d depth] [-f fan-out] "
+                "[-s exponent] [-l lookups] [-r seed]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (entries < 1 || depth < 1 || fan_out < 1 || lookups < 1)
+  {
+    fprintf(stderr, "%s: the sizes must be positive\n", argv[0]);
+    return 1;
+  }
+
+  /* the results go to the real standard output, the listings nowhere */
+  fflush(stdout);
+  results = fdopen(dup(STDOUT_FILENO), "w");
+  if (results == NULL || freopen("/dev/null", "w", stdout) == NULL)
+  {
+    fprintf(stderr, "%s: cannot redirect the standard output\n", argv[0]);
+    return 1;
+  }
+
+  fprintf(results, "workload,operation,calls,calls_per_second,p50_ns,"
+          "p99_ns,p999_ns\n");
+
+  wide(entries);
+  report("wide");
+  deep(depth);
+  report("deep");
+  fanout(entries, fan_out);
+  report("fanout");
+  zipf(entries, exponent, lookups);
+  report("zipf");
+
+  fclose(results);
+
+  return 0;
+}
+
+/*
+ * now returns the time in seconds from an arbitrary starting point.
+ */
+static double now(void)
+{
+  struct timespec time;
+
+  clock_gettime(CLOCK_MONOTONIC, &time);
+
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/*
+ * record adds a call that began at start and has just ended to the timing of
+ * an operation.
+ *
+ * operation: TOUCH to RMFS.
+ * start: The time the call began, as returned by now.
+ */
+static void record(int operation, double start)
+{
+  Timing *timing = &timings[operation];
+  double elapsed = now() - start;
+
+  if (timing->count == timing->size)
+  {
+    timing->size = timing->size > 0 ? timing->size * 2 : 1024;
+    timing->latencies = realloc(timing->latencies,
+                                timing->size * sizeof(*timing->latencies));
+    if (timing->latencies == NULL)
+    {
+      fprintf(stderr, "bench: out of memory\n");
+      exit(1);
+    }
+  }
+
+  timing->latencies[timing->count++] = (unsigned long) (elapsed * 1e9);
+  timing->total += elapsed;
+}
+
+/*
+ * report prints the results of a workload for every operation it timed, and
+ * clears the timings for the next workload.
+ *
+ * workload: The name of the workload.
+ */
+static void report(const char workload[])
+{
+  Timing *timing;
+  int i;
+
+  for (i = 0; i < OPERATIONS; i++)
+  {
+    timing = &timings[i];
+    if (timing->count == 0)
+      continue;
+
+    qsort(timing->latencies, timing->count, sizeof(*timing->latencies),
+          compare);
+
+    fprintf(results, "%s,%s,%lu,%.0f,%lu,%lu,%lu\n", workload, names[i],
+            timing->count,
+            timing->total > 0 ? timing->count / timing->total : 0.0,
+            timing->latencies[timing->count * 50 / 100],
+            timing->latencies[timing->count * 99 / 100],
+            timing->latencies[timing->count * 999 / 1000]);
+
+    timing->count = 0;
+    timing->total = 0;
+  }
+
+  fflush(results);
+}
+
+/*
+ * random_below returns a pseudo-random number from 0 to limit - 1.
+ */
+static unsigned long random_below(unsigned long limit)
+{
+  unsigned long high;
+
+  /* two draws of 24 bits each, since the low bits of the seed are weak */
+  seed = (seed * 1103515245UL + 12345) & 0xffffffffUL;
+  high = seed >> 8;
+  seed = (seed * 1103515245UL + 12345) & 0xffffffffUL;
+
+  return ((high << 24) ^ (seed >> 8)) % limit;
+}
+
+/*
+ * compare orders latencies for qsort.
+ */
+static int compare(const void *a, const void *b)
+{
+  unsigned long first = *(const unsigned long *) a;
+  unsigned long second = *(const unsigned long *) b;
+
+  return first < second ? -1 : first > second;
+}
+
+/*
+ * wide creates files with random names and directories in one directory,
+ * lists it, moves into random directories and prints their paths, and
+ * removes the files again.
+ *
+ * entries: The number of files; a tenth as many directories are created.
+ */
+static void wide(long entries)
+{
+  Fs_sim files;
+  unsigned long first_seed = seed;
+  char name[32];
+  double start;
+  long i;
+
+  mkfs(&files);
+  mkdir(&files, "wide");
+  cd(&files, "wide");
+
+  for (i = 0; i < entries; i++)
+  {
+    sprintf(name, "f%07ld", random_below(entries * 10));
+    TIME_START;
+    touch(&files, name);
+    TIME_END(TOUCH);
+  }
+
+  for (i = 0; i < entries / 10; i++)
+  {
+    sprintf(name, "d%06ld", i);
+    TIME_START;
+    mkdir(&files, name);
+    TIME_END(MKDIR);
+  }
+
+  for (i = 0; i < 20; i++)
+  {
+    TIME_START;
+    ls(&files, ".");
+    TIME_END(LS);
+  }
+
+  for (i = 0; i < entries / 10; i++)
+  {
+    sprintf(name, "d%06ld", random_below(entries / 10 + 1));
+    TIME_START;
+    cd(&files, name);
+    TIME_END(CD);
+
+    TIME_START;
+    pwd(&files);
+    TIME_END(PWD);
+
+    TIME_START;
+    cd(&files, "..");
+    TIME_END(CD);
+  }
+
+  /* the same names are drawn again, so every file created is removed */
+  seed = first_seed;
+  for (i = 0; i < entries; i++)
+  {
+    sprintf(name, "f%07ld", random_below(entries * 10));
+    TIME_START;
+    rm(&files, name);
+    TIME_END(RM);
+  }
+
+  cd(&files, "/");
+  TIME_START;
+  rmfs(&files);
+  TIME_END(RMFS);
+}
+
+/*
+ * deep creates a chain of nested directories, moving down it with a file and
+ * a pwd at every level, moves back up listing every level, and removes the
+ * chain a level at a time from the bottom.
+ *
+ * depth: The number of levels.
+ */
+static void deep(long depth)
+{
+  Fs_sim files;
+  double start;
+  long i;
+
+  mkfs(&files);
+
+  for (i = 0; i < depth; i++)
+  {
+    TIME_START;
+    mkdir(&files, "d");
+    TIME_END(MKDIR);
+
+    TIME_START;
+    cd(&files, "d");
+    TIME_END(CD);
+
+    TIME_START;
+    touch(&files, "f");
+    TIME_END(TOUCH);
+
+    TIME_START;
+    pwd(&files);
+    TIME_END(PWD);
+  }
+
+  for (i = 0; i < depth; i++)
+  {
+    TIME_START;
+    ls(&files, ".");
+    TIME_END(LS);
+
+    TIME_START;
+    cd(&files, "..");
+    TIME_END(CD);
+
+    TIME_START;
+    rm(&files, "d");
+    TIME_END(RM);
+  }
+
+  TIME_START;
+  rmfs(&files);
+  TIME_END(RMFS);
+}
+
+/*
+ * copy_path returns a copy of a path allocated with malloc, exiting if
+ * memory ran out.
+ *
+ * path: The path.
+ */
+static char *copy_path(const char path[])
+{
+  char *copy = malloc(strlen(path) + 1);
+
+  if (copy == NULL)
+  {
+    fprintf(stderr, "bench: out of memory\n");
+    exit(1);
+  }
+
+  return strcpy(copy, path);
+}
+
+/*
+ * fanout builds a tree breadth-first, giving every directory from 1 to
+ * fan_out subdirectories and a file, then moves into random directories by
+ * their absolute paths, listing them and printing their paths, and removes
+ * the files.
+ *
+ * entries: The number of directories.
+ * fan_out: The greatest number of subdirectories of a directory.
+ */
+static void fanout(long entries, int fan_out)
+{
+  Fs_sim files;
+  char **paths = malloc(entries * sizeof(*paths)), name[4096];
+  long next = 1, i, j, count;
+  double start;
+
+  if (paths == NULL)
+  {
+    fprintf(stderr, "bench: out of memory\n");
+    exit(1);
+  }
+
+  mkfs(&files);
+  paths[0] = copy_path("");
+
+  for (i = 0; i < next && next < entries; i++)
+  {
+    count = 1 + random_below(fan_out);
+    for (j = 0; j < count && next < entries; j++)
+    {
+      /* room for the path of the directory and of the file in it */
+      if (strlen(paths[i]) + sizeof("/d/f") + LONG_DIGITS > sizeof(name))
+        break;
+      sprintf(name, "%s/d%ld", paths[i], j);
+      paths[next++] = copy_path(name);
+
+      TIME_START;
+      mkdir(&files, name);
+      TIME_END(MKDIR);
+
+      strcat(name, "/f");
+      TIME_START;
+      touch(&files, name);
+      TIME_END(TOUCH);
+    }
+  }
+
+  for (i = 1; i < next; i++)
+  {
+    j = 1 + random_below(next - 1);
+
+    TIME_START;
+    cd(&files, paths[j]);
+    TIME_END(CD);
+
+    TIME_START;
+    ls(&files, ".");
+    TIME_END(LS);
+
+    TIME_START;
+    pwd(&files);
+    TIME_END(PWD);
+  }
+
+  cd(&files, "/");
+  for (i = 1; i < next; i++)
+  {
+    sprintf(name, "%s/f", paths[i]);
+    TIME_START;
+    rm(&files, name);
+    TIME_END(RM);
+  }
+
+  TIME_START;
+  rmfs(&files);
+  TIME_END(RMFS);
+
+  for (i = 0; i < next; i++)
+    free(paths[i]);
+  free(paths);
+}
+
+/*
+ * zipf creates files and directories in one directory, then looks up names
+ * drawn from a Zipf distribution over them, the rank of each name being its
+ * number: every lookup moves into a directory and back, or lists a file.
+ *
+ * entries: The number of files, and of directories.
+ * exponent: The exponent of the distribution.
+ * lookups: The number of lookups.
+ */
+static void zipf(long entries, double exponent, long lookups)
+{
+  Fs_sim files;
+  double *cumulative = malloc(entries * sizeof(*cumulative)), sum = 0, start;
+  double target;
+  long i, low, high;
+  char name[32];
+
+  if (cumulative == NULL)
+  {
+    fprintf(stderr, "bench: out of memory\n");
+    exit(1);
+  }
+
+  for (i = 0; i < entries; i++)
+  {
+    sum += 1 / pow(i + 1, exponent);
+    cumulative[i] = sum;
+  }
+
+  mkfs(&files);
+  for (i = 0; i < entries; i++)
+  {
+    sprintf(name, "f%07ld", i);
+    touch(&files, name);
+    sprintf(name, "d%07ld", i);
+    mkdir(&files, name);
+  }
+
+  for (i = 0; i < lookups; i++)
+  {
+    /* finding the first rank whose cumulative weight reaches the target */
+    target = random_below(1000000000UL) / 1e9 * sum;
+    low = 0;
+    high = entries - 1;
+    while (low < high)
+    {
+      if (cumulative[(low + high) / 2] < target)
+        low = (low + high) / 2 + 1;
+      else
+        high = (low + high) / 2;
+    }
+
+    if (i % 2 == 0)
+    {
+      sprintf(name, "d%07ld", low);
+      TIME_START;
+      cd(&files, name);
+      TIME_END(CD);
+
+      TIME_START;
+      cd(&files, "..");
+      TIME_END(CD);
+    }
+    else
+    {
+      sprintf(name, "f%07ld", low);
+      TIME_START;
+      ls(&files, name);
+      TIME_END(LS);
+    }
+  }
+
+  TIME_START;
+  rmfs(&files);
+  TIME_END(RMFS);
+
+  free(cumulative);
+}
@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include "fs-sim.h"
+#include "file-checksum.h"
+
+/*
+ * print_file prints the size of a file and a checksum of its contents, for
+ * the public tests that check files too big to print whole.
+ *
+ * files: The filesystem.
+ * arg: The path of the file.
+ */
+void print_file(Fs_sim *files, const char arg[])
+{
+  Fs_view view;
+  const char *bytes;
+  size_t length, i;
+  unsigned long size = 0, sum = 0;
+
+  if (read_open(files, arg, 0, 100000, &view))
+  {
+    while ((bytes = read_next(&view, &length)) != NULL)
+    {
+      for (i = 0; i < length; i++)
+        sum = (sum * 31 + (unsigned char) bytes[i]) % 1000003;
+      size += length;
+    }
+  }
+
+  printf("%s: %lu bytes, checksum %lu\n", arg, size, sum);
+}
@@ -0,0 +1 @@
+void print_file(Fs_sim *files, const char arg[]);
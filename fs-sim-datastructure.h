@@ -1,17 +1,94 @@
 #if !defined(FS_SIM_DATASTRUCTURE)
 #define FS_SIM_DATASTRUCTURE
 
+/*
+ * Built with FS_SIM_THREADS, a directory holds a pthread_rwlock_t, which
+ * <pthread.h> only declares under -ansi if _POSIX_C_SOURCE is defined as
+ * 200112L or later before the first header is included.
+ */
+#if defined(FS_SIM_THREADS)
+#include <pthread.h>
+#endif
+
+/*
+ * The contents of a file are held in its file data, which keeps small files
+ * inline and bigger ones in fixed-size chunks. Its layout is private to
+ * fs-sim.c.
+ */
+struct file_data;
+
 /* The File structure defines the files in the simulated system. 
  *
  * name: The pointer points to the name of this file
  * next: Since files are saved in the directory using linked-list structue, this
  *       is a file pointer points to the next file in the current direcotry.
+ * prev: A file pointer points to the previous file in the current directory,
+ *       so that a file found through the name index can be unlinked without
+ *       walking the list again.
+ * inode: The inode of the file, which all of its names share, or NULL once a
+ *        name under a removed directory was given up. In a directory sharing
+ *        the entries of another, a file without an inode hides the entry of
+ *        that one with the same name.
+ * parent: The directory the file is saved in.
+ * link: The next name of the same file, in any directory.
  */
 typedef struct file {
   char *name;
   struct file *next;
+  struct file *prev;
+  struct inode *inode;
+  struct directory *parent;
+  struct file *link;
 } File;
 
+/*
+ * The Inode structure holds a file itself, as opposed to its names: a file
+ * made by touch has one name, and ln gives it more.
+ *
+ * id: The inode number of the file, which it keeps for as long as it has a
+ *     name, wherever mv moves it.
+ * links: The number of names the file has.
+ * data: The contents of the file, or NULL while it is empty.
+ * file: The first of the names of the file, the others following it through
+ *       their link pointers.
+ */
+typedef struct inode {
+  unsigned long id;
+  unsigned long links;
+  struct file_data *data;
+  File *file;
+} Inode;
+
+/*
+ * The name index is a hash table over the names of all files and
+ * subdirectories of one directory. It is only attached to directories holding
+ * many entries, and its layout is private to fs-sim.c.
+ */
+struct name_index;
+
+/*
+ * The filesystem state is shared by all directories of one simulated
+ * filesystem. It owns the pool the files and directories are allocated from,
+ * and its layout is private to fs-sim.c.
+ */
+struct fs_state;
+
+/*
+ * The Fs_usage structure tells what a subtree holds, as reported by du, or
+ * how much it may hold, as given to set_quota. The directory at the top of
+ * the subtree is not counted.
+ *
+ * files: The number of files in the subtree, a file counted once per name.
+ * directories: The number of directories in the subtree.
+ * name_bytes: The number of bytes of the names of all of them, not counting
+ *             the null bytes.
+ */
+typedef struct fs_usage {
+  unsigned long files;
+  unsigned long directories;
+  unsigned long name_bytes;
+} Fs_usage;
+
 /*
  * The Directory strucute defines the directories in the simulated system.
  *
@@ -23,6 +100,37 @@ typedef struct file {
  *       directory's parent.
  * f_head: A file pointer points to the head of the linked list of the files
  *         saved in the current directory.
+ * prev: A directory pointer points to the previous sub directory of the current
+ *       directory's parent.
+ * sub_tail: A directory pointer points to the last sub directory, so names
+ *           created in increasing order are appended without a list walk.
+ * f_tail: A file pointer points to the last file saved in the directory.
+ * count: The number of files and sub directories saved in the directory.
+ * index: The name index of the directory, or NULL while the directory is small
+ *        enough for the linked lists to be scanned directly.
+ * state: The state of the filesystem the directory belongs to.
+ * removed: 0 while the directory is in the filesystem. Once rm removes it, the
+ *          epoch it was removed in, until it is deallocated.
+ * held: 1 once cd has made the directory the current directory of an Fs_sim,
+ *       which copies of the Fs_sim may go on holding. Once it is removed,
+ *       only its contents are deallocated, and it is kept, as removed, until
+ *       the filesystem is.
+ * origin: The directory whose files and sub directories this one still shares
+ *         since cp copied it, or NULL once it has its own. A directory
+ *         sharing another's entries only has entries of its own standing in
+ *         for those of the other one with the same names, given to it when
+ *         the other one changed them or was given them (see prepare_change).
+ * clones: The first of the directories sharing the entries of this one.
+ * next_clone: The next directory sharing the entries of the same origin.
+ * prev_clone: The previous directory sharing the entries of the same origin.
+ * id: The inode number of the directory, which it keeps for as long as it
+ *     exists, wherever mv moves it.
+ * usage: What the subtree under the directory holds, kept up to date by every
+ *        command adding or removing anything in it.
+ * quota: The most the subtree may hold, a field of 0 meaning no limit.
+ * lock: The reader/writer lock guarding the linked lists and the name index of
+ *       the directory, only present when built with FS_SIM_THREADS. It comes
+ *       last, so the other fields are laid out the same either way.
  */
 typedef struct directory {
   char *name;
@@ -30,9 +138,170 @@ typedef struct directory {
   struct directory *sub;
   struct directory *next;
   File *f_head;
+  struct directory *prev;
+  struct directory *sub_tail;
+  File *f_tail;
+  unsigned long count;
+  struct name_index *index;
+  struct fs_state *state;
+  unsigned long removed;
+  int held;
+  struct directory *origin;
+  struct directory *clones;
+  struct directory *next_clone;
+  struct directory *prev_clone;
+  unsigned long id;
+  Fs_usage usage;
+  Fs_usage quota;
+#if defined(FS_SIM_THREADS)
+  pthread_rwlock_t lock;
+#endif
 } Directory;
 
+/*
+ * The Fs_memory structure reports the memory used by one simulated filesystem,
+ * as returned by memory_stats.
+ *
+ * allocations: The number of files, directories and name index blocks handed
+ *              out by the pool so far.
+ * frees: The number of them given back to the pool by rm.
+ * system_allocations: The number of malloc calls the pool made, which is much
+ *                     smaller than allocations since files and directories are
+ *                     carved out of large slabs.
+ * bytes_in_use: The number of bytes currently handed out.
+ * peak_bytes: The largest value bytes_in_use has reached.
+ * bytes_reserved: The number of bytes currently obtained from malloc.
+ * names: The number of distinct names of files and directories, each saved
+ *        once in the name table however many of them have it.
+ * name_references: The number of files and directories holding those names.
+ * name_bytes_saved: The number of bytes a copy of the name per file and
+ *                   directory would take on top of the names saved.
+ */
+typedef struct fs_memory {
+  unsigned long allocations;
+  unsigned long frees;
+  unsigned long system_allocations;
+  unsigned long bytes_in_use;
+  unsigned long peak_bytes;
+  unsigned long bytes_reserved;
+  unsigned long names;
+  unsigned long name_references;
+  unsigned long name_bytes_saved;
+} Fs_memory;
+
+/*
+ * The Fs_stats structure reports what the commands run on one simulated
+ * filesystem did, as returned by fs_stats. It is only filled in when fs-sim.c
+ * is built with FS_SIM_STATS.
+ *
+ * operations: The calls of each command, indexed by FS_STATS_TOUCH to
+ *             FS_STATS_RM:
+ *   calls: The number of calls.
+ *   successes: The number of calls returning 1.
+ *   failures: The number of the other calls.
+ *   latency: The number of calls taking from 2^i up to 2^(i+1) nanoseconds
+ *            in element i; the last element also counts the longer ones.
+ * lookups: The number of names looked up in a directory.
+ * lookup_nodes: The number of list nodes visited by the lookups.
+ * lookup_compares: The number of names compared by the lookups.
+ * inserts: The number of files and directories linked into a directory.
+ * insert_nodes: The number of list nodes visited to find where they go.
+ * insert_compares: The number of names compared to find where they go.
+ */
+#define FS_STATS_TOUCH 0
+#define FS_STATS_MKDIR 1
+#define FS_STATS_CD 2
+#define FS_STATS_LS 3
+#define FS_STATS_PWD 4
+#define FS_STATS_RM 5
+#define FS_STATS_OPERATIONS 6
+#define FS_STATS_BUCKETS 32
+
+typedef struct fs_stats {
+  struct {
+    unsigned long calls;
+    unsigned long successes;
+    unsigned long failures;
+    unsigned long latency[FS_STATS_BUCKETS];
+  } operations[FS_STATS_OPERATIONS];
+  unsigned long lookups;
+  unsigned long lookup_nodes;
+  unsigned long lookup_compares;
+  unsigned long inserts;
+  unsigned long insert_nodes;
+  unsigned long insert_compares;
+} Fs_stats;
+
+/*
+ * The Fs_entry structure describes a file or directory, as returned by
+ * stat_entry and stat_id.
+ *
+ * id: The inode number, which stat_id, ls_id and read_open_id find it by.
+ * is_dir: 1 for a directory and 0 for a file.
+ * links: The number of names of a file, or 1 for a directory.
+ * size: The number of bytes of a file, or the number of files and sub
+ *       directories saved in a directory.
+ */
+typedef struct fs_entry {
+  unsigned long id;
+  int is_dir;
+  unsigned long links;
+  unsigned long size;
+} Fs_entry;
+
+/*
+ * The Fs_cursor structure is used to go through the entries listed by ls in
+ * increasing order of names, as set up by ls_open and read by ls_next. The
+ * entries left are the files from file up to file_end and the directories from
+ * sub up to sub_end, where the end pointers are not included. directory is the
+ * directory the entries are in, which session_ls_open keeps locked until the
+ * cursor is closed. If pattern is not NULL, only the entries whose names match
+ * it are returned, and prefix_length is the length of its literal prefix,
+ * which the names of those entries all start with; the ranges then end at the
+ * first name without it, whatever their end pointers.
+ *
+ * If the entries are those of a directory sharing the entries of another
+ * while having some of its own, the entries of the other one left are the
+ * files from shared_file up to shared_file_end and the directories from
+ * shared_sub up to shared_sub_end. Each is only returned if none of the
+ * entries of the directory itself has its name.
+ */
+typedef struct fs_cursor {
+  File *file;
+  File *file_end;
+  Directory *sub;
+  Directory *sub_end;
+  Directory *directory;
+  const char *pattern;
+  unsigned long prefix_length;
+  File *shared_file;
+  File *shared_file_end;
+  Directory *shared_sub;
+  Directory *shared_sub_end;
+} Fs_cursor;
+
+/*
+ * The Fs_view structure is used to read the contents of a file without copying
+ * them, as set up by read_open and read by read_next, which returns them a
+ * piece at a time, each pointing into the chunk it is kept in. The bytes left
+ * are those of file from offset up to end. directory is the directory the file
+ * is in, which session_read_open keeps locked until the view is closed, along
+ * with the file.
+ */
+typedef struct fs_view {
+  File *file;
+  unsigned long offset;
+  unsigned long end;
+  Directory *directory;
+} Fs_view;
+
 /* Fs_sim is defined as the pointer type of the Directory structure. */
 typedef Directory *Fs_sim;
 
+/*
+ * A session is a current directory of a filesystem that one thread works in,
+ * as opened by session_open. Its layout is private to fs-sim.c.
+ */
+typedef struct fs_session Fs_session;
+
 #endif
@@ -0,0 +1,683 @@
+/*
+ * The following functions copy whole trees between a simulated filesystem and
+ * the filesystem of the host: import_fs builds a simulated tree from a host
+ * directory, and export_fs writes a simulated tree out to one. Both go through
+ * the tree with several threads, each taking the next directory to copy and
+ * handing out the directories under it, and create the entries of every
+ * directory in bulk, with touch_many and mkdir_many on the simulated side.
+ *
+ * They only use the session functions, each thread working in its own
+ * session, so the filesystem has to be built with FS_SIM_THREADS for more than
+ * one thread to be used; otherwise the calling thread does all the work.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "fs-sim-session.h"
+#include "fs-sim-host.h"
+
+#if defined(FS_SIM_THREADS)
+#include <pthread.h>
+
+#define MUTEX_LOCK(mutex) pthread_mutex_lock(mutex)
+#define MUTEX_UNLOCK(mutex) pthread_mutex_unlock(mutex)
+#define INIT_MUTEX(mutex) pthread_mutex_init(mutex, NULL)
+#define DESTROY_MUTEX(mutex) pthread_mutex_destroy(mutex)
+#define COND_WAIT(cond, mutex) pthread_cond_wait(cond, mutex)
+#define COND_SIGNAL(cond) pthread_cond_signal(cond)
+#define COND_BROADCAST(cond) pthread_cond_broadcast(cond)
+#define INIT_COND(cond) pthread_cond_init(cond, NULL)
+#define DESTROY_COND(cond) pthread_cond_destroy(cond)
+#else
+#define MUTEX_LOCK(mutex)
+#define MUTEX_UNLOCK(mutex)
+#define INIT_MUTEX(mutex)
+#define DESTROY_MUTEX(mutex)
+#define COND_WAIT(cond, mutex)
+#define COND_SIGNAL(cond)
+#define COND_BROADCAST(cond)
+#define INIT_COND(cond)
+#define DESTROY_COND(cond)
+#endif
+
+/* The contents of host files are read HOST_BUFFER_SIZE bytes at a time */
+#define HOST_BUFFER_SIZE 65536
+
+/*
+ * A directory waiting to be copied.
+ *
+ * path: The path to the directory in the simulated filesystem, from the top
+ *       of the tree copied, which is ".".
+ * host: The path to the directory on the host.
+ * next: The next directory waiting.
+ */
+typedef struct host_item {
+  char *path;
+  char *host;
+  struct host_item *next;
+} Host_item;
+
+/*
+ * The names found in one directory, along with the sizes of the files.
+ *
+ * names: The names.
+ * sizes: The size of each file, or NULL for directories.
+ * count: The number of names.
+ * size: The number of names there is room for.
+ */
+typedef struct host_names {
+  char **names;
+  unsigned long *sizes;
+  size_t count;
+  size_t size;
+} Host_names;
+
+/*
+ * A copy of a tree, shared by the threads doing it.
+ *
+ * files: The filesystem.
+ * top: The directory at the top of the tree, as it would be given to cd.
+ * export: 1 for export_fs and 0 for import_fs.
+ * items: The directories waiting to be copied, the last one handed out
+ *        first, so the tree is gone through depth first.
+ * pending: The number of directories waiting or being copied.
+ * failed: 1 once anything could not be copied.
+ * lock: The mutex guarding items, pending and failed.
+ * work: Signalled when a directory is handed out or the copy is finished.
+ */
+struct host_copy {
+  Fs_sim *files;
+  const char *top;
+  int export;
+  Host_item *items;
+  unsigned long pending;
+  int failed;
+#if defined(FS_SIM_THREADS)
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+#endif
+};
+
+/*
+ * Helper (static) functions.
+ *
+ * host_run copies a tree with a number of threads, each running host_work.
+ * host_push hands out a directory to be copied.
+ *
+ * import_directory and export_directory copy one directory, along with the
+ * contents of its files, which import_data and export_data copy.
+ *
+ * host_add and host_clear keep the names found in a directory, and host_join
+ * puts a path together.
+ */
+static int host_run(struct host_copy *copy, const char host[], int threads);
+#if defined(FS_SIM_THREADS)
+static void *host_worker(void *arg);
+#endif
+static void host_work(struct host_copy *copy);
+static int host_push(struct host_copy *copy, const char path[],
+                     const char host[], const char name[]);
+static int import_directory(Fs_session *session, const Host_item *item,
+                            struct host_copy *copy, char buffer[]);
+static int import_data(Fs_session *session, int directory,
+                       const char path[], const char name[], char buffer[]);
+static int export_directory(Fs_session *session, const Host_item *item,
+                            struct host_copy *copy);
+static int export_data(Fs_session *session, int directory,
+                       const char path[], const char name[]);
+static int host_add(Host_names *list, const char name[], unsigned long size,
+                    int sized);
+static void host_clear(Host_names *list);
+static char *host_join(const char path[], const char name[]);
+
+/*
+ * import_fs copies a directory tree of the host into the simulated
+ * filesystem, under a directory that must already exist: every directory,
+ * regular file and the contents of the files. Symbolic links and special
+ * files are skipped. The entries of each host directory are created in bulk,
+ * as by touch_many and mkdir_many, so each simulated directory is gone
+ * through once however many entries it gets. Directories that are already
+ * there are copied into, and files that are already there are left as they
+ * are.
+ *
+ * The function returns 1 if the whole tree was copied, and 0 if invalid
+ * arguments were passed in, the directory is not found, or anything on the
+ * host could not be read, memory ran out, or a host directory has the name of
+ * a simulated file. The other directories are copied all the same.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * host: The path to the host directory.
+ * arg: The directory the tree is copied into, as it would be given to cd.
+ * threads: The number of threads doing the copy, from 1 up to
+ *          FS_SIM_HOST_MAX_THREADS.
+ */
+int import_fs(Fs_sim *files, const char host[], const char arg[],
+              int threads)
+{
+  struct host_copy copy;
+
+  if (files == NULL || *files == NULL || host == NULL || arg == NULL)
+    return 0;
+
+  copy.files = files;
+  copy.top = arg;
+  copy.export = 0;
+
+  return host_run(&copy, host, threads);
+}
+
+/*
+ * export_fs copies a simulated directory tree onto the host, as the reverse
+ * of import_fs: every directory and file under the directory, with the
+ * contents of the files, is written under a host directory, which is made if
+ * it does not exist. Host directories that are already there are copied
+ * into, and host files that are already there are replaced.
+ *
+ * A file is read through a view, so its contents are written out from where
+ * they are kept, and its directory cannot be changed while they are.
+ *
+ * The function returns 1 if the whole tree was copied, and 0 if invalid
+ * arguments were passed in, the directory is not found, or anything could not
+ * be written on the host or memory ran out. The other directories are copied
+ * all the same.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * arg: The directory whose tree is copied, as it would be given to cd.
+ * host: The path to the host directory.
+ * threads: The number of threads doing the copy, from 1 up to
+ *          FS_SIM_HOST_MAX_THREADS.
+ */
+int export_fs(Fs_sim *files, const char arg[], const char host[],
+              int threads)
+{
+  struct host_copy copy;
+
+  if (files == NULL || *files == NULL || host == NULL || arg == NULL)
+    return 0;
+
+  /* mkdir itself is the one of the simulated filesystem */
+  if (mkdirat(AT_FDCWD, host, 0777) != 0 && errno != EEXIST)
+    return 0;
+
+  copy.files = files;
+  copy.top = arg;
+  copy.export = 1;
+
+  return host_run(&copy, host, threads);
+}
+
+/*
+ * host_run copies a tree, starting with its top directory. The calling thread
+ * is one of the threads doing the work, and the others are started for the
+ * copy and stopped once it is finished. It returns 1 if the whole tree was
+ * copied, and 0 if not.
+ *
+ * copy: the copy, with files, top and export filled in.
+ * host: the path to the host directory.
+ * threads: the number of threads.
+ */
+static int host_run(struct host_copy *copy, const char host[], int threads)
+{
+  Host_item *item;
+#if defined(FS_SIM_THREADS)
+  pthread_t workers[FS_SIM_HOST_MAX_THREADS];
+  int started = 0, i;
+#endif
+
+  copy->items = NULL;
+  copy->pending = 0;
+  copy->failed = 0;
+  INIT_MUTEX(&copy->lock);
+  INIT_COND(&copy->work);
+
+  if (!host_push(copy, NULL, host, NULL))
+    copy->failed = 1;
+
+#if defined(FS_SIM_THREADS)
+  if (threads > FS_SIM_HOST_MAX_THREADS)
+    threads = FS_SIM_HOST_MAX_THREADS;
+  while (started < threads - 1 &&
+         pthread_create(&workers[started], NULL, host_worker, copy) == 0)
+    started++;
+#else
+  (void) threads;
+#endif
+
+  host_work(copy);
+
+#if defined(FS_SIM_THREADS)
+  for (i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+#endif
+
+  /* the directories left are those nobody could copy */
+  while (copy->items != NULL)
+  {
+    item = copy->items;
+    copy->items = item->next;
+    free(item);
+  }
+
+  DESTROY_MUTEX(&copy->lock);
+  DESTROY_COND(&copy->work);
+
+  return !copy->failed;
+}
+
+#if defined(FS_SIM_THREADS)
+/*
+ * host_worker is the function the threads started by host_run run.
+ *
+ * arg: the copy.
+ */
+static void *host_worker(void *arg)
+{
+  host_work(arg);
+
+  return NULL;
+}
+#endif
+
+/*
+ * host_work copies the directories handed out in turn, in a session of its
+ * own working in the top directory, until no directory is waiting or being
+ * copied. A thread whose session cannot be set up does not copy anything.
+ *
+ * copy: the copy.
+ */
+static void host_work(struct host_copy *copy)
+{
+  Fs_session *session = session_open(copy->files);
+  char *buffer = copy->export ? NULL : malloc(HOST_BUFFER_SIZE);
+  Host_item *item;
+  int ok, result;
+
+  ok = session != NULL && (copy->export || buffer != NULL) &&
+       session_cd(session, copy->top) == 1;
+
+  MUTEX_LOCK(&copy->lock);
+  if (!ok)
+    copy->failed = 1;
+
+  while (ok && copy->pending > 0)
+  {
+    if (copy->items != NULL)
+    {
+      item = copy->items;
+      copy->items = item->next;
+      MUTEX_UNLOCK(&copy->lock);
+
+      result = copy->export ? export_directory(session, item, copy)
+                            : import_directory(session, item, copy, buffer);
+      free(item);
+
+      MUTEX_LOCK(&copy->lock);
+      if (!result)
+        copy->failed = 1;
+      if (--copy->pending == 0)
+        COND_BROADCAST(&copy->work);
+    }
+    else
+      COND_WAIT(&copy->work, &copy->lock);
+  }
+  MUTEX_UNLOCK(&copy->lock);
+
+  free(buffer);
+  session_close(session);
+}
+
+/*
+ * host_push hands out a directory to be copied, its two paths allocated
+ * along with it. It returns 0 if memory runs out and 1 otherwise.
+ *
+ * copy: the copy.
+ * path: the simulated path of the directory the new one is in, or NULL for
+ *       the top.
+ * host: the host path of the directory the new one is in, or of the top.
+ * name: the name of the new directory, or NULL for the top.
+ */
+static int host_push(struct host_copy *copy, const char path[],
+                     const char host[], const char name[])
+{
+  Host_item *item;
+  size_t size;
+
+  if (name == NULL)
+    size = sizeof(".") + strlen(host) + 1;
+  else
+    size = strlen(path) + strlen(host) + 2 * (strlen(name) + 2);
+
+  item = malloc(sizeof(*item) + size);
+  if (item == NULL)
+    return 0;
+
+  item->path = (char *) (item + 1);
+  if (name == NULL)
+    strcpy(item->path, ".");
+  else if (!strcmp(path, "."))
+    strcpy(item->path, name);
+  else
+    sprintf(item->path, "%s/%s", path, name);
+
+  item->host = item->path + strlen(item->path) + 1;
+  if (name == NULL)
+    strcpy(item->host, host);
+  else
+    sprintf(item->host, "%s/%s", host, name);
+
+  MUTEX_LOCK(&copy->lock);
+  item->next = copy->items;
+  copy->items = item;
+  copy->pending++;
+  COND_SIGNAL(&copy->work);
+  MUTEX_UNLOCK(&copy->lock);
+
+  return 1;
+}
+
+/*
+ * import_directory copies one host directory into the simulated filesystem:
+ * its sub directories and files are created in bulk, the contents of the
+ * files just created are copied, and the sub directories are handed out to be
+ * copied in turn. It returns 1 if everything in it was copied, and 0 if not.
+ *
+ * session: the session.
+ * item: the directory.
+ * copy: the copy.
+ * buffer: HOST_BUFFER_SIZE bytes the contents of files are read into.
+ */
+static int import_directory(Fs_session *session, const Host_item *item,
+                            struct host_copy *copy, char buffer[])
+{
+  Host_names files = {NULL, NULL, 0, 0}, directories = {NULL, NULL, 0, 0};
+  struct dirent *entry;
+  struct stat status;
+  DIR *directory;
+  int *created = NULL, ok = 1;
+  size_t i;
+
+  directory = opendir(item->host);
+  if (directory == NULL)
+    return 0;
+
+  /* the names are gathered first, the host handing them out in any order */
+  while (ok && (errno = 0, entry = readdir(directory)) != NULL)
+  {
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+      ;
+    else if (fstatat(dirfd(directory), entry->d_name, &status,
+                     AT_SYMLINK_NOFOLLOW) != 0)
+      ok = 0;
+    else if (S_ISDIR(status.st_mode))
+      ok = host_add(&directories, entry->d_name, 0, 0);
+    else if (S_ISREG(status.st_mode))
+      ok = host_add(&files, entry->d_name, (unsigned long) status.st_size, 1);
+  }
+  if (entry == NULL && errno != 0)
+    ok = 0;
+
+  if (ok && files.count > 0)
+  {
+    created = malloc(files.count * sizeof(*created));
+    ok = created != NULL;
+  }
+
+  /* directories already there are copied into, so they need no status */
+  ok = ok &&
+       session_mkdir_many(session, item->path,
+                          (const char **) directories.names,
+                          directories.count, NULL) == 1 &&
+       session_touch_many(session, item->path, (const char **) files.names,
+                          files.count, created) == 1;
+
+  for (i = 0; ok && i < files.count; i++)
+    if (created[i] && files.sizes[i] > 0)
+      ok = import_data(session, dirfd(directory), item->path, files.names[i],
+                       buffer);
+
+  for (i = 0; ok && i < directories.count; i++)
+    ok = host_push(copy, item->path, item->host, directories.names[i]);
+
+  closedir(directory);
+  free(created);
+  host_clear(&files);
+  host_clear(&directories);
+
+  return ok;
+}
+
+/*
+ * import_data copies the contents of a host file into the simulated file of
+ * the same name, HOST_BUFFER_SIZE bytes at a time. It returns 1 on success,
+ * and 0 if the host file could not be read or memory ran out.
+ *
+ * session: the session.
+ * directory: the open host directory the file is in.
+ * path: the simulated path of the directory the file is in.
+ * name: the name of the file.
+ * buffer: HOST_BUFFER_SIZE bytes the contents are read into.
+ */
+static int import_data(Fs_session *session, int directory,
+                       const char path[], const char name[], char buffer[])
+{
+  unsigned long offset = 0;
+  char *file_path;
+  ssize_t length;
+  int fd, ok;
+
+  file_path = host_join(path, name);
+  fd = openat(directory, name, O_RDONLY);
+  ok = file_path != NULL && fd >= 0;
+
+  while (ok && (length = read(fd, buffer, HOST_BUFFER_SIZE)) != 0)
+  {
+    if (length < 0)
+      ok = errno == EINTR;
+    else
+    {
+      ok = session_write_file(session, file_path, offset, buffer,
+                              (size_t) length) == 1;
+      offset += length;
+    }
+  }
+
+  if (fd >= 0)
+    close(fd);
+  free(file_path);
+
+  return ok;
+}
+
+/*
+ * export_directory copies one simulated directory onto the host: its entries
+ * are listed first, the contents of its files written out, and its sub
+ * directories made on the host and handed out to be copied in turn. It
+ * returns 1 if everything in it was copied, and 0 if not.
+ *
+ * session: the session.
+ * item: the directory.
+ * copy: the copy.
+ */
+static int export_directory(Fs_session *session, const Host_item *item,
+                            struct host_copy *copy)
+{
+  Host_names files = {NULL, NULL, 0, 0}, directories = {NULL, NULL, 0, 0};
+  Fs_cursor cursor;
+  const char *name;
+  int is_dir, ok, fd;
+  size_t i;
+
+  fd = open(item->host, O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+    return 0;
+
+  /* the names are copied out, so the directory is not kept locked */
+  ok = session_ls_open(session, item->path, &cursor) == 1;
+  if (ok)
+  {
+    while (ok && (name = ls_next(&cursor, &is_dir)) != NULL)
+      ok = is_dir ? host_add(&directories, name, 0, 0)
+                  : host_add(&files, name, 0, 0);
+    session_ls_close(session, &cursor);
+  }
+
+  for (i = 0; ok && i < files.count; i++)
+    ok = export_data(session, fd, item->path, files.names[i]);
+
+  for (i = 0; ok && i < directories.count; i++)
+    ok = (mkdirat(fd, directories.names[i], 0777) == 0 || errno == EEXIST) &&
+         host_push(copy, item->path, item->host, directories.names[i]);
+
+  close(fd);
+  host_clear(&files);
+  host_clear(&directories);
+
+  return ok;
+}
+
+/*
+ * export_data writes out a simulated file onto the host, replacing the host
+ * file of the same name. The pieces of its contents are written as a view
+ * hands them out, without being copied first. It returns 1 on success, and 0
+ * if the host file could not be written, the simulated file is gone, or
+ * memory ran out.
+ *
+ * session: the session.
+ * directory: the open host directory the file goes in.
+ * path: the simulated path of the directory the file is in.
+ * name: the name of the file.
+ */
+static int export_data(Fs_session *session, int directory,
+                       const char path[], const char name[])
+{
+  char *file_path;
+  const char *bytes;
+  size_t length;
+  ssize_t written;
+  Fs_view view;
+  int fd, ok;
+
+  file_path = host_join(path, name);
+  fd = openat(directory, name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  ok = file_path != NULL && fd >= 0 &&
+       session_read_open(session, file_path, 0, ULONG_MAX, &view) == 1;
+
+  if (ok)
+  {
+    while (ok && (bytes = read_next(&view, &length)) != NULL)
+    {
+      /* a write to the host may take less than a whole piece */
+      while (ok && length > 0)
+      {
+        written = write(fd, bytes, length);
+        if (written < 0)
+          ok = errno == EINTR;
+        else
+        {
+          bytes += written;
+          length -= written;
+        }
+      }
+    }
+    session_read_close(session, &view);
+  }
+
+  if (fd >= 0 && close(fd) != 0)
+    ok = 0;
+  free(file_path);
+
+  return ok;
+}
+
+/*
+ * host_add adds a copy of a name to the names found in a directory, growing
+ * the list as needed. It returns 0 if memory runs out and 1 otherwise.
+ *
+ * list: the list.
+ * name: the name.
+ * size: the size of the file, if sized is 1.
+ * sized: 1 to keep the size, and 0 for a list without sizes.
+ */
+static int host_add(Host_names *list, const char name[], unsigned long size,
+                    int sized)
+{
+  char **names;
+  unsigned long *sizes;
+  size_t grown;
+
+  if (list->count == list->size)
+  {
+    grown = list->size * 2 + 16;
+
+    names = realloc(list->names, grown * sizeof(*names));
+    if (names == NULL)
+      return 0;
+    list->names = names;
+
+    if (sized)
+    {
+      sizes = realloc(list->sizes, grown * sizeof(*sizes));
+      if (sizes == NULL)
+        return 0;
+      list->sizes = sizes;
+    }
+
+    list->size = grown;
+  }
+
+  list->names[list->count] = malloc(strlen(name) + 1);
+  if (list->names[list->count] == NULL)
+    return 0;
+  strcpy(list->names[list->count], name);
+  if (sized)
+    list->sizes[list->count] = size;
+  list->count++;
+
+  return 1;
+}
+
+/*
+ * host_clear deallocates the names found in a directory.
+ *
+ * list: the list.
+ */
+static void host_clear(Host_names *list)
+{
+  size_t i;
+
+  for (i = 0; i < list->count; i++)
+    free(list->names[i]);
+  free(list->names);
+  free(list->sizes);
+}
+
+/*
+ * host_join returns the simulated path of an entry of a directory, allocated
+ * with malloc, or NULL if memory runs out.
+ *
+ * path: the path of the directory, "." for the top.
+ * name: the name of the entry.
+ */
+static char *host_join(const char path[], const char name[])
+{
+  char *joined = malloc(strlen(path) + 1 + strlen(name) + 1);
+
+  if (joined != NULL)
+  {
+    if (!strcmp(path, "."))
+      strcpy(joined, name);
+    else
+      sprintf(joined, "%s/%s", path, name);
+  }
+
+  return joined;
+}
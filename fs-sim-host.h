@@ -0,0 +1,18 @@
+#if !defined(FS_SIM_HOST)
+#define FS_SIM_HOST
+
+#include "fs-sim-datastructure.h"
+
+/*
+ * Copying whole trees between a simulated filesystem and the filesystem of
+ * the host, as done by fs-sim-host.c. Programs that do not copy to or from
+ * the host need not include it.
+ */
+#define FS_SIM_HOST_MAX_THREADS 16
+
+int import_fs(Fs_sim *files, const char host[], const char arg[],
+              int threads);
+int export_fs(Fs_sim *files, const char arg[], const char host[],
+              int threads);
+
+#endif
@@ -0,0 +1,68 @@
+#if !defined(FS_SIM_SESSION)
+#define FS_SIM_SESSION
+
+#include <stddef.h>
+#include "fs-sim-datastructure.h"
+
+/*
+ * The sessions of the simulated filesystem, each with a current directory of
+ * its own, and the cursors and views they hand out. It is kept apart from
+ * fs-sim.h, whose mkdir cannot be declared along with the one of
+ * <sys/stat.h>, so code using the host filesystem can include it too.
+ */
+
+/*
+ * Returned by the session functions when the current directory of the session
+ * was removed by another session, and the argument does not lead away from it.
+ */
+#define FS_SIM_STALE (-1)
+
+Fs_session *session_open(Fs_sim *files);
+void session_close(Fs_session *session);
+int session_touch(Fs_session *session, const char arg[]);
+int session_mkdir(Fs_session *session, const char arg[]);
+int session_touch_many(Fs_session *session, const char arg[],
+                       const char *names[], size_t count, int status[]);
+int session_mkdir_many(Fs_session *session, const char arg[],
+                       const char *names[], size_t count, int status[]);
+int session_cd(Fs_session *session, const char arg[]);
+int session_ls(Fs_session *session, const char arg[]);
+int session_ls_page(Fs_session *session, const char arg[], const char after[],
+                    size_t limit, char resume[], size_t size);
+int session_ls_open(Fs_session *session, const char arg[], Fs_cursor *cursor);
+const char *ls_next(Fs_cursor *cursor, int *is_dir);
+void session_ls_close(Fs_session *session, Fs_cursor *cursor);
+void session_pwd(Fs_session *session);
+int session_pwd_path(Fs_session *session, char path[], size_t size);
+int session_rm(Fs_session *session, const char arg[]);
+int session_cp(Fs_session *session, const char source[], const char target[]);
+int session_mv(Fs_session *session, const char source[], const char target[]);
+int session_write_file(Fs_session *session, const char arg[],
+                       unsigned long offset, const char data[], size_t length);
+int session_append_file(Fs_session *session, const char arg[],
+                        const char data[], size_t length);
+int session_truncate_file(Fs_session *session, const char arg[],
+                          unsigned long size);
+int session_read_open(Fs_session *session, const char arg[],
+                      unsigned long offset, unsigned long length,
+                      Fs_view *view);
+const char *read_next(Fs_view *view, size_t *length);
+void session_read_close(Fs_session *session, Fs_view *view);
+int session_ln(Fs_session *session, const char source[], const char target[]);
+int session_stat_entry(Fs_session *session, const char arg[],
+                       Fs_entry *entry);
+int session_stat_id(Fs_session *session, unsigned long id, Fs_entry *entry);
+int session_ls_id(Fs_session *session, unsigned long id);
+int session_ls_open_id(Fs_session *session, unsigned long id,
+                       Fs_cursor *cursor);
+int session_read_open_id(Fs_session *session, unsigned long id,
+                         unsigned long offset, unsigned long length,
+                         Fs_view *view);
+int session_ls_recursive(Fs_session *session, const char arg[]);
+int session_find(Fs_session *session, const char arg[],
+                 const char pattern[]);
+int session_du(Fs_session *session, const char arg[], Fs_usage *usage);
+int session_set_quota(Fs_session *session, const char arg[],
+                      const Fs_usage *limit);
+
+#endif
@@ -6,36 +6,1201 @@
  * structure.
  */
 
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
 #include "fs-sim.h"
 
 /*
- * Four helper (static) functions.
+ * When built with FS_SIM_THREADS defined, sessions can be used by several
+ * threads at the same time. Every directory then has a reader/writer lock
+ * guarding its linkedlists and name index. Since ln lets a file be reached
+ * through several directories, the contents of files are guarded by inode
+ * locks instead, reader/writer locks each shared by the files whose inode
+ * numbers fall on it. The pool, the garbage list, the epochs, the handle table
+ * and the reference counts of the chunks of file data each have a mutex, and
+ * every shard of the name table a reader/writer lock. Locks are always taken
+ * in the order directory lock, inode lock, garbage list mutex, epoch mutex,
+ * name table lock, handle table mutex, data mutex, pool mutex, and a command
+ * never holds more than one inode lock or name table lock. It never holds
+ * more than one directory lock either, except rm, which locks the directories
+ * under one it removes from the top down while it gives up the names of files
+ * with names elsewhere.
+ *
+ * Every command also holds the clone lock for reading while it runs, taken
+ * before anything else. A command changing what directories share, which
+ * includes any change to a directory cp has left sharing entries with others,
+ * holds it for writing instead and runs alone, so copying shared entries
+ * needs no directory locks. Commands in directories sharing nothing still
+ * run side by side with each other and with those only looking at shared
+ * ones.
+ *
+ * Removed directories are deallocated using epochs rather than by locking
+ * every other session out. Every command records the epoch it began in, and
+ * the epoch only advances once no command that began two epochs before is
+ * still running. A directory removed in some epoch is therefore deallocated
+ * once the epoch is two further on, when every command that could have found
+ * it has finished, and no session is standing in it.
+ *
+ * Without FS_SIM_THREADS all of the locking compiles away.
+ */
+#if defined(FS_SIM_THREADS)
+#define READ_LOCK(lock) pthread_rwlock_rdlock(lock)
+#define WRITE_LOCK(lock) pthread_rwlock_wrlock(lock)
+#define UNLOCK(lock) pthread_rwlock_unlock(lock)
+#define INIT_LOCK(lock) pthread_rwlock_init(lock, NULL)
+#define DESTROY_LOCK(lock) pthread_rwlock_destroy(lock)
+#define MUTEX_LOCK(mutex) pthread_mutex_lock(mutex)
+#define MUTEX_UNLOCK(mutex) pthread_mutex_unlock(mutex)
+#define INIT_MUTEX(mutex) pthread_mutex_init(mutex, NULL)
+#define DESTROY_MUTEX(mutex) pthread_mutex_destroy(mutex)
+#define COND_WAIT(cond, mutex) pthread_cond_wait(cond, mutex)
+#define COND_SIGNAL(cond) pthread_cond_signal(cond)
+#define COND_BROADCAST(cond) pthread_cond_broadcast(cond)
+#define INIT_COND(cond) pthread_cond_init(cond, NULL)
+#define DESTROY_COND(cond) pthread_cond_destroy(cond)
+#else
+#define READ_LOCK(lock)
+#define WRITE_LOCK(lock)
+#define UNLOCK(lock)
+#define INIT_LOCK(lock)
+#define DESTROY_LOCK(lock)
+#define MUTEX_LOCK(mutex)
+#define MUTEX_UNLOCK(mutex)
+#define INIT_MUTEX(mutex)
+#define DESTROY_MUTEX(mutex)
+#define COND_WAIT(cond, mutex)
+#define COND_SIGNAL(cond)
+#define COND_BROADCAST(cond)
+#define INIT_COND(cond)
+#define DESTROY_COND(cond)
+#endif
+
+/*
+ * Built with FS_SIM_STATS, the commands time themselves and count their calls
+ * and what the name lookups and inserts go through in the Fs_stats of the
+ * filesystem. Otherwise these macros compile away, and so do the counters the
+ * lookups and inserts keep in local variables.
+ */
+#if defined(FS_SIM_STATS)
+#define STATS_START(session) ((session)->started = stats_clock())
+#define STATS_END(session, operation, result) \
+  stats_operation(session, operation, result)
+#define STATS_LOOKUP(state, nodes, compares) \
+  stats_names(state, 0, nodes, compares)
+#define STATS_INSERT(state, nodes, compares) \
+  stats_names(state, 1, nodes, compares)
+#else
+#define STATS_START(session)
+#define STATS_END(session, operation, result) ((void) (result))
+#define STATS_LOOKUP(state, nodes, compares) ((void) (nodes), (void) (compares))
+#define STATS_INSERT(state, nodes, compares) ((void) (nodes), (void) (compares))
+#endif
+
+#if !defined(FS_SIM_COMPACT)
+/*
+ * The name index is a chained hash table over the names of the files and sub
+ * directories of one directory, used in place of scanning both linked lists.
+ * It is attached once a directory holds INDEX_THRESHOLD entries and it grows
+ * incrementally: when the table gets full, a table of twice the size is
+ * allocated and the chains are moved over a few buckets per insertion or
+ * removal, so no single touch or mkdir pays for rehashing every entry.
+ *
+ * hash: The hash value of the name of the entry.
+ * is_dir: 1 if node points to a Directory, 0 if it points to a File.
+ * node: The file or sub directory holding the name.
+ * next: The next entry in the same bucket.
+ */
+typedef struct index_entry {
+  unsigned long hash;
+  int is_dir;
+  void *node;
+  struct index_entry *next;
+} Index_entry;
+
+/*
+ * Since the hash table knows nothing about order, the index also samples each
+ * of the two sorted linkedlists: it keeps every INDEX_SAMPLE_GAP-th node or
+ * so in an array sorted by name, the first node of the list always being the
+ * first sample. A name is found in order by binary search over the samples
+ * and a walk of at most a gap from there, which is how ls_page starts a page
+ * deep into a huge directory. Adding a node makes the gap it falls in longer,
+ * and a gap twice as long as it should be is split in two; removing a sampled
+ * node puts the next one in its place.
+ *
+ * node: The sampled file or sub directory.
+ * count: The number of nodes from node up to the next sample.
+ */
+typedef struct index_sample {
+  void *node;
+  unsigned long count;
+} Index_sample;
+
+/*
+ * state: The state of the filesystem the index is allocated from.
+ * table: The old (0) and the new (1) bucket arrays. table[1] is only in use
+ *        while the index is being grown.
+ * size: The number of buckets of each table, always a power of two.
+ * used: The number of entries saved in each table.
+ * rehash: The next bucket of table[0] to be moved into table[1], or -1 if the
+ *         index is not being grown.
+ * samples: The samples of the files (0) and of the sub directories (1), or
+ *          NULL if memory ran out, in which case the list is walked instead.
+ * sample_count: The number of samples of each list.
+ * sample_size: The number of slots of each array of samples.
+ */
+struct name_index {
+  struct fs_state *state;
+  Index_entry **table[2];
+  unsigned long size[2];
+  unsigned long used[2];
+  long rehash;
+  Index_sample *samples[2];
+  unsigned long sample_count[2];
+  unsigned long sample_size[2];
+};
+
+#define INDEX_THRESHOLD 16
+#define INDEX_INITIAL_SIZE 32
+#define INDEX_REHASH_STEPS 4
+#define INDEX_SAMPLE_GAP 64
+#define INDEX_SAMPLES(count) (((count) + INDEX_SAMPLE_GAP - 1) / \
+                              INDEX_SAMPLE_GAP)
+#else
+/*
+ * When built with FS_SIM_COMPACT defined, the name index is instead an array
+ * of all files and sub directories of one directory sorted by name, looked up
+ * by binary search and listed by ls in a single pass. Every directory holding
+ * an entry has one. A name shorter than INDEX_INLINE bytes is saved in the
+ * entry itself, so most lookups and listings never touch the files and
+ * directories; of a longer one only the first INDEX_INLINE bytes are, the rest
+ * being read from the name saved with the node.
+ *
+ * The array is cut into blocks of at most INDEX_BLOCK_SIZE entries, each
+ * sorted and all of them in order, so adding or removing an entry only shifts
+ * the entries of its block, however big the directory is. A name is found by
+ * binary search over the last names of the blocks and then in one block. A
+ * full block is split in two, except that a name going after all others
+ * starts a new block, so names added in increasing order, as by touch_many,
+ * fill the blocks. An emptied block is given back, and a block left a
+ * quarter full takes in the next one if it has room for it.
+ *
+ * node: The file or sub directory holding the name.
+ * is_dir: 1 if node points to a Directory, 0 if it points to a File.
+ * length: The length of the name, or 255 if it is longer.
+ * name: The name if it is shorter than INDEX_INLINE bytes, null-terminated,
+ *       and its first INDEX_INLINE bytes otherwise.
+ */
+#define INDEX_INLINE (32 - sizeof(void *) - 2)
+
+typedef struct index_entry {
+  void *node;
+  unsigned char is_dir;
+  unsigned char length;
+  char name[INDEX_INLINE];
+} Index_entry;
+
+/*
+ * entries: The entries of the block, sorted by name.
+ * count: The number of entries.
+ * size: The number of slots of entries.
+ */
+typedef struct index_block {
+  Index_entry *entries;
+  unsigned long count;
+  unsigned long size;
+} Index_block;
+
+/*
+ * state: The state of the filesystem the index is allocated from.
+ * blocks: The blocks, none of them empty, in order of their names.
+ * block_count: The number of blocks.
+ * block_size: The number of slots of blocks.
+ */
+struct name_index {
+  struct fs_state *state;
+  Index_block *blocks;
+  unsigned long block_count;
+  unsigned long block_size;
+};
+
+#define INDEX_THRESHOLD 1
+#define INDEX_INITIAL_SIZE 4
+#define INDEX_BLOCK_SIZE 128
+#define INDEX_BLOCKS(count) (((count) + INDEX_BLOCK_SIZE - 1) / \
+                             INDEX_BLOCK_SIZE)
+#endif
+
+/*
+ * Files and directories are allocated from a pool owned by the filesystem
+ * state, and so are the names they point to. Blocks up to
+ * POOL_CLASSES * POOL_GRAIN bytes are rounded up to a multiple of POOL_GRAIN
+ * and carved out of POOL_SLAB_SIZE-byte slabs; freed blocks are kept on a
+ * free list per size class for reuse. Bigger blocks are malloc'ed one by one
+ * and kept on a list. rmfs releases the slabs and the list instead of walking
+ * the tree.
+ *
+ * Pool_block: A free block, linked into the free list of its size class.
+ * Pool_slab: The header of a slab, linked into the list of all slabs.
+ * Pool_large: The header of a big block, linked into the list of big blocks.
+ */
+#define POOL_GRAIN 16
+#define POOL_CLASSES 16
+#define POOL_SLAB_SIZE 65536
+
+typedef struct pool_block {
+  struct pool_block *next;
+} Pool_block;
+
+typedef struct pool_slab {
+  struct pool_slab *next;
+  double align;
+} Pool_slab;
+
+typedef struct pool_large {
+  struct pool_large *prev;
+  struct pool_large *next;
+  size_t size;
+  double align;
+} Pool_large;
+
+/*
+ * The contents of a file are kept in its file data. A file of up to
+ * DATA_INLINE_SIZE bytes holds them right after the file_data header, which
+ * is allocated only as big as they need. A bigger one holds a table of
+ * chunks of DATA_CHUNK_SIZE bytes instead, each after a Data_chunk header, in
+ * which a NULL slot is a hole reading as zeros. The bytes past the end of the
+ * file, inline or in its last chunk, are always zero, so a file grows without
+ * clearing them.
+ *
+ * Chunks are counted by the files holding them, so cp shares them between a
+ * file and its copy, and a chunk held by several files is copied before it is
+ * written. They are carved out of slabs of DATA_SLAB_CHUNKS chunks, and freed
+ * chunks are kept on a free list of their own.
+ *
+ * No file grows past DATA_MAX_SIZE bytes, so the number of chunks covering
+ * its size can be worked out without overflowing.
+ *
+ * size: The number of bytes of the file.
+ * capacity: The number of bytes that fit inline, or 0 once the file holds
+ *           chunks.
+ * slots: The number of slots of the table of chunks, which cover at least
+ *        size bytes.
+ * chunks: The table of chunks.
+ * references: The number of files holding the chunk.
+ */
+#define DATA_CHUNK_SIZE 4096
+#define DATA_INLINE_SIZE 192
+#define DATA_SLAB_CHUNKS 16
+#define DATA_END ULONG_MAX
+#define DATA_MAX_SIZE (ULONG_MAX - DATA_CHUNK_SIZE)
+#define DATA_BYTES(data) ((char *) ((data) + 1))
+#define DATA_BLOCK_SIZE(capacity) (sizeof(struct file_data) + (capacity))
+#define CHUNK_BYTES(chunk) ((char *) ((chunk) + 1))
+#define CHUNK_BLOCK_SIZE (sizeof(Data_chunk) + DATA_CHUNK_SIZE)
+
+typedef struct data_chunk {
+  unsigned long references;
+} Data_chunk;
+
+struct file_data {
+  unsigned long size;
+  unsigned long capacity;
+  unsigned long slots;
+  Data_chunk **chunks;
+};
+
+/* holes in files are read from here */
+static const char zero_chunk[DATA_CHUNK_SIZE];
+
+/*
+ * The names of all files and directories of a filesystem are interned in its
+ * name table: every distinct name is saved once, right after a Name header,
+ * and counted by the files and directories holding it. The table is a hash
+ * table split into NAME_SHARDS shards by the low bits of the hash, each with
+ * its own lock and bucket array, which doubles in size once it holds as many
+ * names as buckets.
+ *
+ * Since every name in the filesystem is in the table, a name looked up and
+ * not found there is in no directory, and one found is held by an entry only
+ * if that entry points to the same Name; check_name compares pointers only.
+ *
+ * Name:
+ *   next: The next name in the same bucket.
+ *   hash: The hash value of the name.
+ *   references: The number of files and directories holding the name.
+ *
+ * Name_shard:
+ *   buckets: The bucket array, or NULL until the first name is added.
+ *   size: The number of buckets, a power of two.
+ *   names: The number of names held by some file or directory.
+ *   references: The number of files and directories holding them.
+ *   bytes_saved: The bytes a copy of each name per file and directory would
+ *                take beyond the copies saved, not counting the headers.
+ *   lock: The reader/writer lock guarding the shard.
+ */
+#define NAME_SHARDS 16
+#define NAME_INITIAL_SIZE 64
+#define NAME_RECORD(name) ((Name *) (name) - 1)
+#define NAME_HASH(name) (((const Name *) (name) - 1)->hash)
+#define NAME_SHARD(state, hash) (&(state)->names[(hash) & (NAME_SHARDS - 1)])
+#define NAME_BUCKET(shard, hash) \
+  (&(shard)->buckets[((hash) / NAME_SHARDS) & ((shard)->size - 1)])
+
+typedef struct name {
+  struct name *next;
+  unsigned long hash;
+  unsigned long references;
+} Name;
+
+typedef struct name_shard {
+  Name **buckets;
+  unsigned long size;
+  unsigned long names;
+  unsigned long references;
+  unsigned long bytes_saved;
+#if defined(FS_SIM_THREADS)
+  pthread_rwlock_t lock;
+#endif
+} Name_shard;
+
+/*
+ * The inode number of a file or directory is its slot in the handle table of
+ * the filesystem, so it is found by its number without going through any
+ * directory. Slot 0 is never used, which makes the root number 1. The slots
+ * given up are kept on a free list for reuse, and the table doubles in size
+ * once every slot is in use.
+ *
+ * A file or directory is only found through its slot while no directory
+ * above it was removed. Finding that out takes going up to the root, so the
+ * slot remembers the path generation it was last found in the filesystem in,
+ * and it is only gone up again once a directory was removed or moved since.
+ *
+ * directory: The directory in the slot, or NULL.
+ * inode: The inode of the file in the slot, or NULL.
+ * checked: The path generation the slot was last found in the filesystem in,
+ *          or 0.
+ * serial: The number of times the slot was given up, which tells a file
+ *         found through it apart from one taking the slot over later.
+ * next: The next free slot, or 0.
+ *
+ * The contents of a file are guarded by inode lock INODE_LOCK finds for its
+ * inode number, one of INODE_LOCKS, rather than by a lock of its own.
+ */
+#define HANDLE_INITIAL_SIZE 64
+#define INODE_LOCKS 64
+#define INODE_LOCK(state, inode) \
+  (&(state)->inode_locks[(inode)->id & (INODE_LOCKS - 1)])
+
+typedef struct handle {
+  Directory *directory;
+  Inode *inode;
+  unsigned long checked;
+  unsigned long serial;
+  unsigned long next;
+} Handle;
+
+/*
+ * The path cache of a session remembers which directory a path with more than
+ * one component led to, so resolving it again takes a single lookup instead of
+ * one lookup per component. It is a direct-mapped table of PATH_CACHE_SLOTS
+ * entries, so it never grows, and only paths shorter than PATH_CACHE_LENGTH
+ * are cached.
+ *
+ * Creating directories or files never changes where an existing path leads,
+ * but removing or moving a directory can, so rm and mv simply advance the
+ * generation of the filesystem, which makes all existing entries stale at
+ * once.
+ *
+ * generation: The generation the entry was saved in, or 0 if the slot is empty.
+ * hash: The hash value of the starting directory and the path.
+ * start: The directory the path was resolved from.
+ * target: The directory the path led to.
+ * path: The path.
+ */
+#define PATH_CACHE_SLOTS 256
+#define PATH_CACHE_LENGTH 112
+
+typedef struct path_cache_entry {
+  unsigned long generation;
+  unsigned long hash;
+  Directory *start;
+  Directory *target;
+  char path[PATH_CACHE_LENGTH];
+} Path_cache_entry;
+
+/*
+ * A snapshot image, as written by save_fs and mapped by load_fs, holds the
+ * directories, files and name indexes of a filesystem laid out exactly as the
+ * filesystem uses them, so loading needs no allocation per node. Its pointers
+ * are the ones the nodes have when the image is mapped at the base address in
+ * its header; load_fs asks for it to be mapped there, and only goes through
+ * the nodes to relocate the pointers if it is not. After the header come:
+ *
+ * state: Room for the struct fs_state of the loaded filesystem.
+ * directories: All directories, the root first. The subdirectories of each
+ *              directory are next to each other, in order.
+ * files: All files. The files of each directory are next to each other, in
+ *        order.
+ * inodes: The inodes of the files, one for all names of a file.
+ * handles: The handle table, handle_count slots, the slots of nothing saved
+ *          being on the free list.
+ * indexes: The name indexes of the directories with INDEX_THRESHOLD entries.
+ * entries: The entries of the name indexes.
+ * tables: The bucket arrays and samples of the name indexes, or their arrays
+ *         of blocks when built with FS_SIM_COMPACT.
+ * buckets: The bucket arrays of the shards of the name table, bucket_count
+ *          buckets each.
+ * names: The name_count names of the name table, each after its Name header
+ *        and padded to IMAGE_NAME_SIZE bytes. Names only held by removed
+ *        directories are saved as held by none.
+ * data: The contents of the files, each file data followed by its table of
+ *       chunks and its chunks. A chunk shared by several files is saved once
+ *       for each of them, and the contents of a file with several names once
+ *       for all of them.
+ *
+ * sequence is the sequence number of the last journal record the image holds
+ * the change of, so recover_fs knows where to replay the journal from.
+ *
+ * layout holds the sizes of the structures saved, so an image is only loaded
+ * by a build that lays them out the same way. Blocks of a loaded image given
+ * back to the pool are not reused; the whole image is unmapped by rmfs.
+ */
+#define IMAGE_MAGIC "fs-sim8"
+#if ULONG_MAX > 0xffffffffUL
+#define IMAGE_BASE 0x300000000000UL
+#else
+#define IMAGE_BASE 0x70000000UL
+#endif
+#define IMAGE_ALIGN(offset) (((offset) + 63) & ~63UL)
+#define IMAGE_POINTER(base, offset) ((void *) ((base) + (offset)))
+#define IMAGE_NAME_SIZE(length) \
+  ((sizeof(Name) + (length) + sizeof(Name *)) & ~(sizeof(Name *) - 1))
+
+typedef struct image_header {
+  char magic[8];
+  unsigned long layout[9];
+  unsigned long base;
+  unsigned long size;
+  unsigned long state;
+  unsigned long directories;
+  unsigned long directory_count;
+  unsigned long files;
+  unsigned long file_count;
+  unsigned long inodes;
+  unsigned long inode_count;
+  unsigned long handles;
+  unsigned long handle_count;
+  unsigned long indexes;
+  unsigned long index_count;
+  unsigned long entries;
+  unsigned long entry_count;
+  unsigned long tables;
+  unsigned long buckets;
+  unsigned long bucket_count;
+  unsigned long names;
+  unsigned long name_count;
+  unsigned long data;
+  unsigned long sequence;
+} Image_header;
+
+/*
+ * A journal file, attached to a filesystem by recover_fs, holds the changes
+ * made since the snapshot image the filesystem was last saved to, so both
+ * together survive a crash. It starts with JOURNAL_MAGIC and the sequence
+ * number of its first record, an 8-byte little-endian number, followed by one
+ * record per successful touch, mkdir, rm, cp, mv, ln, write_file,
+ * append_file, truncate_file and set_quota, numbered on from there:
+ *
+ * op: JOURNAL_TOUCH, JOURNAL_MKDIR, JOURNAL_RM, JOURNAL_CP, JOURNAL_MV,
+ *     JOURNAL_LINK, JOURNAL_WRITE, JOURNAL_TRUNCATE or JOURNAL_QUOTA, in one
+ *     byte.
+ * length: The length of the path, 7 bits to a byte with the lowest bits
+ *         first, the top bit set on every byte but the last.
+ * path: The full path of the file or directory. For cp, mv and ln, the full
+ *       path of the source, a null byte, and the full path of the copy, of
+ *       where it was moved to or of the new name. For a write, the full path
+ *       of the file, a null byte, the offset written at as an 8-byte
+ *       little-endian number, and the bytes written; an append is saved as a
+ *       write at the end the file had. For truncate_file, the full path, a
+ *       null byte and the new size. For set_quota, the full path of the
+ *       directory followed by "/.", a null byte, and the limits on files,
+ *       directories and bytes of names, in that order.
+ * checksum: The FNV-1a hash of the record up to here, 4 bytes little-endian,
+ *           so a record torn by a crash is found and cut off.
+ *
+ * Records name files and directories by path only, so those created while
+ * the journal is replayed may get other inode numbers than they had.
+ *
+ * Records are collected in a buffer, and written out as a group, with a single
+ * fsync, once JOURNAL_GROUP_SIZE bytes of them are waiting or
+ * JOURNAL_GROUP_INTERVAL seconds went by since the last group, at the end of
+ * run_batch, touch_many and mkdir_many, and by journal_sync and rmfs. A crash
+ * loses the changes made since the last group. Commands finishing while a
+ * group is being written wait for it, and the first of them then writes all
+ * of their records as the next group. Once a group cannot be written, the
+ * journal is cut back to the groups before it and taken as failed, and no more
+ * changes are made. A journal growing past its limit is compacted: the
+ * filesystem is saved as the new snapshot, numbered with the sequence number
+ * of the last change it holds, and the journal starts over.
+ */
+#define JOURNAL_MAGIC "fsjrnl1"
+#define JOURNAL_HEADER_SIZE 16
+#define JOURNAL_TOUCH 't'
+#define JOURNAL_MKDIR 'm'
+#define JOURNAL_RM 'r'
+#define JOURNAL_CP 'c'
+#define JOURNAL_MV 'v'
+#define JOURNAL_LINK 'l'
+#define JOURNAL_WRITE 'w'
+#define JOURNAL_TRUNCATE 'z'
+#define JOURNAL_QUOTA 'q'
+#define JOURNAL_BUFFER_SIZE 65536
+#define JOURNAL_GROUP_SIZE 32768
+#define JOURNAL_GROUP_INTERVAL 1
+#define JOURNAL_LIMIT (64UL << 20)
+
+/*
+ * fd: The journal file, opened for appending.
+ * path: The name of the journal file.
+ * snapshot: The name of the snapshot image file.
+ * buffer: The records not written yet.
+ * used: The number of bytes in the buffer.
+ * size: The size of the buffer.
+ * spare: A second buffer, swapped with the first one when it is written, so
+ *        records can be added while the group is being written.
+ * spare_size: The size of the spare buffer.
+ * file_size: The size of the journal file, up to the last group written.
+ * synced: The sequence number of the last change written and flushed to
+ *         disk.
+ * last_group: When the last group was written.
+ * limit: The size of the journal file past which it is compacted, or 0.
+ * failed: 1 once a record was lost because memory ran out, or a group could
+ *         not be written.
+ * lock: The mutex guarding the buffer, last_group, failed and the sequence
+ *       number of the filesystem.
+ * commit_lock: The mutex held while a group is written, guarding synced.
+ */
+struct journal {
+  int fd;
+  char *path;
+  char *snapshot;
+  char *buffer;
+  size_t used;
+  size_t size;
+  char *spare;
+  size_t spare_size;
+  unsigned long file_size;
+  unsigned long synced;
+  time_t last_group;
+  unsigned long limit;
+  int failed;
+#if defined(FS_SIM_THREADS)
+  pthread_mutex_t lock;
+  pthread_mutex_t commit_lock;
+#endif
+};
+
+/*
+ * A session is a current directory of a filesystem together with the buffers
+ * the commands need for it. Several sessions can be open on one filesystem,
+ * each used by its own thread. The filesystem state has a session of its own,
+ * used by the functions taking an Fs_sim.
+ *
+ * cwd: The current directory.
+ * state: The state of the filesystem.
+ * path_cache: The path cache, or NULL until the first path is resolved.
+ * scratch: A buffer paths are copied into to be split into components.
+ * scratch_size: The size of the scratch buffer.
+ * cwd_path: The full path of cwd_path_dir followed by a newline, as printed by
+ *           pwd. cd keeps it up to date while moving from cwd_path_dir, so pwd
+ *           can print it without going through the directories again.
+ * cwd_path_length: The length of the path, including the newline.
+ * cwd_path_size: The size of the cwd_path buffer.
+ * cwd_path_dir: The directory cwd_path is the path of, or NULL if it has to be
+ *               rebuilt.
+ * cwd_path_generation: The generation of the filesystem cwd_path was saved
+ *                      in. The path is stale if a directory was removed or
+ *                      moved since.
+ * next: The next session open on the filesystem.
+ * pinned: The current directory as of the end of the last command, which is
+ *         not deallocated, nor any directory above it, even if it is removed.
+ * epoch: The epoch the running command began in.
+ * generation: The generation of the filesystem when the running command
+ *             began, which it uses throughout.
+ * stale: 1 if the current directory, or a directory above it, was removed.
+ * stale_generation: The generation stale was worked out in.
+ * parent: The directory open_parent last found.
+ * hint: The directory the next call of open_parent is to use for a path,
+ *       without resolving it, as set by run_batch, or NULL.
+ * hint_generation: The generation hint was found in. It is not used if a
+ *                  directory was removed or moved since.
+ * started: The time the running command began in nanoseconds, only kept when
+ *          built with FS_SIM_STATS.
+ * exclusive: 1 if the running command holds the clone lock for writing, as
+ *            every command does in effect when built without
+ *            FS_SIM_THREADS.
+ * views: The views the running command looked through directories shared
+ *        with others by, linked by their next pointers (see make_view).
+ */
+struct fs_session {
+  Directory *cwd;
+  struct fs_state *state;
+  Path_cache_entry *path_cache;
+  char *scratch;
+  size_t scratch_size;
+  char *cwd_path;
+  size_t cwd_path_length;
+  size_t cwd_path_size;
+  Directory *cwd_path_dir;
+  unsigned long cwd_path_generation;
+  struct fs_session *next;
+  Directory *pinned;
+  unsigned long epoch;
+  unsigned long generation;
+  int stale;
+  unsigned long stale_generation;
+  Directory *parent;
+  Directory *hint;
+  unsigned long hint_generation;
+  unsigned long started;
+  int exclusive;
+  Directory *views;
+};
+
+/*
+ * root: The root directory of the filesystem.
+ * free_blocks: The free list of each size class.
+ * slabs: All slabs allocated so far.
+ * bump: The start of the unused part of the newest slab.
+ * bump_left: The number of bytes left in the newest slab.
+ * large: All big blocks currently handed out.
+ * free_chunks: The free list of the chunks of file data.
+ * memory: The allocation statistics reported by memory_stats.
+ * image: The snapshot image the filesystem was loaded from, which the state
+ *        itself lives in, or NULL if it was created by mkfs.
+ * image_size: The size of the image.
+ * garbage: The removed directories still waiting to be deallocated, linked by
+ *          their next pointers, in the order they were removed.
+ * garbage_tail: The last directory of the garbage list.
+ * pinned_garbage: The removed directories that some session was standing in
+ *                 when they were due to be deallocated, linked by their next
+ *                 pointers.
+ * reclaim_at: The directory of the first garbage tree that the deallocation is
+ *             working on, or NULL if it has not started on it yet.
+ * deferred_rm: 1 if rm leaves removed directories on the garbage list to be
+ *              deallocated a chunk at a time by later commands.
+ * path_generation: The generation of the path cache entries and saved paths
+ *                  that are valid. It is advanced whenever a directory is
+ *                  removed or moved.
+ * epoch: The current epoch.
+ * active: The number of commands running that began in an even (0) and an odd
+ *         (1) epoch.
+ * sessions: All sessions open on the filesystem, including main.
+ * journal: The journal the changes are saved in, or NULL.
+ * sequence: The sequence number of the last change saved in the journal.
+ * stats: The statistics reported by fs_stats.
+ * shared: The number of directories sharing the entries of others, as cp
+ *         left them.
+ * handles: The handle table.
+ * handle_size: The number of slots of the handle table.
+ * handle_count: The number of slots in use or on the free list, slot 0
+ *               included.
+ * free_handle: The first slot of the free list, or 0 if it is empty.
+ * linked: The number of files with more than one name, as ln left them.
+ * main: The session used by the functions taking an Fs_sim.
+ * pool_lock: The mutex guarding the pool and its statistics.
+ * data_lock: The mutex guarding the reference counts of the chunks.
+ * handle_lock: The mutex guarding the handle table, the names and the number
+ *              of names of the inodes, and linked.
+ * garbage_lock: The mutex guarding the garbage lists and deferred_rm.
+ * epoch_lock: The mutex guarding path_generation, the epochs, the list of
+ *             sessions and their pinned directories, and the removed, held,
+ *             usage and quota fields of the directories.
+ * walk_threads: The number of threads ls_recursive and find use.
+ * names: The shards of the name table.
+ * stats_lock: The mutex guarding stats.
+ * clone_lock: The reader/writer lock every command holds while it runs, for
+ *             writing if it has to run alone (see exclusive_command). It
+ *             guards shared and what directories share.
+ * inode_locks: The inode locks.
+ */
+struct fs_state {
+  Directory *root;
+  Pool_block *free_blocks[POOL_CLASSES];
+  Pool_slab *slabs;
+  char *bump;
+  size_t bump_left;
+  Pool_large *large;
+  Pool_block *free_chunks;
+  Fs_memory memory;
+  char *image;
+  size_t image_size;
+  Directory *garbage;
+  Directory *garbage_tail;
+  Directory *pinned_garbage;
+  Directory *reclaim_at;
+  int deferred_rm;
+  unsigned long path_generation;
+  unsigned long epoch;
+  unsigned long active[2];
+  Fs_session *sessions;
+  struct journal *journal;
+  unsigned long sequence;
+  Fs_stats stats;
+  unsigned long shared;
+  Handle *handles;
+  unsigned long handle_size;
+  unsigned long handle_count;
+  unsigned long free_handle;
+  unsigned long linked;
+  int walk_threads;
+  Name_shard names[NAME_SHARDS];
+  Fs_session main;
+#if defined(FS_SIM_THREADS)
+  pthread_mutex_t pool_lock;
+  pthread_mutex_t data_lock;
+  pthread_mutex_t handle_lock;
+  pthread_mutex_t garbage_lock;
+  pthread_mutex_t epoch_lock;
+  pthread_mutex_t stats_lock;
+  pthread_rwlock_t clone_lock;
+  pthread_rwlock_t inode_locks[INODE_LOCKS];
+#endif
+};
+
+/*
+ * In deferred mode, every touch, mkdir and rm deallocates at most
+ * RECLAIM_CHUNK files and directories left over by earlier removals.
+ */
+#define RECLAIM_CHUNK 1024
+
+/* ls collects its output in a buffer of LS_BUFFER_SIZE bytes */
+#define LS_BUFFER_SIZE 16384
+
+/*
+ * A name given to ls or rm holding any of the GLOB_CHARACTERS is taken as a
+ * shell wildcard pattern, unless an entry has that very name. The characters
+ * before the first of them, or of a backslash, are the literal prefix every
+ * name matching the pattern starts with.
+ */
+#define GLOB_CHARACTERS "*?["
+#define GLOB_PREFIX_END "*?[\\"
+
+/*
+ * touch_many and mkdir_many sort the names they are given along with where
+ * each was given, so they can be merged into a directory in one pass and
+ * their results saved in the order given.
+ */
+typedef struct bulk_name {
+  const char *name;
+  size_t position;
+} Bulk_name;
+
+/* The commands run_batch understands */
+#define BATCH_UNKNOWN 0
+#define BATCH_MKFS 1
+#define BATCH_TOUCH 2
+#define BATCH_MKDIR 3
+#define BATCH_CD 4
+#define BATCH_LS 5
+#define BATCH_PWD 6
+#define BATCH_RM 7
+#define BATCH_RMFS 8
+#define BATCH_STATS 9
+
+/*
+ * ls_recursive and find walk a subtree with up to WALK_MAX_THREADS threads,
+ * WALK_LIST and WALK_FIND telling which of them it is for. At most
+ * WALK_WINDOW directories are handed out to the threads ahead of the one being
+ * printed, each listed into a slot whose output buffer starts out
+ * WALK_OUTPUT_SIZE bytes big and is kept for the directories after it.
+ */
+#define WALK_LIST 0
+#define WALK_FIND 1
+#define WALK_MAX_THREADS 16
+#define WALK_WINDOW 256
+#define WALK_OUTPUT_SIZE 256
+
+/*
+ * directory: The directory listed into the slot.
+ * output: What is printed for it, from output + start.
+ * used: The number of bytes in the output.
+ * size: The size of the output buffer.
+ * start: Where the text printed starts; find keeps the path of the directory
+ *        before it, to copy for each match.
+ * failed: 1 if memory ran out while listing it.
+ * done: 1 once it has been listed.
+ */
+typedef struct walk_slot {
+  Directory *directory;
+  char *output;
+  size_t used;
+  size_t size;
+  size_t start;
+  int failed;
+  int done;
+} Walk_slot;
+
+/*
+ * mode: WALK_LIST or WALK_FIND.
+ * pattern: The pattern names are matched against, for WALK_FIND.
+ * slots: The slots, directory number i being listed into slot
+ *        i % WALK_WINDOW.
+ * assigned: The number of directories handed out so far.
+ * claimed: The number of them taken by a thread to be listed.
+ * printed: The number of them printed, which only the calling thread uses.
+ * finished: 1 once the workers are to stop.
+ * lock: The mutex guarding assigned, claimed, finished and the done fields.
+ * work: Signalled when a directory is handed out or the walk is finished.
+ * done: Signalled when a directory has been listed.
+ */
+struct walk {
+  int mode;
+  const char *pattern;
+  Walk_slot slots[WALK_WINDOW];
+  unsigned long assigned;
+  unsigned long claimed;
+  unsigned long printed;
+  int finished;
+#if defined(FS_SIM_THREADS)
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+#endif
+};
+
+
+/*
+ * Helper (static) functions.
+ *
+ * main_session returns the session used by the functions taking an Fs_sim.
+ *
+ * touch_name, mkdir_name and remove_name carry out touch, mkdir and rm for a
+ * single name in a directory, and bulk_command and create_names carry out
+ * touch_many and mkdir_many. remove_directory and remove_matches remove a
+ * directory and the entries matching a pattern, and release_links gives up
+ * the names under a removed directory of files with names elsewhere.
+ *
+ * open_parent finds and locks the directory the last component of a path is
+ * in, and find_directory finds the directory a path leads to as cd does.
+ *
+ * The walk functions go through a subtree for ls_recursive and find.
+ *
+ * begin_command and end_command mark the start and the end of a command of a
+ * session, and pinned_by_session tells whether a session stands in a removed
+ * directory.
  * 
  * print_list is used to print files and directories with certain format by 
  * typing ls command.
  *
+ * open_cursor sets up a cursor over all files and subdirectories of a
+ * directory, and glob_range over those that may match a pattern. seek_cursor
+ * moves a cursor to where a page of ls_page starts.
+ *
  * check_name is used to check whether if the current directory already
- * contained a same-name file or directory as the paramter arg.
+ * contained a same-name file or directory as the paramter arg, and to find it.
  *
- * destroy_files is used to deallocate all files under the current directory. 
+ * link_file, unlink_file, link_directory and unlink_directory insert or remove
+ * one entry from the sorted linked lists of a directory and keep its name
+ * index up to date. splice_file and splice_directory insert one where the
+ * caller already found it goes.
  *
  * destroy_directories is used to deallocate all dynamically allocated memory 
  * under the "top" directory and "top" itself.
+ *
+ * reclaim_garbage deallocates the directories on the garbage list, a bounded
+ * number of entries at a time if asked to.
+ *
+ * scratch_copy, split_path and resolve_path find the directories that paths
+ * with more than one component lead to, using the path cache.
+ *
+ * track_path and path_moved maintain the saved path of the current directory
+ * printed by pwd.
+ *
+ * alloc_file and alloc_directory take a new file or directory from the pool,
+ * and free_file and free_directory give one back.
+ *
+ * The usage functions keep the counts du reports up to date in every
+ * directory above a change, and check the change against their quotas.
+ *
+ * copy_name carries out cp, and the share functions keep track of which
+ * directories share the entries of others, giving them entries of their own
+ * for those about to change.
+ * move_name carries out mv, and link_name carries out ln.
+ *
+ * The handle functions keep the handle table the files and directories are
+ * found in by inode number, and inode_release gives up a name of a file.
+ * stat_fill and open_view describe a file or directory found for stat_entry
+ * and stat_id, and set up a view of a file.
+ *
+ * change_data carries out write_file, append_file and truncate_file, and the
+ * data functions keep the contents of files in chunks, taken from the pool by
+ * chunk_alloc and given back by chunk_release.
+ *
+ * image_layout, image_write, image_data, image_valid, relocate and image_open
+ * save and load snapshot images.
+ *
+ * init_session and close_session set up and tear down the buffers of a
+ * session.
+ *
+ * The pool functions manage the memory of a filesystem, the name functions
+ * its name table, and the index functions maintain the name index.
  * 
  * Explained more under.
  */
-static void print_list(File *file_head, Directory *sub_head);
-static int check_name(Fs_sim fs, const char arg[]);
-static void destroy_files(File *file_head);
+static Fs_session *main_session(Fs_sim *files);
+static int touch_name(Directory *directory, const char name[]);
+static int mkdir_name(Directory *directory, const char name[]);
+static int remove_name(Fs_session *session, const char arg[]);
+static int remove_directory(Fs_session *session, Directory *directory,
+                            Directory *target);
+static void release_links(struct fs_state *state, Directory *top);
+static int remove_matches(Fs_session *session, Directory *directory,
+                          const char pattern[]);
+static int bulk_command(Fs_session *session, const char arg[],
+                        const char *names[], size_t count, int is_dir,
+                        int status[]);
+static void create_names(Directory *directory, const Bulk_name names[],
+                         size_t count, int is_dir, int status[]);
+static int compare_bulk_names(const void *first, const void *second);
+static Directory *open_parent(Fs_session *session, const char arg[],
+                              const char **name, int write);
+static Directory *find_directory(Fs_session *session, const char arg[],
+                                 int own);
+static int exclusive_command(Fs_session *session);
+static int is_shared(const Directory *directory);
+static int copy_name(Fs_session *session, const char source[],
+                     const char target[]);
+static int move_name(Fs_session *session, const char source[],
+                     const char target[]);
+static int link_name(Fs_session *session, const char source[],
+                     const char target[]);
+static void stat_fill(Fs_entry *entry, Directory *directory,
+                      const File *file);
+static void open_view(Fs_view *view, File *file, Directory *directory,
+                      unsigned long offset, unsigned long length);
+static int change_data(Fs_session *session, const char arg[], int op,
+                       unsigned long offset, const char bytes[],
+                       size_t length);
+static int batch_command(const char word[], size_t length);
+static int walk_command(Fs_session *session, const char arg[], int mode,
+                        const char pattern[]);
+static int walk_tree(Fs_session *session, Directory *top, int mode,
+                     const char pattern[]);
+#if defined(FS_SIM_THREADS)
+static void *walk_worker(void *arg);
+#endif
+static void walk_directory(struct walk *walk, Walk_slot *slot);
+static int walk_path(Walk_slot *slot, Directory *directory);
+static int walk_append(Walk_slot *slot, const char text[], size_t length);
+static int walk_reserve(Walk_slot *slot, size_t size);
+static int begin_command(Fs_session *session);
+static int begin_exclusive(Fs_session *session);
+static void end_command(Fs_session *session);
+static int pinned_by_session(struct fs_state *state, const Directory *top);
+static const char *first_entry(const File *file, const File *file_end,
+                               const Directory *sub, const Directory *sub_end,
+                               int *is_dir);
+static void end_prefix(Fs_cursor *cursor);
+static int print_list(Fs_cursor *cursor, size_t limit, const char **last);
+static void open_cursor(Fs_cursor *cursor, Directory *directory);
+static void file_cursor(Fs_cursor *cursor, Directory *directory, File *file);
+static void glob_range(Fs_cursor *cursor, Directory *directory,
+                       const char pattern[]);
+static void prefix_range(Directory *entries, const char pattern[],
+                         size_t length, File **file, Directory **sub);
+static void seek_cursor(Fs_cursor *cursor, const char after[]);
+static void seek_range(Directory *entries, const char after[], File **file,
+                       File *file_end, Directory **sub, Directory *sub_end);
+static int check_name(Fs_sim fs, const char arg[], File **file,
+                      Directory **directory);
+static int find_entry(Directory *directory, const char arg[], File **file,
+                      Directory **sub);
+static void link_file(Fs_sim fs, File *new_file);
+static void splice_file(Fs_sim fs, File *new_file, File *curr);
+static void unlink_file(Fs_sim fs, File *file);
+static void link_directory(Fs_sim fs, Directory *new_directory);
+static void splice_directory(Fs_sim fs, Directory *new_directory,
+                             Directory *curr);
+static File *alloc_file(struct fs_state *state, const char name[],
+                        Inode *inode);
+static Directory *alloc_directory(struct fs_state *state, const char name[]);
+static Fs_usage *usage_entry(Fs_usage *change, const char name[], int is_dir);
+static int usage_charge(Directory *directory, const Fs_usage *change);
+static void usage_release(Directory *directory, const Fs_usage *change);
+static int usage_move(Directory *from, const Fs_usage *removed, Directory *to,
+                      const Fs_usage *added);
+static int usage_fits(const Directory *directory, const Fs_usage *change);
+static int usage_over(unsigned long used, unsigned long added,
+                      unsigned long limit);
+static void usage_add(Directory *directory, const Fs_usage *change,
+                      int subtract);
+static int share_entries(Directory *directory, Directory *origin);
+static void discard_entries(Directory *top);
+static void stop_sharing(Directory *directory);
+static Directory *entries_of(Directory *directory);
+static unsigned long entry_count(Directory *directory);
+static int copy_origin(Directory *directory);
+static int prepare_change(Directory *directory, const char name[]);
+static int stand_in(Directory *clone, const char name[]);
+static int release_subtree(Directory *top);
+static int copy_subtree(Directory *directory, Directory *top);
+static int under_directory(const Directory *directory, const Directory *top);
+static Directory *preorder_next(Directory *curr, Directory *top);
+static void unlink_directory(Fs_sim fs, Directory *directory);
+static void free_file(struct fs_state *state, File *file);
+static void inode_release(struct fs_state *state, File *file);
+static unsigned long handle_reserve(struct fs_state *state);
+static void handle_free(struct fs_state *state, unsigned long id);
+static Directory *handle_find(Fs_session *session, unsigned long id,
+                              File **file);
+static int data_write(struct fs_state *state, Inode *inode,
+                      unsigned long offset, const char bytes[], size_t length,
+                      size_t *written);
+static int data_truncate(struct fs_state *state, Inode *inode,
+                         unsigned long size);
+static struct file_data *data_reserve(struct fs_state *state, Inode *inode,
+                                      unsigned long size);
+static int data_table(struct fs_state *state, struct file_data *data,
+                      unsigned long size);
+static Data_chunk *data_chunk(struct fs_state *state, struct file_data *data,
+                              unsigned long slot);
+static int data_share(struct fs_state *state, Inode *inode,
+                      const Inode *source);
+static void data_free(struct fs_state *state, struct file_data *data);
+static void free_directory(struct fs_state *state, Directory *directory);
+static void keep_directory(struct fs_state *state, Directory *directory,
+                           unsigned long removed);
 static void destroy_directories(Fs_sim top);
+static int reclaim_garbage(struct fs_state *state, unsigned long limit);
+static char *scratch_copy(Fs_session *session, const char arg[]);
+static int split_path(Fs_session *session, const char arg[],
+                      Fs_sim *directory, const char **name, int own);
+static Directory *resolve_path(Fs_session *session, char path[], int own);
+static Directory *enter_directory(Fs_session *session, Directory *directory,
+                                  const char name[], int own);
+static Directory *make_view(Fs_session *session, Directory *parent,
+                            Directory *sub);
+static unsigned long hash_path(const Directory *start, const char path[]);
+static int track_path(Fs_session *session);
+static void path_moved(Fs_session *session, Fs_sim from, Fs_sim to);
+static int reserve_path(Fs_session *session, size_t size);
+static void init_session(Fs_session *session, struct fs_state *state,
+                         Directory *cwd);
+static void close_session(Fs_session *session);
+static void image_layout(Directory *root, Image_header *header);
+static int image_write(Directory *root, const Image_header *header,
+                       char *image);
+static void image_names(struct fs_state *state, char *image,
+                        unsigned long *starts[]);
+static unsigned long image_data(const struct file_data *data, char *image,
+                                unsigned long base, unsigned long offset);
+static char *image_name(struct fs_state *state, char *image,
+                        unsigned long *starts[], const char name[]);
+static int image_valid(const Image_header *header, unsigned long size);
+static void *relocate(void *pointer, unsigned long delta);
+static struct fs_state *image_open(char *image, size_t size);
+static int save_image(struct fs_state *state, const char path[]);
+static void journal_append(struct fs_state *state, int op,
+                           Directory *directory, const char name[],
+                           Directory *source, const char source_name[]);
+static void journal_data(struct fs_state *state, int op, Directory *directory,
+                         const char name[], unsigned long offset,
+                         const char bytes[], size_t length);
+static char *journal_record(struct journal *journal, int op, size_t total,
+                            size_t *start);
+static void journal_seal(struct fs_state *state, char *record, size_t length);
+static size_t journal_path_length(Directory *directory, const char name[]);
+static void journal_path(char *end, Directory *directory, const char name[]);
+static void journal_reserve(struct journal *journal, size_t size);
+static int journal_commit(struct fs_state *state);
+static int journal_commit_due(struct fs_state *state);
+static int journal_failed(struct fs_state *state);
+static int journal_start(const char path[], unsigned long sequence);
+static int journal_replay(Fs_sim *files, const char path[]);
+static int journal_attach(struct fs_state *state, int fd, const char path[],
+                          const char snapshot[]);
+static void journal_detach(struct fs_state *state);
+static int journal_compact(struct fs_state *state);
+static unsigned long hash_bytes(const char bytes[], size_t length);
+static int write_all(int fd, const char buffer[], size_t size);
+static int sync_directory(const char path[]);
+#if defined(FS_SIM_STATS)
+static unsigned long stats_clock(void);
+static void stats_operation(Fs_session *session, int operation, int result);
+static void stats_names(struct fs_state *state, int insert,
+                        unsigned long nodes, unsigned long compares);
+#endif
+static struct fs_state *pool_create(void);
+static void pool_init(struct fs_state *state);
+static void *pool_alloc(struct fs_state *state, size_t size);
+static void pool_free(struct fs_state *state, void *block, size_t size);
+static void pool_destroy(struct fs_state *state);
+static Data_chunk *chunk_alloc(struct fs_state *state);
+static void chunk_release(struct fs_state *state, Data_chunk *chunk);
+static char *name_intern(struct fs_state *state, const char name[]);
+static const char *name_find(struct fs_state *state, const char name[],
+                             unsigned long *hash);
+static void name_release(struct fs_state *state, char *name);
+static int name_grow(struct fs_state *state, Name_shard *shard);
+static unsigned long hash_name(const char name[]);
+static const char *index_entry_name(const Index_entry *entry);
+static unsigned long index_table_size(unsigned long count);
+static int index_build(Fs_sim fs);
+static int index_add(struct name_index *index, void *node, int is_dir,
+                     const char name[]);
+static void index_remove(struct name_index *index, const void *node,
+                         const char name[]);
+static Index_entry *index_find(const struct name_index *index,
+                               const char arg[], const char *name,
+                               unsigned long hash);
+static void *index_seek(const struct name_index *index, void *head,
+                        const char after[], int is_dir);
+static void *index_seek_prefix(const struct name_index *index, void *head,
+                               const char prefix[], size_t length,
+                               int is_dir);
+#if !defined(FS_SIM_COMPACT)
+static void index_step(struct name_index *index);
+static const char *index_node_name(const void *node, int is_dir);
+static void *index_node_next(const void *node, int is_dir);
+static void index_sample_build(struct name_index *index, void *head,
+                               int is_dir);
+static void index_sample_add(struct name_index *index, void *node,
+                             int is_dir, const char name[]);
+static void index_sample_remove(struct name_index *index, const void *node,
+                                int is_dir, const char name[]);
+static unsigned long index_sample_search(const struct name_index *index,
+                                         int is_dir, const char name[]);
+#else
+static void *index_next(const struct name_index *index, const char name[],
+                        int is_dir);
+static int index_search(const struct name_index *index, const char name[],
+                        unsigned long *block, unsigned long *slot);
+static int index_compare(const char name[], const Index_entry *entry);
+static void index_fill(Index_entry *entry, void *node, int is_dir,
+                       const char name[]);
+static int index_block_insert(struct name_index *index,
+                              unsigned long position, unsigned long size);
+static void index_block_delete(struct name_index *index,
+                               unsigned long position);
+#endif
+static void index_destroy(struct name_index *index);
 
 /*
  * mkfs is the initialzed function of simulated filesystem. Before the
  * commands used, it should be first called to initialize a new filesystem
- * which would dynamically allocate the root directory of the filesystem.
+ * which would dynamically allocate the pool of the filesystem and the root
+ * directory of the filesystem.
  *
  * files: The pointer points to the filesystem defined in main function. Since
  *        Fs_sim is defined as pointer points to directory, files is actually
@@ -43,9 +1208,16 @@ static void destroy_directories(Fs_sim top);
  */
 void mkfs(Fs_sim *files)
 {
+  struct fs_state *state;
+  unsigned long id = 0;
+
   if (files != NULL)
   {
-    *files = malloc(sizeof(Directory));
+    /* The pool of the filesystem is created first to allocate the root */
+    state = pool_create();
+    if (state != NULL)
+      id = handle_reserve(state);
+    *files = id != 0 ? pool_alloc(state, sizeof(Directory)) : NULL;
     if (*files != NULL)
     {
       (*files)->name = NULL;
@@ -53,99 +1225,61 @@ void mkfs(Fs_sim *files)
       (*files)->sub = NULL;
       (*files)->next = NULL;
       (*files)->f_head = NULL;
+      (*files)->prev = NULL;
+      (*files)->sub_tail = NULL;
+      (*files)->f_tail = NULL;
+      (*files)->count = 0;
+      (*files)->index = NULL;
+      (*files)->state = state;
+      (*files)->removed = 0;
+      (*files)->held = 1;
+      (*files)->origin = NULL;
+      (*files)->clones = NULL;
+      (*files)->next_clone = NULL;
+      (*files)->prev_clone = NULL;
+      (*files)->id = id;
+      (*files)->usage.files = 0;
+      (*files)->usage.directories = 0;
+      (*files)->usage.name_bytes = 0;
+      (*files)->quota = (*files)->usage;
+      INIT_LOCK(&(*files)->lock);
+      state->handles[id].directory = *files;
+      state->root = *files;
+      state->main.cwd = *files;
+      state->main.pinned = *files;
     }
     else
+    {
+      if (state != NULL)
+        pool_destroy(state);
       printf("fail to create the filesystem!\n");
+    }
   }
 }
 
 /*
  * touch function is used to simulate the touch command in UNIX. It would create
- * a new file as defined in fs-sim-structure.h with parameter arg as the name 
- * of the new file.
+ * a new file as defined in fs-sim-structure.h with parameter arg as the name
+ * of the new file. arg may also be a path such as "/a/b/c" or "../c", and then
+ * the file named by its last component is created in the directory the rest of
+ * it leads to.
  *
  * The function would return 1 if valid arguments passed in and new file
- * created ,and 0 if invalid cases happened (explain more in the function).
+ * created ,and 0 if invalid cases happened (explain more in touch_name).
  *
  * files: The pointer used to track the current directory in the filesystem.
  * arg: A characters pointer points to name that would be assigned for new file.
  */
 int touch(Fs_sim *files, const char arg[])
 {
-  int result = 0;
-  File *curr, *prev = NULL, *new_file = NULL;
-
-  /* Both files and arg need to be valid pointers for use */
-  if (files != NULL && *files != NULL && arg != NULL)
-  {
-    /* If the name is empty, nothing would be created */
-    if (!strcmp(arg, ""))
-      result = 0;
-    /*  
-     * If name (arg) is not just a single forward-slash character, then any name
-     * contained forward-slash character somewhere would be invalid.
-     */
-    else if (strcmp(arg, "/") && strchr(arg, '/') != NULL)
-      result = 0;
-    else if (!strcmp(arg, ".") || !strcmp(arg, "..") || !strcmp(arg, "/"))
-      result = 1;
-    /* case of a normal valid file name */
-    else
-    {
-      /* 
-       * The name of new file cannot be an existing file or directory.
-       * Therefore, using the helper function, check_name, to check all names of
-       * files and sub directories in the current directory. If no repetition,
-       * go for the linked list insertion. 
-       */
-      if (!check_name(*files, arg))
-      {
-        curr = (*files)->f_head;
-
-        /* Inserting new file into the linkedlist in increasing order */
-        while (curr != NULL && strcmp(arg, curr->name) > 0)
-        {
-          prev = curr;
-          curr = curr->next;
-        }
-
-        new_file = malloc(sizeof(*new_file));
-        if (new_file != NULL)
-        {
-          new_file->name = malloc(strlen(arg) + 1);
-          if (new_file->name != NULL)
-          {
-            result = 1;
-
-            strcpy(new_file->name, arg);
-            new_file->next = curr;
-
-            /* handling empty linkedlist conditon */
-            if (prev == NULL)
-              (*files)->f_head = new_file;
-            else
-              prev->next = new_file;
-          }
-          else
-          {
-            printf("fail to set the file name!\n");
-          }
-        }
-        else
-        {
-          printf("fail to create the new file!\n");
-        }
-      }
-    }
-  }
-
-  return result;
+  return session_touch(main_session(files), arg);
 }
 
 /*
  * mkdir function is used to simulate the mkdir command in UNIX. It would create
  * a new sub-directory in the current directory as defined in fs-sim-structure.h
- * with parameter arg as the name of the new directory.
+ * with parameter arg as the name of the new directory. As for touch, arg may
+ * also be a path, whose last component names the new directory.
  *
  * The function would return 1 if valid arguments passed in and new directory
  * created ,and 0 if invalid cases happened (most of invalid cases are the same
@@ -157,610 +1291,10142 @@ int touch(Fs_sim *files, const char arg[])
  */
 int mkdir(Fs_sim *files, const char arg[])
 {
-  int result = 0;
-  Directory *curr, *parent, *prev = NULL, *new_directory = NULL;
+  return session_mkdir(main_session(files), arg);
+}
+
+/*
+ * touch_many creates many files in one directory at once, as touch would
+ * create each of them there, in time linear in the size of the directory
+ * rather than in the number of names times that. The names are sorted and
+ * merged into the directory in a single pass. The function returns 1 if the
+ * directory was found, 0 if invalid arguments were passed in, it was not
+ * found or memory ran out, and FS_SIM_STALE as cd does.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * arg: The directory the files are created in, given as it would be to cd.
+ * names: The names of the files, which cannot be paths.
+ * count: The number of names.
+ * status: If not NULL, status[i] is set to what touch would have returned for
+ *         names[i], a name given again returning 0 the second time.
+ */
+int touch_many(Fs_sim *files, const char arg[], const char *names[],
+               size_t count, int status[])
+{
+  return session_touch_many(main_session(files), arg, names, count, status);
+}
+
+/*
+ * mkdir_many creates many sub directories in one directory at once, as
+ * touch_many creates files. The function returns what touch_many would.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * arg: The directory the sub directories are created in, given as it would be
+ *      to cd.
+ * names: The names of the sub directories, which cannot be paths.
+ * count: The number of names.
+ * status: If not NULL, status[i] is set to what mkdir would have returned for
+ *         names[i], a name given again returning 0 the second time.
+ */
+int mkdir_many(Fs_sim *files, const char arg[], const char *names[],
+               size_t count, int status[])
+{
+  return session_mkdir_many(main_session(files), arg, names, count, status);
+}
+
+/*
+ * cd function is used to simulate the cd command in UNIX. The function would
+ * change the current directory of its Fs_sim parameter and navigate to certain
+ * directory as told by arg parameter.
+ *
+ * The function would return 1 if valid arguments passed in and navigation made
+ * correctly, and 0 if invalid cases happened. (Explain more in session_cd)
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * arg: A characters pointer points to the name of target directory or certain
+ *      patterns of characters which indicate certain types of navigation.
+ */
+int cd(Fs_sim *files, const char arg[])
+{
+  Fs_session *session = main_session(files);
+  int result = session_cd(session, arg);
 
-  if (files != NULL && *files != NULL && arg != NULL)
+  /* copies of files may be left holding the directory */
+  if (result == 1)
   {
-    if (!strcmp(arg, ""))
-      result = 0;
-    /* 
-     *  Same as before, name contained forward-slash character (not sole of it)
-     *  would be invalid.
-     */
-    else if (strcmp(arg, "/") && strchr(arg, '/') != NULL)
-      result = 0;
-    else if (!strcmp(arg, ".") || !strcmp(arg, "..") || !strcmp(arg, "/"))
-      result = 0;
-    else
-    {
-      /* 
-       * arg cannot be a name of existing file or sub-directory located in the
-       * current directory.
-       */
-      if (check_name(*files, arg))
-        result = 0;
-      else
-      {
-        /* 
-	 * Using a directory pointer (or Fs_sim), parent, to explicity indicate
-	 * that the files is pointing to the parent directory of the new sub-
-	 * directory, which would be later assigned to its parent pointer.
-	 */
-        parent = *files;
-        curr = (*files)->sub;
+    MUTEX_LOCK(&session->state->epoch_lock);
+    session->cwd->held = 1;
+    MUTEX_UNLOCK(&session->state->epoch_lock);
+    *files = session->cwd;
+  }
 
-        /* Still inserting into the linkedlist in increasing order */
-        while (curr != NULL && strcmp(arg, curr->name) > 0)
-        {
-          prev = curr;
-          curr = curr->next;
-        }
+  return result;
+}
+
+/*
+ * ls function is used to simulate the ls command in UNIX. The function would
+ * list the files and subdirectories of the current directories, or of its
+ * argument, or just the argument if that is a file. The argument may also be a
+ * path, and then its last component is listed in the directory the rest of it
+ * leads to. A last component using the shell wildcards '*', '?' and '[...]'
+ * lists the files and subdirectories it matches, without their contents.
+ *
+ * The function would return 1 if valid arguments passed in and list files
+ * /directories correctly, and 0 if invalid cases happened. (Explain more in
+ * session_ls_open, which finds the entries to list.)
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * arg: A characters pointer points to the name of listing target or certain
+ *      patterns of characters which indicate certain types of list.
+ */
+int ls(Fs_sim *files, const char arg[])
+{
+  return session_ls(main_session(files), arg);
+}
 
-        new_directory = malloc(sizeof(*new_directory));
+/*
+ * ls_page lists one page of what ls would list for the same argument: at most
+ * limit entries, starting with the first one whose name comes after a given
+ * name. The name of the last entry listed is saved in resume if any entries
+ * are left, so the next page is listed by passing it as after, and resume is
+ * set to an empty string once the last page was listed. Since a page starts
+ * after a name rather than at a position, entries added or removed in between
+ * pages do not make it skip or repeat any others.
+ *
+ * The first entry of a page is found through the name index of the
+ * directory, so a page takes the same time however far into a huge directory
+ * it starts.
+ *
+ * The function returns 1 if valid arguments passed in and the page was
+ * listed, 0 if invalid cases happened, limit is 0, or the name to resume from
+ * does not fit in resume, in which case nothing is listed, and FS_SIM_STALE
+ * as ls does.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * arg: What to list, as it would be given to ls.
+ * after: The name the page starts after, or NULL or an empty string to start
+ *        from the first entry.
+ * limit: The largest number of entries to list.
+ * resume: Where to save the name to pass as after for the next page.
+ * size: The size of resume.
+ */
+int ls_page(Fs_sim *files, const char arg[], const char after[], size_t limit,
+            char resume[], size_t size)
+{
+  return session_ls_page(main_session(files), arg, after, limit, resume,
+                         size);
+}
 
-        if (new_directory != NULL)
-        {
-          new_directory->name = malloc(strlen(arg) + 1);
+/*
+ * ls_open sets up a cursor over the entries the ls command would list for the
+ * same argument, so they can be read one at a time with ls_next without
+ * printing anything. The function would return 1 if valid arguments passed in
+ * and the cursor was set up, and 0 if invalid cases happened.
+ *
+ * Unlike session_ls_open, it does not keep the directory listed locked, since
+ * the functions taking an Fs_sim are not meant to be called by several threads.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * arg: A characters pointer points to the name of listing target or certain
+ *      patterns of characters which indicate certain types of list.
+ * cursor: The cursor to set up. It stays valid until the directory listed is
+ *         changed. If arg is a wildcard pattern, arg must not be changed
+ *         either until the cursor has been read.
+ */
+int ls_open(Fs_sim *files, const char arg[], Fs_cursor *cursor)
+{
+  Fs_session *session = main_session(files);
+  int result = session_ls_open(session, arg, cursor);
+
+  if (result == 1)
+    session_ls_close(session, cursor);
+
+  return result;
+}
+
+/*
+ * ls_next returns the name of the next entry of a cursor set up by ls_open, in
+ * increasing order of names, or NULL if all of them have been returned.
+ *
+ * cursor: The cursor.
+ * is_dir: If not NULL, set to 1 if the entry is a directory and 0 if it is a
+ *         file.
+ */
+const char *ls_next(Fs_cursor *cursor, int *is_dir)
+{
+  const char *name = NULL, *shared;
+  int directory = 0, shared_dir, order;
+
+  /* the names not matching the pattern of the cursor are skipped */
+  while (cursor != NULL && (name == NULL || (cursor->pattern != NULL &&
+                                             fnmatch(cursor->pattern, name,
+                                                     0))))
+  {
+    /* the names matching a pattern end with the last one with its prefix */
+    if (cursor->pattern != NULL)
+      end_prefix(cursor);
+
+    /*
+     * Since linkedlists of files and subdirectories are already in the
+     * increasing order, simply comparing the first remaining ones and
+     * returning the one coming first. The entries shared with another
+     * directory are merged in the same way.
+     */
+    name = first_entry(cursor->file, cursor->file_end, cursor->sub,
+                       cursor->sub_end, &directory);
+    shared = first_entry(cursor->shared_file, cursor->shared_file_end,
+                         cursor->shared_sub, cursor->shared_sub_end,
+                         &shared_dir);
+    if (name == NULL && shared == NULL)
+    {
+      directory = 0;
+      break;
+    }
+
+    order = shared == NULL ? 1 : name == NULL ? -1 : strcmp(shared, name);
+    if (order < 0)
+    {
+      name = shared;
+      directory = shared_dir;
+      if (directory)
+        cursor->shared_sub = cursor->shared_sub->next;
+      else
+        cursor->shared_file = cursor->shared_file->next;
+    }
+    else
+    {
+      /* an entry of the directory itself stands in for the shared one */
+      if (order == 0 && shared_dir)
+        cursor->shared_sub = cursor->shared_sub->next;
+      else if (order == 0)
+        cursor->shared_file = cursor->shared_file->next;
+
+      if (directory)
+        cursor->sub = cursor->sub->next;
+      else
+      {
+        /* and a file without an inode only hides it */
+        if (cursor->file->parent->origin != NULL &&
+            cursor->file->inode == NULL)
+          name = NULL;
+        cursor->file = cursor->file->next;
+      }
+    }
+  }
+
+  if (is_dir != NULL)
+    *is_dir = directory;
+
+  return name;
+}
+
+/*
+ * pwd function is used to simulate the pwd command in UNIX. The function would
+ * print out the full path from the root to the current directory.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ */
+void pwd(Fs_sim *files)
+{
+  session_pwd(main_session(files));
+}
+
+/*
+ * pwd_path saves the full path from the root to the current directory in a
+ * buffer instead of printing it. The function returns 1 if the whole path fit
+ * in the buffer, and 0 if it did not or invalid arguments were passed in. The
+ * path is cut short if the buffer is too small, but is always terminated.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * path: The buffer the path is saved in.
+ * size: The size of the buffer.
+ */
+int pwd_path(Fs_sim *files, char path[], size_t size)
+{
+  return session_pwd_path(main_session(files), path, size);
+}
+
+/*
+ * cp copies a file, or a directory together with everything under it, to a
+ * new name, the way cp -r does. Copying a directory takes the same time
+ * however big it is: the copy shares the files and sub directories of the
+ * source instead of getting its own. Reading either tree copies nothing, the
+ * shared entries being looked at where they are. A directory of the copy
+ * only gets copies of the entries it shares, one level at a time, once it is
+ * changed itself, and a change to the source only gives the copies an entry
+ * of their own for the name changed, and for each directory above it on the
+ * way. So the memory a copy takes grows with how much the two trees differ,
+ * rather than with their size. Either can be changed afterwards without the
+ * other seeing it.
+ *
+ * A command changing a directory that shares entries with another, or that
+ * is under one whose entries another shares, runs alone: it waits for the
+ * commands of other sessions to end, and keeps them waiting while it runs.
+ * So do cp, mv and ln, and, while any directory shares entries, rm of a
+ * directory and a change to a file with more than one name. Other commands
+ * run side by side.
+ *
+ * The function returns 1 if the copy was made, 0 if invalid arguments were
+ * passed in, the source is not found, the target exists or is not a valid
+ * name, a directory would be copied into itself, or memory ran out, and
+ * FS_SIM_STALE if the current directory was removed and either argument is
+ * not an absolute path.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * source: The file or directory to copy. A directory is found as cd would
+ *         find it.
+ * target: The name of, or the path to, the copy, as it would be given to
+ *         mkdir.
+ */
+int cp(Fs_sim *files, const char source[], const char target[])
+{
+  return session_cp(main_session(files), source, target);
+}
+
+/*
+ * mv moves a file, or a directory together with everything under it, to a
+ * new name, which may be in another directory, the way mv does. Nothing is
+ * copied: the file or directory is unlinked from the directory it is in and
+ * linked into the other one under its new name, so moving a directory takes
+ * the same time however big it is. The current directory of any session can
+ * be moved, or any directory above it, and the session moves along with it.
+ *
+ * The function returns 1 if the file or directory was moved, 0 if invalid
+ * arguments were passed in, the source is not found, the target exists or is
+ * not a valid name, a directory would be moved into itself or a directory
+ * under it, or memory ran out, and FS_SIM_STALE if the current directory was
+ * removed and either argument is not an absolute path.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * source: The name of, or the path to, the file or directory to move, as it
+ *         would be given to rm.
+ * target: The name of, or the path to, where to move it, as it would be
+ *         given to mkdir.
+ */
+int mv(Fs_sim *files, const char source[], const char target[])
+{
+  return session_mv(main_session(files), source, target);
+}
+
+/*
+ * write_file writes bytes into a file at an offset, the way pwrite does,
+ * growing the file if they go past its end. If the offset is past the end,
+ * the bytes in between read as zeros, without taking any memory. A file of up
+ * to a couple of hundred bytes is kept inline, and a bigger one in chunks of
+ * 4096 bytes, so only the chunks written to are touched. A chunk the file
+ * shares with a copy made by cp is copied first.
+ *
+ * The function returns 1 if the bytes were written, 0 if invalid arguments
+ * were passed in, the file is not found, the bytes would go past the largest
+ * size a file can have or memory ran out, and FS_SIM_STALE
+ * if the current directory was removed and arg is not an absolute path. If
+ * memory runs out part way, the file may hold the first part of the bytes.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * arg: The name of, or the path to, the file, as it would be given to rm.
+ * offset: Where the bytes go.
+ * data: The bytes.
+ * length: The number of bytes.
+ */
+int write_file(Fs_sim *files, const char arg[], unsigned long offset,
+               const char data[], size_t length)
+{
+  return session_write_file(main_session(files), arg, offset, data, length);
+}
+
+/*
+ * append_file writes bytes at the end of a file, the way write does to a file
+ * opened for appending. It returns what write_file returns.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * arg: The name of, or the path to, the file, as it would be given to rm.
+ * data: The bytes.
+ * length: The number of bytes.
+ */
+int append_file(Fs_sim *files, const char arg[], const char data[],
+                size_t length)
+{
+  return session_append_file(main_session(files), arg, data, length);
+}
+
+/*
+ * truncate_file makes a file a given number of bytes long, the way truncate
+ * does, cutting off what is past the new end or growing it with bytes reading
+ * as zeros. It returns what write_file returns.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * arg: The name of, or the path to, the file, as it would be given to rm.
+ * size: The new size.
+ */
+int truncate_file(Fs_sim *files, const char arg[], unsigned long size)
+{
+  return session_truncate_file(main_session(files), arg, size);
+}
+
+/*
+ * read_open sets up a view of part of the contents of a file, so they can be
+ * read a piece at a time with read_next without being copied. The part
+ * starts at an offset and is cut off at the end of the file. The function
+ * would return 1 if the file was found and the view was set up, and 0 if
+ * invalid cases happened.
+ *
+ * Unlike session_read_open, it does not keep the directory of the file
+ * locked, since the functions taking an Fs_sim are not meant to be called by
+ * several threads.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * arg: The name of, or the path to, the file, as it would be given to rm.
+ * offset: Where the part starts.
+ * length: The largest number of bytes to read.
+ * view: The view to set up. It stays valid until the file is changed.
+ */
+int read_open(Fs_sim *files, const char arg[], unsigned long offset,
+              unsigned long length, Fs_view *view)
+{
+  Fs_session *session = main_session(files);
+  int result = session_read_open(session, arg, offset, length, view);
+
+  if (result == 1)
+    session_read_close(session, view);
+
+  return result;
+}
+
+/*
+ * read_next returns the next piece of the contents of a file set up by
+ * read_open, or NULL once all of them have been returned. A piece is never
+ * longer than a chunk, and points into the filesystem itself, so it must not
+ * be written to.
+ *
+ * view: The view.
+ * length: Set to the number of bytes of the piece.
+ */
+const char *read_next(Fs_view *view, size_t *length)
+{
+  const struct file_data *data;
+  const Data_chunk *chunk;
+  unsigned long within, piece;
+  const char *bytes;
+
+  if (view == NULL || view->offset >= view->end)
+    return NULL;
+
+  data = view->file->inode->data;
+  if (data->capacity > 0)
+  {
+    bytes = DATA_BYTES(data) + view->offset;
+    piece = view->end - view->offset;
+  }
+  else
+  {
+    /* a hole is read from a chunk of zeros shared by all */
+    within = view->offset % DATA_CHUNK_SIZE;
+    piece = DATA_CHUNK_SIZE - within;
+    if (piece > view->end - view->offset)
+      piece = view->end - view->offset;
+    chunk = data->chunks[view->offset / DATA_CHUNK_SIZE];
+    bytes = chunk != NULL ? CHUNK_BYTES(chunk) + within : zero_chunk + within;
+  }
+
+  view->offset += piece;
+  if (length != NULL)
+    *length = piece;
+
+  return bytes;
+}
+
+/*
+ * ln gives a file another name, which may be in another directory, the way
+ * ln does without -s. Both names are the same file: it has one inode number
+ * and one contents, written and read through either of them, and it is only
+ * deallocated once rm has removed all of its names. Directories cannot be
+ * given other names.
+ *
+ * A file with several names can be changed through any of them at the same
+ * time as commands of other sessions run in the other directories.
+ *
+ * The function returns 1 if the name was made, 0 if invalid arguments were
+ * passed in, the source is not found or is a directory, the target exists or
+ * is not a valid name, or memory ran out, and FS_SIM_STALE if the current
+ * directory was removed and either argument is not an absolute path.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * source: The name of, or the path to, the file, as it would be given to rm.
+ * target: The new name of, or the path to the new name of, the file, as it
+ *         would be given to touch.
+ */
+int ln(Fs_sim *files, const char source[], const char target[])
+{
+  return session_ln(main_session(files), source, target);
+}
+
+/*
+ * stat_entry describes a file or directory: its inode number, whether it is
+ * a directory, its number of names and its size. The inode number is kept
+ * for as long as the file or directory is in the filesystem, wherever mv
+ * moves it, so stat_id, ls_id and read_open_id can find it by that number
+ * later without going through any directory. The files and directories a
+ * copy made by cp shares with its source have the numbers of the source, and
+ * one name each, until either side changes them, and then get numbers of
+ * their own. The numbers of files and directories removed are handed out
+ * again. The function returns 1 if the file or directory was found, 0 if
+ * invalid arguments were passed in or it was not found, and FS_SIM_STALE if
+ * the current directory was removed and arg is not an absolute path.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * arg: The directory, as it would be given to cd, or else the file, as it
+ *      would be given to rm.
+ * entry: Where the description is saved.
+ */
+int stat_entry(Fs_sim *files, const char arg[], Fs_entry *entry)
+{
+  return session_stat_entry(main_session(files), arg, entry);
+}
+
+/*
+ * stat_id describes the file or directory with an inode number, as
+ * stat_entry does, finding it in the handle table of the filesystem in
+ * constant time. The function returns 1 if it was found, and 0 if invalid
+ * arguments were passed in or nothing in the filesystem has the number.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * id: The inode number.
+ * entry: Where the description is saved.
+ */
+int stat_id(Fs_sim *files, unsigned long id, Fs_entry *entry)
+{
+  return session_stat_id(main_session(files), id, entry);
+}
+
+/*
+ * ls_id lists the file or directory with an inode number as ls lists its
+ * path, found as stat_id finds it. It returns what stat_id returns.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * id: The inode number.
+ */
+int ls_id(Fs_sim *files, unsigned long id)
+{
+  return session_ls_id(main_session(files), id);
+}
+
+/*
+ * ls_open_id sets up a cursor over what ls_id would list, as ls_open does for
+ * a path. It returns what stat_id returns.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * id: The inode number.
+ * cursor: The cursor to set up, which stays valid until the directory listed
+ *         is changed.
+ */
+int ls_open_id(Fs_sim *files, unsigned long id, Fs_cursor *cursor)
+{
+  Fs_session *session = main_session(files);
+  int result = session_ls_open_id(session, id, cursor);
+
+  if (result == 1)
+    session_ls_close(session, cursor);
+
+  return result;
+}
+
+/*
+ * read_open_id sets up a view of part of the contents of the file with an
+ * inode number, as read_open does for a path. It returns 1 if the file was
+ * found and the view was set up, and 0 if invalid arguments were passed in or
+ * no file has the number.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * id: The inode number.
+ * offset: Where the part starts.
+ * length: The largest number of bytes to read.
+ * view: The view to set up. It stays valid until the file is changed.
+ */
+int read_open_id(Fs_sim *files, unsigned long id, unsigned long offset,
+                 unsigned long length, Fs_view *view)
+{
+  Fs_session *session = main_session(files);
+  int result = session_read_open_id(session, id, offset, length, view);
+
+  if (result == 1)
+    session_read_close(session, view);
+
+  return result;
+}
+
+/*
+ * rmfs function is used to clean out the current filesystem. It would remove
+ * all things (directories, files) in the filesystem. It deallocates any
+ * dynamically-allocated memory, including directories, files and their names.
+ * Since all of them are allocated from the pool of the filesystem, it simply
+ * releases the pool instead of visiting every directory and file. Any session
+ * still open on the filesystem is released with it and must not be used
+ * anymore. A journal attached by recover_fs has the changes not written yet
+ * written to it, and is closed.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ */
+void rmfs(Fs_sim *files)
+{
+  /*
+   * checking the parameter is not NULL and the filesystem has been correctly
+   * created.
+   */
+  if (files != NULL && *files != NULL)
+  {
+    /* the changes not written to the journal yet are written first */
+    journal_detach((*files)->state);
+    pool_destroy((*files)->state);
+
+    /*
+     * the current directory pointer would be NULL until the next filesystem
+     * created (calling mkfs).
+     */
+    *files = NULL;
+  }
+}
+
+/*
+ * rm function is used to remove a file or a directory from the current
+ * directory, or from the directory a path leads to if arg is a path. The
+ * function returns 1 if any file or directory was correctly removed.
+ * Otherwise, it returns 0. The current directory and the directories above it
+ * cannot be removed. A last component using the shell wildcards '*', '?' and
+ * '[...]' removes every file and directory it matches at once.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ */
+int rm(Fs_sim *files, const char arg[])
+{
+  return session_rm(main_session(files), arg);
+}
+
+/*
+ * session_open opens a new session on the filesystem the current directory
+ * belongs to, starting in the current directory. Each thread using the
+ * filesystem needs its own session; the session functions can then be called
+ * by all of them at the same time if the filesystem was built with
+ * FS_SIM_THREADS. The function returns NULL if memory runs out or files is not
+ * valid.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ */
+Fs_session *session_open(Fs_sim *files)
+{
+  Fs_session *session = NULL;
+
+  if (files != NULL && *files != NULL)
+  {
+    session = pool_alloc((*files)->state, sizeof(*session));
+    if (session != NULL)
+      init_session(session, (*files)->state, *files);
+  }
+
+  return session;
+}
+
+/*
+ * session_close closes a session opened by session_open and deallocates it.
+ *
+ * session: The session, which may be NULL.
+ */
+void session_close(Fs_session *session)
+{
+  if (session != NULL)
+  {
+    close_session(session);
+    pool_free(session->state, session, sizeof(*session));
+  }
+}
+
+/*
+ * session_touch is touch for the current directory of a session. It returns
+ * FS_SIM_STALE without doing anything if the current directory was removed
+ * and arg is not an absolute path.
+ *
+ * session: The session.
+ * arg: A characters pointer points to name that would be assigned for new file.
+ */
+int session_touch(Fs_session *session, const char arg[])
+{
+  int result = 0;
+  Directory *directory;
+  const char *name;
+
+  /* Both session and arg need to be valid pointers for use */
+  if (session != NULL && arg != NULL && !journal_failed(session->state))
+  {
+    if (!begin_command(session) && arg[0] != '/')
+      result = FS_SIM_STALE;
+    else
+    {
+      /*
+       * If arg is a path, it is split into the directory it leads to and the
+       * name of the new file. The file is created there as if it was the
+       * current directory.
+       */
+      directory = open_parent(session, arg, &name, 1);
+      if (directory != NULL)
+      {
+        result = touch_name(directory, name);
+        UNLOCK(&directory->lock);
+      }
+    }
+
+    end_command(session);
+    STATS_END(session, FS_STATS_TOUCH, result);
+
+    /* Deallocating a chunk of directories removed earlier, if there are any */
+    reclaim_garbage(session->state, RECLAIM_CHUNK);
+
+    /* The change is written to the journal with the next group */
+    if (!journal_commit_due(session->state) && result > 0)
+      result = 0;
+  }
+
+  return result;
+}
+
+/*
+ * session_mkdir is mkdir for the current directory of a session. It returns
+ * FS_SIM_STALE without doing anything if the current directory was removed
+ * and arg is not an absolute path.
+ *
+ * session: The session.
+ * arg: A characters pointer points to name that would be assigned for new
+ *      directory.
+ */
+int session_mkdir(Fs_session *session, const char arg[])
+{
+  int result = 0;
+  Directory *directory;
+  const char *name;
+
+  if (session != NULL && arg != NULL && !journal_failed(session->state))
+  {
+    if (!begin_command(session) && arg[0] != '/')
+      result = FS_SIM_STALE;
+    else
+    {
+      /*
+       *  Same as before, name contained forward-slash character (not sole of
+       *  it) is a path to the directory the new one is created in.
+       */
+      directory = open_parent(session, arg, &name, 1);
+      if (directory != NULL)
+      {
+        result = mkdir_name(directory, name);
+        UNLOCK(&directory->lock);
+      }
+    }
+
+    end_command(session);
+    STATS_END(session, FS_STATS_MKDIR, result);
+    reclaim_garbage(session->state, RECLAIM_CHUNK);
+    if (!journal_commit_due(session->state) && result > 0)
+      result = 0;
+  }
+
+  return result;
+}
+
+/*
+ * session_touch_many is touch_many for the current directory of a session.
+ *
+ * session: The session.
+ * arg: The directory the files are created in, given as it would be to cd.
+ * names: The names of the files.
+ * count: The number of names.
+ * status: Where the result of each name is saved, or NULL.
+ */
+int session_touch_many(Fs_session *session, const char arg[],
+                       const char *names[], size_t count, int status[])
+{
+  return bulk_command(session, arg, names, count, 0, status);
+}
+
+/*
+ * session_mkdir_many is mkdir_many for the current directory of a session.
+ *
+ * session: The session.
+ * arg: The directory the sub directories are created in, given as it would
+ *      be to cd.
+ * names: The names of the sub directories.
+ * count: The number of names.
+ * status: Where the result of each name is saved, or NULL.
+ */
+int session_mkdir_many(Fs_session *session, const char arg[],
+                       const char *names[], size_t count, int status[])
+{
+  return bulk_command(session, arg, names, count, 1, status);
+}
+
+/*
+ * session_cd is cd for the current directory of a session. If the current
+ * directory was removed, only absolute paths and the empty string, which both
+ * lead away from it, can be used, and anything else returns FS_SIM_STALE.
+ *
+ * session: The session.
+ * arg: A characters pointer points to the name of target directory or certain
+ *      patterns of characters which indicate certain types of navigation.
+ */
+int session_cd(Fs_session *session, const char arg[])
+{
+  int result = 0;
+  Directory *from, *target = NULL;
+
+  if (session != NULL && arg != NULL)
+  {
+    from = session->cwd;
+
+    if (!begin_command(session) && arg[0] != '/' && arg[0] != '\0')
+      result = FS_SIM_STALE;
+    else
+      target = find_directory(session, arg, 1);
+
+    if (target != NULL)
+    {
+      session->cwd = target;
+      result = 1;
+
+      /*
+       * the target was reached from the root or from a current directory that
+       * was not removed, so it was not removed either when the command began.
+       */
+      session->stale = 0;
+      session->stale_generation = session->generation;
+
+      /* Keeping the saved path of the current directory up to date */
+      path_moved(session, from, target);
+    }
+
+    end_command(session);
+    STATS_END(session, FS_STATS_CD, result);
+  }
+
+  return result;
+}
+
+/*
+ * session_ls is ls for the current directory of a session.
+ *
+ * session: The session.
+ * arg: A characters pointer points to the name of listing target or certain
+ *      patterns of characters which indicate certain types of list.
+ */
+int session_ls(Fs_session *session, const char arg[])
+{
+  Fs_cursor cursor;
+  int result = session_ls_open(session, arg, &cursor);
+
+  /* print_list would assign the output in the format of increasing order */
+  if (result == 1)
+  {
+    print_list(&cursor, (size_t) -1, NULL);
+    session_ls_close(session, &cursor);
+  }
+
+  return result;
+}
+
+/*
+ * session_ls_page is ls_page for the current directory of a session.
+ *
+ * session: The session.
+ * arg: What to list, as it would be given to ls.
+ * after: The name the page starts after, or NULL or an empty string to start
+ *        from the first entry.
+ * limit: The largest number of entries to list.
+ * resume: Where to save the name to pass as after for the next page.
+ * size: The size of resume.
+ */
+int session_ls_page(Fs_session *session, const char arg[], const char after[],
+                    size_t limit, char resume[], size_t size)
+{
+  Fs_cursor cursor, rest;
+  const char *last = NULL, *name;
+  size_t count;
+  int result = 0;
+
+  if (limit == 0 || resume == NULL || size == 0)
+    return 0;
+
+  result = session_ls_open(session, arg, &cursor);
+  if (result == 1)
+  {
+    if (after != NULL && after[0] != '\0')
+      seek_cursor(&cursor, after);
+
+    /*
+     * The page is read from a copy first, so nothing is printed if the name
+     * to resume from does not fit in resume.
+     */
+    rest = cursor;
+    for (count = 0; count < limit && (name = ls_next(&rest, NULL)) != NULL;
+         count++)
+      last = name;
+    if (count == limit && ls_next(&rest, NULL) != NULL &&
+        strlen(last) >= size)
+      result = 0;
+    /* the resume name is saved before the directory is unlocked */
+    else
+    {
+      resume[0] = '\0';
+      if (print_list(&cursor, limit, &last))
+        strcpy(resume, last);
+    }
+
+    session_ls_close(session, &cursor);
+  }
+
+  return result;
+}
+
+/*
+ * session_ls_open sets up a cursor over the entries the ls command would list
+ * for the same argument, so they can be read one at a time with ls_next. The
+ * function would return 1 if valid arguments passed in and the cursor was set
+ * up, 0 if invalid cases happened, and FS_SIM_STALE if the current directory
+ * was removed and arg is not an absolute path.
+ *
+ * The directory listed is kept locked against changes until the cursor is
+ * closed with session_ls_close, which has to be done before the session is
+ * used for anything else.
+ *
+ * session: The session.
+ * arg: A characters pointer points to the name of listing target or certain
+ *      patterns of characters which indicate certain types of list.
+ * cursor: The cursor to set up.
+ */
+int session_ls_open(Fs_session *session, const char arg[], Fs_cursor *cursor)
+{
+  int result = 0;
+  Directory *directory = NULL, *curr_directory = NULL;
+  File *curr_file = NULL;
+  const char *name, *pattern;
+  Fs_cursor rest;
+
+  if (session != NULL && arg != NULL && cursor != NULL)
+  {
+    if (!begin_command(session) && arg[0] != '/')
+      result = FS_SIM_STALE;
+    else
+      directory = open_parent(session, arg, &name, 0);
+
+    if (directory != NULL)
+    {
+      /*
+       * A single period or empty string represents listing all files and
+       * subdirectories in the current directory.
+       */
+      if (!strcmp(name, ".") || !strcmp(name, ""))
+        curr_directory = directory;
+      /*
+       * Double periods represents listing files and subdirectories in the
+       * parent directory. If current directory is the root, worked as same as
+       * calling ".".
+       */
+      else if (!strcmp(name, ".."))
+        curr_directory = directory->parent != NULL ? directory->parent
+                                                   : directory;
+      /*
+       * A single forward-slash represents listing files and subdirectories in
+       * the root.
+       */
+      else if (!strcmp(name, "/"))
+        curr_directory = session->state->root;
+      /*
+       * Check if arg is a name existing in the current directory, otherwise,
+       * simply return 0. If arg is the name of a file, only that file is
+       * listed, otherwise it is the name of a subdirectory, so listing all
+       * files and subdirecotries in that subdirectory.
+       */
+      else if (find_entry(directory, name, &curr_file, &curr_directory))
+      {
+        if (curr_file != NULL)
+        {
+          file_cursor(cursor, directory, curr_file);
+          result = 1;
+        }
+        /* a sub directory shared with another is listed through a view */
+        else if (curr_directory->parent != directory)
+          curr_directory = make_view(session, directory, curr_directory);
+      }
+      /*
+       * A name holding wildcards that no entry has lists the entries matching
+       * it. The cursor keeps the pattern as it is in arg, which outlives the
+       * copy open_parent may have split the path into.
+       */
+      else if (strpbrk(name, GLOB_CHARACTERS) != NULL)
+      {
+        pattern = strrchr(arg, '/') != NULL ? strrchr(arg, '/') + 1 : arg;
+        if (!strcmp(pattern, name))
+        {
+          /* anything listed with the literal prefix of the pattern counts */
+          glob_range(cursor, directory, pattern);
+          rest = *cursor;
+          rest.pattern = NULL;
+          result = ls_next(&rest, NULL) != NULL;
+        }
+      }
+
+      /* only the directory listed stays locked */
+      if (curr_directory != NULL)
+      {
+        if (curr_directory != directory)
+        {
+          UNLOCK(&directory->lock);
+          READ_LOCK(&curr_directory->lock);
+        }
+
+        open_cursor(cursor, curr_directory);
+        result = 1;
+      }
+      else if (result != 1)
+        UNLOCK(&directory->lock);
+    }
+
+    /* the command goes on until the cursor is closed */
+    if (result != 1)
+    {
+      end_command(session);
+      STATS_END(session, FS_STATS_LS, result);
+    }
+  }
+
+  return result;
+}
+
+/*
+ * session_ls_close closes a cursor set up by session_ls_open, unlocking the
+ * directory listed.
+ *
+ * session: The session.
+ * cursor: The cursor.
+ */
+void session_ls_close(Fs_session *session, Fs_cursor *cursor)
+{
+  if (session != NULL && cursor != NULL && cursor->directory != NULL)
+  {
+    UNLOCK(&cursor->directory->lock);
+    end_command(session);
+    STATS_END(session, FS_STATS_LS, 1);
+    cursor->directory = NULL;
+  }
+}
+
+/*
+ * session_pwd is pwd for the current directory of a session.
+ *
+ * The path is kept up to date by cd as it moves around, so it is normally
+ * printed with a single write. It is only rebuilt by going through the
+ * directories up to the root if the current directory was not reached by cd.
+ *
+ * session: The session.
+ */
+void session_pwd(Fs_session *session)
+{
+  int result = 0;
+
+  if (session != NULL)
+  {
+    if (!begin_command(session))
+      printf("the current directory was removed!\n");
+    else if (track_path(session))
+    {
+      fwrite(session->cwd_path, 1, session->cwd_path_length, stdout);
+      result = 1;
+    }
+    else
+      printf("fail to track the path!\n");
+
+    end_command(session);
+    STATS_END(session, FS_STATS_PWD, result);
+  }
+}
+
+/*
+ * session_pwd_path is pwd_path for the current directory of a session. It
+ * returns FS_SIM_STALE if the current directory was removed.
+ *
+ * session: The session.
+ * path: The buffer the path is saved in.
+ * size: The size of the buffer.
+ */
+int session_pwd_path(Fs_session *session, char path[], size_t size)
+{
+  int result = 0;
+  size_t length;
+
+  if (session != NULL && path != NULL && size > 0)
+  {
+    if (!begin_command(session))
+      result = FS_SIM_STALE;
+    else if (track_path(session))
+    {
+      /* the saved path ends with a newline, which is not part of the path */
+      length = session->cwd_path_length - 1;
+      result = length < size;
+      if (!result)
+        length = size - 1;
+
+      memcpy(path, session->cwd_path, length);
+      path[length] = '\0';
+    }
+
+    end_command(session);
+    STATS_END(session, FS_STATS_PWD, result);
+  }
+
+  return result;
+}
+
+/*
+ * session_rm is rm for the current directory of a session. It returns
+ * FS_SIM_STALE without doing anything if the current directory was removed
+ * and arg is not an absolute path.
+ *
+ * A directory can be removed while other sessions are going through it or
+ * standing in it. It is only unlinked right away, and deallocated once none
+ * of them can see it anymore; sessions left standing in it get FS_SIM_STALE
+ * from then on.
+ *
+ * session: The session.
+ * arg: The name of, or the path to, the file or directory to remove.
+ */
+int session_rm(Fs_session *session, const char arg[])
+{
+  int result = 0;
+
+  if (session != NULL && arg != NULL && !journal_failed(session->state))
+  {
+    if (!begin_command(session) && arg[0] != '/')
+      result = FS_SIM_STALE;
+    else
+      result = remove_name(session, arg);
+
+    end_command(session);
+    STATS_END(session, FS_STATS_RM, result);
+
+    /*
+     * Unless removal is deferred, the directory removed is deallocated right
+     * away if no other session is in the middle of a command.
+     */
+    reclaim_garbage(session->state,
+                    session->state->deferred_rm ? RECLAIM_CHUNK : 0);
+    if (!journal_commit_due(session->state) && result > 0)
+      result = 0;
+  }
+
+  return result;
+}
+
+/*
+ * session_ls_recursive is ls_recursive for the current directory of a
+ * session.
+ *
+ * session: The session.
+ * arg: The directory to list, given as it would be to cd.
+ */
+int session_ls_recursive(Fs_session *session, const char arg[])
+{
+  return walk_command(session, arg, WALK_LIST, NULL);
+}
+
+/*
+ * session_find is find for the current directory of a session.
+ *
+ * session: The session.
+ * arg: The directory to search, given as it would be to cd.
+ * pattern: The pattern, using '*', '?' and '[...]' as the shell does.
+ */
+int session_find(Fs_session *session, const char arg[], const char pattern[])
+{
+  return pattern != NULL ? walk_command(session, arg, WALK_FIND, pattern)
+                         : 0;
+}
+
+/*
+ * session_du is du for the current directory of a session.
+ *
+ * session: The session.
+ * arg: The directory to count, given as it would be to cd.
+ * usage: Where to save the counts.
+ */
+int session_du(Fs_session *session, const char arg[], Fs_usage *usage)
+{
+  int result = 0;
+  Directory *directory = NULL;
+
+  if (usage == NULL)
+    return 0;
+
+  usage->files = 0;
+  usage->directories = 0;
+  usage->name_bytes = 0;
+
+  if (session != NULL && arg != NULL)
+  {
+    if (!begin_command(session) && arg[0] != '/' && arg[0] != '\0')
+      result = FS_SIM_STALE;
+    else
+      directory = find_directory(session, arg, 0);
+
+    /* the counts are kept up to date by every change, so none are made */
+    if (directory != NULL)
+    {
+      MUTEX_LOCK(&session->state->epoch_lock);
+      *usage = directory->usage;
+      MUTEX_UNLOCK(&session->state->epoch_lock);
+      result = 1;
+    }
+
+    end_command(session);
+  }
+
+  return result;
+}
+
+/*
+ * session_set_quota is set_quota for the current directory of a session. It
+ * runs alone, so no change counted against the old quota is saved in the
+ * journal after the new one.
+ *
+ * session: The session.
+ * arg: The directory, given as it would be to cd.
+ * limit: The quota, or NULL to lift it.
+ */
+int session_set_quota(Fs_session *session, const char arg[],
+                      const Fs_usage *limit)
+{
+  int result = 0, i;
+  Directory *directory = NULL;
+  Fs_usage quota = {0, 0, 0};
+  char bytes[16];
+
+  if (session != NULL && arg != NULL && !journal_failed(session->state))
+  {
+    if (!begin_exclusive(session) && arg[0] != '/' && arg[0] != '\0')
+      result = FS_SIM_STALE;
+    else
+      directory = find_directory(session, arg, 1);
+
+    if (directory != NULL)
+    {
+      if (limit != NULL)
+        quota = *limit;
+
+      MUTEX_LOCK(&session->state->epoch_lock);
+      directory->quota = quota;
+      MUTEX_UNLOCK(&session->state->epoch_lock);
+
+      /* the limits on directories and name bytes follow the one on files */
+      for (i = 0; i < 8; i++)
+      {
+        bytes[i] = (char) ((quota.directories >> (8 * i)) & 0xff);
+        bytes[8 + i] = (char) ((quota.name_bytes >> (8 * i)) & 0xff);
+      }
+      journal_data(session->state, JOURNAL_QUOTA, directory, ".",
+                   quota.files, bytes, sizeof(bytes));
+      result = 1;
+    }
+
+    end_command(session);
+    if (!journal_commit_due(session->state) && result > 0)
+      result = 0;
+  }
+
+  return result;
+}
+
+/*
+ * session_cp is cp for the current directory of a session.
+ *
+ * session: The session.
+ * source: The file or directory to copy.
+ * target: The name of, or the path to, the copy.
+ */
+int session_cp(Fs_session *session, const char source[], const char target[])
+{
+  int result = 0;
+
+  if (session != NULL && source != NULL && target != NULL &&
+      !journal_failed(session->state))
+  {
+    if (!begin_exclusive(session) && (source[0] != '/' || target[0] != '/'))
+      result = FS_SIM_STALE;
+    else
+      result = copy_name(session, source, target);
+
+    end_command(session);
+    reclaim_garbage(session->state, RECLAIM_CHUNK);
+    if (!journal_commit_due(session->state) && result > 0)
+      result = 0;
+  }
+
+  return result;
+}
+
+/*
+ * session_mv is mv for the current directory of a session. It runs alone,
+ * since it changes two directories, and the paths of every directory under
+ * one it moves.
+ *
+ * session: The session.
+ * source: The file or directory to move.
+ * target: The name of, or the path to, where to move it.
+ */
+int session_mv(Fs_session *session, const char source[], const char target[])
+{
+  int result = 0;
+
+  if (session != NULL && source != NULL && target != NULL &&
+      !journal_failed(session->state))
+  {
+    if (!begin_exclusive(session) && (source[0] != '/' || target[0] != '/'))
+      result = FS_SIM_STALE;
+    else
+      result = move_name(session, source, target);
+
+    end_command(session);
+    if (!journal_commit_due(session->state) && result > 0)
+      result = 0;
+  }
+
+  return result;
+}
+
+/*
+ * session_write_file is write_file for the current directory of a session.
+ *
+ * session: The session.
+ * arg: The name of, or the path to, the file.
+ * offset: Where the bytes go.
+ * data: The bytes.
+ * length: The number of bytes.
+ */
+int session_write_file(Fs_session *session, const char arg[],
+                       unsigned long offset, const char data[], size_t length)
+{
+  int result = 0;
+
+  if (session != NULL && arg != NULL && (data != NULL || length == 0) &&
+      !journal_failed(session->state))
+  {
+    if (!begin_command(session) && arg[0] != '/')
+      result = FS_SIM_STALE;
+    else
+      result = change_data(session, arg, JOURNAL_WRITE, offset, data, length);
+
+    end_command(session);
+    if (!journal_commit_due(session->state) && result > 0)
+      result = 0;
+  }
+
+  return result;
+}
+
+/*
+ * session_append_file is append_file for the current directory of a session.
+ *
+ * session: The session.
+ * arg: The name of, or the path to, the file.
+ * data: The bytes.
+ * length: The number of bytes.
+ */
+int session_append_file(Fs_session *session, const char arg[],
+                        const char data[], size_t length)
+{
+  return session_write_file(session, arg, DATA_END, data, length);
+}
+
+/*
+ * session_truncate_file is truncate_file for the current directory of a
+ * session.
+ *
+ * session: The session.
+ * arg: The name of, or the path to, the file.
+ * size: The new size.
+ */
+int session_truncate_file(Fs_session *session, const char arg[],
+                          unsigned long size)
+{
+  int result = 0;
+
+  if (session != NULL && arg != NULL && !journal_failed(session->state))
+  {
+    if (!begin_command(session) && arg[0] != '/')
+      result = FS_SIM_STALE;
+    else
+      result = change_data(session, arg, JOURNAL_TRUNCATE, size, NULL, 0);
+
+    end_command(session);
+    if (!journal_commit_due(session->state) && result > 0)
+      result = 0;
+  }
+
+  return result;
+}
+
+/*
+ * session_read_open sets up a view of part of the contents of a file, so they
+ * can be read with read_next. The function would return 1 if the file was
+ * found and the view was set up, 0 if invalid cases happened, and
+ * FS_SIM_STALE if the current directory was removed and arg is not an
+ * absolute path.
+ *
+ * The file, and the directory it is in, are kept locked against changes until
+ * the view is closed with session_read_close, which has to be done before the
+ * session is used for anything else.
+ *
+ * session: The session.
+ * arg: The name of, or the path to, the file.
+ * offset: Where the part starts.
+ * length: The largest number of bytes to read.
+ * view: The view to set up.
+ */
+int session_read_open(Fs_session *session, const char arg[],
+                      unsigned long offset, unsigned long length,
+                      Fs_view *view)
+{
+  int result = 0;
+  Directory *directory = NULL;
+  File *file = NULL;
+  const char *name;
+
+  if (session != NULL && arg != NULL && view != NULL)
+  {
+    if (!begin_command(session) && arg[0] != '/')
+      result = FS_SIM_STALE;
+    else
+      directory = open_parent(session, arg, &name, 0);
+
+    if (directory != NULL)
+    {
+      if (find_entry(directory, name, &file, NULL) && file != NULL &&
+          file->inode != NULL)
+      {
+        open_view(view, file, directory, offset, length);
+        result = 1;
+      }
+      else
+        UNLOCK(&directory->lock);
+    }
+
+    /* the command goes on until the view is closed */
+    if (result != 1)
+      end_command(session);
+  }
+
+  return result;
+}
+
+/*
+ * session_read_close closes a view set up by session_read_open, unlocking the
+ * file and the directory it is in.
+ *
+ * session: The session.
+ * view: The view.
+ */
+void session_read_close(Fs_session *session, Fs_view *view)
+{
+  if (session != NULL && view != NULL && view->directory != NULL)
+  {
+    UNLOCK(INODE_LOCK(session->state, view->file->inode));
+    UNLOCK(&view->directory->lock);
+    end_command(session);
+    view->directory = NULL;
+  }
+}
+
+/*
+ * session_ln is ln for the current directory of a session. It runs alone,
+ * since the file it finds in one directory must not be removed before it is
+ * given its name in the other.
+ *
+ * session: The session.
+ * source: The name of, or the path to, the file.
+ * target: The new name of, or the path to the new name of, the file.
+ */
+int session_ln(Fs_session *session, const char source[], const char target[])
+{
+  int result = 0;
+
+  if (session != NULL && source != NULL && target != NULL &&
+      !journal_failed(session->state))
+  {
+    if (!begin_exclusive(session) && (source[0] != '/' || target[0] != '/'))
+      result = FS_SIM_STALE;
+    else
+      result = link_name(session, source, target);
+
+    end_command(session);
+    if (!journal_commit_due(session->state) && result > 0)
+      result = 0;
+  }
+
+  return result;
+}
+
+/*
+ * session_stat_entry is stat_entry for the current directory of a session.
+ *
+ * A file or directory shared with another one since cp is found through a
+ * view without being copied, and described as stat_fill describes it.
+ *
+ * session: The session.
+ * arg: The directory or file.
+ * entry: Where the description is saved.
+ */
+int session_stat_entry(Fs_session *session, const char arg[],
+                       Fs_entry *entry)
+{
+  int result = 0;
+  Directory *directory = NULL;
+  File *file = NULL;
+  const char *name;
+
+  if (session != NULL && arg != NULL && entry != NULL)
+  {
+    if (!begin_command(session) && arg[0] != '/')
+      result = FS_SIM_STALE;
+    else
+    {
+      /* a directory is found as cd finds it, and a file as rm does */
+      directory = find_directory(session, arg, 0);
+      if (directory != NULL)
+      {
+        READ_LOCK(&directory->lock);
+        stat_fill(entry, directory, NULL);
+        UNLOCK(&directory->lock);
+        result = 1;
+      }
+      else if (split_path(session, arg, &directory, &name, 0))
+      {
+        READ_LOCK(&directory->lock);
+        if (find_entry(directory, name, &file, NULL) && file != NULL &&
+            file->inode != NULL)
+        {
+          stat_fill(entry, directory, file);
+          result = 1;
+        }
+        UNLOCK(&directory->lock);
+      }
+    }
+
+    end_command(session);
+  }
+
+  return result;
+}
+
+/*
+ * session_stat_id is stat_id for a session. Since an inode number does not
+ * depend on the current directory, it works the same whether or not the
+ * current directory was removed.
+ *
+ * session: The session.
+ * id: The inode number.
+ * entry: Where the description is saved.
+ */
+int session_stat_id(Fs_session *session, unsigned long id, Fs_entry *entry)
+{
+  int result = 0;
+  Directory *directory;
+  File *file;
+
+  if (session != NULL && entry != NULL)
+  {
+    begin_command(session);
+
+    directory = handle_find(session, id, &file);
+    if (directory != NULL)
+    {
+      stat_fill(entry, directory, file);
+      UNLOCK(&directory->lock);
+      result = 1;
+    }
+
+    end_command(session);
+  }
+
+  return result;
+}
+
+/*
+ * session_ls_id is ls_id for a session.
+ *
+ * session: The session.
+ * id: The inode number.
+ */
+int session_ls_id(Fs_session *session, unsigned long id)
+{
+  Fs_cursor cursor;
+  int result = session_ls_open_id(session, id, &cursor);
+
+  if (result == 1)
+  {
+    print_list(&cursor, (size_t) -1, NULL);
+    session_ls_close(session, &cursor);
+  }
+
+  return result;
+}
+
+/*
+ * session_ls_open_id is ls_open_id for a session. The directory listed, or
+ * the directory the file listed is in, is kept locked against changes until
+ * the cursor is closed with session_ls_close, as for session_ls_open.
+ *
+ * session: The session.
+ * id: The inode number.
+ * cursor: The cursor to set up.
+ */
+int session_ls_open_id(Fs_session *session, unsigned long id,
+                       Fs_cursor *cursor)
+{
+  int result = 0;
+  Directory *directory;
+  File *file;
+
+  if (session != NULL && cursor != NULL)
+  {
+    begin_command(session);
+
+    directory = handle_find(session, id, &file);
+    if (directory != NULL && file != NULL)
+    {
+      file_cursor(cursor, directory, file);
+      result = 1;
+    }
+    else if (directory != NULL)
+    {
+      open_cursor(cursor, directory);
+      result = 1;
+    }
+
+    /* the command goes on until the cursor is closed */
+    if (result != 1)
+    {
+      end_command(session);
+      STATS_END(session, FS_STATS_LS, result);
+    }
+  }
+
+  return result;
+}
+
+/*
+ * session_read_open_id is read_open_id for a session. The directory the file
+ * is in is kept locked against changes until the view is closed with
+ * session_read_close, as for session_read_open.
+ *
+ * session: The session.
+ * id: The inode number.
+ * offset: Where the part starts.
+ * length: The largest number of bytes to read.
+ * view: The view to set up.
+ */
+int session_read_open_id(Fs_session *session, unsigned long id,
+                         unsigned long offset, unsigned long length,
+                         Fs_view *view)
+{
+  int result = 0;
+  Directory *directory;
+  File *file;
+
+  if (session != NULL && view != NULL)
+  {
+    begin_command(session);
+
+    directory = handle_find(session, id, &file);
+    if (directory != NULL && file != NULL)
+    {
+      open_view(view, file, directory, offset, length);
+      result = 1;
+    }
+    else if (directory != NULL)
+      UNLOCK(&directory->lock);
+
+    /* the command goes on until the view is closed */
+    if (result != 1)
+      end_command(session);
+  }
+
+  return result;
+}
+
+/*
+ * set_deferred_rm switches the filesystem the current directory belongs to
+ * between immediate and deferred removal. In deferred mode, rm only unlinks a
+ * removed directory and leaves it on a garbage list, and every later touch,
+ * mkdir and rm deallocates a bounded chunk of the garbage, so removing a huge
+ * directory does not stall the command that removes it. reclaim can be called
+ * to deallocate the garbage at any other time.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * deferred: 1 to switch to deferred removal and 0 to switch back.
+ */
+void set_deferred_rm(Fs_sim *files, int deferred)
+{
+  if (files != NULL && *files != NULL)
+  {
+    MUTEX_LOCK(&(*files)->state->garbage_lock);
+    (*files)->state->deferred_rm = deferred != 0;
+    MUTEX_UNLOCK(&(*files)->state->garbage_lock);
+  }
+}
+
+/*
+ * reclaim deallocates directories and files left on the garbage list of the
+ * filesystem by deferred removal. The function returns 1 if no garbage is left
+ * afterwards and 0 otherwise.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * limit: The greatest number of directories and files to deallocate, or 0 to
+ *        deallocate all of them. It is ignored unless the filesystem is in
+ *        deferred mode.
+ */
+int reclaim(Fs_sim *files, unsigned long limit)
+{
+  int result = 0;
+
+  if (files != NULL && *files != NULL)
+    result = reclaim_garbage((*files)->state, limit);
+
+  return result;
+}
+
+/*
+ * memory_stats reports the memory used by the filesystem the current directory
+ * belongs to. It returns 1 if the statistics were saved in stats, and 0 if
+ * invalid arguments were passed in.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * stats: The structure the statistics are saved in.
+ */
+int memory_stats(Fs_sim *files, Fs_memory *stats)
+{
+  struct fs_state *state;
+  int result = 0, i;
+
+  if (files != NULL && *files != NULL && stats != NULL)
+  {
+    state = (*files)->state;
+
+    MUTEX_LOCK(&state->pool_lock);
+    *stats = state->memory;
+    MUTEX_UNLOCK(&state->pool_lock);
+
+    /* the name table keeps its own counts, a shard at a time */
+    stats->names = 0;
+    stats->name_references = 0;
+    stats->name_bytes_saved = 0;
+    for (i = 0; i < NAME_SHARDS; i++)
+    {
+      READ_LOCK(&state->names[i].lock);
+      stats->names += state->names[i].names;
+      stats->name_references += state->names[i].references;
+      stats->name_bytes_saved += state->names[i].bytes_saved;
+      UNLOCK(&state->names[i].lock);
+    }
+
+    result = 1;
+  }
+
+  return result;
+}
+
+/*
+ * fs_stats reports what the commands run on the filesystem the current
+ * directory belongs to did: how often each was called and succeeded, how long
+ * the calls took, and how many list nodes and names the name lookups and
+ * inserts went through. The function returns 1 if the statistics were saved
+ * in stats, and 0 if invalid arguments were passed in or fs-sim.c was not
+ * built with FS_SIM_STATS, in which case they are all 0.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * stats: The structure the statistics are saved in.
+ */
+int fs_stats(Fs_sim *files, Fs_stats *stats)
+{
+  int result = 0;
+
+  if (files != NULL && *files != NULL && stats != NULL)
+  {
+    MUTEX_LOCK(&(*files)->state->stats_lock);
+    *stats = (*files)->state->stats;
+    MUTEX_UNLOCK(&(*files)->state->stats_lock);
+
+#if defined(FS_SIM_STATS)
+    result = 1;
+#endif
+  }
+
+  return result;
+}
+
+/*
+ * print_stats prints the statistics fs_stats reports, one line per command
+ * called so far followed by its latency histogram, and one line each for the
+ * name lookups and inserts. It is what the stats command of run_batch
+ * prints. The function returns 1 if they were printed, and 0 if invalid
+ * arguments were passed in or fs-sim.c was not built with FS_SIM_STATS.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ */
+int print_stats(Fs_sim *files)
+{
+  static const char *names[FS_STATS_OPERATIONS] = {
+    "touch", "mkdir", "cd", "ls", "pwd", "rm"
+  };
+  Fs_stats stats;
+  int result = fs_stats(files, &stats), i, j;
+
+  if (!result)
+    printf("no statistics are kept!\n");
+  else
+  {
+    for (i = 0; i < FS_STATS_OPERATIONS; i++)
+    {
+      if (stats.operations[i].calls == 0)
+        continue;
+
+      printf("%s: %lu calls, %lu succeeded, %lu failed\n", names[i],
+             stats.operations[i].calls, stats.operations[i].successes,
+             stats.operations[i].failures);
+
+      /* each bucket is printed as the lowest latency in it, in nanoseconds */
+      printf("  latency:");
+      for (j = 0; j < FS_STATS_BUCKETS; j++)
+        if (stats.operations[i].latency[j] > 0)
+          printf(" %lu+:%lu", 1UL << j, stats.operations[i].latency[j]);
+      printf("\n");
+    }
+
+    printf("lookups: %lu, %lu nodes visited, %lu names compared\n",
+           stats.lookups, stats.lookup_nodes, stats.lookup_compares);
+    printf("inserts: %lu, %lu nodes visited, %lu names compared\n",
+           stats.inserts, stats.insert_nodes, stats.insert_compares);
+  }
+
+  return result;
+}
+
+/*
+ * ls_recursive lists a directory and every directory under it, the way ls -R
+ * does: each directory's full path followed by a colon, then its entries as
+ * ls prints them, one directory after another in preorder, separated by blank
+ * lines. The directories are listed by several threads at once when built
+ * with FS_SIM_THREADS, as set by set_walk_threads, but the output is always
+ * the same as if they were listed one at a time. The function returns 1 if
+ * the directory was listed, 0 if invalid arguments were passed in, arg does
+ * not lead to a directory or memory ran out, and FS_SIM_STALE as cd does.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * arg: The directory to list, given as it would be to cd.
+ */
+int ls_recursive(Fs_sim *files, const char arg[])
+{
+  return session_ls_recursive(main_session(files), arg);
+}
+
+/*
+ * find prints the full path of every file and directory under a directory
+ * whose name matches a shell wildcard pattern, with a '/' after the names of
+ * directories, in the order ls_recursive would list them. The function
+ * returns what ls_recursive would, and 0 if pattern is NULL too.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * arg: The directory to search, given as it would be to cd.
+ * pattern: The pattern, using '*', '?' and '[...]' as the shell does.
+ */
+int find(Fs_sim *files, const char arg[], const char pattern[])
+{
+  return session_find(main_session(files), arg, pattern);
+}
+
+/*
+ * du counts the files and directories under a directory, and the bytes of
+ * their names, not counting the directory itself. Every directory keeps these
+ * counts for its subtree as things are added and removed, so nothing is
+ * walked. The function returns 1 if the directory was found, and 0 if not or
+ * if usage is NULL.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * arg: The directory to count, given as it would be to cd.
+ * usage: Where to save the counts.
+ */
+int du(Fs_sim *files, const char arg[], Fs_usage *usage)
+{
+  return session_du(main_session(files), arg, usage);
+}
+
+/*
+ * set_quota limits what the subtree under a directory may hold, in the counts
+ * du reports. From then on touch, mkdir, touch_many, mkdir_many, cp, mv and
+ * ln fail, before anything is allocated, for every name that would take the
+ * subtree of the directory, or of any directory above it, past its quota. A
+ * subtree already holding more than its new quota keeps what it holds. The
+ * function returns 1 if the directory was found, and 0 otherwise.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * arg: The directory, given as it would be to cd.
+ * limit: The most files, directories and bytes of names the subtree may
+ *        hold, a field of 0 meaning no limit on that count, or NULL to lift
+ *        the quota.
+ */
+int set_quota(Fs_sim *files, const char arg[], const Fs_usage *limit)
+{
+  return session_set_quota(main_session(files), arg, limit);
+}
+
+/*
+ * set_walk_threads sets how many threads ls_recursive and find use for the
+ * filesystem the current directory belongs to, counting the thread that calls
+ * them, from 1 up to WALK_MAX_THREADS. It starts out as the number of
+ * processors online. Without FS_SIM_THREADS it makes no difference.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * threads: The number of threads.
+ */
+void set_walk_threads(Fs_sim *files, int threads)
+{
+  if (files != NULL && *files != NULL)
+  {
+    if (threads < 1)
+      threads = 1;
+    if (threads > WALK_MAX_THREADS)
+      threads = WALK_MAX_THREADS;
+
+    (*files)->state->walk_threads = threads;
+  }
+}
+
+/*
+ * save_fs saves the whole filesystem the current directory belongs to, from
+ * its root down, into a snapshot image file that load_fs can load. The
+ * function returns 1 if the image was written and flushed to disk, and 0 if
+ * invalid arguments were passed in, or the file could not be written. No
+ * other session may change the filesystem while it is being saved.
+ *
+ * The image is written next to the file as path with ".tmp" appended and
+ * only then renamed over it, so the file is either replaced whole or left as
+ * it was, and it can be the one the filesystem was loaded from.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * path: The name of the image file, which is replaced if it exists.
+ */
+int save_fs(Fs_sim *files, const char path[])
+{
+  int result = 0;
+
+  if (files != NULL && *files != NULL && path != NULL)
+    result = save_image((*files)->state, path);
+
+  return result;
+}
+
+/*
+ * load_fs is used in place of mkfs to create a filesystem from a snapshot
+ * image file written by save_fs. The image is mapped into memory and used as
+ * it is, so loading does not allocate or copy anything per directory or file,
+ * and the filesystem then works exactly as the one saved. Changes only copy
+ * the pages of the image they touch, and never change the file. rmfs removes
+ * the filesystem as usual.
+ *
+ * The function returns 1 if the filesystem was loaded, and 0 if invalid
+ * arguments were passed in, or the file could not be mapped or is not an
+ * image written by this build.
+ *
+ * files: The pointer the current directory of the new filesystem is saved in,
+ *        as for mkfs. It is set to the root.
+ * path: The name of the image file.
+ */
+int load_fs(Fs_sim *files, const char path[])
+{
+  int result = 0, fd;
+  Image_header header;
+  char *image;
+  off_t size;
+
+  if (files != NULL && path != NULL)
+  {
+    fd = open(path, O_RDONLY);
+    if (fd >= 0)
+    {
+      size = lseek(fd, 0, SEEK_END);
+
+      if (size >= (off_t) sizeof(header) && lseek(fd, 0, SEEK_SET) == 0 &&
+          read(fd, &header, sizeof(header)) == (ssize_t) sizeof(header) &&
+          image_valid(&header, (unsigned long) size))
+      {
+        /* asking for the base address, which saves relocating the image */
+        image = mmap((void *) header.base, header.size,
+                     PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (image != MAP_FAILED)
+        {
+          *files = image_open(image, header.size)->root;
+          result = 1;
+        }
+      }
+
+      close(fd);
+    }
+  }
+
+  return result;
+}
+
+/*
+ * run_batch runs a whole buffer of commands against the filesystem, one per
+ * line, with the same effect and output as calling the functions one after
+ * another. Each line holds the name of a command, one of mkfs, touch, mkdir,
+ * cd, ls, pwd, rm, rmfs and stats (print_stats), and its argument, separated
+ * by spaces or tabs; a missing argument is the empty string, and blank lines
+ * are skipped.
+ *
+ * The lines are read in place, without being copied or split up first; only
+ * the argument of each command is copied, to be terminated. When a command
+ * works on a path whose directory part is the same as that of the command
+ * before, the directory found by that command is used again, unless a
+ * directory was removed or the current directory changed since, so runs of
+ * commands in one directory only resolve it once.
+ *
+ * The changes made are written to the journal of the filesystem, if it has
+ * one, as a single group at the end.
+ *
+ * The function returns the number of commands run, or -1 if invalid
+ * arguments were passed in, memory ran out, or the changes could not be
+ * written to the journal. The result of each command, 1 for those not
+ * returning anything, or FS_SIM_UNKNOWN for a line that is not a command, is
+ * saved in status as long as there is room.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * commands: The commands.
+ * length: The length of the commands.
+ * status: The array the results are saved in, which may be NULL.
+ * size: The number of results status has room for.
+ */
+long run_batch(Fs_sim *files, const char commands[], size_t length,
+               int status[], size_t size)
+{
+  const char *line = commands, *end = commands + length, *next, *word;
+  const char *arg, *last, *directory = NULL;
+  size_t word_length, arg_length, directory_length = 0, buffer_size = 0;
+  Directory *start = NULL, *found = NULL;
+  unsigned long generation = 0;
+  Fs_session *session;
+  char *buffer = NULL, *grown;
+  long count = 0;
+  int command, result;
+
+  if (files == NULL || commands == NULL)
+    return -1;
+
+  while (line < end)
+  {
+    next = memchr(line, '\n', end - line);
+    if (next == NULL)
+      next = end;
+
+    /* the command and its argument are the first two words of the line */
+    for (word = line; word < next && isspace((unsigned char) *word); word++)
+      ;
+    for (arg = word; arg < next && !isspace((unsigned char) *arg); arg++)
+      ;
+    word_length = arg - word;
+    while (arg < next && isspace((unsigned char) *arg))
+      arg++;
+    for (arg_length = 0;
+         arg + arg_length < next && !isspace((unsigned char) arg[arg_length]);
+         arg_length++)
+      ;
+
+    line = next < end ? next + 1 : end;
+    if (word_length == 0)
+      continue;
+
+    if (arg_length >= buffer_size)
+    {
+      grown = realloc(buffer, arg_length + 64);
+      if (grown == NULL)
+      {
+        count = -1;
+        break;
+      }
+      buffer = grown;
+      buffer_size = arg_length + 64;
+    }
+    memcpy(buffer, arg, arg_length);
+    buffer[arg_length] = '\0';
+
+    command = batch_command(word, word_length);
+    session = main_session(files);
+
+    /*
+     * The directory part of a path is everything before its last slash; a
+     * path ending with a slash is left to be resolved as usual.
+     */
+    last = NULL;
+    if (session != NULL && arg_length > 1 && arg[arg_length - 1] != '/' &&
+        (command == BATCH_TOUCH || command == BATCH_MKDIR ||
+         command == BATCH_LS || command == BATCH_RM))
+    {
+      last = arg + arg_length - 1;
+      while (last >= arg && *last != '/')
+        last--;
+      if (last < arg)
+        last = NULL;
+    }
+
+    if (last != NULL)
+    {
+      session->parent = NULL;
+      if (found != NULL && directory_length == (size_t) (last - arg) &&
+          !memcmp(directory, arg, directory_length) &&
+          start == (arg[0] == '/' ? session->state->root : session->cwd))
+      {
+        session->hint = found;
+        session->hint_generation = generation;
+      }
+    }
+
+    switch (command)
+    {
+      case BATCH_MKFS:
+        mkfs(files);
+        result = 1;
+        break;
+      case BATCH_TOUCH:
+        result = touch(files, buffer);
+        break;
+      case BATCH_MKDIR:
+        result = mkdir(files, buffer);
+        break;
+      case BATCH_CD:
+        result = cd(files, buffer);
+        break;
+      case BATCH_LS:
+        result = ls(files, buffer);
+        break;
+      case BATCH_PWD:
+        pwd(files);
+        result = 1;
+        break;
+      case BATCH_RM:
+        result = rm(files, buffer);
+        break;
+      case BATCH_RMFS:
+        rmfs(files);
+        result = 1;
+        break;
+      case BATCH_STATS:
+        result = print_stats(files);
+        break;
+      default:
+        result = FS_SIM_UNKNOWN;
+        break;
+    }
+
+    /* remembering where the directory part of the path led */
+    found = NULL;
+    if (last != NULL)
+    {
+      session->hint = NULL;
+      if (session->parent != NULL)
+      {
+        directory = arg;
+        directory_length = last - arg;
+        start = arg[0] == '/' ? session->state->root : session->cwd;
+        found = session->parent;
+        generation = session->generation;
+      }
+    }
+
+    if ((size_t) count < size && status != NULL)
+      status[count] = result;
+    count++;
+  }
+
+  free(buffer);
+
+  /* rmfs may have been run last, which wrote the journal out itself */
+  if (*files != NULL && !journal_commit((*files)->state))
+    count = -1;
+
+  return count;
+}
+
+/*
+ * run_script runs the commands in a script file, as run_batch does for a
+ * buffer. The file is mapped into memory rather than read. The function
+ * returns the number of commands run, or -1 if invalid arguments were passed
+ * in, or the file could not be mapped, or memory ran out.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * path: The name of the script file.
+ * status: The array the results are saved in, which may be NULL.
+ * size: The number of results status has room for.
+ */
+long run_script(Fs_sim *files, const char path[], int status[], size_t size)
+{
+  long count = -1;
+  char *script;
+  off_t length;
+  int fd;
+
+  if (files != NULL && path != NULL)
+  {
+    fd = open(path, O_RDONLY);
+    if (fd >= 0)
+    {
+      length = lseek(fd, 0, SEEK_END);
+      if (length == 0)
+        count = 0;
+      else if (length > 0)
+      {
+        script = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (script != MAP_FAILED)
+        {
+          count = run_batch(files, script, length, status, size);
+          munmap(script, length);
+        }
+      }
+
+      close(fd);
+    }
+  }
+
+  return count;
+}
+
+/*
+ * recover_fs is used in place of mkfs to create a filesystem whose changes
+ * survive a crash. It loads the snapshot image file if there is one, or else
+ * starts out empty, and then replays the changes saved in the journal file
+ * after the snapshot was taken, cutting off a record torn by a crash. Every
+ * successful touch, mkdir and rm is saved in the journal from then on.
+ *
+ * Every command changing the filesystem adds its record to a buffer, which is
+ * written and flushed to disk with a single fsync once it has grown large
+ * enough or a second has gone by since it last was, at the end of run_batch,
+ * run_script, touch_many and mkdir_many, and by journal_sync and rmfs; a crash
+ * loses the changes made since. If records cannot be written, the command
+ * writing them returns 0 though its change was made, and every command that
+ * would change the filesystem returns 0 without doing anything from then on.
+ * Once the journal grows past its limit, the filesystem is saved as the new
+ * snapshot and the journal starts over. rmfs closes the journal.
+ *
+ * The function returns 1 if the filesystem was recovered, and 0 if invalid
+ * arguments were passed in, or the snapshot or journal could not be read, or
+ * the journal does not go on from the snapshot, or could not be created.
+ *
+ * files: The pointer the current directory of the new filesystem is saved in,
+ *        as for mkfs. It is set to the root.
+ * snapshot: The name of the snapshot image file.
+ * journal: The name of the journal file.
+ */
+int recover_fs(Fs_sim *files, const char snapshot[], const char journal[])
+{
+  int result = 0, fd = -1;
+
+  if (files != NULL && snapshot != NULL && journal != NULL)
+  {
+    *files = NULL;
+    if (!load_fs(files, snapshot) && access(snapshot, F_OK) != 0)
+      mkfs(files);
+
+    if (*files != NULL)
+    {
+      if (access(journal, F_OK) != 0)
+        fd = journal_start(journal, (*files)->state->sequence);
+      else if (journal_replay(files, journal))
+        fd = open(journal, O_WRONLY | O_APPEND);
+
+      result = fd >= 0 && journal_attach((*files)->state, fd, journal,
+                                         snapshot);
+      if (!result)
+      {
+        if (fd >= 0)
+          close(fd);
+        rmfs(files);
+      }
+    }
+  }
+
+  return result;
+}
+
+/*
+ * journal_sync writes the changes saved in the journal of the filesystem the
+ * current directory belongs to but not written yet, and flushes them to disk.
+ * The function returns 1 if the changes are on disk or the filesystem has no
+ * journal, and 0 if invalid arguments were passed in or changes were lost.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ */
+int journal_sync(Fs_sim *files)
+{
+  int result = 0;
+
+  if (files != NULL && *files != NULL)
+    result = journal_commit((*files)->state);
+
+  return result;
+}
+
+/*
+ * compact_fs saves the filesystem the current directory belongs to as its new
+ * snapshot image and starts its journal over, as is done when the journal
+ * grows past its limit. The function returns 1 if it was compacted, and 0 if
+ * invalid arguments were passed in, the filesystem has no journal, or the
+ * snapshot or journal could not be written. No other session may change the
+ * filesystem meanwhile.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ */
+int compact_fs(Fs_sim *files)
+{
+  int result = 0;
+
+  if (files != NULL && *files != NULL && (*files)->state->journal != NULL)
+    result = journal_compact((*files)->state);
+
+  return result;
+}
+
+/*
+ * set_journal_limit sets the size the journal of the filesystem the current
+ * directory belongs to may grow to before it is compacted, JOURNAL_LIMIT
+ * unless set.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ * limit: The size in bytes, or 0 to only compact with compact_fs.
+ */
+void set_journal_limit(Fs_sim *files, unsigned long limit)
+{
+  if (files != NULL && *files != NULL && (*files)->state->journal != NULL)
+  {
+    MUTEX_LOCK(&(*files)->state->journal->commit_lock);
+    (*files)->state->journal->limit = limit;
+    MUTEX_UNLOCK(&(*files)->state->journal->commit_lock);
+  }
+}
+
+/*
+ * main_session returns the session of the filesystem used by the functions
+ * taking an Fs_sim, moved to the current directory, or NULL if files is not
+ * valid.
+ *
+ * An Fs_sim may be a copy of another one whose current directory was removed
+ * since, through the other one or a session. The directory is still there
+ * then, since cd marked it as held, so whether it was removed is found out
+ * the same way as for the current directory of a session.
+ *
+ * files: The pointer used to track the current directory in the filesystem.
+ */
+static Fs_session *main_session(Fs_sim *files)
+{
+  Fs_session *session = NULL;
+
+  if (files != NULL && *files != NULL)
+  {
+    session = &(*files)->state->main;
+
+    /* whether the current directory was removed has to be worked out again */
+    if (session->cwd != *files)
+    {
+      session->cwd = *files;
+      session->stale_generation = 0;
+    }
+  }
+
+  return session;
+}
+
+/*
+ * touch_name creates a new file in a directory, which must be locked for
+ * writing. The function would return 1 if valid arguments passed in and new
+ * file created ,and 0 if invalid cases happened (explain more in the function).
+ *
+ * directory: The directory the file is created in.
+ * name: A characters pointer points to name that would be assigned for new
+ *       file.
+ */
+static int touch_name(Directory *directory, const char name[])
+{
+  int result = 0;
+  File *new_file = NULL;
+  Fs_usage change;
+
+  /* If the name is empty, nothing would be created */
+  if (!strcmp(name, ""))
+    result = 0;
+  else if (!strcmp(name, ".") || !strcmp(name, "..") || !strcmp(name, "/"))
+    result = 1;
+  /*
+   * case of a normal valid file name. The name of new file cannot be an
+   * existing file or directory. Therefore, using the helper function,
+   * check_name, to check all names of files and sub directories in the
+   * directory. If no repetition, and no quota is exceeded by it, go for the
+   * linked list insertion.
+   */
+  else if (!check_name(directory, name, NULL, NULL) &&
+           usage_charge(directory, usage_entry(&change, name, 0)))
+  {
+    new_file = alloc_file(directory->state, name, NULL);
+    if (new_file != NULL)
+    {
+      result = 1;
+
+      /* Inserting new file into the linkedlist in increasing order */
+      link_file(directory, new_file);
+      journal_append(directory->state, JOURNAL_TOUCH, directory, name,
+                     NULL, NULL);
+    }
+    else
+    {
+      usage_release(directory, &change);
+      printf("fail to create the new file!\n");
+    }
+  }
+
+  return result;
+}
+
+/*
+ * mkdir_name creates a new sub directory in a directory, which must be locked
+ * for writing. The function would return 1 if valid arguments passed in and
+ * new directory created ,and 0 if invalid cases happened (most of invalid cases
+ * are the same as in touch_name).
+ *
+ * directory: The directory the sub directory is created in.
+ * name: A characters pointer points to name that would be assigned for new
+ *       directory.
+ */
+static int mkdir_name(Directory *directory, const char name[])
+{
+  int result = 0;
+  Directory *new_directory = NULL;
+  Fs_usage change;
+
+  if (!strcmp(name, ""))
+    result = 0;
+  else if (!strcmp(name, ".") || !strcmp(name, "..") || !strcmp(name, "/"))
+    result = 0;
+  /*
+   * name cannot be a name of existing file or sub-directory located in the
+   * directory.
+   */
+  else if (check_name(directory, name, NULL, NULL))
+    result = 0;
+  /* nor take the directory, or any above it, past its quota */
+  else if (!usage_charge(directory, usage_entry(&change, name, 1)))
+    result = 0;
+  else
+  {
+    new_directory = alloc_directory(directory->state, name);
+
+    if (new_directory != NULL)
+    {
+      /*
+       * Still inserting into the linkedlist in increasing order, which also
+       * saves the directory as the parent directory of the new one.
+       */
+      link_directory(directory, new_directory);
+      journal_append(directory->state, JOURNAL_MKDIR, directory, name,
+                     NULL, NULL);
+
+      result = 1;
+    }
+    else
+    {
+      usage_release(directory, &change);
+      printf("fail to create the new directory!\n");
+    }
+  }
+
+  return result;
+}
+
+/*
+ * bulk_command carries out touch_many or mkdir_many for a session. It
+ * returns what they return.
+ *
+ * session: the session.
+ * arg: the directory the names are created in, given as it would be to cd.
+ * names: the names.
+ * count: the number of names.
+ * is_dir: 1 for mkdir_many and 0 for touch_many.
+ * status: where the result of each name is saved, or NULL.
+ */
+static int bulk_command(Fs_session *session, const char arg[],
+                        const char *names[], size_t count, int is_dir,
+                        int status[])
+{
+  int result = 0;
+  Directory *directory = NULL;
+  Bulk_name *sorted = NULL;
+  size_t i, used = 0;
+
+  if (session == NULL || arg == NULL || (names == NULL && count > 0) ||
+      journal_failed(session->state))
+    return 0;
+
+  if (status != NULL)
+    for (i = 0; i < count; i++)
+      status[i] = 0;
+
+  /* the names are sorted before anything is locked */
+  if (count > 0)
+  {
+    sorted = malloc(count * sizeof(*sorted));
+    if (sorted == NULL)
+      return 0;
+
+    for (i = 0; i < count; i++)
+      if (names[i] != NULL)
+      {
+        sorted[used].name = names[i];
+        sorted[used].position = i;
+        used++;
+      }
+
+    qsort(sorted, used, sizeof(*sorted), compare_bulk_names);
+  }
+
+  if (!begin_command(session) && arg[0] != '/' && arg[0] != '\0')
+    result = FS_SIM_STALE;
+  else
+    directory = find_directory(session, arg, 1);
+
+  /* each name is dealt with as a touch or mkdir of it would */
+  if (directory != NULL && is_shared(directory))
+  {
+    exclusive_command(session);
+    for (i = 0; directory != NULL && i < used; i++)
+      if (!prepare_change(directory, sorted[i].name))
+        directory = NULL;
+  }
+
+  if (directory != NULL)
+  {
+    WRITE_LOCK(&directory->lock);
+    create_names(directory, sorted, used, is_dir, status);
+    UNLOCK(&directory->lock);
+    result = 1;
+  }
+
+  end_command(session);
+  free(sorted);
+
+  reclaim_garbage(session->state, RECLAIM_CHUNK);
+
+  /* all of the names are written to the journal as one group */
+  if (!journal_commit(session->state) && result > 0)
+    result = 0;
+
+  return result;
+}
+
+/*
+ * create_names merges sorted names into a directory, which must be locked
+ * for writing, creating a file or sub directory for each. The linkedlists of
+ * the directory are walked once alongside the names, each new entry being
+ * spliced in where the walk has got to. Every name gets the result touch_name
+ * or mkdir_name would give it, a name given more than once being there
+ * already from the second time on.
+ *
+ * directory: the directory.
+ * names: the names, sorted by compare_bulk_names.
+ * count: the number of names.
+ * is_dir: 1 to create sub directories and 0 to create files.
+ * status: where the result of each name is saved, or NULL.
+ */
+static void create_names(Directory *directory, const Bulk_name names[],
+                         size_t count, int is_dir, int status[])
+{
+  File *curr_file = directory->f_head, *new_file;
+  Directory *curr_directory = directory->sub, *new_directory;
+  const char *name, *last = NULL;
+  unsigned long nodes = 0, compares = 0;
+  Fs_usage change;
+  size_t i;
+  int result;
+
+  for (i = 0; i < count; i++)
+  {
+    name = names[i].name;
+    result = 0;
+
+    /* the same names touch_name and mkdir_name do not create, and paths */
+    if (!strcmp(name, ".") || !strcmp(name, "..") || !strcmp(name, "/"))
+      result = !is_dir;
+    else if (!strcmp(name, "") || strchr(name, '/') != NULL)
+      result = 0;
+    else if (last != NULL && !strcmp(name, last))
+      result = 0;
+    else
+    {
+      last = name;
+
+      /* moving on to the first entries not less than the name */
+      while (curr_file != NULL &&
+             (compares++, strcmp(curr_file->name, name) < 0))
+      {
+        curr_file = curr_file->next;
+        nodes++;
+      }
+      while (curr_directory != NULL &&
+             (compares++, strcmp(curr_directory->name, name) < 0))
+      {
+        curr_directory = curr_directory->next;
+        nodes++;
+      }
+
+      if ((curr_file != NULL && !strcmp(curr_file->name, name)) ||
+          (curr_directory != NULL && !strcmp(curr_directory->name, name)))
+        result = 0;
+      else if (!usage_charge(directory, usage_entry(&change, name, is_dir)))
+        result = 0;
+      else if (!is_dir)
+      {
+        new_file = alloc_file(directory->state, name, NULL);
+        if (new_file != NULL)
+        {
+          splice_file(directory, new_file, curr_file);
+          journal_append(directory->state, JOURNAL_TOUCH, directory, name,
+                         NULL, NULL);
+          result = 1;
+        }
+        else
+        {
+          usage_release(directory, &change);
+          printf("fail to create the new file!\n");
+        }
+      }
+      else
+      {
+        new_directory = alloc_directory(directory->state, name);
+        if (new_directory != NULL)
+        {
+          splice_directory(directory, new_directory, curr_directory);
+          journal_append(directory->state, JOURNAL_MKDIR, directory, name,
+                         NULL, NULL);
+          result = 1;
+        }
+        else
+        {
+          usage_release(directory, &change);
+          printf("fail to create the new directory!\n");
+        }
+      }
+
+      if (result)
+      {
+        STATS_INSERT(directory->state, nodes, compares);
+        nodes = 0;
+        compares = 0;
+      }
+    }
+
+    if (status != NULL)
+      status[names[i].position] = result;
+  }
+}
+
+/*
+ * compare_bulk_names orders names for create_names by qsort: in increasing
+ * order, and a name given more than once in the order it was given.
+ */
+static int compare_bulk_names(const void *first, const void *second)
+{
+  const Bulk_name *a = first, *b = second;
+  int order = strcmp(a->name, b->name);
+
+  if (order == 0)
+    order = a->position < b->position ? -1 : a->position > b->position;
+
+  return order;
+}
+
+/*
+ * remove_name carries out rm for a session. It returns 1 if the file or
+ * directory was removed, or anything matching the pattern given, and 0 if
+ * not.
+ *
+ * session: The session.
+ * arg: The name of, or the path to, the file or directory to remove.
+ */
+static int remove_name(Fs_session *session, const char arg[])
+{
+  int result = 0, removed = 0;
+  Directory *directory, *curr_directory = NULL;
+  File *curr_file = NULL;
+  const char *name;
+  Fs_usage change;
+
+  directory = open_parent(session, arg, &name, 1);
+  if (directory == NULL)
+    return 0;
+
+  /*
+   * Anything sharing the entries of a directory about to be removed, or of
+   * one under it, gets copies of its own first (see release_subtree), which
+   * the command does alone. It then looks for the target again, as other
+   * commands may have run meanwhile.
+   */
+  if (directory->state->shared > 0 && !session->exclusive &&
+      (strpbrk(name, GLOB_CHARACTERS) != NULL ? directory->sub != NULL :
+       check_name(directory, name, NULL, &curr_directory) &&
+       curr_directory != NULL))
+  {
+    UNLOCK(&directory->lock);
+    exclusive_command(session);
+    return remove_name(session, arg);
+  }
+
+  /*
+   * the name of target could not be a single or double period, or an empty
+   * string, or a single forward-slash.
+   */
+  if (!strcmp(name, ".") || !strcmp(name, "..") || !strcmp(name, "") ||
+      !strcmp(name, "/"))
+  {
+    result = 0;
+  }
+  /*
+   * returns 0 if the target does not exist in the directory, unless it is a
+   * pattern, which removes every entry matching it.
+   */
+  else if (!check_name(directory, name, &curr_file, &curr_directory))
+  {
+    if (strpbrk(name, GLOB_CHARACTERS) != NULL)
+      removed = remove_matches(session, directory, name);
+  }
+  /* remove and deallocate the file from the linkedlist if found */
+  else if (curr_file != NULL)
+  {
+    unlink_file(directory, curr_file);
+    usage_release(directory, usage_entry(&change, curr_file->name, 0));
+    free_file(directory->state, curr_file);
+    result = 1;
+  }
+  /*
+   * the case when the target is not a file. Since check_name found it, it
+   * must be a subdirectory.
+   */
+  else
+    result = remove_directory(session, directory, curr_directory);
+
+  /*
+   * The removal is saved in the journal after the directory removed is marked
+   * as removed, so any change made in it is either saved before or not at all.
+   */
+  if (result)
+    journal_append(directory->state, JOURNAL_RM, directory, name,
+                   NULL, NULL);
+
+  UNLOCK(&directory->lock);
+
+  return result || removed;
+}
+
+/*
+ * remove_directory removes a subdirectory of a directory locked for writing,
+ * along with everything under it, for rm. It returns 1 if it was removed, and
+ * 0 if it is the current directory of the session or holds it.
+ *
+ * session: the session.
+ * directory: the directory the subdirectory is in.
+ * target: the subdirectory.
+ */
+static int remove_directory(Fs_session *session, Directory *directory,
+                            Directory *target)
+{
+  struct fs_state *state = directory->state;
+  Directory *curr = session->cwd;
+  int linked;
+
+  /* it cannot be the current directory or contain it */
+  while (curr != NULL && curr != target)
+    curr = curr->parent;
+
+  /* nothing shares anything in it once it is gone */
+  if (curr != NULL || (directory->state->shared > 0 &&
+                       !release_subtree(target)))
+    return 0;
+
+  /*
+   * remove it from the linkedlist, which also cuts its connections with any
+   * other directory in the same level to avoid any unintended deallocation.
+   */
+  unlink_directory(directory, target);
+
+  /*
+   * A file with other names elsewhere is not deallocated along with the
+   * directory, so its names under it are given up right away. Only then can
+   * the rest be left to be deallocated without looking at anything still in
+   * the filesystem.
+   */
+  MUTEX_LOCK(&state->handle_lock);
+  linked = state->linked > 0;
+  MUTEX_UNLOCK(&state->handle_lock);
+
+  if (linked)
+    release_links(state, target);
+
+  /*
+   * hand all things under the target directory and the directory itself over
+   * to the helper function to be deallocated once it is safe.
+   */
+  destroy_directories(target);
+
+  return 1;
+}
+
+/*
+ * release_links gives up the names under a directory being removed of the
+ * files that have names elsewhere. Commands that began before it was removed
+ * may still be changing the directories under it, so each is locked for
+ * writing while its files are gone through, and stays locked while the ones
+ * under it are, which keeps its list of subdirectories from changing.
+ *
+ * state: the state of the filesystem.
+ * top: the directory, already unlinked from its parent.
+ */
+static void release_links(struct fs_state *state, Directory *top)
+{
+  Directory *curr = top, *next;
+  File *curr_file;
+  int linked;
+
+  WRITE_LOCK(&curr->lock);
+
+  while (curr != NULL)
+  {
+    for (curr_file = curr->f_head; curr_file != NULL;
+         curr_file = curr_file->next)
+    {
+      MUTEX_LOCK(&state->handle_lock);
+      linked = curr_file->inode != NULL && curr_file->inode->links > 1;
+      MUTEX_UNLOCK(&state->handle_lock);
+
+      if (linked)
+        inode_release(state, curr_file);
+    }
+
+    /* in preorder, unlocking each directory once it is gone back up from */
+    if (curr->sub != NULL)
+    {
+      curr = curr->sub;
+      WRITE_LOCK(&curr->lock);
+    }
+    else
+    {
+      while (curr != top && curr->next == NULL)
+      {
+        UNLOCK(&curr->lock);
+        curr = curr->parent;
+      }
+
+      next = curr != top ? curr->next : NULL;
+      UNLOCK(&curr->lock);
+      curr = next;
+      if (curr != NULL)
+        WRITE_LOCK(&curr->lock);
+    }
+  }
+}
+
+/*
+ * remove_matches removes every file and subdirectory of a directory locked
+ * for writing whose name matches a wildcard pattern, in a single pass over
+ * the entries glob_range finds could match it. Each removal is saved in the
+ * journal under the name removed. It returns 1 if anything was removed, and
+ * 0 otherwise; directories remove_directory refuses to remove are skipped.
+ *
+ * session: the session.
+ * directory: the directory.
+ * pattern: the pattern.
+ */
+static int remove_matches(Fs_session *session, Directory *directory,
+                          const char pattern[])
+{
+  Fs_cursor cursor;
+  File *curr_file, *next_file;
+  Directory *curr, *next;
+  Fs_usage change;
+  int result = 0;
+
+  glob_range(&cursor, directory, pattern);
+
+  /* the ranges end at the first name without the prefix of the pattern */
+  for (curr_file = cursor.file;
+       curr_file != NULL &&
+       !strncmp(curr_file->name, pattern, cursor.prefix_length);
+       curr_file = next_file)
+  {
+    next_file = curr_file->next;
+    if (!fnmatch(pattern, curr_file->name, 0))
+    {
+      unlink_file(directory, curr_file);
+      usage_release(directory, usage_entry(&change, curr_file->name, 0));
+      journal_append(directory->state, JOURNAL_RM, directory, curr_file->name,
+                     NULL, NULL);
+      free_file(directory->state, curr_file);
+      result = 1;
+    }
+  }
+
+  for (curr = cursor.sub;
+       curr != NULL && !strncmp(curr->name, pattern, cursor.prefix_length);
+       curr = next)
+  {
+    next = curr->next;
+    if (!fnmatch(pattern, curr->name, 0) &&
+        remove_directory(session, directory, curr))
+    {
+      journal_append(directory->state, JOURNAL_RM, directory, curr->name,
+                     NULL, NULL);
+      result = 1;
+    }
+  }
+
+  return result;
+}
+
+/*
+ * exclusive_command makes the running command of a session the only one
+ * running on the filesystem, if it is not already, by taking the clone lock
+ * for writing in place of reading. Every command that changes what
+ * directories share runs alone, which includes any change to a directory
+ * sharing entries with others (see is_shared). Commands only looking at them
+ * do not, since the clone lock they hold for reading keeps those changes
+ * out. It returns 1 if the command was running alone already, and 0 if other
+ * commands may have run meanwhile, in which case what it found so far may
+ * have changed. It must not be called while any directory is locked.
+ *
+ * session: the session.
+ */
+static int exclusive_command(Fs_session *session)
+{
+  if (session->exclusive)
+    return 1;
+
+  UNLOCK(&session->state->clone_lock);
+  WRITE_LOCK(&session->state->clone_lock);
+  session->exclusive = 1;
+
+  return 0;
+}
+
+/*
+ * is_shared returns 1 if a directory shares the entries of another one, or
+ * another one shares the entries of it or of a directory above it, so
+ * changing it is a change to what directories share (see prepare_change),
+ * and 0 otherwise. Nothing it looks at changes while the clone lock is held.
+ *
+ * directory: the directory.
+ */
+static int is_shared(const Directory *directory)
+{
+  const Directory *curr;
+
+  if (directory->state->shared == 0)
+    return 0;
+  if (directory->origin != NULL)
+    return 1;
+
+  for (curr = directory; curr != NULL; curr = curr->parent)
+    if (curr->clones != NULL)
+      return 1;
+
+  return 0;
+}
+
+/*
+ * copy_name carries out cp for a session, which has to be the only one
+ * running a command. It returns what cp returns, but for FS_SIM_STALE.
+ *
+ * session: the session.
+ * source: the file or directory to copy.
+ * target: the name of, or the path to, the copy.
+ */
+static int copy_name(Fs_session *session, const char source[],
+                     const char target[])
+{
+  struct fs_state *state = session->state;
+  Directory *from, *source_parent = NULL, *directory, *curr;
+  Directory *new_directory;
+  File *source_file = NULL, *new_file;
+  const char *name, *source_name = NULL;
+  Fs_usage change;
+  int result = 0;
+
+  /* the source is a directory, found as cd would, or else a file */
+  from = find_directory(session, source, 1);
+  if (from != NULL)
+  {
+    source_parent = from->parent;
+    source_name = from->name;
+  }
+  else if (split_path(session, source, &source_parent, &name, 1))
+  {
+    READ_LOCK(&source_parent->lock);
+    find_entry(source_parent, name, &source_file, NULL);
+    UNLOCK(&source_parent->lock);
+
+    if (source_file != NULL)
+      source_name = source_file->name;
+  }
+
+  /* the root, which every directory is under, is never copied */
+  if (source_parent == NULL || source_name == NULL)
+    return 0;
+
+  directory = open_parent(session, target, &name, 1);
+  if (directory == NULL)
+    return 0;
+
+  /* a directory cannot be copied into itself */
+  for (curr = directory; curr != NULL && curr != from; curr = curr->parent)
+    ;
+
+  /* the copy of a directory brings everything under it along */
+  usage_entry(&change, name, from != NULL);
+  if (from != NULL)
+  {
+    change.files += from->usage.files;
+    change.directories += from->usage.directories;
+    change.name_bytes += from->usage.name_bytes;
+  }
+
+  if (!strcmp(name, "") || !strcmp(name, ".") || !strcmp(name, "..") ||
+      !strcmp(name, "/") || curr != NULL ||
+      check_name(directory, name, NULL, NULL) ||
+      !usage_charge(directory, &change))
+    result = 0;
+  else if (source_file != NULL)
+  {
+    /* the copy is a new file sharing the chunks of the source */
+    new_file = alloc_file(state, name, NULL);
+    if (new_file != NULL &&
+        !data_share(state, new_file->inode, source_file->inode))
+    {
+      free_file(state, new_file);
+      new_file = NULL;
+    }
+    if (new_file != NULL)
+    {
+      link_file(directory, new_file);
+      result = 1;
+    }
+    else
+    {
+      usage_release(directory, &change);
+      printf("fail to create the new file!\n");
+    }
+  }
+  else
+  {
+    new_directory = alloc_directory(state, name);
+
+    /* the copy shares all of the entries of the source for now */
+    if (new_directory != NULL && (from->origin != NULL || from->count > 0) &&
+        !share_entries(new_directory, from))
+    {
+      free_directory(state, new_directory);
+      new_directory = NULL;
+    }
+
+    if (new_directory != NULL)
+    {
+      new_directory->usage = from->usage;
+      link_directory(directory, new_directory);
+      result = 1;
+    }
+    else
+    {
+      usage_release(directory, &change);
+      printf("fail to create the new directory!\n");
+    }
+  }
+
+  if (result)
+    journal_append(state, JOURNAL_CP, directory, name, source_parent,
+                   source_name);
+
+  UNLOCK(&directory->lock);
+
+  return result;
+}
+
+/*
+ * move_name carries out mv for a session, which has to be the only one
+ * running a command, so the directory moved from can be changed without its
+ * lock. It returns what mv returns, but for FS_SIM_STALE.
+ *
+ * The name of the target is interned, and the quotas checked, before anything
+ * is unlinked, so running out of memory or over a quota leaves everything
+ * where it was. The path generation is advanced once a directory was moved,
+ * since the paths saved in the path caches and the saved paths of the current
+ * directories might go through it.
+ *
+ * session: the session.
+ * source: the name of, or the path to, the file or directory to move.
+ * target: the name of, or the path to, where to move it.
+ */
+static int move_name(Fs_session *session, const char source[],
+                     const char target[])
+{
+  struct fs_state *state = session->state;
+  Directory *source_parent, *directory, *curr, *moved = NULL;
+  File *file = NULL;
+  const char *name;
+  char *old_name, *new_name = NULL;
+  Fs_usage removed, added;
+
+  /* the source is found as rm finds what it removes */
+  source_parent = open_parent(session, source, &name, 1);
+  if (source_parent == NULL)
+    return 0;
+
+  if (strcmp(name, "") && strcmp(name, ".") && strcmp(name, "..") &&
+      strcmp(name, "/"))
+    check_name(source_parent, name, &file, &moved);
+  UNLOCK(&source_parent->lock);
+
+  if (file == NULL && moved == NULL)
+    return 0;
+
+  directory = open_parent(session, target, &name, 1);
+  if (directory == NULL)
+    return 0;
+
+  /* a directory cannot be moved into itself or anything under it */
+  for (curr = directory; curr != NULL && curr != moved; curr = curr->parent)
+    ;
+
+  if (strcmp(name, "") && strcmp(name, ".") && strcmp(name, "..") &&
+      strcmp(name, "/") && curr == NULL &&
+      !check_name(directory, name, NULL, NULL))
+    new_name = name_intern(state, name);
+
+  /* it is counted under its new name where it goes, quotas permitting */
+  if (new_name != NULL)
+  {
+    usage_entry(&removed, file != NULL ? file->name : moved->name,
+                moved != NULL);
+    usage_entry(&added, new_name, moved != NULL);
+    if (moved != NULL)
+    {
+      removed.files += moved->usage.files;
+      removed.directories += moved->usage.directories;
+      removed.name_bytes += moved->usage.name_bytes;
+      added.files = removed.files;
+      added.directories = removed.directories;
+      added.name_bytes += moved->usage.name_bytes;
+    }
+
+    if (!usage_move(source_parent, &removed, directory, &added))
+    {
+      name_release(state, new_name);
+      new_name = NULL;
+    }
+  }
+
+  if (new_name == NULL)
+  {
+    UNLOCK(&directory->lock);
+    return 0;
+  }
+
+  /* the node itself is relinked under its new name */
+  if (file != NULL)
+  {
+    unlink_file(source_parent, file);
+    old_name = file->name;
+    file->name = new_name;
+    link_file(directory, file);
+  }
+  else
+  {
+    unlink_directory(source_parent, moved);
+    old_name = moved->name;
+    moved->name = new_name;
+    link_directory(directory, moved);
+
+    MUTEX_LOCK(&state->epoch_lock);
+    state->path_generation++;
+    MUTEX_UNLOCK(&state->epoch_lock);
+  }
+
+  journal_append(state, JOURNAL_MV, directory, name, source_parent, old_name);
+  name_release(state, old_name);
+
+  UNLOCK(&directory->lock);
+
+  return 1;
+}
+
+/*
+ * link_name carries out ln for a session, which has to be the only one
+ * running a command, so the directory of the source can be left unlocked
+ * while the new name is made. It returns what ln returns, but for
+ * FS_SIM_STALE.
+ *
+ * session: the session.
+ * source: the name of, or the path to, the file.
+ * target: the new name of, or the path to the new name of, the file.
+ */
+static int link_name(Fs_session *session, const char source[],
+                     const char target[])
+{
+  struct fs_state *state = session->state;
+  Directory *source_parent, *directory;
+  File *file = NULL, *new_file;
+  const char *name;
+  Fs_usage change;
+  int result = 0;
+
+  /* the source is found as rm finds what it removes, and must be a file */
+  source_parent = open_parent(session, source, &name, 1);
+  if (source_parent == NULL)
+    return 0;
+
+  check_name(source_parent, name, &file, NULL);
+  UNLOCK(&source_parent->lock);
+
+  if (file == NULL)
+    return 0;
+
+  directory = open_parent(session, target, &name, 1);
+  if (directory == NULL)
+    return 0;
+
+  /* every name of a file counts as a file of its own */
+  if (!strcmp(name, "") || !strcmp(name, ".") || !strcmp(name, "..") ||
+      !strcmp(name, "/") || check_name(directory, name, NULL, NULL) ||
+      !usage_charge(directory, usage_entry(&change, name, 0)))
+    result = 0;
+  else
+  {
+    /* the new name shares the inode of the file */
+    new_file = alloc_file(state, name, file->inode);
+    if (new_file != NULL)
+    {
+      link_file(directory, new_file);
+      journal_append(state, JOURNAL_LINK, directory, name, source_parent,
+                     file->name);
+      result = 1;
+    }
+    else
+    {
+      usage_release(directory, &change);
+      printf("fail to create the new file!\n");
+    }
+  }
+
+  UNLOCK(&directory->lock);
+
+  return result;
+}
+
+/*
+ * stat_fill describes a file or directory. A file the directory shares with
+ * another, and a view, are described by the file and directory they are
+ * shared with, but for the names a shared file has elsewhere.
+ *
+ * entry: where the description goes.
+ * directory: the directory, or the directory the file is in, which must be
+ *            locked.
+ * file: the file, or NULL to describe the directory.
+ */
+static void stat_fill(Fs_entry *entry, Directory *directory,
+                      const File *file)
+{
+  if (file != NULL)
+  {
+    entry->id = file->inode->id;
+    entry->is_dir = 0;
+
+    /* names and contents can be changed through other directories */
+    MUTEX_LOCK(&directory->state->handle_lock);
+    entry->links = file->parent == directory ? file->inode->links : 1;
+    MUTEX_UNLOCK(&directory->state->handle_lock);
+
+    READ_LOCK(INODE_LOCK(directory->state, file->inode));
+    entry->size = file->inode->data != NULL ? file->inode->data->size : 0;
+    UNLOCK(INODE_LOCK(directory->state, file->inode));
+  }
+  else
+  {
+    entry->id = directory->id != 0 ? directory->id : directory->origin->id;
+    entry->is_dir = 1;
+    entry->links = 1;
+    entry->size = entry_count(directory);
+  }
+}
+
+/*
+ * open_view sets up a view of part of a file, cut down to the end of the
+ * file, and locks the inode of the file for reading until the view is closed.
+ *
+ * view: the view.
+ * file: the file.
+ * directory: the directory the file is in, which is kept locked until the
+ *            view is closed.
+ * offset: where the part starts.
+ * length: the number of bytes of the part.
+ */
+static void open_view(Fs_view *view, File *file, Directory *directory,
+                      unsigned long offset, unsigned long length)
+{
+  unsigned long size;
+
+  READ_LOCK(INODE_LOCK(directory->state, file->inode));
+
+  size = file->inode->data != NULL ? file->inode->data->size : 0;
+  view->file = file;
+  view->offset = offset < size ? offset : size;
+  view->end = length < size - view->offset ? view->offset + length : size;
+  view->directory = directory;
+}
+
+/*
+ * change_data carries out write_file, append_file and truncate_file for a
+ * session. It returns 1 if the file was changed, and 0 if it is not found or
+ * memory ran out, in which case the first part of the bytes to write may have
+ * been written, and is saved in the journal.
+ *
+ * session: the session.
+ * arg: the name of, or the path to, the file.
+ * op: JOURNAL_WRITE to write bytes into the file, or JOURNAL_TRUNCATE to
+ *     change its size.
+ * offset: where the bytes go, or DATA_END to append them, or the new size.
+ * bytes: the bytes to write.
+ * length: the number of bytes to write.
+ */
+static int change_data(Fs_session *session, const char arg[], int op,
+                       unsigned long offset, const char bytes[],
+                       size_t length)
+{
+  struct fs_state *state = session->state;
+  Directory *directory;
+  File *file = NULL, *other;
+  const char *name;
+  size_t written = 0;
+  int result = 0, ready = 1, linked = 0;
+
+  directory = open_parent(session, arg, &name, 1);
+  if (directory == NULL)
+    return 0;
+
+  /* a name under a directory removed meanwhile may have been given up */
+  if (check_name(directory, name, &file, NULL) && file != NULL &&
+      file->inode != NULL)
+  {
+    if (state->shared > 0)
+    {
+      MUTEX_LOCK(&state->handle_lock);
+      linked = file->inode->links > 1;
+      MUTEX_UNLOCK(&state->handle_lock);
+    }
+
+    /*
+     * The directories the other names of the file are in may be shared by
+     * copies made by cp, which must not see the change either. The command
+     * then runs alone, and looks for the file again if it was not already.
+     */
+    if (linked && !session->exclusive)
+    {
+      UNLOCK(&directory->lock);
+      exclusive_command(session);
+      return change_data(session, arg, op, offset, bytes, length);
+    }
+
+    if (linked)
+      for (other = file->inode->file; other != NULL && ready;
+           other = other->link)
+        ready = other == file ||
+                prepare_change(other->parent, other->name);
+
+    /*
+     * The file may be changed through its other names at the same time, so
+     * the change is made, and saved in the journal, under its inode lock.
+     */
+    WRITE_LOCK(INODE_LOCK(state, file->inode));
+
+    if (!ready)
+      result = 0;
+    else if (op == JOURNAL_TRUNCATE)
+      result = data_truncate(state, file->inode, offset);
+    else
+    {
+      /* an append is saved as a write at the end the file had */
+      if (offset == DATA_END)
+        offset = file->inode->data != NULL ? file->inode->data->size : 0;
+      result = data_write(state, file->inode, offset, bytes, length,
+                          &written);
+    }
+
+    /* the part of a write made before memory ran out is saved as well */
+    if (result && op == JOURNAL_TRUNCATE)
+      journal_data(state, op, directory, name, offset, bytes, length);
+    else if (op != JOURNAL_TRUNCATE && written > 0)
+      journal_data(state, op, directory, name, offset, bytes, written);
+
+    UNLOCK(INODE_LOCK(state, file->inode));
+  }
+
+  UNLOCK(&directory->lock);
+
+  return result;
+}
+
+/*
+ * find_directory finds the directory cd would move a session to for arg,
+ * returning it, or NULL if there is none.
+ *
+ * session: The session.
+ * arg: A characters pointer points to the name of target directory or certain
+ *      patterns of characters which indicate certain types of navigation.
+ * own: 1 if the directory is to be changed, or kept, and 0 if it is only
+ *      looked at, as for resolve_path.
+ */
+static Directory *find_directory(Fs_session *session, const char arg[],
+                                 int own)
+{
+  Directory *from = session->cwd, *target = NULL;
+  char *path;
+
+  /*
+   * A path with more than one component is resolved one component at a time,
+   * unless the path cache remembers where it leads. Nothing is found if any
+   * of its components does not lead to a directory.
+   */
+  if (strcmp(arg, "/") && strchr(arg, '/') != NULL)
+  {
+    path = scratch_copy(session, arg);
+    if (path != NULL)
+      target = resolve_path(session, path, own);
+  }
+  /* A single period represents staying in the current directory */
+  else if (!strcmp(arg, "."))
+    target = from;
+  /*
+   * Double periods represents changing to the parent directory, or staying
+   * if the current directory is the root.
+   */
+  else if (!strcmp(arg, ".."))
+    target = from->parent != NULL ? from->parent : from;
+  /*
+   * A single forward-slash or empty string indicates moving to the root
+   * directory.
+   */
+  else if (!strcmp(arg, "/") || !strcmp(arg, ""))
+    target = session->state->root;
+  /*
+   * If arg is a normal valid string, searching for it among the
+   * sub-directories of the current directory.
+   */
+  else
+    target = enter_directory(session, from, arg, own);
+
+  return target;
+}
+
+/*
+ * open_parent finds the directory the last component of a path is in, and
+ * locks it for reading or writing. If arg is a plain name rather than a path,
+ * that is the current directory of the session. It returns the directory, or
+ * NULL if the path does not lead to one.
+ *
+ * If the session has a hint, arg must be a path not ending with a slash whose
+ * directory part leads to the hint.
+ *
+ * session: The session.
+ * arg: The name or path.
+ * name: set to the last component of the path.
+ * write: 1 to lock the directory for writing and 0 for reading.
+ */
+static Directory *open_parent(Fs_session *session, const char arg[],
+                              const char **name, int write)
+{
+  Directory *directory = session->cwd;
+
+  /* run_batch may already know where the path leads, from the last command */
+  if (session->hint != NULL && session->hint_generation == session->generation)
+  {
+    directory = session->hint;
+    *name = strrchr(arg, '/') + 1;
+  }
+  else if (strcmp(arg, "/") && strchr(arg, '/') != NULL)
+  {
+    if (!split_path(session, arg, &directory, name, write))
+      return NULL;
+  }
+  else
+    *name = arg;
+
+  /* a view only lives as long as the command */
+  session->hint = NULL;
+  session->parent = directory->id != 0 ? directory : NULL;
+
+  /* nothing another directory shares is changed, nor any copy not made yet */
+  if (write && is_shared(directory))
+  {
+    exclusive_command(session);
+    if (!prepare_change(directory, *name))
+      return NULL;
+  }
+
+  if (write)
+    WRITE_LOCK(&directory->lock);
+  else
+    READ_LOCK(&directory->lock);
+
+  return directory;
+}
+
+/*
+ * walk_command finds the directory at the top of the subtree for
+ * ls_recursive and find, as cd would, and walks it as one command of the
+ * session. It returns what ls_recursive returns.
+ *
+ * session: the session.
+ * arg: the directory at the top of the subtree, given as it would be to cd.
+ * mode: WALK_LIST or WALK_FIND.
+ * pattern: the pattern for WALK_FIND.
+ */
+static int walk_command(Fs_session *session, const char arg[], int mode,
+                        const char pattern[])
+{
+  int result = 0;
+  Directory *top = NULL;
+
+  if (session != NULL && arg != NULL)
+  {
+    if (!begin_command(session) && arg[0] != '/' && arg[0] != '\0')
+      result = FS_SIM_STALE;
+    else
+      top = find_directory(session, arg, 0);
+
+    if (top != NULL)
+      result = walk_tree(session, top, mode, pattern);
+
+    end_command(session);
+  }
+
+  return result;
+}
+
+/*
+ * walk_tree goes through the subtree under a directory for ls_recursive or
+ * find, returning 0 if memory ran out and 1 otherwise.
+ *
+ * The calling thread hands out the directories of the subtree in preorder,
+ * the subdirectories of each in increasing order, reading each directory's
+ * list of subdirectories under its lock. Up to WALK_WINDOW directories handed
+ * out can be waiting to be printed, and the worker threads, and the calling
+ * thread while it waits, take the next one in turn and list it into its slot.
+ * The calling thread prints the slots in the order they were handed out as
+ * soon as each is done, so the output comes out in the same order whatever
+ * thread listed what, and no more than the window is ever held in memory.
+ *
+ * The walk is one command of the session, so no directory it reaches is
+ * deallocated before it ends, even if it is removed meanwhile.
+ *
+ * session: the session.
+ * top: the directory at the top of the subtree.
+ * mode: WALK_LIST or WALK_FIND.
+ * pattern: the pattern the names found have to match, for WALK_FIND.
+ */
+static int walk_tree(Fs_session *session, Directory *top, int mode,
+                     const char pattern[])
+{
+  struct walk *walk = malloc(sizeof(*walk));
+  Directory **stack = NULL, **grown, *curr, *sub, *entries, *own, *shared;
+  size_t depth = 0, stack_size = 0;
+  Walk_slot *slot;
+  unsigned long next;
+  int result = 1, i;
+#if defined(FS_SIM_THREADS)
+  pthread_t threads[WALK_MAX_THREADS];
+  int workers = 0;
+#endif
+
+  if (walk == NULL)
+    return 0;
+
+  walk->mode = mode;
+  walk->pattern = pattern;
+  walk->assigned = 0;
+  walk->claimed = 0;
+  walk->printed = 0;
+  walk->finished = 0;
+  for (i = 0; i < WALK_WINDOW; i++)
+  {
+    walk->slots[i].output = NULL;
+    walk->slots[i].size = 0;
+  }
+  INIT_MUTEX(&walk->lock);
+  INIT_COND(&walk->work);
+  INIT_COND(&walk->done);
+
+#if defined(FS_SIM_THREADS)
+  /* the calling thread is one of the threads doing the work */
+  while (workers < session->state->walk_threads - 1 &&
+         pthread_create(&threads[workers], NULL, walk_worker, walk) == 0)
+    workers++;
+#endif
+
+  curr = top;
+  while (curr != NULL || walk->printed < walk->assigned)
+  {
+    /* handing out directories while there is room in the window */
+    while (curr != NULL && walk->assigned - walk->printed < WALK_WINDOW)
+    {
+      /*
+       * The subdirectories are pushed last first, so they come out in order,
+       * those of the directory the entries are shared with merged in unless
+       * one of its own has the name, and gone into through views.
+       */
+      READ_LOCK(&curr->lock);
+      entries = entries_of(curr);
+      own = entries->sub_tail;
+      shared = entries->origin != NULL ? entries->origin->sub_tail : NULL;
+      while ((own != NULL || shared != NULL) && result)
+      {
+        if (shared != NULL && check_name(entries, shared->name, NULL, NULL))
+        {
+          shared = shared->prev;
+          continue;
+        }
+
+        if (own != NULL &&
+            (shared == NULL || strcmp(own->name, shared->name) > 0))
+        {
+          sub = own->parent == curr ? own : make_view(session, curr, own);
+          own = own->prev;
+        }
+        else
+        {
+          sub = make_view(session, curr, shared);
+          shared = shared->prev;
+        }
+
+        if (sub == NULL)
+          result = 0;
+        else if (depth == stack_size)
+        {
+          grown = realloc(stack, (stack_size * 2 + 64) * sizeof(*stack));
+          if (grown == NULL)
+            result = 0;
+          else
+          {
+            stack = grown;
+            stack_size = stack_size * 2 + 64;
+          }
+        }
+
+        if (result)
+          stack[depth++] = sub;
+      }
+      UNLOCK(&curr->lock);
+
+      slot = &walk->slots[walk->assigned % WALK_WINDOW];
+      slot->directory = curr;
+      slot->used = 0;
+      slot->start = 0;
+      slot->failed = 0;
+      slot->done = 0;
+
+      MUTEX_LOCK(&walk->lock);
+      walk->assigned++;
+      COND_SIGNAL(&walk->work);
+      MUTEX_UNLOCK(&walk->lock);
+
+      curr = result && depth > 0 ? stack[--depth] : NULL;
+    }
+
+    /* waiting for the oldest directory handed out, listing others meanwhile */
+    slot = &walk->slots[walk->printed % WALK_WINDOW];
+
+    MUTEX_LOCK(&walk->lock);
+    while (!slot->done)
+    {
+      if (walk->claimed < walk->assigned)
+      {
+        next = walk->claimed++;
+        MUTEX_UNLOCK(&walk->lock);
+        walk_directory(walk, &walk->slots[next % WALK_WINDOW]);
+        MUTEX_LOCK(&walk->lock);
+        walk->slots[next % WALK_WINDOW].done = 1;
+      }
+      else
+        COND_WAIT(&walk->done, &walk->lock);
+    }
+    MUTEX_UNLOCK(&walk->lock);
+
+    /* the listings of the directories are separated by blank lines */
+    if (mode == WALK_LIST && walk->printed > 0)
+      putchar('\n');
+    if (slot->used > slot->start)
+      fwrite(slot->output + slot->start, 1, slot->used - slot->start, stdout);
+    if (slot->failed)
+      result = 0;
+
+    walk->printed++;
+  }
+
+  MUTEX_LOCK(&walk->lock);
+  walk->finished = 1;
+  COND_BROADCAST(&walk->work);
+  MUTEX_UNLOCK(&walk->lock);
+
+#if defined(FS_SIM_THREADS)
+  for (i = 0; i < workers; i++)
+    pthread_join(threads[i], NULL);
+#endif
+
+  for (i = 0; i < WALK_WINDOW; i++)
+    free(walk->slots[i].output);
+  DESTROY_MUTEX(&walk->lock);
+  DESTROY_COND(&walk->work);
+  DESTROY_COND(&walk->done);
+  free(walk);
+  free(stack);
+
+  return result;
+}
+
+#if defined(FS_SIM_THREADS)
+/*
+ * walk_worker lists the directories handed out by walk_tree in turn, until
+ * the walk is finished.
+ *
+ * arg: the walk.
+ */
+static void *walk_worker(void *arg)
+{
+  struct walk *walk = arg;
+  unsigned long next;
+
+  MUTEX_LOCK(&walk->lock);
+  while (!walk->finished)
+  {
+    if (walk->claimed < walk->assigned)
+    {
+      next = walk->claimed++;
+      MUTEX_UNLOCK(&walk->lock);
+      walk_directory(walk, &walk->slots[next % WALK_WINDOW]);
+      MUTEX_LOCK(&walk->lock);
+      walk->slots[next % WALK_WINDOW].done = 1;
+      COND_SIGNAL(&walk->done);
+    }
+    else
+      COND_WAIT(&walk->work, &walk->lock);
+  }
+  MUTEX_UNLOCK(&walk->lock);
+
+  return NULL;
+}
+#endif
+
+/*
+ * walk_directory lists a directory handed out by walk_tree into its slot: its
+ * path and entries for WALK_LIST, and the paths of the entries whose names
+ * match the pattern for WALK_FIND.
+ *
+ * walk: the walk.
+ * slot: the slot of the directory.
+ */
+static void walk_directory(struct walk *walk, Walk_slot *slot)
+{
+  Directory *directory = slot->directory;
+  Fs_cursor cursor;
+  const char *name;
+  size_t length;
+  int is_dir, ok = 1;
+
+  /* the path of the directory goes first, and is copied for every match */
+  ok = walk_path(slot, directory);
+  if (walk->mode == WALK_LIST)
+    ok = ok && (slot->used > 0 || walk_append(slot, "/", 1)) &&
+         walk_append(slot, ":\n", 2);
+  else
+    slot->start = slot->used;
+
+  READ_LOCK(&directory->lock);
+  open_cursor(&cursor, directory);
+
+  while (ok && (name = ls_next(&cursor, &is_dir)) != NULL)
+  {
+    length = strlen(name);
+    if (walk->mode == WALK_LIST)
+      ok = walk_append(slot, name, length) &&
+           (!is_dir || walk_append(slot, "/", 1)) &&
+           walk_append(slot, "\n", 1);
+    else if (walk->mode == WALK_FIND && !fnmatch(walk->pattern, name, 0))
+      ok = walk_append(slot, NULL, slot->start) &&
+           walk_append(slot, "/", 1) && walk_append(slot, name, length) &&
+           (!is_dir || walk_append(slot, "/", 1)) &&
+           walk_append(slot, "\n", 1);
+  }
+
+  UNLOCK(&directory->lock);
+
+  slot->failed = !ok;
+}
+
+/*
+ * walk_path appends the full path of a directory to the output of a slot,
+ * which is empty for the root. It returns 0 if memory runs out and 1
+ * otherwise.
+ *
+ * slot: the slot.
+ * directory: the directory.
+ */
+static int walk_path(Walk_slot *slot, Directory *directory)
+{
+  Directory *curr;
+  size_t length = 0;
+  char *end;
+
+  for (curr = directory; curr->parent != NULL; curr = curr->parent)
+    length += strlen(curr->name) + 1;
+
+  if (slot->used + length > slot->size &&
+      !walk_reserve(slot, slot->used + length))
+    return 0;
+
+  /* Filling in the names from the end of the path back to its start */
+  slot->used += length;
+  end = slot->output + slot->used;
+  for (curr = directory; curr->parent != NULL; curr = curr->parent)
+  {
+    end -= strlen(curr->name);
+    memcpy(end, curr->name, strlen(curr->name));
+    *--end = '/';
+  }
+
+  return 1;
+}
+
+/*
+ * walk_append appends text to the output of a slot, growing it as needed. If
+ * text is NULL, the first length bytes of the output itself are appended. It
+ * returns 0 if memory runs out and 1 otherwise.
+ *
+ * slot: the slot.
+ * text: the text, or NULL.
+ * length: the length of the text.
+ */
+static int walk_append(Walk_slot *slot, const char text[], size_t length)
+{
+  if (slot->used + length > slot->size &&
+      !walk_reserve(slot, slot->used + length))
+    return 0;
+
+  if (length > 0)
+  {
+    memcpy(slot->output + slot->used, text != NULL ? text : slot->output,
+           length);
+    slot->used += length;
+  }
+
+  return 1;
+}
+
+/*
+ * walk_reserve makes the output buffer of a slot at least size bytes big,
+ * keeping its contents. It returns 0 if memory runs out and 1 otherwise.
+ *
+ * slot: the slot.
+ * size: the number of bytes needed.
+ */
+static int walk_reserve(Walk_slot *slot, size_t size)
+{
+  char *output;
+
+  if (size < slot->size * 2)
+    size = slot->size * 2;
+  if (size < WALK_OUTPUT_SIZE)
+    size = WALK_OUTPUT_SIZE;
+
+  output = realloc(slot->output, size);
+  if (output == NULL)
+    return 0;
+
+  slot->output = output;
+  slot->size = size;
+
+  return 1;
+}
+
+/*
+ * batch_command returns the command a word of a batch names, BATCH_MKFS to
+ * BATCH_STATS, or BATCH_UNKNOWN. The word is told apart by its length and
+ * then compared against the commands of that length only.
+ *
+ * word: the word, which is not terminated.
+ * length: the length of the word.
+ */
+static int batch_command(const char word[], size_t length)
+{
+  int command = BATCH_UNKNOWN;
+
+  switch (length)
+  {
+    case 2:
+      if (!memcmp(word, "cd", 2))
+        command = BATCH_CD;
+      else if (!memcmp(word, "ls", 2))
+        command = BATCH_LS;
+      else if (!memcmp(word, "rm", 2))
+        command = BATCH_RM;
+      break;
+    case 3:
+      if (!memcmp(word, "pwd", 3))
+        command = BATCH_PWD;
+      break;
+    case 4:
+      if (!memcmp(word, "mkfs", 4))
+        command = BATCH_MKFS;
+      else if (!memcmp(word, "rmfs", 4))
+        command = BATCH_RMFS;
+      break;
+    case 5:
+      if (!memcmp(word, "touch", 5))
+        command = BATCH_TOUCH;
+      else if (!memcmp(word, "mkdir", 5))
+        command = BATCH_MKDIR;
+      else if (!memcmp(word, "stats", 5))
+        command = BATCH_STATS;
+      break;
+  }
+
+  return command;
+}
+
+/*
+ * begin_command marks the start of a command of a session, which has to be
+ * followed by end_command once the command no longer looks at any directory.
+ * Nothing removed after the command began is deallocated before that. It
+ * returns 0 if the current directory of the session, or any directory above
+ * it, was removed, and 1 otherwise.
+ *
+ * session: the session.
+ */
+static int begin_command(Fs_session *session)
+{
+  struct fs_state *state = session->state;
+  Directory *curr;
+
+  STATS_START(session);
+
+#if defined(FS_SIM_THREADS)
+  /* a command running alone from the start waits for the others to end */
+  if (session->exclusive)
+    WRITE_LOCK(&state->clone_lock);
+  else
+    READ_LOCK(&state->clone_lock);
+#else
+  session->exclusive = 1;
+#endif
+
+  MUTEX_LOCK(&state->epoch_lock);
+
+  session->epoch = state->epoch;
+  state->active[session->epoch & 1]++;
+  session->generation = state->path_generation;
+
+  /* going up to the root is only needed if a directory was removed since */
+  if (session->stale_generation != session->generation)
+  {
+    curr = session->cwd;
+    while (curr != NULL && !curr->removed)
+      curr = curr->parent;
+
+    session->stale = curr != NULL;
+    session->stale_generation = session->generation;
+  }
+
+  MUTEX_UNLOCK(&state->epoch_lock);
+
+  return !session->stale;
+}
+
+/*
+ * begin_exclusive is begin_command for a command that runs alone from the
+ * start, as cp, mv, ln and set_quota do, so nothing changes between finding
+ * out whether the current directory was removed and using it.
+ *
+ * session: the session.
+ */
+static int begin_exclusive(Fs_session *session)
+{
+  session->exclusive = 1;
+
+  return begin_command(session);
+}
+
+/*
+ * end_command marks the end of a command of a session, gives back the views
+ * it made, and advances the epoch if no command that began before the
+ * current epoch is still running.
+ *
+ * session: the session.
+ */
+static void end_command(Fs_session *session)
+{
+  struct fs_state *state = session->state;
+  Directory *view;
+  int i;
+
+  while ((view = session->views) != NULL)
+  {
+    session->views = view->next;
+    DESTROY_LOCK(&view->lock);
+    pool_free(state, view, sizeof(*view));
+  }
+
+  MUTEX_LOCK(&state->epoch_lock);
+
+  state->active[session->epoch & 1]--;
+  session->pinned = session->cwd;
+
+  /*
+   * The commands that began in the epoch before the current one are counted
+   * with those that would begin in the next one, which none have yet.
+   */
+  for (i = 0; i < 2 && state->active[(state->epoch - 1) & 1] == 0; i++)
+    state->epoch++;
+
+  MUTEX_UNLOCK(&state->epoch_lock);
+
+  session->exclusive = 0;
+  UNLOCK(&state->clone_lock);
+}
+
+/*
+ * pinned_by_session returns 1 if some session is standing in a removed
+ * directory or in a directory under it, and 0 otherwise. It has to be called
+ * with the epoch mutex locked.
+ *
+ * state: the state of the filesystem.
+ * top: the removed directory.
+ */
+static int pinned_by_session(struct fs_state *state, const Directory *top)
+{
+  Fs_session *session;
+  const Directory *curr;
+
+  for (session = state->sessions; session != NULL; session = session->next)
+    for (curr = session->pinned; curr != NULL; curr = curr->parent)
+      if (curr == top)
+        return 1;
+
+  return 0;
+}
+
+/*
+ * first_entry returns the name of the first of the files from file up to
+ * file_end and the subdirectories from sub up to sub_end, in increasing order
+ * of names, or NULL if there are none.
+ *
+ * file: the first file.
+ * file_end: the file after the last one.
+ * sub: the first subdirectory.
+ * sub_end: the subdirectory after the last one.
+ * is_dir: set to 1 if it is a subdirectory and 0 if not.
+ */
+static const char *first_entry(const File *file, const File *file_end,
+                               const Directory *sub, const Directory *sub_end,
+                               int *is_dir)
+{
+  *is_dir = file == file_end ||
+            (sub != sub_end && strcmp(file->name, sub->name) > 0);
+
+  if (!*is_dir)
+    return file->name;
+
+  return sub != sub_end ? sub->name : NULL;
+}
+
+/*
+ * end_prefix ends each range of a cursor over the names matching a pattern
+ * whose next name does not start with the literal prefix of the pattern,
+ * since no name after it does either.
+ *
+ * cursor: the cursor.
+ */
+static void end_prefix(Fs_cursor *cursor)
+{
+  const char *pattern = cursor->pattern;
+  size_t length = cursor->prefix_length;
+
+  if (cursor->file != cursor->file_end &&
+      strncmp(cursor->file->name, pattern, length))
+    cursor->file = cursor->file_end;
+  if (cursor->sub != cursor->sub_end &&
+      strncmp(cursor->sub->name, pattern, length))
+    cursor->sub = cursor->sub_end;
+  if (cursor->shared_file != cursor->shared_file_end &&
+      strncmp(cursor->shared_file->name, pattern, length))
+    cursor->shared_file = cursor->shared_file_end;
+  if (cursor->shared_sub != cursor->shared_sub_end &&
+      strncmp(cursor->shared_sub->name, pattern, length))
+    cursor->shared_sub = cursor->shared_sub_end;
+}
+
+/*
+ * print_list is used to print files and directories in the format of increasing
+ * order, one name per line with a forward-slash after the names of
+ * directories.
+ *
+ * The lines are collected in a buffer, which is written out whenever it gets
+ * full, instead of being printed one at a time. When built with
+ * FS_SIM_COMPACT, a cursor over a whole directory is printed straight from
+ * the sorted blocks of its name index instead of merging the linkedlists.
+ *
+ * It returns 1 if it stopped at the limit with entries left, and 0 if it
+ * printed all of them.
+ *
+ * cursor: A cursor over the files and directories to print.
+ * limit: The largest number of entries to print.
+ * last: If not NULL, set to the name of the last entry printed.
+ */
+static int print_list(Fs_cursor *cursor, size_t limit, const char **last)
+{
+  char buffer[LS_BUFFER_SIZE];
+  size_t used = 0, length, printed = 0;
+  const char *name = NULL;
+  Fs_cursor rest;
+  int is_dir, left = 0;
+#if defined(FS_SIM_COMPACT)
+  Directory *entries = entries_of(cursor->directory);
+  struct name_index *index = entries->index;
+  const Index_entry *entry;
+  unsigned long block = 0, slot = 0;
+
+  /* entries merged with those shared with another directory are not in it */
+  if (cursor->file != entries->f_head || cursor->file_end != NULL ||
+      cursor->sub != entries->sub || cursor->sub_end != NULL ||
+      cursor->pattern != NULL || entries->origin != NULL)
+    index = NULL;
+#endif
+
+  for (; printed < limit; printed++)
+  {
+#if defined(FS_SIM_COMPACT)
+    if (index != NULL)
+    {
+      if (block < index->block_count && slot == index->blocks[block].count)
+      {
+        block++;
+        slot = 0;
+      }
+      if (block == index->block_count)
+        break;
+
+      entry = &index->blocks[block].entries[slot++];
+      is_dir = entry->is_dir;
+      if (entry->length < INDEX_INLINE)
+      {
+        name = entry->name;
+        length = entry->length;
+      }
+      else
+      {
+        name = index_entry_name(entry);
+        length = strlen(name);
+      }
+    }
+    else
+#endif
+    if ((name = ls_next(cursor, &is_dir)) != NULL)
+      length = strlen(name);
+    else
+      break;
+
+    if (used > 0 && used + length + 2 > sizeof(buffer))
+    {
+      fwrite(buffer, 1, used, stdout);
+      used = 0;
+    }
+
+    /* a name too long for the buffer is written out directly */
+    if (length + 2 > sizeof(buffer))
+      printf(is_dir ? "%s/\n" : "%s\n", name);
+    else
+    {
+      memcpy(buffer + used, name, length);
+      used += length;
+      if (is_dir)
+        buffer[used++] = '/';
+      buffer[used++] = '\n';
+    }
+
+    if (last != NULL)
+      *last = name;
+  }
+
+  if (used > 0)
+    fwrite(buffer, 1, used, stdout);
+
+  /* whether any entry is left is found out by reading on from a copy */
+  if (printed == limit)
+  {
+#if defined(FS_SIM_COMPACT)
+    if (index != NULL)
+      left = block < index->block_count &&
+             (slot < index->blocks[block].count ||
+              block + 1 < index->block_count);
+    else
+#endif
+    {
+      rest = *cursor;
+      left = ls_next(&rest, NULL) != NULL;
+    }
+  }
+
+  return left;
+}
+
+/*
+ * open_cursor sets up a cursor over all files and subdirectories of a
+ * directory.
+ *
+ * cursor: the cursor to set up.
+ * directory: the directory.
+ */
+static void open_cursor(Fs_cursor *cursor, Directory *directory)
+{
+  /* a directory sharing the entries of another lists those */
+  Directory *entries = entries_of(directory), *origin = entries->origin;
+
+  cursor->file = entries->f_head;
+  cursor->file_end = NULL;
+  cursor->sub = entries->sub;
+  cursor->sub_end = NULL;
+  cursor->directory = directory;
+  cursor->pattern = NULL;
+  cursor->shared_file = origin != NULL ? origin->f_head : NULL;
+  cursor->shared_file_end = NULL;
+  cursor->shared_sub = origin != NULL ? origin->sub : NULL;
+  cursor->shared_sub_end = NULL;
+}
+
+/*
+ * file_cursor sets up a cursor over a single file of a directory, which may
+ * be one the directory shares with another.
+ *
+ * cursor: the cursor to set up.
+ * directory: the directory.
+ * file: the file.
+ */
+static void file_cursor(Fs_cursor *cursor, Directory *directory, File *file)
+{
+  int own = file->parent == entries_of(directory);
+
+  cursor->file = own ? file : NULL;
+  cursor->file_end = own ? file->next : NULL;
+  cursor->sub = NULL;
+  cursor->sub_end = NULL;
+  cursor->directory = directory;
+  cursor->pattern = NULL;
+  cursor->shared_file = own ? NULL : file;
+  cursor->shared_file_end = own ? NULL : file->next;
+  cursor->shared_sub = NULL;
+  cursor->shared_sub_end = NULL;
+}
+
+/*
+ * glob_range sets up a cursor over the files and subdirectories of a
+ * directory matching a wildcard pattern. Every name matching it starts with
+ * its literal prefix, and since both linkedlists are in increasing order of
+ * names, those names are next to each other in each of them. The cursor
+ * starts at the first of them, in the lists of the directory and in those of
+ * the directory it shares entries with, as found by prefix_range. ls_next
+ * then skips the names in between not matching the pattern, and stops at the
+ * first name past them.
+ *
+ * cursor: the cursor to set up.
+ * directory: the directory.
+ * pattern: the pattern, which has to stay unchanged while the cursor is used.
+ */
+static void glob_range(Fs_cursor *cursor, Directory *directory,
+                       const char pattern[])
+{
+  Directory *entries = entries_of(directory);
+
+  cursor->directory = directory;
+  cursor->pattern = pattern;
+  cursor->prefix_length = (unsigned long) strcspn(pattern,
+                                                   GLOB_PREFIX_END);
+
+  prefix_range(entries, pattern, cursor->prefix_length, &cursor->file,
+               &cursor->sub);
+  cursor->file_end = NULL;
+  cursor->sub_end = NULL;
+
+  cursor->shared_file = NULL;
+  cursor->shared_file_end = NULL;
+  cursor->shared_sub = NULL;
+  cursor->shared_sub_end = NULL;
+  if (entries->origin != NULL)
+    prefix_range(entries->origin, pattern, cursor->prefix_length,
+                 &cursor->shared_file, &cursor->shared_sub);
+}
+
+/*
+ * prefix_range finds the first file and the first subdirectory of a directory
+ * whose names start with the literal prefix of a pattern, through the name
+ * index of the directory if it has one, or by scanning the lists otherwise.
+ * Where the names starting with it end is not looked for: the ranges go on to
+ * the end of the lists, and ls_next ends each one at the first name not
+ * starting with the prefix, so only the names listed are ever gone through.
+ *
+ * entries: the directory.
+ * pattern: the pattern.
+ * length: the length of its literal prefix.
+ * file: set to the first file found, or NULL.
+ * sub: set to the first subdirectory found, or NULL.
+ */
+static void prefix_range(Directory *entries, const char pattern[],
+                         size_t length, File **file, Directory **sub)
+{
+  File *curr_file;
+  Directory *curr;
+
+  if (entries->index != NULL)
+  {
+    *file = index_seek_prefix(entries->index, entries->f_head, pattern,
+                              length, 0);
+    *sub = index_seek_prefix(entries->index, entries->sub, pattern, length,
+                             1);
+    return;
+  }
+
+  for (curr_file = entries->f_head;
+       curr_file != NULL && strncmp(curr_file->name, pattern, length) < 0;
+       curr_file = curr_file->next)
+    ;
+  for (curr = entries->sub;
+       curr != NULL && strncmp(curr->name, pattern, length) < 0;
+       curr = curr->next)
+    ;
+
+  *file = curr_file != NULL && !strncmp(curr_file->name, pattern, length)
+          ? curr_file : NULL;
+  *sub = curr != NULL && !strncmp(curr->name, pattern, length) ? curr : NULL;
+}
+
+/*
+ * seek_cursor moves a cursor past the entries whose names are not greater
+ * than a name, in the lists of the directory and in those of the directory
+ * it shares entries with, as seek_range does.
+ *
+ * cursor: the cursor.
+ * after: the name.
+ */
+static void seek_cursor(Fs_cursor *cursor, const char after[])
+{
+  Directory *entries = entries_of(cursor->directory);
+
+  seek_range(entries, after, &cursor->file, cursor->file_end, &cursor->sub,
+             cursor->sub_end);
+  if (entries->origin != NULL)
+    seek_range(entries->origin, after, &cursor->shared_file,
+               cursor->shared_file_end, &cursor->shared_sub,
+               cursor->shared_sub_end);
+}
+
+/*
+ * seek_range moves the start of a range of the files and of a range of the
+ * subdirectories of a directory past the entries whose names are not greater
+ * than a name. The first file and the first sub directory with a greater
+ * name are found through the name index of the directory, if it has one, and
+ * the ranges are then kept within the part of the lists they covered.
+ *
+ * entries: the directory.
+ * after: the name.
+ * file: the start of the range of files.
+ * file_end: the end of the range of files.
+ * sub: the start of the range of subdirectories.
+ * sub_end: the end of the range of subdirectories.
+ */
+static void seek_range(Directory *entries, const char after[], File **file,
+                       File *file_end, Directory **sub, Directory *sub_end)
+{
+  File *next_file = NULL;
+  Directory *next = NULL;
+
+  /* a list ending at or before the name has nothing left to seek to */
+  if (entries->f_tail != NULL && strcmp(entries->f_tail->name, after) > 0)
+  {
+    if (entries->index != NULL)
+      next_file = index_seek(entries->index, entries->f_head, after, 0);
+    else
+      for (next_file = entries->f_head; strcmp(next_file->name, after) <= 0;
+           next_file = next_file->next)
+        ;
+  }
+
+  if (entries->sub_tail != NULL && strcmp(entries->sub_tail->name, after) > 0)
+  {
+    if (entries->index != NULL)
+      next = index_seek(entries->index, entries->sub, after, 1);
+    else
+      for (next = entries->sub; strcmp(next->name, after) <= 0;
+           next = next->next)
+        ;
+  }
+
+  /* nothing before the start of the range is reached, nor past its end */
+  if (*file != file_end &&
+      (next_file == NULL || strcmp(next_file->name, (*file)->name) > 0))
+  {
+    if (next_file == NULL || (file_end != NULL &&
+                              strcmp(next_file->name, file_end->name) >= 0))
+      *file = file_end;
+    else
+      *file = next_file;
+  }
+
+  if (*sub != sub_end &&
+      (next == NULL || strcmp(next->name, (*sub)->name) > 0))
+  {
+    if (next == NULL || (sub_end != NULL &&
+                         strcmp(next->name, sub_end->name) >= 0))
+      *sub = sub_end;
+    else
+      *sub = next;
+  }
+}
+
+/*
+ * check_name is used to check whether if the current directory already
+ * contained a same-name file or directory as the paramter arg. For touch and
+ * mkdir commands, new file or directory is only created when none of the files
+ * and sub directory in the current directory have the same name as the new one.
+ * Also, cd, ls and rm commands relies on check_name to find the target
+ * directory or file to navigate to, print out or remove.
+ * 
+ * The function returns 1 if the file/directory name (arg) is found in the
+ * current directory and 0 if not found. The name is looked up in the name
+ * table first: a name not in it is in no directory, and one in it is compared
+ * with the names of the entries by pointer. It is then looked up in the name
+ * index of the directory if it has one, otherwise both linkedlists are
+ * scanned.
+ *
+ * fs: a directory pointer points to the current directory which would be
+ *     checked for names.
+ * arg: the target name.
+ * file: if not NULL, set to the file named arg, or NULL if there is none.
+ * directory: if not NULL, set to the sub directory named arg, or NULL if there
+ *            is none.
+ */
+static int check_name(Fs_sim fs, const char arg[], File **file,
+                      Directory **directory)
+{
+  File *curr_file = NULL;
+  Directory *curr_directory = NULL;
+  unsigned long nodes = 0, compares = 0, hash;
+  const char *name = fs->count > 0 ? name_find(fs->state, arg, &hash) : NULL;
+
+  /*
+   * Once the name table is unlocked, the copy of arg found in it may be given
+   * back to the pool by a command in another directory, so it is only
+   * compared by pointer, which the entries of fs, locked by the caller, keep
+   * valid.
+   */
+  if (name != NULL && fs->index != NULL)
+  {
+    Index_entry *entry = index_find(fs->index, arg, name, hash);
+
+    if (entry != NULL && entry->is_dir)
+      curr_directory = entry->node;
+    else if (entry != NULL)
+      curr_file = entry->node;
+  }
+  else if (name != NULL)
+  {
+    /* Searching for arg in the linkedlist of files */
+    curr_file = fs->f_head;
+    while (curr_file != NULL && (compares++, curr_file->name != name))
+    {
+      curr_file = curr_file->next;
+      nodes++;
+    }
+
+    /* Searching for arg in the linkedlist of subdirectories */
+    if (curr_file == NULL)
+    {
+      curr_directory = fs->sub;
+      while (curr_directory != NULL &&
+             (compares++, curr_directory->name != name))
+      {
+        curr_directory = curr_directory->next;
+        nodes++;
+      }
+    }
+  }
+
+  STATS_LOOKUP(fs->state, nodes, compares);
+
+  if (file != NULL)
+    *file = curr_file;
+  if (directory != NULL)
+    *directory = curr_directory;
+
+  return curr_file != NULL || curr_directory != NULL;
+}
+
+/*
+ * find_entry is check_name for a directory that may share the entries of
+ * another. The entries of its own are checked first, since they stand in for
+ * those of the other one with the same names, and a file without an inode
+ * among them hides the name. It returns 1 if the name is found and 0 if not.
+ *
+ * directory: the directory, which must be locked.
+ * arg: the target name.
+ * file: if not NULL, set to the file named arg, or NULL if there is none.
+ * sub: if not NULL, set to the sub directory named arg, or NULL if there is
+ *      none.
+ */
+static int find_entry(Directory *directory, const char arg[], File **file,
+                      Directory **sub)
+{
+  File *found = NULL;
+  Directory *found_sub = NULL;
+
+  while (!check_name(directory, arg, &found, &found_sub) &&
+         directory->origin != NULL)
+    directory = directory->origin;
+
+  if (found != NULL && found->inode == NULL && directory->origin != NULL)
+    found = NULL;
+
+  if (file != NULL)
+    *file = found;
+  if (sub != NULL)
+    *sub = found_sub;
+
+  return found != NULL || found_sub != NULL;
+}
+
+/*
+ * link_file inserts a new file into the linkedlist of files of a directory in
+ * increasing order of names, and adds it to the name index. A name greater
+ * than the last one is appended directly, otherwise the insertion point is
+ * found by index_seek if the directory has a name index, which only walks
+ * the list from the nearest sample in the hashed build, and by walking the
+ * whole list if not.
+ *
+ * fs: the directory the file is saved in.
+ * new_file: the file to insert, whose name must not exist in fs yet.
+ */
+static void link_file(Fs_sim fs, File *new_file)
+{
+  File *curr = NULL, *prev = fs->f_tail;
+  unsigned long nodes = 0, compares = prev != NULL;
+
+  if (prev != NULL && strcmp(new_file->name, prev->name) < 0)
+  {
+    if (fs->index != NULL)
+      curr = index_seek(fs->index, fs->f_head, new_file->name, 0);
+    else
+    {
+      prev = NULL;
+      curr = fs->f_head;
+
+      while (curr != NULL &&
+             (compares++, strcmp(new_file->name, curr->name) > 0))
+      {
+        prev = curr;
+        curr = curr->next;
+        nodes++;
+      }
+    }
+  }
+
+  STATS_INSERT(fs->state, nodes, compares);
+
+  splice_file(fs, new_file, curr);
+}
+
+/*
+ * splice_file inserts a new file into the linkedlist of files of a directory
+ * right before another file, or at the end, saves the directory as the one
+ * it is in, and adds it to the name index. The file can be found by its
+ * inode number from then on. The caller must have found where the name goes
+ * in increasing order.
+ *
+ * fs: the directory the file is saved in.
+ * new_file: the file to insert, whose name must not exist in fs yet.
+ * curr: the file that comes right after it, or NULL if it comes last.
+ */
+static void splice_file(Fs_sim fs, File *new_file, File *curr)
+{
+  File *prev = curr != NULL ? curr->prev : fs->f_tail;
+
+  /* a file hiding a shared name has no inode to be found by */
+  MUTEX_LOCK(&fs->state->handle_lock);
+  new_file->parent = fs;
+  if (new_file->inode != NULL)
+    fs->state->handles[new_file->inode->id].inode = new_file->inode;
+  MUTEX_UNLOCK(&fs->state->handle_lock);
+
+  new_file->prev = prev;
+  new_file->next = curr;
+
+  /* handling empty linkedlist conditon */
+  if (prev == NULL)
+    fs->f_head = new_file;
+  else
+    prev->next = new_file;
+
+  if (curr == NULL)
+    fs->f_tail = new_file;
+  else
+    curr->prev = new_file;
+
+  fs->count++;
+  if (fs->index != NULL)
+  {
+    if (!index_add(fs->index, new_file, 0, new_file->name))
+    {
+      /* an incomplete index is useless, so fall back to scanning the lists */
+      index_destroy(fs->index);
+      fs->index = NULL;
+    }
+  }
+  else if (fs->count >= INDEX_THRESHOLD)
+    index_build(fs);
+}
+
+/*
+ * unlink_file removes a file from the linkedlist of files of a directory and
+ * from its name index, without deallocating it.
+ *
+ * fs: the directory the file is saved in.
+ * file: the file to remove.
+ */
+static void unlink_file(Fs_sim fs, File *file)
+{
+  if (file->prev != NULL)
+    file->prev->next = file->next;
+  else
+    /* handling the case if the file is the first one in the linkedlist */
+    fs->f_head = file->next;
+
+  if (file->next != NULL)
+    file->next->prev = file->prev;
+  else
+    fs->f_tail = file->prev;
+
+  /* the name index still sees which file came after it */
+  fs->count--;
+  if (fs->index != NULL)
+    index_remove(fs->index, file, file->name);
+
+  file->next = NULL;
+  file->prev = NULL;
+}
+
+/*
+ * link_directory inserts a new sub directory into the linkedlist of sub
+ * directories of a directory in increasing order of names, saves the directory
+ * as its parent, and adds it to the name index. The insertion point is found
+ * the way link_file finds it.
+ *
+ * fs: the parent directory.
+ * new_directory: the sub directory to insert, whose name must not exist in fs
+ *                yet.
+ */
+static void link_directory(Fs_sim fs, Directory *new_directory)
+{
+  Directory *curr = NULL, *prev = fs->sub_tail;
+  unsigned long nodes = 0, compares = prev != NULL;
+
+  if (prev != NULL && strcmp(new_directory->name, prev->name) < 0)
+  {
+    if (fs->index != NULL)
+      curr = index_seek(fs->index, fs->sub, new_directory->name, 1);
+    else
+    {
+      prev = NULL;
+      curr = fs->sub;
+
+      while (curr != NULL &&
+             (compares++, strcmp(new_directory->name, curr->name) > 0))
+      {
+        prev = curr;
+        curr = curr->next;
+        nodes++;
+      }
+    }
+  }
+
+  STATS_INSERT(fs->state, nodes, compares);
+
+  splice_directory(fs, new_directory, curr);
+}
+
+/*
+ * splice_directory inserts a new sub directory into the linkedlist of sub
+ * directories of a directory right before another one, or at the end, saves
+ * the directory as its parent, and adds it to the name index. The sub
+ * directory can be found by its inode number from then on. The caller must
+ * have found where the name goes in increasing order.
+ *
+ * fs: the parent directory.
+ * new_directory: the sub directory to insert, whose name must not exist in fs
+ *                yet.
+ * curr: the sub directory that comes right after it, or NULL if it comes last.
+ */
+static void splice_directory(Fs_sim fs, Directory *new_directory,
+                             Directory *curr)
+{
+  Directory *prev = curr != NULL ? curr->prev : fs->sub_tail;
+
+  MUTEX_LOCK(&fs->state->handle_lock);
+  new_directory->parent = fs;
+  fs->state->handles[new_directory->id].directory = new_directory;
+  MUTEX_UNLOCK(&fs->state->handle_lock);
+
+  new_directory->prev = prev;
+  new_directory->next = curr;
+
+  if (prev == NULL)
+    fs->sub = new_directory;
+  else
+    prev->next = new_directory;
+
+  if (curr == NULL)
+    fs->sub_tail = new_directory;
+  else
+    curr->prev = new_directory;
+
+  fs->count++;
+  if (fs->index != NULL)
+  {
+    if (!index_add(fs->index, new_directory, 1, new_directory->name))
+    {
+      index_destroy(fs->index);
+      fs->index = NULL;
+    }
+  }
+  else if (fs->count >= INDEX_THRESHOLD)
+    index_build(fs);
+}
+
+/*
+ * unlink_directory removes a sub directory from the linkedlist of sub
+ * directories of its parent and from the name index of the parent, and cuts
+ * its connections with any other directory in the same level. Its parent
+ * pointer is kept, so sessions standing in it can still go through the
+ * directories above it to find out that it was removed.
+ *
+ * fs: the parent directory.
+ * directory: the sub directory to remove.
+ */
+static void unlink_directory(Fs_sim fs, Directory *directory)
+{
+  if (directory->prev != NULL)
+    directory->prev->next = directory->next;
+  else
+    /* the case when it is the first subdirectory in the list */
+    fs->sub = directory->next;
+
+  if (directory->next != NULL)
+    directory->next->prev = directory->prev;
+  else
+    fs->sub_tail = directory->prev;
+
+  fs->count--;
+  if (fs->index != NULL)
+    index_remove(fs->index, directory, directory->name);
+
+  directory->next = NULL;
+  directory->prev = NULL;
+}
+
+/*
+ * alloc_file allocates a new file from the pool of a filesystem, with its
+ * name interned in the name table. It is either a new, empty file with an
+ * inode number of its own, or a new name of an existing file, sharing its
+ * inode. It returns NULL if memory runs out.
+ *
+ * state: the state of the filesystem.
+ * name: the name of the file.
+ * inode: the inode of the file the name is given to, or NULL for a new file.
+ */
+static File *alloc_file(struct fs_state *state, const char name[],
+                        Inode *inode)
+{
+  File *new_file = pool_alloc(state, sizeof(*new_file));
+
+  if (new_file == NULL)
+    return NULL;
+
+  new_file->name = name_intern(state, name);
+  if (new_file->name != NULL && inode == NULL)
+  {
+    inode = pool_alloc(state, sizeof(*inode));
+    if (inode != NULL)
+    {
+      inode->id = handle_reserve(state);
+      inode->links = 0;
+      inode->data = NULL;
+      inode->file = NULL;
+      if (inode->id == 0)
+      {
+        pool_free(state, inode, sizeof(*inode));
+        inode = NULL;
+      }
+    }
+  }
+
+  if (new_file->name == NULL || inode == NULL)
+  {
+    if (new_file->name != NULL)
+      name_release(state, new_file->name);
+    pool_free(state, new_file, sizeof(*new_file));
+    return NULL;
+  }
+
+  /* the new name goes first among the names of the file */
+  MUTEX_LOCK(&state->handle_lock);
+  new_file->inode = inode;
+  new_file->parent = NULL;
+  new_file->link = inode->file;
+  inode->file = new_file;
+  if (++inode->links == 2)
+    state->linked++;
+  MUTEX_UNLOCK(&state->handle_lock);
+
+  return new_file;
+}
+
+/*
+ * alloc_directory allocates a new, empty directory from the pool of a
+ * filesystem, with its name interned in the name table and an inode number
+ * of its own. It returns NULL if memory runs out.
+ *
+ * state: the state of the filesystem.
+ * name: the name of the directory.
+ */
+static Directory *alloc_directory(struct fs_state *state, const char name[])
+{
+  Directory *new_directory = pool_alloc(state, sizeof(*new_directory));
+
+  if (new_directory != NULL)
+  {
+    new_directory->name = name_intern(state, name);
+    new_directory->id = new_directory->name != NULL ? handle_reserve(state)
+                                                    : 0;
+    if (new_directory->id == 0)
+    {
+      if (new_directory->name != NULL)
+        name_release(state, new_directory->name);
+      pool_free(state, new_directory, sizeof(*new_directory));
+      return NULL;
+    }
+    new_directory->sub = NULL;
+    new_directory->f_head = NULL;
+    new_directory->sub_tail = NULL;
+    new_directory->f_tail = NULL;
+    new_directory->count = 0;
+    new_directory->index = NULL;
+    new_directory->state = state;
+    new_directory->removed = 0;
+    new_directory->held = 0;
+    new_directory->origin = NULL;
+    new_directory->clones = NULL;
+    new_directory->next_clone = NULL;
+    new_directory->prev_clone = NULL;
+    new_directory->usage.files = 0;
+    new_directory->usage.directories = 0;
+    new_directory->usage.name_bytes = 0;
+    new_directory->quota = new_directory->usage;
+    INIT_LOCK(&new_directory->lock);
+  }
+
+  return new_directory;
+}
+
+/*
+ * usage_entry fills in the change to the usage of a directory that one file
+ * or sub directory with a given name makes, and returns it.
+ *
+ * change: where the change is saved.
+ * name: the name of the file or sub directory.
+ * is_dir: 1 for a sub directory and 0 for a file.
+ */
+static Fs_usage *usage_entry(Fs_usage *change, const char name[], int is_dir)
+{
+  change->files = !is_dir;
+  change->directories = is_dir != 0;
+  change->name_bytes = strlen(name);
+
+  return change;
+}
+
+/*
+ * usage_charge adds a change to the usage of a directory and of every
+ * directory above it, before what makes it is allocated. It returns 1, or 0
+ * without changing anything if that would take any of them past its quota.
+ *
+ * directory: the directory.
+ * change: the change.
+ */
+static int usage_charge(Directory *directory, const Fs_usage *change)
+{
+  int result;
+
+  MUTEX_LOCK(&directory->state->epoch_lock);
+  result = usage_fits(directory, change);
+  if (result)
+    usage_add(directory, change, 0);
+  MUTEX_UNLOCK(&directory->state->epoch_lock);
+
+  return result;
+}
+
+/*
+ * usage_release takes a change back from the usage of a directory and of
+ * every directory above it, once what made it was removed, or could not be
+ * allocated after all.
+ *
+ * directory: the directory.
+ * change: the change.
+ */
+static void usage_release(Directory *directory, const Fs_usage *change)
+{
+  MUTEX_LOCK(&directory->state->epoch_lock);
+  usage_add(directory, change, 1);
+  MUTEX_UNLOCK(&directory->state->epoch_lock);
+}
+
+/*
+ * usage_move moves what mv moves from the usage of one directory, and those
+ * above it, to that of another, taking it away first so the directories both
+ * are under do not count it twice. It returns 1, or 0 without changing
+ * anything if that would take any directory past its quota.
+ *
+ * from: the directory it is moved from.
+ * removed: the change it makes there.
+ * to: the directory it is moved to.
+ * added: the change it makes there, under its new name.
+ */
+static int usage_move(Directory *from, const Fs_usage *removed, Directory *to,
+                      const Fs_usage *added)
+{
+  int result;
+
+  MUTEX_LOCK(&from->state->epoch_lock);
+  usage_add(from, removed, 1);
+  result = usage_fits(to, added);
+  if (result)
+    usage_add(to, added, 0);
+  else
+    usage_add(from, removed, 0);
+  MUTEX_UNLOCK(&from->state->epoch_lock);
+
+  return result;
+}
+
+/*
+ * usage_fits returns 1 if a change can be added to the usage of a directory
+ * and of every directory above it without taking any of them past its quota,
+ * and 0 otherwise. Like usage_add, it has to be called with the epoch mutex
+ * locked, and stops at a removed directory, since what is under it is no
+ * longer counted above it.
+ *
+ * directory: the directory.
+ * change: the change.
+ */
+static int usage_fits(const Directory *directory, const Fs_usage *change)
+{
+  const Directory *curr;
+
+  for (curr = directory; curr != NULL && !curr->removed; curr = curr->parent)
+    if (usage_over(curr->usage.files, change->files, curr->quota.files) ||
+        usage_over(curr->usage.directories, change->directories,
+                   curr->quota.directories) ||
+        usage_over(curr->usage.name_bytes, change->name_bytes,
+                   curr->quota.name_bytes))
+      return 0;
+
+  return 1;
+}
+
+/*
+ * usage_over returns 1 if adding to a count takes it past its limit, and 0
+ * otherwise. Nothing added never does, so a subtree left holding more than
+ * its quota can still get what it is not over the quota on.
+ *
+ * used: the count.
+ * added: what is added to it.
+ * limit: the limit, or 0 for none.
+ */
+static int usage_over(unsigned long used, unsigned long added,
+                      unsigned long limit)
+{
+  return limit != 0 && added > 0 && (used >= limit || added > limit - used);
+}
+
+/*
+ * usage_add adds a change to the usage of a directory and of every directory
+ * above it, or subtracts it, up to the first one removed. It has to be called
+ * with the epoch mutex locked.
+ *
+ * directory: the directory.
+ * change: the change.
+ * subtract: 1 to subtract the change and 0 to add it.
+ */
+static void usage_add(Directory *directory, const Fs_usage *change,
+                      int subtract)
+{
+  Directory *curr;
+
+  for (curr = directory; curr != NULL && !curr->removed; curr = curr->parent)
+    if (subtract)
+    {
+      curr->usage.files -= change->files;
+      curr->usage.directories -= change->directories;
+      curr->usage.name_bytes -= change->name_bytes;
+    }
+    else
+    {
+      curr->usage.files += change->files;
+      curr->usage.directories += change->directories;
+      curr->usage.name_bytes += change->name_bytes;
+    }
+}
+
+/*
+ * share_entries makes a new, empty directory share the files and sub
+ * directories of another one instead of having copies of its own. If the
+ * other one shares the entries of a third, the new one shares them with that
+ * one directly, so the directories shared with never share any themselves,
+ * and gets copies of the entries the other one has standing in for some of
+ * them: a new file sharing the chunks of each file or hiding the same name,
+ * and a new sub directory for each sub directory, which is made to share its
+ * entries in the same way. It returns 0 if memory ran out, in which case the
+ * new directory is left empty and sharing nothing, and 1 otherwise.
+ *
+ * Like all the functions changing what directories share, it has to be called
+ * by the only command running (see exclusive_command), and takes no directory
+ * locks.
+ *
+ * directory: the new directory.
+ * origin: the directory whose entries it shares.
+ */
+static int share_entries(Directory *directory, Directory *origin)
+{
+  struct fs_state *state = directory->state;
+  Directory *to = directory, *from = origin, *shared, *sub, *new_directory;
+  File *file, *new_file;
+  int ok = 1;
+
+  /* the new sub directories line up with those they are copies of */
+  while (to != NULL && ok)
+  {
+    shared = from->origin != NULL ? from->origin : from;
+    to->origin = shared;
+    to->prev_clone = NULL;
+    to->next_clone = shared->clones;
+    if (shared->clones != NULL)
+      shared->clones->prev_clone = to;
+    shared->clones = to;
+    state->shared++;
+
+    for (file = from != shared ? from->f_head : NULL; file != NULL && ok;
+         file = file->next)
+    {
+      new_file = alloc_file(state, file->name, NULL);
+      ok = new_file != NULL;
+      if (ok && file->inode == NULL)
+        inode_release(state, new_file);
+      else if (ok && !data_share(state, new_file->inode, file->inode))
+      {
+        free_file(state, new_file);
+        ok = 0;
+      }
+      if (ok)
+        splice_file(to, new_file, NULL);
+    }
+
+    for (sub = from != shared ? from->sub : NULL; sub != NULL && ok;
+         sub = sub->next)
+    {
+      new_directory = alloc_directory(state, sub->name);
+      ok = new_directory != NULL;
+      if (ok)
+      {
+        new_directory->usage = sub->usage;
+        splice_directory(to, new_directory, NULL);
+      }
+    }
+
+    /* going on in preorder through the new sub directories */
+    if (to->sub != NULL)
+    {
+      to = to->sub;
+      from = from->sub;
+    }
+    else
+    {
+      while (to != directory && to->next == NULL)
+      {
+        to = to->parent;
+        from = from->parent;
+      }
+      to = to != directory ? to->next : NULL;
+      from = from->next;
+    }
+  }
+
+  if (!ok)
+    discard_entries(directory);
+
+  return ok;
+}
+
+/*
+ * discard_entries gives back everything under a directory that is not in the
+ * filesystem yet, and makes it and every directory under it stop sharing
+ * entries, after memory ran out while it was being set up.
+ *
+ * top: the directory.
+ */
+static void discard_entries(Directory *top)
+{
+  struct fs_state *state = top->state;
+  Directory *curr = top, *parent;
+  File *file;
+
+  /* each directory is given back once everything under it is */
+  while (curr != NULL)
+  {
+    if (curr->sub != NULL)
+    {
+      curr = curr->sub;
+      continue;
+    }
+
+    while ((file = curr->f_head) != NULL)
+    {
+      unlink_file(curr, file);
+      free_file(state, file);
+    }
+    if (curr->origin != NULL)
+      stop_sharing(curr);
+
+    parent = curr != top ? curr->parent : NULL;
+    if (parent != NULL)
+    {
+      unlink_directory(parent, curr);
+      free_directory(state, curr);
+    }
+    curr = parent;
+  }
+}
+
+/*
+ * stop_sharing makes a directory stop sharing the entries of its origin,
+ * leaving it with those of its own.
+ *
+ * directory: the directory.
+ */
+static void stop_sharing(Directory *directory)
+{
+  if (directory->prev_clone != NULL)
+    directory->prev_clone->next_clone = directory->next_clone;
+  else
+    directory->origin->clones = directory->next_clone;
+
+  if (directory->next_clone != NULL)
+    directory->next_clone->prev_clone = directory->prev_clone;
+
+  directory->origin = NULL;
+  directory->next_clone = NULL;
+  directory->prev_clone = NULL;
+
+  directory->state->shared--;
+}
+
+/*
+ * entries_of returns the directory whose linkedlists hold the entries of a
+ * directory: the directory itself, unless it shares the entries of another
+ * without any of its own standing in for them, in which case it is the one
+ * it shares them with, found the same way. A directory returned that shares
+ * the entries of another has entries standing in for some of them.
+ *
+ * directory: the directory.
+ */
+static Directory *entries_of(Directory *directory)
+{
+  while (directory->origin != NULL && directory->count == 0)
+    directory = directory->origin;
+
+  return directory;
+}
+
+/*
+ * entry_count returns the number of files and sub directories a directory
+ * lists, counting those it shares with another directory and not those its
+ * files without an inode hide.
+ *
+ * directory: the directory.
+ */
+static unsigned long entry_count(Directory *directory)
+{
+  Directory *entries = entries_of(directory), *origin = entries->origin, *sub;
+  unsigned long count = entries->count;
+  File *file;
+
+  if (origin != NULL)
+  {
+    /* each entry of its own stands in for one with the same name, if any */
+    count = origin->count;
+    for (file = entries->f_head; file != NULL; file = file->next)
+      if (!check_name(origin, file->name, NULL, NULL))
+        count += file->inode != NULL;
+      else if (file->inode == NULL)
+        count--;
+
+    for (sub = entries->sub; sub != NULL; sub = sub->next)
+      if (!check_name(origin, sub->name, NULL, NULL))
+        count++;
+  }
+
+  return count;
+}
+
+/*
+ * copy_origin gives a directory sharing the entries of another one copies of
+ * its own: a new file sharing the chunks of each file, and a new sub
+ * directory sharing the entries of each sub directory, so only one level is
+ * copied at a time. The entries it already has stand in for those with the
+ * same names, and the files without an inode hiding names are given back. It
+ * returns 1 if the directory has entries of its own, and 0 if memory ran
+ * out, in which case it goes on sharing them.
+ *
+ * directory: the directory.
+ */
+static int copy_origin(Directory *directory)
+{
+  struct fs_state *state = directory->state;
+  Directory *origin = directory->origin, *curr, *new_directory;
+  Directory *new_subs = NULL, *own;
+  File *curr_file, *new_file, *new_files = NULL, *own_file;
+
+  if (origin == NULL)
+    return 1;
+
+  /*
+   * The copies are made before any is linked in, last first so they come out
+   * in order, and running out of memory part way takes them back.
+   */
+  for (curr_file = origin->f_tail; curr_file != NULL;
+       curr_file = curr_file->prev)
+  {
+    if (directory->count > 0 &&
+        check_name(directory, curr_file->name, NULL, NULL))
+      continue;
+
+    new_file = alloc_file(state, curr_file->name, NULL);
+    if (new_file == NULL)
+      break;
+    if (!data_share(state, new_file->inode, curr_file->inode))
+    {
+      free_file(state, new_file);
+      break;
+    }
+    new_file->next = new_files;
+    new_files = new_file;
+  }
+
+  for (curr = origin->sub_tail; curr != NULL && curr_file == NULL;
+       curr = curr->prev)
+  {
+    if (directory->count > 0 && check_name(directory, curr->name, NULL, NULL))
+      continue;
+
+    new_directory = alloc_directory(state, curr->name);
+    if (new_directory == NULL)
+      break;
+    new_directory->usage = curr->usage;
+    if (!share_entries(new_directory, curr))
+    {
+      free_directory(state, new_directory);
+      break;
+    }
+    new_directory->next = new_subs;
+    new_subs = new_directory;
+  }
+
+  if (curr_file != NULL || curr != NULL)
+  {
+    while ((new_file = new_files) != NULL)
+    {
+      new_files = new_file->next;
+      free_file(state, new_file);
+    }
+    while ((new_directory = new_subs) != NULL)
+    {
+      new_subs = new_directory->next;
+      discard_entries(new_directory);
+      free_directory(state, new_directory);
+    }
+
+    printf("fail to copy the shared directory!\n");
+    return 0;
+  }
+
+  /* each copy goes right before the first entry of its own after it */
+  for (own_file = directory->f_head; (new_file = new_files) != NULL;)
+  {
+    new_files = new_file->next;
+    while (own_file != NULL && strcmp(own_file->name, new_file->name) < 0)
+      own_file = own_file->next;
+    splice_file(directory, new_file, own_file);
+  }
+
+  for (own = directory->sub; (new_directory = new_subs) != NULL;)
+  {
+    new_subs = new_directory->next;
+    while (own != NULL && strcmp(own->name, new_directory->name) < 0)
+      own = own->next;
+    splice_directory(directory, new_directory, own);
+  }
+
+  for (curr_file = directory->f_head; curr_file != NULL; curr_file = new_file)
+  {
+    new_file = curr_file->next;
+    if (curr_file->inode == NULL)
+    {
+      unlink_file(directory, curr_file);
+      free_file(state, curr_file);
+    }
+  }
+
+  stop_sharing(directory);
+
+  return 1;
+}
+
+/*
+ * prepare_change is called before an entry of a directory is changed, added
+ * or removed. The directory gets entries of its own if it shares another's.
+ * Any directory sharing the entries of it gets an entry of its own standing
+ * in for the one about to change, as stand_in makes it, and any directory
+ * sharing the entries of a directory above it one for the sub directory the
+ * change is under. The directories above are dealt with from the top down,
+ * as the sub directory standing in for another shares its entries, and so
+ * gets an entry of its own from the one below in turn. It returns 0 if
+ * memory ran out, and 1 otherwise.
+ *
+ * directory: the directory.
+ * name: the name of the entry, or a pattern, which every entry matching it
+ *       is dealt with for along with the entry named by it.
+ */
+static int prepare_change(Directory *directory, const char name[])
+{
+  Directory *curr, *below, *clone, *top = NULL;
+  unsigned long level, top_level = 0, i;
+  Fs_cursor cursor;
+  const char *match;
+  int named;
+
+  if (!copy_origin(directory))
+    return 0;
+
+  for (curr = directory, level = 0; curr != NULL; curr = curr->parent, level++)
+    if (curr->clones != NULL)
+    {
+      top = curr;
+      top_level = level;
+    }
+
+  /* the names of no entry stand in for nothing */
+  named = strcmp(name, "") && strcmp(name, ".") && strcmp(name, "..") &&
+          strcmp(name, "/");
+
+  for (level = top_level + 1; top != NULL && level-- > 0;)
+  {
+    below = NULL;
+    for (curr = directory, i = 0; i < level; i++)
+    {
+      below = curr;
+      curr = curr->parent;
+    }
+
+    if (below == NULL && !named)
+      continue;
+
+    for (clone = curr->clones; clone != NULL; clone = clone->next_clone)
+    {
+      if (!stand_in(clone, below != NULL ? below->name : name))
+        return 0;
+
+      if (below != NULL || strpbrk(name, GLOB_CHARACTERS) == NULL)
+        continue;
+
+      glob_range(&cursor, directory, name);
+      while ((match = ls_next(&cursor, NULL)) != NULL)
+        if (!stand_in(clone, match))
+          return 0;
+    }
+  }
+
+  return 1;
+}
+
+/*
+ * stand_in gives a directory sharing the entries of another an entry of its
+ * own standing in for the one of the other with a name, unless it has one: a
+ * new file sharing the chunks of the file, a new sub directory sharing the
+ * entries of the sub directory, or, if the other one has no entry with the
+ * name, a new file without an inode hiding whatever is given that name
+ * there. The entries it shares look the same as before. It returns 0 if
+ * memory ran out, and 1 otherwise.
+ *
+ * clone: the directory.
+ * name: the name.
+ */
+static int stand_in(Directory *clone, const char name[])
+{
+  struct fs_state *state = clone->state;
+  Directory *sub = NULL, *new_directory;
+  File *file = NULL, *new_file;
+
+  if (check_name(clone, name, NULL, NULL))
+    return 1;
+
+  check_name(clone->origin, name, &file, &sub);
+
+  if (sub != NULL)
+  {
+    new_directory = alloc_directory(state, name);
+    if (new_directory == NULL)
+      return 0;
+    if (!share_entries(new_directory, sub))
+    {
+      free_directory(state, new_directory);
+      return 0;
+    }
+    new_directory->usage = sub->usage;
+    link_directory(clone, new_directory);
+  }
+  else
+  {
+    new_file = alloc_file(state, name, NULL);
+    if (new_file == NULL)
+      return 0;
+    if (file == NULL)
+      inode_release(state, new_file);
+    else if (!data_share(state, new_file->inode, file->inode))
+    {
+      free_file(state, new_file);
+      return 0;
+    }
+    link_file(clone, new_file);
+  }
+
+  return 1;
+}
+
+/*
+ * release_subtree is called before a directory is removed, once
+ * prepare_change was called for its parent. Any directory elsewhere that
+ * shares the entries of a directory under it, or itself, gets copies of its
+ * own, all the way down, since what it shares is about to go. Only then does
+ * every directory there stop sharing, as the copies may be made from the
+ * entries they share. It returns 0 if memory ran out, and 1 otherwise.
+ *
+ * top: the directory.
+ */
+static int release_subtree(Directory *top)
+{
+  Directory *curr, *clone;
+
+  for (curr = top; curr != NULL; curr = preorder_next(curr, top))
+  {
+    /* a clone given copies is no longer in the list, which is gone again */
+    clone = curr->clones;
+    while (clone != NULL)
+    {
+      if (under_directory(clone, top))
+        clone = clone->next_clone;
+      else if (!copy_subtree(clone, top))
+        return 0;
+      else
+        clone = curr->clones;
+    }
+  }
+
+  /* the directories to be removed as well only stop sharing */
+  for (curr = top; curr != NULL; curr = preorder_next(curr, top))
+  {
+    if (curr->origin != NULL)
+      stop_sharing(curr);
+    while (curr->clones != NULL)
+      stop_sharing(curr->clones);
+  }
+
+  return 1;
+}
+
+/*
+ * copy_subtree gives every directory under a directory, and itself, copies of
+ * the entries they share with directories under another directory, so no
+ * directory goes on sharing anything from there. It returns 0 if memory ran
+ * out, and 1 otherwise.
+ *
+ * directory: the directory.
+ * top: the other directory.
+ */
+static int copy_subtree(Directory *directory, Directory *top)
+{
+  Directory *curr;
+
+  /* the copies of each directory are gone through right after it */
+  for (curr = directory; curr != NULL; curr = preorder_next(curr, directory))
+    if (curr->origin != NULL && under_directory(curr->origin, top) &&
+        !copy_origin(curr))
+      return 0;
+
+  return 1;
+}
+
+/*
+ * under_directory returns 1 if a directory is another one or under it, and 0
+ * otherwise.
+ *
+ * directory: the directory.
+ * top: the other directory.
+ */
+static int under_directory(const Directory *directory, const Directory *top)
+{
+  while (directory != NULL && directory != top)
+    directory = directory->parent;
+
+  return directory != NULL;
+}
+
+/*
+ * preorder_next returns the directory after another one when going through
+ * the directories under a top directory in preorder, or NULL after the last.
+ *
+ * curr: the directory.
+ * top: the top directory.
+ */
+static Directory *preorder_next(Directory *curr, Directory *top)
+{
+  if (curr->sub != NULL)
+    return curr->sub;
+
+  while (curr != top && curr->next == NULL)
+    curr = curr->parent;
+
+  return curr != top ? curr->next : NULL;
+}
+
+/*
+ * free_file gives a file back to the pool and releases its name. Its inode
+ * and contents go along with it unless the file has other names.
+ *
+ * state: the state of the filesystem the file belongs to.
+ * file: the file to deallocate.
+ */
+static void free_file(struct fs_state *state, File *file)
+{
+  if (file->inode != NULL)
+    inode_release(state, file);
+  name_release(state, file->name);
+  pool_free(state, file, sizeof(*file));
+}
+
+/*
+ * inode_release gives up a name of a file, taking it off the names of its
+ * inode. Once the file has no names left, its slot in the handle table is
+ * given up, and the inode is given back to the pool along with the contents
+ * of the file.
+ *
+ * state: the state of the filesystem the file belongs to.
+ * file: the name, which is left without an inode.
+ */
+static void inode_release(struct fs_state *state, File *file)
+{
+  Inode *inode = file->inode;
+  File **link;
+  int last;
+
+  MUTEX_LOCK(&state->handle_lock);
+
+  for (link = &inode->file; *link != file; link = &(*link)->link)
+    ;
+  *link = file->link;
+  file->link = NULL;
+  file->inode = NULL;
+
+  last = --inode->links == 0;
+  if (last)
+    handle_free(state, inode->id);
+  else if (inode->links == 1)
+    state->linked--;
+
+  MUTEX_UNLOCK(&state->handle_lock);
+
+  if (last)
+  {
+    data_free(state, inode->data);
+    pool_free(state, inode, sizeof(*inode));
+  }
+}
+
+/*
+ * handle_reserve takes a slot of the handle table of a filesystem for a new
+ * file or directory, which is put in it once it is linked into a directory.
+ * It returns the inode number, or 0 if memory ran out.
+ *
+ * state: the state of the filesystem.
+ */
+static unsigned long handle_reserve(struct fs_state *state)
+{
+  Handle *grown;
+  unsigned long id = 0, size;
+
+  MUTEX_LOCK(&state->handle_lock);
+
+  if (state->free_handle != 0)
+  {
+    id = state->free_handle;
+    state->free_handle = state->handles[id].next;
+  }
+  else
+  {
+    if (state->handle_count >= state->handle_size)
+    {
+      size = state->handle_size > 0 ? state->handle_size * 2
+                                    : HANDLE_INITIAL_SIZE;
+      grown = pool_alloc(state, size * sizeof(*grown));
+      if (grown != NULL)
+      {
+        if (state->handle_size > 0)
+        {
+          memcpy(grown, state->handles, state->handle_size * sizeof(*grown));
+          pool_free(state, state->handles,
+                    state->handle_size * sizeof(*grown));
+        }
+        memset(grown + state->handle_size, 0,
+               (size - state->handle_size) * sizeof(*grown));
+        state->handles = grown;
+        state->handle_size = size;
+      }
+    }
+
+    if (state->handle_count < state->handle_size)
+      id = state->handle_count++;
+  }
+
+  if (id != 0)
+  {
+    state->handles[id].directory = NULL;
+    state->handles[id].inode = NULL;
+    state->handles[id].checked = 0;
+    state->handles[id].next = 0;
+  }
+
+  MUTEX_UNLOCK(&state->handle_lock);
+
+  return id;
+}
+
+/*
+ * handle_free gives up a slot of the handle table of a filesystem, putting it
+ * on the free list. It has to be called with the handle table mutex locked.
+ *
+ * state: the state of the filesystem.
+ * id: the inode number.
+ */
+static void handle_free(struct fs_state *state, unsigned long id)
+{
+  Handle *slot = &state->handles[id];
+
+  slot->directory = NULL;
+  slot->inode = NULL;
+  slot->checked = 0;
+  slot->serial++;
+  slot->next = state->free_handle;
+  state->free_handle = id;
+}
+
+/*
+ * handle_find finds the file or directory with an inode number for the
+ * running command of a session, in constant time unless a directory was
+ * removed or moved since it was last found. A directory is returned locked
+ * for reading. A file is saved in file, and the directory it is in is
+ * returned locked for reading instead; a file with several names is found
+ * under its first. It returns NULL if nothing in the filesystem has the
+ * number.
+ *
+ * Whatever is found was in the filesystem once the command began, so the
+ * epochs keep it from being deallocated until the command ends. A file can
+ * still be removed before its directory is locked, which is found out by the
+ * slot having been given up since, or, for a file with other names, by the
+ * name no longer being among them, in which case it is looked up again.
+ *
+ * session: the session.
+ * id: the inode number.
+ * file: set to the file, or NULL if a directory was found.
+ */
+static Directory *handle_find(Fs_session *session, unsigned long id,
+                              File **file)
+{
+  struct fs_state *state = session->state;
+  Directory *directory, *curr;
+  const File *curr_file;
+  unsigned long serial;
+  Handle *slot;
+  int again;
+
+  do
+  {
+    directory = NULL;
+    serial = 0;
+    again = 0;
+    *file = NULL;
+
+    MUTEX_LOCK(&state->epoch_lock);
+    MUTEX_LOCK(&state->handle_lock);
+
+    if (id > 0 && id < state->handle_count)
+    {
+      slot = &state->handles[id];
+      if (slot->directory != NULL)
+        directory = slot->directory;
+      else if (slot->inode != NULL)
+      {
+        *file = slot->inode->file;
+        directory = (*file)->parent;
+      }
+
+      /* it is in the filesystem if no directory above it was removed */
+      if (directory != NULL && slot->checked != state->path_generation)
+      {
+        for (curr = directory; curr != NULL && !curr->removed;
+             curr = curr->parent)
+          ;
+
+        if (curr == NULL)
+          slot->checked = state->path_generation;
+        else
+          directory = NULL;
+      }
+
+      serial = slot->serial;
+    }
+
+    MUTEX_UNLOCK(&state->handle_lock);
+    MUTEX_UNLOCK(&state->epoch_lock);
+
+    if (directory == NULL)
+    {
+      *file = NULL;
+      return NULL;
+    }
+
+    READ_LOCK(&directory->lock);
+
+    /* no name in the directory can be removed while it is locked */
+    if (*file != NULL)
+    {
+      MUTEX_LOCK(&state->handle_lock);
+      curr_file = NULL;
+      if (state->handles[id].serial == serial)
+      {
+        for (curr_file = state->handles[id].inode->file;
+             curr_file != NULL && curr_file != *file;
+             curr_file = curr_file->link)
+          ;
+        again = curr_file == NULL;
+      }
+      MUTEX_UNLOCK(&state->handle_lock);
+
+      if (curr_file == NULL)
+      {
+        UNLOCK(&directory->lock);
+        *file = NULL;
+        directory = NULL;
+      }
+    }
+  } while (again);
+
+  return directory;
+}
+
+/*
+ * data_write writes bytes into a file at an offset, growing it if they go
+ * past its end; the bytes between its old end and the offset read as zeros.
+ * It returns 1 if they were written, and 0 if they would go past
+ * DATA_MAX_SIZE, or if memory ran out, in which case the file holds the
+ * first part of them, as if only that part had been written.
+ *
+ * state: the state of the filesystem the file belongs to.
+ * inode: the inode of the file, whose INODE_LOCK the caller holds for
+ *        writing. A file with several names is written under it alongside
+ *        other commands, like any other file.
+ * offset: where the bytes go.
+ * bytes: the bytes.
+ * length: the number of bytes.
+ * written: set to the number of bytes written, which the caller saves in
+ *          the journal even if not all of them were.
+ */
+static int data_write(struct fs_state *state, Inode *inode,
+                      unsigned long offset, const char bytes[], size_t length,
+                      size_t *written)
+{
+  struct file_data *data = inode->data;
+  Data_chunk *chunk;
+  unsigned long start = offset, end = offset + length, within, piece;
+
+  *written = 0;
+  if (length == 0)
+    return 1;
+  if (end < offset || end > DATA_MAX_SIZE)
+    return 0;
+
+  data = data_reserve(state, inode,
+                      data != NULL && data->size > end ? data->size : end);
+  if (data == NULL)
+    return 0;
+
+  if (data->capacity > 0)
+    memcpy(DATA_BYTES(data) + offset, bytes, length);
+  else
+  {
+    /* going through the chunks the bytes fall in, one piece per chunk */
+    for (; length > 0; offset += piece, bytes += piece, length -= piece)
+    {
+      within = offset % DATA_CHUNK_SIZE;
+      piece = DATA_CHUNK_SIZE - within < length ? DATA_CHUNK_SIZE - within
+                                                : length;
+      chunk = data_chunk(state, data, offset / DATA_CHUNK_SIZE);
+      if (chunk == NULL)
+      {
+        /* the file only grows if some of the bytes went past its end */
+        *written = offset - start;
+        if (offset > start && offset > data->size)
+          data->size = offset;
+        return 0;
+      }
+      memcpy(CHUNK_BYTES(chunk) + within, bytes, piece);
+    }
+  }
+
+  if (end > data->size)
+    data->size = end;
+  *written = end - start;
+
+  return 1;
+}
+
+/*
+ * data_truncate makes a file a given number of bytes long, cutting off what
+ * is past the new end, or growing it with bytes reading as zeros. Growing it
+ * leaves holes rather than allocating chunks. It returns 1 on success, and 0
+ * if the size is bigger than DATA_MAX_SIZE or memory ran out.
+ *
+ * state: the state of the filesystem the file belongs to.
+ * inode: the inode of the file, whose INODE_LOCK the caller holds for
+ *        writing. A file with several names is written under it alongside
+ *        other commands, like any other file.
+ * size: the new size.
+ */
+static int data_truncate(struct fs_state *state, Inode *inode,
+                         unsigned long size)
+{
+  struct file_data *data = inode->data;
+  Data_chunk *chunk;
+  unsigned long old = data != NULL ? data->size : 0, keep, slot;
+
+  if (size == old)
+    return 1;
+  if (size > DATA_MAX_SIZE)
+    return 0;
+
+  if (size == 0)
+  {
+    data_free(state, data);
+    inode->data = NULL;
+  }
+  else if (size > old)
+  {
+    data = data_reserve(state, inode, size);
+    if (data == NULL)
+      return 0;
+    data->size = size;
+  }
+  else if (data->capacity > 0)
+  {
+    memset(DATA_BYTES(data) + size, 0, old - size);
+    data->size = size;
+  }
+  else
+  {
+    /* the end of the last chunk kept is cleared, which may copy it first */
+    keep = (size + DATA_CHUNK_SIZE - 1) / DATA_CHUNK_SIZE;
+    if (size % DATA_CHUNK_SIZE != 0 && data->chunks[keep - 1] != NULL)
+    {
+      chunk = data_chunk(state, data, keep - 1);
+      if (chunk == NULL)
+        return 0;
+      memset(CHUNK_BYTES(chunk) + size % DATA_CHUNK_SIZE, 0,
+             DATA_CHUNK_SIZE - size % DATA_CHUNK_SIZE);
+    }
+
+    for (slot = keep; slot < data->slots; slot++)
+    {
+      if (data->chunks[slot] != NULL)
+      {
+        chunk_release(state, data->chunks[slot]);
+        data->chunks[slot] = NULL;
+      }
+    }
+    data->size = size;
+  }
+
+  return 1;
+}
+
+/*
+ * data_reserve makes room for a file to grow to a given size, without
+ * changing its size. A file that stays small enough gets a bigger inline
+ * buffer, and one that does not is moved into chunks, its inline bytes into
+ * the first one, and gets a table of chunks covering the size. It returns the
+ * file data, or NULL if memory ran out, in which case the file is left as it
+ * was.
+ *
+ * state: the state of the filesystem the file belongs to.
+ * inode: the inode of the file.
+ * size: the size, which must not be 0.
+ */
+static struct file_data *data_reserve(struct fs_state *state, Inode *inode,
+                                      unsigned long size)
+{
+  struct file_data *data = inode->data, *grown;
+  Data_chunk *chunk;
+  unsigned long capacity;
+
+  if (data != NULL && data->capacity == 0)
+    return data_table(state, data, size) ? data : NULL;
+
+  if (data != NULL && size <= data->capacity)
+    return data;
+
+  if (size <= DATA_INLINE_SIZE)
+  {
+    capacity = (size + POOL_GRAIN - 1) / POOL_GRAIN * POOL_GRAIN;
+    grown = pool_alloc(state, DATA_BLOCK_SIZE(capacity));
+    if (grown == NULL)
+      return NULL;
+
+    grown->size = data != NULL ? data->size : 0;
+    grown->capacity = capacity;
+    grown->slots = 0;
+    grown->chunks = NULL;
+    if (data != NULL)
+      memcpy(DATA_BYTES(grown), DATA_BYTES(data), data->size);
+    memset(DATA_BYTES(grown) + grown->size, 0, capacity - grown->size);
+  }
+  else
+  {
+    grown = pool_alloc(state, DATA_BLOCK_SIZE(0));
+    if (grown == NULL)
+      return NULL;
+
+    grown->size = 0;
+    grown->capacity = 0;
+    grown->slots = 0;
+    grown->chunks = NULL;
+    chunk = NULL;
+    if (data_table(state, grown, size) &&
+        (data == NULL || data->size == 0 ||
+         (chunk = data_chunk(state, grown, 0)) != NULL))
+    {
+      if (chunk != NULL)
+        memcpy(CHUNK_BYTES(chunk), DATA_BYTES(data), data->size);
+      grown->size = data != NULL ? data->size : 0;
+    }
+    else
+    {
+      data_free(state, grown);
+      return NULL;
+    }
+  }
+
+  data_free(state, data);
+  inode->data = grown;
+
+  return grown;
+}
+
+/*
+ * data_table makes the table of chunks of a file cover a given size, at
+ * least doubling it when it has to grow. The new slots are holes. It returns
+ * 1 on success, and 0 if the size is bigger than DATA_MAX_SIZE or memory ran
+ * out.
+ *
+ * state: the state of the filesystem the file belongs to.
+ * data: the file data, which must hold chunks.
+ * size: the size.
+ */
+static int data_table(struct fs_state *state, struct file_data *data,
+                      unsigned long size)
+{
+  unsigned long slots;
+  Data_chunk **table;
+
+  if (size > DATA_MAX_SIZE)
+    return 0;
+
+  slots = (size + DATA_CHUNK_SIZE - 1) / DATA_CHUNK_SIZE;
+  if (slots <= data->slots)
+    return 1;
+
+  if (slots < data->slots * 2)
+    slots = data->slots * 2;
+
+  table = pool_alloc(state, slots * sizeof(*table));
+  if (table == NULL)
+    return 0;
+
+  if (data->slots > 0)
+  {
+    memcpy(table, data->chunks, data->slots * sizeof(*table));
+    pool_free(state, data->chunks, data->slots * sizeof(*table));
+  }
+  memset(table + data->slots, 0, (slots - data->slots) * sizeof(*table));
+  data->chunks = table;
+  data->slots = slots;
+
+  return 1;
+}
+
+/*
+ * data_chunk returns a chunk of a file that can be written, or NULL if
+ * memory ran out. A hole gets a new chunk of zeros, and a chunk held by other
+ * files as well is replaced by a copy of its own. The count is only read
+ * under the data mutex, and the chunk is copied before it is given up, so
+ * another file giving up the same chunk at the same time at worst copies it
+ * too.
+ *
+ * state: the state of the filesystem the file belongs to.
+ * data: the file data, which must hold chunks.
+ * slot: the slot of the chunk in the table.
+ */
+static Data_chunk *data_chunk(struct fs_state *state, struct file_data *data,
+                              unsigned long slot)
+{
+  Data_chunk *chunk = data->chunks[slot], *copy;
+  int shared = 1;
+
+  if (chunk != NULL)
+  {
+    MUTEX_LOCK(&state->data_lock);
+    shared = chunk->references > 1;
+    MUTEX_UNLOCK(&state->data_lock);
+
+    if (!shared)
+      return chunk;
+  }
+
+  copy = chunk_alloc(state);
+  if (copy == NULL)
+    return NULL;
+
+  if (chunk != NULL)
+  {
+    memcpy(CHUNK_BYTES(copy), CHUNK_BYTES(chunk), DATA_CHUNK_SIZE);
+    chunk_release(state, chunk);
+  }
+  else
+    memset(CHUNK_BYTES(copy), 0, DATA_CHUNK_SIZE);
+
+  data->chunks[slot] = copy;
+
+  return copy;
+}
+
+/*
+ * data_share gives a new file the contents of another one, for cp. Inline
+ * bytes and the table of chunks are copied, but the chunks are shared. It
+ * returns 1 on success, and 0 if memory ran out, in which case the new file
+ * is left empty.
+ *
+ * state: the state of the filesystem the files belong to.
+ * inode: the inode of the new file.
+ * source: the inode of the file whose contents it gets.
+ */
+static int data_share(struct fs_state *state, Inode *inode,
+                      const Inode *source)
+{
+  const struct file_data *data = source->data;
+  struct file_data *copy;
+  unsigned long slot;
+
+  inode->data = NULL;
+  if (data == NULL)
+    return 1;
+
+  copy = pool_alloc(state, DATA_BLOCK_SIZE(data->capacity));
+  if (copy == NULL)
+    return 0;
+  memcpy(copy, data, DATA_BLOCK_SIZE(data->capacity));
+
+  if (data->slots > 0)
+  {
+    copy->chunks = pool_alloc(state, data->slots * sizeof(*copy->chunks));
+    if (copy->chunks == NULL)
+    {
+      pool_free(state, copy, DATA_BLOCK_SIZE(data->capacity));
+      return 0;
+    }
+    memcpy(copy->chunks, data->chunks, data->slots * sizeof(*copy->chunks));
+
+    MUTEX_LOCK(&state->data_lock);
+    for (slot = 0; slot < data->slots; slot++)
+      if (data->chunks[slot] != NULL)
+        data->chunks[slot]->references++;
+    MUTEX_UNLOCK(&state->data_lock);
+  }
+
+  inode->data = copy;
+
+  return 1;
+}
+
+/*
+ * data_free gives the file data of a file back to the pool, along with its
+ * table of chunks, and gives up its chunks.
+ *
+ * state: the state of the filesystem the file belongs to.
+ * data: the file data, which may be NULL.
+ */
+static void data_free(struct fs_state *state, struct file_data *data)
+{
+  unsigned long slot;
+
+  if (data == NULL)
+    return;
+
+  for (slot = 0; slot < data->slots; slot++)
+    if (data->chunks[slot] != NULL)
+      chunk_release(state, data->chunks[slot]);
+
+  if (data->slots > 0)
+    pool_free(state, data->chunks, data->slots * sizeof(*data->chunks));
+  pool_free(state, data, DATA_BLOCK_SIZE(data->capacity));
+}
+
+/*
+ * free_directory gives a directory, together with its name index, back to
+ * the pool, and releases its name and its slot of the handle table. Its files
+ * and sub directories are not touched.
+ *
+ * state: the state of the filesystem the directory belongs to.
+ * directory: the directory to deallocate.
+ */
+static void free_directory(struct fs_state *state, Directory *directory)
+{
+  MUTEX_LOCK(&state->handle_lock);
+  handle_free(state, directory->id);
+  MUTEX_UNLOCK(&state->handle_lock);
+
+  index_destroy(directory->index);
+  DESTROY_LOCK(&directory->lock);
+  name_release(state, directory->name);
+  pool_free(state, directory, sizeof(*directory));
+}
+
+/*
+ * keep_directory takes a removed directory whose contents were deallocated
+ * out of the filesystem without deallocating it, since an Fs_sim may still
+ * hold it as its current directory, and there is no telling when the last
+ * copy holding it goes away. It is marked as removed itself, and cut off
+ * from the directories above it, which are deallocated, so the commands run
+ * through the Fs_sim find out it was removed without looking at them. Only
+ * its name and the directory itself are left, given back by rmfs with the
+ * rest of the pool.
+ *
+ * state: the state of the filesystem the directory belongs to.
+ * directory: the directory, which must be empty and unlinked.
+ * removed: the epoch the directory at the top of the tree it was removed
+ *          with was removed in.
+ */
+static void keep_directory(struct fs_state *state, Directory *directory,
+                           unsigned long removed)
+{
+  MUTEX_LOCK(&state->handle_lock);
+  handle_free(state, directory->id);
+  MUTEX_UNLOCK(&state->handle_lock);
+
+  index_destroy(directory->index);
+  directory->index = NULL;
+
+  MUTEX_LOCK(&state->epoch_lock);
+  directory->removed = removed;
+  directory->parent = NULL;
+  MUTEX_UNLOCK(&state->epoch_lock);
+}
+
+/*
+ * destroy_directories takes the directory pointed by top out of the
+ * filesystem, with all files and subdirectories under it. Nothing is
+ * deallocated here: top is marked as removed in the current epoch and added
+ * to the garbage list of the filesystem, and reclaim_garbage gives its memory
+ * back to the pool once no command can still be going through it.
+ *
+ * The generation of the filesystem is advanced, since paths saved in the path
+ * caches might have led into it, and the saved paths of the current
+ * directories might have gone through it. It is taken out of the usage of the
+ * directories above it along with everything under it, in the same step, so a
+ * change made under it meanwhile is either counted above it and taken out
+ * with the rest, or never counted there.
+ *
+ * top: a directory pointer points to the top directory of everything which
+ *      is removed. It must already be unlinked from its parent.
+ */
+static void destroy_directories(Fs_sim top)
+{
+  struct fs_state *state = top->state;
+  Fs_usage change;
+
+  MUTEX_LOCK(&state->garbage_lock);
+
+  MUTEX_LOCK(&state->epoch_lock);
+  top->removed = state->epoch;
+  state->path_generation++;
+  usage_entry(&change, top->name, 1);
+  change.files += top->usage.files;
+  change.directories += top->usage.directories;
+  change.name_bytes += top->usage.name_bytes;
+  usage_add(top->parent, &change, 1);
+  MUTEX_UNLOCK(&state->epoch_lock);
+
+  top->next = NULL;
+  if (state->garbage_tail != NULL)
+    state->garbage_tail->next = top;
+  else
+    state->garbage = top;
+  state->garbage_tail = top;
+
+  MUTEX_UNLOCK(&state->garbage_lock);
+}
+
+/*
+ * reclaim_garbage deallocates the directories on the garbage list of a
+ * filesystem, with all files and subdirectories under them. It returns 1 if
+ * the garbage lists are empty afterwards and 0 otherwise.
+ *
+ * A directory is only deallocated once the epoch is two past the one it was
+ * removed in, and while no session is standing in it. Those that a session is
+ * standing in are moved to the pinned garbage list, and tried again on every
+ * call. Unless the filesystem is in deferred mode, there is no limit on how
+ * much is deallocated.
+ *
+ * A directory cd made the current directory of an Fs_sim is not deallocated
+ * itself, since copies of the Fs_sim may still hold it (see keep_directory).
+ *
+ * The trees are taken apart without recursion, so the stack used does not
+ * depend on how deep or wide they are: starting at the top, it keeps moving
+ * down into the first subdirectory until reaching one without subdirectories,
+ * deallocates its files and then itself, and moves back up to its parent. The
+ * directory it stopped at is saved in the filesystem state, so deallocation can
+ * continue from there when it is called again.
+ *
+ * state: the state of the filesystem.
+ * limit: the greatest number of files and directories to deallocate, or 0 for
+ *        no limit.
+ */
+static int reclaim_garbage(struct fs_state *state, unsigned long limit)
+{
+  Directory *curr, *parent, *top, **link;
+  File *curr_file;
+  unsigned long done = 0, removed;
+  int result, ready;
+
+  MUTEX_LOCK(&state->garbage_lock);
+
+  if (!state->deferred_rm)
+    limit = 0;
+
+  /* the directories that sessions were standing in might have been left */
+  if (state->pinned_garbage != NULL)
+  {
+    MUTEX_LOCK(&state->epoch_lock);
+    link = &state->pinned_garbage;
+    while (*link != NULL)
+    {
+      top = *link;
+      if (pinned_by_session(state, top))
+        link = &top->next;
+      else
+      {
+        *link = top->next;
+        top->next = NULL;
+        if (state->garbage_tail != NULL)
+          state->garbage_tail->next = top;
+        else
+          state->garbage = top;
+        state->garbage_tail = top;
+      }
+    }
+    MUTEX_UNLOCK(&state->epoch_lock);
+  }
+
+  curr = state->reclaim_at;
+
+  while (limit == 0 || done < limit)
+  {
+    /* starting on the next directory of the garbage list, if it is ready */
+    if (curr == NULL)
+    {
+      top = state->garbage;
+      if (top == NULL)
+        break;
+
+      MUTEX_LOCK(&state->epoch_lock);
+      ready = top->removed + 2 <= state->epoch;
+      if (ready && pinned_by_session(state, top))
+      {
+        state->garbage = top->next;
+        if (state->garbage == NULL)
+          state->garbage_tail = NULL;
+        top->next = state->pinned_garbage;
+        state->pinned_garbage = top;
+      }
+      else if (ready)
+        curr = top;
+      MUTEX_UNLOCK(&state->epoch_lock);
+
+      /* the rest of the list was removed later, so it is not ready either */
+      if (!ready)
+        break;
+    }
+    else if (curr->sub != NULL)
+      curr = curr->sub;
+    else if (curr->f_head != NULL)
+    {
+      curr_file = curr->f_head;
+      unlink_file(curr, curr_file);
+      free_file(state, curr_file);
+      done++;
+    }
+    else
+    {
+      /* 
+       * the directory is empty now. A top directory is removed from the
+       * garbage list, and the next one is started on if it is ready, any
+       * other directory is removed from its parent, which is gone back to.
+       */
+      removed = state->garbage->removed;
+      if (curr == state->garbage)
+      {
+        state->garbage = curr->next;
+        if (state->garbage == NULL)
+          state->garbage_tail = NULL;
+        parent = NULL;
+      }
+      else
+      {
+        parent = curr->parent;
+        unlink_directory(parent, curr);
+      }
+
+      /* an Fs_sim may still hold it, so only the directory itself is left */
+      if (curr->held)
+        keep_directory(state, curr, removed);
+      else
+        free_directory(state, curr);
+      done++;
+      curr = parent;
+    }
+  }
+
+  state->reclaim_at = curr;
+  result = state->garbage == NULL && state->pinned_garbage == NULL;
+  MUTEX_UNLOCK(&state->garbage_lock);
+
+  return result;
+}
+
+/*
+ * scratch_copy copies a path into the scratch buffer of a session, making the
+ * buffer bigger if needed, so it can be split into components. It returns the
+ * copy, or NULL if memory runs out.
+ *
+ * session: the session.
+ * arg: the path.
+ */
+static char *scratch_copy(Fs_session *session, const char arg[])
+{
+  size_t size = strlen(arg) + 1;
+
+  if (size > session->scratch_size)
+  {
+    char *scratch = pool_alloc(session->state, size * 2);
+
+    if (scratch == NULL)
+      return NULL;
+
+    if (session->scratch != NULL)
+      pool_free(session->state, session->scratch, session->scratch_size);
+    session->scratch = scratch;
+    session->scratch_size = size * 2;
+  }
+
+  return strcpy(session->scratch, arg);
+}
+
+/*
+ * split_path splits a path into the directory its last component is in and the
+ * last component itself. Trailing forward-slashes are ignored, and a path made
+ * of forward-slashes only is split into the current directory and "/". It
+ * returns 1 if the directory was found and 0 if the path does not lead to one.
+ *
+ * session: the session, whose current directory relative paths start from.
+ * arg: the path.
+ * directory: set to the directory the last component is in.
+ * name: set to the last component, which is saved in the scratch buffer, so it
+ *       stays valid until the next path is split or resolved.
+ * own: 1 if the directory is to be changed, as for resolve_path.
+ */
+static int split_path(Fs_session *session, const char arg[],
+                      Fs_sim *directory, const char **name, int own)
+{
+  char *path = scratch_copy(session, arg), *last;
+  size_t length;
+
+  if (path == NULL)
+    return 0;
+
+  length = strlen(path);
+  while (length > 1 && path[length - 1] == '/')
+    path[--length] = '\0';
+
+  last = strrchr(path, '/');
+
+  if (last == NULL || length == 1)
+  {
+    *directory = session->cwd;
+    *name = path;
+  }
+  else if (last == path)
+  {
+    *directory = session->state->root;
+    *name = last + 1;
+  }
+  else
+  {
+    *last = '\0';
+    *directory = resolve_path(session, path, own);
+    *name = last + 1;
+  }
+
+  return *directory != NULL;
+}
+
+/*
+ * resolve_path returns the directory a path leads to, or NULL if any of its
+ * components is not a directory. A path starting with a forward-slash starts
+ * from the root, and any other from the current directory. Empty components
+ * and single periods are skipped, and double periods lead to the parent
+ * directory, or stay in the root.
+ *
+ * The path cache of the session is checked first, and the directory found is
+ * saved in it, unless it is a view. Each directory is only locked while it
+ * is being looked in.
+ *
+ * session: the session, whose current directory relative paths start from.
+ * path: the path, which is changed while it is being resolved and restored
+ *       before returning.
+ * own: 1 if the directory is to be changed, or kept, so any directory on the
+ *      way that is shared with another is given an entry of its own standing
+ *      in for it, and 0 if it is only looked at, so it is looked through a
+ *      view instead (see enter_directory).
+ */
+static Directory *resolve_path(Fs_session *session, char path[], int own)
+{
+  struct fs_state *state = session->state;
+  Directory *start = path[0] == '/' ? state->root : session->cwd;
+  Directory *curr = start;
+  Path_cache_entry *entry = NULL;
+  unsigned long hash = 0;
+  size_t length = strlen(path);
+  char *component = path, *end, saved;
+
+  if (length < PATH_CACHE_LENGTH)
+  {
+    if (session->path_cache == NULL)
+    {
+      session->path_cache = pool_alloc(state,
+                                       PATH_CACHE_SLOTS * sizeof(*entry));
+      if (session->path_cache != NULL)
+        memset(session->path_cache, 0, PATH_CACHE_SLOTS * sizeof(*entry));
+    }
+
+    if (session->path_cache != NULL)
+    {
+      hash = hash_path(start, path);
+      entry = &session->path_cache[hash % PATH_CACHE_SLOTS];
+
+      /* the path cache only holds directories of their own */
+      if (entry->generation == session->generation &&
+          entry->hash == hash && entry->start == start &&
+          !strcmp(entry->path, path))
+        return entry->target;
+    }
+  }
+
+  while (curr != NULL && *component != '\0')
+  {
+    end = component;
+    while (*end != '\0' && *end != '/')
+      end++;
+
+    saved = *end;
+    *end = '\0';
+
+    if (!strcmp(component, "..") && curr->parent != NULL)
+      curr = curr->parent;
+    else if (strcmp(component, "") && strcmp(component, ".") &&
+             strcmp(component, ".."))
+      curr = enter_directory(session, curr, component, own);
+
+    *end = saved;
+    component = saved != '\0' ? end + 1 : end;
+  }
+
+  if (curr != NULL && curr->id != 0 && entry != NULL)
+  {
+    entry->generation = session->generation;
+    entry->hash = hash;
+    entry->start = start;
+    entry->target = curr;
+    strcpy(entry->path, path);
+  }
+
+  return curr;
+}
+
+/*
+ * enter_directory returns the sub directory of a directory with a name, or
+ * NULL if there is none or memory ran out. If the directory shares it with
+ * another one, and own is 1, the directory is given an entry of its own
+ * standing in for it, as stand_in makes it, which is returned, and if own is
+ * 0, a view of it is returned instead, so nothing is copied to look at it.
+ *
+ * session: the session.
+ * directory: the directory.
+ * name: the name.
+ * own: 1 if the sub directory is to be changed, or kept, and 0 if not.
+ */
+static Directory *enter_directory(Fs_session *session, Directory *directory,
+                                  const char name[], int own)
+{
+  Directory *sub;
+
+  /* it is looked for again if other commands may have changed it meanwhile */
+  do
+  {
+    READ_LOCK(&directory->lock);
+    find_entry(directory, name, NULL, &sub);
+    UNLOCK(&directory->lock);
+
+    if (sub == NULL || sub->parent == directory)
+      return sub;
+
+    if (!own)
+      return make_view(session, directory, sub);
+  }
+  while (!exclusive_command(session));
+
+  sub = NULL;
+  if (stand_in(directory, name))
+    check_name(directory, name, NULL, &sub);
+
+  return sub;
+}
+
+/*
+ * make_view returns a view of a sub directory that a directory shares with
+ * another one, or NULL if memory ran out. A view is a directory record of its
+ * own, with the directory as its parent, so going up from it, and the paths
+ * built from it, lead through the directory rather than the one it shares
+ * the sub directory with. It has no entries of its own, and shares those of
+ * the sub directory without being among the directories sharing them, so it
+ * cannot be changed. Its inode number is 0, and it is given back by
+ * end_command once the command of the session making it ends.
+ *
+ * session: the session.
+ * parent: the directory.
+ * sub: the sub directory.
+ */
+static Directory *make_view(Fs_session *session, Directory *parent,
+                            Directory *sub)
+{
+  Directory *view = pool_alloc(session->state, sizeof(*view));
+
+  if (view != NULL)
+  {
+    view->name = sub->name;
+    view->parent = parent;
+    view->sub = NULL;
+    view->next = session->views;
+    view->f_head = NULL;
+    view->prev = NULL;
+    view->sub_tail = NULL;
+    view->f_tail = NULL;
+    view->count = 0;
+    view->index = NULL;
+    view->state = session->state;
+    view->removed = 0;
+    view->held = 0;
+    view->origin = sub;
+    view->clones = NULL;
+    view->next_clone = NULL;
+    view->prev_clone = NULL;
+    view->id = 0;
+    view->usage = sub->usage;
+    view->quota.files = 0;
+    view->quota.directories = 0;
+    view->quota.name_bytes = 0;
+    INIT_LOCK(&view->lock);
+    session->views = view;
+  }
+
+  return view;
+}
+
+/*
+ * hash_path computes the hash value of a path resolved from a directory for
+ * the path cache.
+ */
+static unsigned long hash_path(const Directory *start, const char path[])
+{
+  return hash_name(path) ^ ((unsigned long) start / sizeof(Directory));
+}
+
+/*
+ * track_path makes sure the saved path of a session is the path of its current
+ * directory, rebuilding it if not. It returns 0 if memory runs out.
+ *
+ * session: the session.
+ */
+static int track_path(Fs_session *session)
+{
+  Directory *fs = session->cwd, *curr;
+  size_t length = 0;
+  char *end;
+
+  if (session->cwd_path_dir == fs &&
+      session->cwd_path_generation == session->generation)
+    return 1;
+
+  /* Counting the length of the path from the directory to the root */
+  for (curr = fs; curr->parent != NULL; curr = curr->parent)
+    length += strlen(curr->name) + 1;
+
+  /* the root itself is a single forward-slash */
+  if (length == 0)
+    length = 1;
+
+  if (!reserve_path(session, length + 1))
+    return 0;
+
+  /* Filling in the names from the end of the path back to its start */
+  end = session->cwd_path + length;
+  *end = '\n';
+  session->cwd_path[0] = '/';
+
+  for (curr = fs; curr->parent != NULL; curr = curr->parent)
+  {
+    end -= strlen(curr->name);
+    memcpy(end, curr->name, strlen(curr->name));
+    *--end = '/';
+  }
+
+  session->cwd_path_length = length + 1;
+  session->cwd_path_dir = fs;
+  session->cwd_path_generation = session->generation;
+
+  return 1;
+}
+
+/*
+ * path_moved updates the saved path of a session after cd moved it from one
+ * directory to another. Moving into a sub directory appends its name, moving
+ * to the parent directory cuts off the last name, and moving to the root
+ * resets the path. If the saved path was not the path of the directory moved
+ * from, or the move was any other one, the path is rebuilt when pwd is called
+ * next.
+ *
+ * session: the session.
+ * from: the directory cd moved from.
+ * to: the directory cd moved to.
+ */
+static void path_moved(Fs_session *session, Fs_sim from, Fs_sim to)
+{
+  size_t length;
+
+  if (from == to || session->cwd_path_dir != from ||
+      session->cwd_path_generation != session->generation)
+    return;
+
+  if (to->parent == from)
+  {
+    /* replacing the newline by the name; the root path has no slash to add */
+    length = session->cwd_path_length - 1;
+    if (length == 1)
+      length = 0;
+
+    if (reserve_path(session, length + strlen(to->name) + 2))
+    {
+      session->cwd_path[length] = '/';
+      strcpy(session->cwd_path + length + 1, to->name);
+      length += strlen(to->name) + 1;
+      session->cwd_path[length] = '\n';
+      session->cwd_path_length = length + 1;
+      session->cwd_path_dir = to;
+    }
+    else
+      session->cwd_path_dir = NULL;
+  }
+  else if (from->parent == to)
+  {
+    length = session->cwd_path_length - 1;
+    while (length > 0 && session->cwd_path[length - 1] != '/')
+      length--;
+
+    /* the slash before the last name is only kept if it is the root one */
+    if (length > 1)
+      length--;
+
+    session->cwd_path[length] = '\n';
+    session->cwd_path_length = length + 1;
+    session->cwd_path_dir = to;
+  }
+  else if (to->parent == NULL)
+  {
+    session->cwd_path[0] = '/';
+    session->cwd_path[1] = '\n';
+    session->cwd_path_length = 2;
+    session->cwd_path_dir = to;
+  }
+  else
+    session->cwd_path_dir = NULL;
+}
+
+/*
+ * reserve_path makes the buffer of the saved path of a session at least size
+ * bytes big, keeping its contents. It returns 0 if memory runs out.
+ *
+ * session: the session.
+ * size: the number of bytes needed.
+ */
+static int reserve_path(Fs_session *session, size_t size)
+{
+  char *path;
+
+  if (size > session->cwd_path_size)
+  {
+    /* growing by doubling, so deep paths cause few reallocations */
+    if (size < session->cwd_path_size * 2)
+      size = session->cwd_path_size * 2;
+    if (size < 64)
+      size = 64;
+
+    path = pool_alloc(session->state, size);
+    if (path == NULL)
+      return 0;
+
+    if (session->cwd_path != NULL)
+    {
+      memcpy(path, session->cwd_path, session->cwd_path_length);
+      pool_free(session->state, session->cwd_path, session->cwd_path_size);
+    }
+
+    session->cwd_path = path;
+    session->cwd_path_size = size;
+  }
+
+  return 1;
+}
+
+/*
+ * init_session sets up a session with no buffers allocated yet, and adds it to
+ * the sessions of the filesystem.
+ *
+ * session: the session.
+ * state: the state of the filesystem.
+ * cwd: the current directory to start in.
+ */
+static void init_session(Fs_session *session, struct fs_state *state,
+                         Directory *cwd)
+{
+  session->cwd = cwd;
+  session->state = state;
+  session->path_cache = NULL;
+  session->scratch = NULL;
+  session->scratch_size = 0;
+  session->cwd_path = NULL;
+  session->cwd_path_length = 0;
+  session->cwd_path_size = 0;
+  session->cwd_path_dir = NULL;
+  session->cwd_path_generation = 0;
+  session->pinned = cwd;
+  session->epoch = 0;
+  session->generation = 0;
+  session->stale = 0;
+  session->stale_generation = 0;
+  session->parent = NULL;
+  session->hint = NULL;
+  session->hint_generation = 0;
+  session->started = 0;
+  session->exclusive = 0;
+  session->views = NULL;
+
+  MUTEX_LOCK(&state->epoch_lock);
+  session->next = state->sessions;
+  state->sessions = session;
+  MUTEX_UNLOCK(&state->epoch_lock);
+}
+
+/*
+ * close_session removes a session from the sessions of the filesystem and
+ * gives its buffers back to the pool.
+ *
+ * session: the session.
+ */
+static void close_session(Fs_session *session)
+{
+  Fs_session **link;
+
+  MUTEX_LOCK(&session->state->epoch_lock);
+  for (link = &session->state->sessions; *link != session;
+       link = &(*link)->next)
+    ;
+  *link = session->next;
+  MUTEX_UNLOCK(&session->state->epoch_lock);
+
+  if (session->path_cache != NULL)
+    pool_free(session->state, session->path_cache,
+              PATH_CACHE_SLOTS * sizeof(*session->path_cache));
+  if (session->scratch != NULL)
+    pool_free(session->state, session->scratch, session->scratch_size);
+  if (session->cwd_path != NULL)
+    pool_free(session->state, session->cwd_path, session->cwd_path_size);
+}
+
+/*
+ * save_image saves the tree of a filesystem into a snapshot image file. It
+ * returns 1 if the image was written and flushed to disk, and 0 otherwise.
+ * Directories sharing the entries of others get copies of their own first,
+ * and no command runs while the image is written.
+ *
+ * The image is written under a temporary name and renamed into place, so a
+ * crash leaves the old file whole, and a filesystem loaded from the old file
+ * keeps the pages it has mapped from it.
+ *
+ * state: the state of the filesystem.
+ * path: the name of the image file, which is replaced if it exists.
+ */
+static int save_image(struct fs_state *state, const char path[])
+{
+  int result = 0, fd;
+  Image_header header;
+  char *image, *temporary;
+
+  temporary = malloc(strlen(path) + sizeof(".tmp"));
+  if (temporary == NULL)
+    return 0;
+  sprintf(temporary, "%s.tmp", path);
+
+  /* the image holds copies of everything directories share */
+  WRITE_LOCK(&state->clone_lock);
+
+  if (state->shared == 0 || copy_subtree(state->root, state->root))
+  {
+    image_layout(state->root, &header);
+    header.sequence = state->sequence;
+
+    fd = open(temporary, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd >= 0)
+    {
+      /* the file is filled in place, starting out as all zero bytes */
+      if (ftruncate(fd, header.size) == 0)
+      {
+        image = mmap(NULL, header.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0);
+        if (image != MAP_FAILED)
+        {
+          result = image_write(state->root, &header, image);
+          if (munmap(image, header.size) != 0 || fsync(fd) != 0)
+            result = 0;
+        }
+      }
+
+      if (close(fd) != 0)
+        result = 0;
+
+      if (result && (rename(temporary, path) != 0 || !sync_directory(path)))
+        result = 0;
+      if (!result)
+        unlink(temporary);
+    }
+  }
+
+  UNLOCK(&state->clone_lock);
+
+  free(temporary);
+
+  return result;
+}
+
+/*
+ * image_layout works out the sections of the snapshot image of the tree under
+ * a root directory, filling in the header of the image.
+ *
+ * root: the root directory.
+ * header: the header to fill in.
+ */
+static void image_layout(Directory *root, Image_header *header)
+{
+  Directory *curr = root;
+  File *curr_file;
+  Name *name;
+  unsigned long names = 0, tables = 0, data = 0, offset, count, i;
+  int s;
+
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, IMAGE_MAGIC, sizeof(header->magic));
+  header->layout[0] = sizeof(void *);
+  header->layout[1] = sizeof(Directory);
+  header->layout[2] = sizeof(File);
+  header->layout[3] = sizeof(Index_entry);
+  header->layout[4] = sizeof(struct fs_state);
+  header->layout[5] = sizeof(struct name_index);
+  header->layout[6] = DATA_CHUNK_SIZE;
+  header->layout[7] = sizeof(Inode);
+  header->layout[8] = sizeof(Handle);
+  header->base = IMAGE_BASE;
+
+  /* going through the tree in preorder, without recursion */
+  while (curr != NULL)
+  {
+    header->directory_count++;
+
+    count = 0;
+    for (curr_file = curr->f_head; curr_file != NULL;
+         curr_file = curr_file->next)
+    {
+      count++;
+
+      /* a file with several names is counted under its first */
+      if (curr_file == curr_file->inode->file)
+      {
+        header->inode_count++;
+        data += image_data(curr_file->inode->data, NULL, 0, 0);
+      }
+    }
+    header->file_count += count;
+
+    if (curr->count >= INDEX_THRESHOLD)
+    {
+      header->index_count++;
+      header->entry_count += curr->count;
+#if !defined(FS_SIM_COMPACT)
+      tables += index_table_size(curr->count) * sizeof(Index_entry *);
+      tables += (INDEX_SAMPLES(count) + 1 +
+                 INDEX_SAMPLES(curr->count - count) + 1) *
+                sizeof(Index_sample);
+#else
+      tables += INDEX_BLOCKS(curr->count) * sizeof(Index_block);
+#endif
+    }
+
+    if (curr->sub != NULL)
+      curr = curr->sub;
+    else
+    {
+      while (curr != root && curr->next == NULL)
+        curr = curr->parent;
+      curr = curr != root ? curr->next : NULL;
+    }
+  }
+
+  /* every shard gets as many buckets as the biggest one needs */
+  header->bucket_count = NAME_INITIAL_SIZE;
+  for (s = 0; s < NAME_SHARDS; s++)
+  {
+    count = 0;
+    for (i = 0; i < root->state->names[s].size; i++)
+    {
+      for (name = root->state->names[s].buckets[i]; name != NULL;
+           name = name->next)
+      {
+        names += IMAGE_NAME_SIZE(strlen((char *) (name + 1)));
+        count++;
+      }
+    }
+
+    header->name_count += count;
+    while (header->bucket_count < count)
+      header->bucket_count *= 2;
+  }
+
+  offset = IMAGE_ALIGN(sizeof(*header));
+  header->state = offset;
+  offset = IMAGE_ALIGN(offset + sizeof(struct fs_state));
+  header->directories = offset;
+  offset = IMAGE_ALIGN(offset + header->directory_count * sizeof(Directory));
+  header->files = offset;
+  offset = IMAGE_ALIGN(offset + header->file_count * sizeof(File));
+  header->inodes = offset;
+  offset = IMAGE_ALIGN(offset + header->inode_count * sizeof(Inode));
+  header->handles = offset;
+  header->handle_count = root->state->handle_count;
+  offset = IMAGE_ALIGN(offset + header->handle_count * sizeof(Handle));
+  header->indexes = offset;
+  offset = IMAGE_ALIGN(offset +
+                       header->index_count * sizeof(struct name_index));
+  header->entries = offset;
+  offset = IMAGE_ALIGN(offset + header->entry_count * sizeof(Index_entry));
+  header->tables = offset;
+  offset = IMAGE_ALIGN(offset + tables);
+  header->buckets = offset;
+  offset = IMAGE_ALIGN(offset + NAME_SHARDS * header->bucket_count *
+                                sizeof(Name *));
+  header->names = offset;
+  header->data = IMAGE_ALIGN(offset + names);
+  header->size = header->data + data;
+}
+
+/*
+ * image_write writes the snapshot image of the tree under a root directory
+ * into a zero-filled buffer laid out by image_layout. It returns 0 if memory
+ * runs out.
+ *
+ * The directories are written in breadth-first order, so the subdirectories
+ * of each directory take consecutive slots, and so do its files. The slot of
+ * a directory is known when its parent is written, which is when the links
+ * between it and its parent and siblings are filled in; the rest of it is
+ * filled in when its own turn comes.
+ *
+ * root: the root directory.
+ * header: the header of the image.
+ * image: the buffer.
+ */
+static int image_write(Directory *root, const Image_header *header,
+                       char *image)
+{
+  Directory **queue = malloc(header->directory_count * sizeof(*queue));
+  Directory *curr, *sub, *record, *directories;
+  File *curr_file, *file_record, *files;
+  Inode *inode_record, *inodes;
+  Handle *handles, *slot;
+  struct fs_state *state = root->state, *state_record;
+  struct name_index *index;
+  Index_entry *entry;
+  unsigned long *starts[NAME_SHARDS], base = header->base, buckets = 0;
+  unsigned long next_directory = 1, next_file = 0, next_index = 0;
+  unsigned long next_entry = 0, first_directory, first_file, i;
+  unsigned long next_data = header->data, next_inode = 0;
+  int s;
+  unsigned long tables = header->tables;
+#if !defined(FS_SIM_COMPACT)
+  Index_entry **table;
+  Index_sample *samples;
+  unsigned long size, bucket, count, j;
+  int t;
+#else
+  Index_block *blocks;
+  unsigned long b;
+#endif
+
+  for (s = 0; s < NAME_SHARDS; s++)
+    buckets += state->names[s].size;
+  starts[0] = malloc((buckets + 1) * sizeof(*starts[0]));
+  if (queue == NULL || starts[0] == NULL)
+  {
+    free(queue);
+    free(starts[0]);
+    return 0;
+  }
+
+  for (s = 1; s < NAME_SHARDS; s++)
+    starts[s] = starts[s - 1] + state->names[s - 1].size;
+
+  memcpy(image, header, sizeof(*header));
+  image_names(state, image, starts);
+  directories = (Directory *) (image + header->directories);
+  files = (File *) (image + header->files);
+  inodes = (Inode *) (image + header->inodes);
+  handles = (Handle *) (image + header->handles);
+  state_record = (struct fs_state *) (image + header->state);
+  queue[0] = root;
+
+  for (i = 0; i < header->directory_count; i++)
+  {
+    curr = queue[i];
+    record = &directories[i];
+
+    if (curr->name != NULL)
+      record->name = image_name(state, image, starts, curr->name);
+    record->state = IMAGE_POINTER(base, header->state);
+    record->count = curr->count;
+    record->id = curr->id;
+    record->usage = curr->usage;
+    record->quota = curr->quota;
+    handles[curr->id].directory =
+      IMAGE_POINTER(base, header->directories + i * sizeof(Directory));
+
+    first_directory = next_directory;
+    for (sub = curr->sub; sub != NULL; sub = sub->next, next_directory++)
+    {
+      queue[next_directory] = sub;
+      directories[next_directory].parent =
+        IMAGE_POINTER(base, header->directories + i * sizeof(Directory));
+      if (sub->prev != NULL)
+        directories[next_directory].prev =
+          IMAGE_POINTER(base, header->directories +
+                        (next_directory - 1) * sizeof(Directory));
+      if (sub->next != NULL)
+        directories[next_directory].next =
+          IMAGE_POINTER(base, header->directories +
+                        (next_directory + 1) * sizeof(Directory));
+    }
+    if (next_directory > first_directory)
+    {
+      record->sub = IMAGE_POINTER(base, header->directories +
+                                  first_directory * sizeof(Directory));
+      record->sub_tail = IMAGE_POINTER(base, header->directories +
+                                       (next_directory - 1) *
+                                       sizeof(Directory));
+    }
+
+    first_file = next_file;
+    for (curr_file = curr->f_head; curr_file != NULL;
+         curr_file = curr_file->next, next_file++)
+    {
+      file_record = &files[next_file];
+      file_record->name = image_name(state, image, starts, curr_file->name);
+      file_record->parent =
+        IMAGE_POINTER(base, header->directories + i * sizeof(Directory));
+
+      /* the inode is written when the first of the names is */
+      slot = &handles[curr_file->inode->id];
+      if (slot->inode == NULL)
+      {
+        inode_record = &inodes[next_inode];
+        inode_record->id = curr_file->inode->id;
+        if (curr_file->inode->data != NULL)
+        {
+          inode_record->data = IMAGE_POINTER(base, next_data);
+          next_data += image_data(curr_file->inode->data, image, base,
+                                  next_data);
+        }
+        slot->inode = IMAGE_POINTER(base, header->inodes +
+                                    next_inode * sizeof(Inode));
+        next_inode++;
+      }
+      else
+        inode_record = (Inode *) (image + ((unsigned long) slot->inode -
+                                           base));
+
+      file_record->inode = slot->inode;
+      file_record->link = inode_record->file;
+      inode_record->file = IMAGE_POINTER(base, header->files +
+                                         next_file * sizeof(File));
+      if (++inode_record->links == 2)
+        state_record->linked++;
+      if (curr_file->prev != NULL)
+        file_record->prev = IMAGE_POINTER(base, header->files +
+                                          (next_file - 1) * sizeof(File));
+      if (curr_file->next != NULL)
+        file_record->next = IMAGE_POINTER(base, header->files +
+                                          (next_file + 1) * sizeof(File));
+    }
+    if (next_file > first_file)
+    {
+      record->f_head = IMAGE_POINTER(base, header->files +
+                                     first_file * sizeof(File));
+      record->f_tail = IMAGE_POINTER(base, header->files +
+                                     (next_file - 1) * sizeof(File));
+    }
+
+    /* a big directory gets a name index holding all of its entries */
+    if (curr->count >= INDEX_THRESHOLD)
+    {
+      index = (struct name_index *) (image + header->indexes) + next_index;
+      index->state = IMAGE_POINTER(base, header->state);
+      record->index = IMAGE_POINTER(base, header->indexes +
+                                    next_index * sizeof(*index));
+      next_index++;
+
+#if defined(FS_SIM_COMPACT)
+      /*
+       * the entries are saved in one run, with the two lists merged in
+       * order, and cut into full blocks
+       */
+      index->blocks = IMAGE_POINTER(base, tables);
+      index->block_count = INDEX_BLOCKS(curr->count);
+      index->block_size = index->block_count;
+      blocks = (Index_block *) (image + tables);
+      tables += index->block_count * sizeof(*blocks);
+
+      for (b = 0; b < index->block_count; b++)
+      {
+        blocks[b].entries = IMAGE_POINTER(base, header->entries +
+                                          (next_entry + b *
+                                           INDEX_BLOCK_SIZE) *
+                                          sizeof(*entry));
+        blocks[b].count = b + 1 < index->block_count
+                          ? INDEX_BLOCK_SIZE
+                          : curr->count - b * INDEX_BLOCK_SIZE;
+        blocks[b].size = blocks[b].count;
+      }
+
+      for (sub = curr->sub, curr_file = curr->f_head;
+           sub != NULL || curr_file != NULL; next_entry++)
+      {
+        entry = (Index_entry *) (image + header->entries) + next_entry;
+        if (curr_file != NULL &&
+            (sub == NULL || strcmp(curr_file->name, sub->name) < 0))
+        {
+          index_fill(entry, IMAGE_POINTER(base, header->files +
+                                          (first_file++) * sizeof(File)),
+                     0, curr_file->name);
+          curr_file = curr_file->next;
+        }
+        else
+        {
+          index_fill(entry, IMAGE_POINTER(base, header->directories +
+                                          (first_directory++) *
+                                          sizeof(Directory)),
+                     1, sub->name);
+          sub = sub->next;
+        }
+      }
+#else
+      size = index_table_size(curr->count);
+      index->table[0] = IMAGE_POINTER(base, tables);
+      index->size[0] = size;
+      index->used[0] = curr->count;
+      index->rehash = -1;
+      table = (Index_entry **) (image + tables);
+      tables += size * sizeof(*table);
+
+      /* every INDEX_SAMPLE_GAP-th file and sub directory is sampled */
+      for (t = 0; t < 2; t++)
+      {
+        count = t ? next_directory - first_directory : next_file - first_file;
+        samples = (Index_sample *) (image + tables);
+        index->samples[t] = IMAGE_POINTER(base, tables);
+        index->sample_count[t] = INDEX_SAMPLES(count);
+        index->sample_size[t] = INDEX_SAMPLES(count) + 1;
+        tables += index->sample_size[t] * sizeof(*samples);
+
+        for (j = 0; j < index->sample_count[t]; j++)
+        {
+          samples[j].node =
+            t ? IMAGE_POINTER(base, header->directories +
+                              (first_directory + j * INDEX_SAMPLE_GAP) *
+                              sizeof(Directory))
+              : IMAGE_POINTER(base, header->files +
+                              (first_file + j * INDEX_SAMPLE_GAP) *
+                              sizeof(File));
+          samples[j].count = count - j * INDEX_SAMPLE_GAP < INDEX_SAMPLE_GAP
+                             ? count - j * INDEX_SAMPLE_GAP : INDEX_SAMPLE_GAP;
+        }
+      }
+
+      for (sub = curr->sub, curr_file = curr->f_head;
+           sub != NULL || curr_file != NULL; next_entry++)
+      {
+        entry = (Index_entry *) (image + header->entries) + next_entry;
+        if (curr_file != NULL)
+        {
+          entry->hash = NAME_HASH(curr_file->name);
+          entry->node = IMAGE_POINTER(base, header->files +
+                                      (first_file++) * sizeof(File));
+          curr_file = curr_file->next;
+        }
+        else
+        {
+          entry->hash = NAME_HASH(sub->name);
+          entry->is_dir = 1;
+          entry->node = IMAGE_POINTER(base, header->directories +
+                                      (first_directory++) *
+                                      sizeof(Directory));
+          sub = sub->next;
+        }
+
+        bucket = entry->hash & (size - 1);
+        entry->next = table[bucket];
+        table[bucket] = IMAGE_POINTER(base, header->entries +
+                                      next_entry * sizeof(*entry));
+      }
+#endif
+    }
+  }
+
+  /* the slots of nothing saved go on the free list, the lowest first */
+  MUTEX_LOCK(&state->handle_lock);
+  for (i = header->handle_count - 1; i > 0; i--)
+  {
+    handles[i].serial = state->handles[i].serial;
+    if (handles[i].directory == NULL && handles[i].inode == NULL)
+    {
+      handles[i].next = state_record->free_handle;
+      state_record->free_handle = i;
+    }
+  }
+  MUTEX_UNLOCK(&state->handle_lock);
+  state_record->handles = IMAGE_POINTER(base, header->handles);
+  state_record->handle_size = header->handle_count;
+  state_record->handle_count = header->handle_count;
+
+  free(queue);
+  free(starts[0]);
+
+  return 1;
+}
+
+/*
+ * image_data works out how many bytes the contents of a file take in a
+ * snapshot image, and writes them into the image at an offset if it is given
+ * one: the file data, its table of chunks and every chunk it holds, each held
+ * by that file alone. It returns the number of bytes.
+ *
+ * data: the file data, which may be NULL.
+ * image: the image, or NULL to only work out the number of bytes.
+ * base: the base address of the image.
+ * offset: the offset to write at.
+ */
+static unsigned long image_data(const struct file_data *data, char *image,
+                                unsigned long base, unsigned long offset)
+{
+  unsigned long size, slot, next;
+  struct file_data *record;
+  Data_chunk **table, *chunk;
+
+  if (data == NULL)
+    return 0;
+
+  size = DATA_BLOCK_SIZE(data->capacity) + data->slots * sizeof(*table);
+  for (slot = 0; slot < data->slots; slot++)
+    if (data->chunks[slot] != NULL)
+      size += CHUNK_BLOCK_SIZE;
+
+  if (image != NULL)
+  {
+    record = (struct file_data *) (image + offset);
+    memcpy(record, data, DATA_BLOCK_SIZE(data->capacity));
+    next = offset + DATA_BLOCK_SIZE(data->capacity);
+
+    if (data->slots > 0)
+    {
+      record->chunks = IMAGE_POINTER(base, next);
+      table = (Data_chunk **) (image + next);
+      next += data->slots * sizeof(*table);
+
+      for (slot = 0; slot < data->slots; slot++)
+      {
+        if (data->chunks[slot] != NULL)
+        {
+          table[slot] = IMAGE_POINTER(base, next);
+          chunk = (Data_chunk *) (image + next);
+          chunk->references = 1;
+          memcpy(CHUNK_BYTES(chunk), CHUNK_BYTES(data->chunks[slot]),
+                 DATA_CHUNK_SIZE);
+          next += CHUNK_BLOCK_SIZE;
+        }
+      }
+    }
+  }
+
+  return size;
+}
+
+/*
+ * image_names writes the name table of a filesystem into a snapshot image
+ * laid out by image_layout, with every name held by nothing yet, and saves
+ * where the names of each bucket of the table were written. The names of a
+ * bucket are written one after another.
+ *
+ * state: the state of the filesystem.
+ * image: the image.
+ * starts: where the offsets of the names of each bucket of each shard are
+ *         saved.
+ */
+static void image_names(struct fs_state *state, char *image,
+                        unsigned long *starts[])
+{
+  const Image_header *header = (const Image_header *) image;
+  Name_shard *shards = ((struct fs_state *) (image + header->state))->names;
+  Name **buckets, **bucket, *curr, *record;
+  unsigned long base = header->base, offset = header->names, i;
+  int s;
+
+  for (s = 0; s < NAME_SHARDS; s++)
+  {
+    buckets = (Name **) (image + header->buckets) + s * header->bucket_count;
+    shards[s].buckets = IMAGE_POINTER(base, header->buckets +
+                                      s * header->bucket_count *
+                                      sizeof(Name *));
+    shards[s].size = header->bucket_count;
+
+    for (i = 0; i < state->names[s].size; i++)
+    {
+      starts[s][i] = offset;
+      for (curr = state->names[s].buckets[i]; curr != NULL; curr = curr->next)
+      {
+        record = (Name *) (image + offset);
+        strcpy((char *) (record + 1), (char *) (curr + 1));
+        record->hash = curr->hash;
+        bucket = &buckets[(curr->hash / NAME_SHARDS) &
+                          (header->bucket_count - 1)];
+        record->next = *bucket;
+        *bucket = IMAGE_POINTER(base, offset);
+        offset += IMAGE_NAME_SIZE(strlen((char *) (curr + 1)));
+      }
+    }
+  }
+}
+
+/*
+ * image_name returns the pointer a name written into a snapshot image by
+ * image_names has once the image is mapped at its base address, and counts
+ * one more file or directory of the image holding it.
+ *
+ * state: the state of the filesystem.
+ * image: the image.
+ * starts: where the names of each bucket were written, as saved by
+ *         image_names.
+ * name: the name, as saved in the name table of the filesystem.
+ */
+static char *image_name(struct fs_state *state, char *image,
+                        unsigned long *starts[], const char name[])
+{
+  const Image_header *header = (const Image_header *) image;
+  const Name *record = NAME_RECORD(name), *curr;
+  Name_shard *shard = NAME_SHARD(state, record->hash);
+  Name_shard *saved = NAME_SHARD((struct fs_state *) (image + header->state),
+                                 record->hash);
+  unsigned long offset;
+  Name *saved_record;
+
+  /* counting the names written before it from the start of its bucket */
+  offset = starts[shard - state->names][(record->hash / NAME_SHARDS) &
+                                        (shard->size - 1)];
+  for (curr = *NAME_BUCKET(shard, record->hash); curr != record;
+       curr = curr->next)
+    offset += IMAGE_NAME_SIZE(strlen((const char *) (curr + 1)));
+
+  saved_record = (Name *) (image + offset);
+  if (saved_record->references++ > 0)
+    saved->bytes_saved += strlen(name) + 1;
+  else
+    saved->names++;
+  saved->references++;
+
+  return IMAGE_POINTER(header->base, offset + sizeof(Name));
+}
+
+/*
+ * relocate moves a pointer of a snapshot image that was not mapped at its base
+ * address by the distance between the two.
+ *
+ * pointer: the pointer, which is left alone if it is NULL.
+ * delta: the address the image was mapped at minus its base address.
+ */
+static void *relocate(void *pointer, unsigned long delta)
+{
+  return pointer != NULL ? (void *) ((unsigned long) pointer + delta) : NULL;
+}
+
+/*
+ * image_open sets up a filesystem in a snapshot image mapped into memory,
+ * returning its state. If the image was not mapped at its base address, the
+ * pointers of all of its directories, files, inodes, handles and name indexes
+ * are relocated first; otherwise nothing but the state is written.
+ *
+ * image: the image.
+ * size: the size of the image.
+ */
+static struct fs_state *image_open(char *image, size_t size)
+{
+  Image_header *header = (Image_header *) image;
+  struct fs_state *state = (struct fs_state *) (image + header->state);
+  Directory *directories = (Directory *) (image + header->directories);
+  File *files = (File *) (image + header->files);
+  Inode *inodes = (Inode *) (image + header->inodes);
+  Handle *handles = (Handle *) (image + header->handles);
+  struct name_index *indexes = (struct name_index *) (image +
+                                                      header->indexes);
+  Index_entry *entries = (Index_entry *) (image + header->entries);
+  Name **buckets = (Name **) (image + header->buckets), *name;
+  Name_shard names[NAME_SHARDS];
+  struct file_data *data;
+  unsigned long slot, free_handle, linked;
+  unsigned long delta = (unsigned long) image - header->base, i, j, offset;
+#if !defined(FS_SIM_COMPACT)
+  int t;
+#endif
+
+  if (delta != 0)
+  {
+    for (i = 0; i < header->directory_count; i++)
+    {
+      directories[i].name = relocate(directories[i].name, delta);
+      directories[i].parent = relocate(directories[i].parent, delta);
+      directories[i].sub = relocate(directories[i].sub, delta);
+      directories[i].next = relocate(directories[i].next, delta);
+      directories[i].f_head = relocate(directories[i].f_head, delta);
+      directories[i].prev = relocate(directories[i].prev, delta);
+      directories[i].sub_tail = relocate(directories[i].sub_tail, delta);
+      directories[i].f_tail = relocate(directories[i].f_tail, delta);
+      directories[i].index = relocate(directories[i].index, delta);
+      directories[i].state = relocate(directories[i].state, delta);
+    }
+
+    for (i = 0; i < header->file_count; i++)
+    {
+      files[i].name = relocate(files[i].name, delta);
+      files[i].next = relocate(files[i].next, delta);
+      files[i].prev = relocate(files[i].prev, delta);
+      files[i].inode = relocate(files[i].inode, delta);
+      files[i].parent = relocate(files[i].parent, delta);
+      files[i].link = relocate(files[i].link, delta);
+    }
+
+    for (i = 0; i < header->inode_count; i++)
+    {
+      inodes[i].data = relocate(inodes[i].data, delta);
+      inodes[i].file = relocate(inodes[i].file, delta);
+
+      data = inodes[i].data;
+      if (data != NULL && data->slots > 0)
+      {
+        data->chunks = relocate(data->chunks, delta);
+        for (slot = 0; slot < data->slots; slot++)
+          data->chunks[slot] = relocate(data->chunks[slot], delta);
+      }
+    }
+
+    for (i = 0; i < header->handle_count; i++)
+    {
+      handles[i].directory = relocate(handles[i].directory, delta);
+      handles[i].inode = relocate(handles[i].inode, delta);
+    }
+
+    for (i = 0; i < header->index_count; i++)
+    {
+      indexes[i].state = relocate(indexes[i].state, delta);
+#if defined(FS_SIM_COMPACT)
+      indexes[i].blocks = relocate(indexes[i].blocks, delta);
+      for (j = 0; j < indexes[i].block_count; j++)
+        indexes[i].blocks[j].entries = relocate(indexes[i].blocks[j].entries,
+                                                delta);
+#else
+      indexes[i].table[0] = relocate(indexes[i].table[0], delta);
+      for (j = 0; j < indexes[i].size[0]; j++)
+        indexes[i].table[0][j] = relocate(indexes[i].table[0][j], delta);
+      for (t = 0; t < 2; t++)
+      {
+        indexes[i].samples[t] = relocate(indexes[i].samples[t], delta);
+        for (j = 0; j < indexes[i].sample_count[t]; j++)
+          indexes[i].samples[t][j].node =
+            relocate(indexes[i].samples[t][j].node, delta);
+      }
+#endif
+    }
+
+    for (i = 0; i < header->entry_count; i++)
+    {
+      entries[i].node = relocate(entries[i].node, delta);
+#if !defined(FS_SIM_COMPACT)
+      entries[i].next = relocate(entries[i].next, delta);
+#endif
+    }
+
+    for (i = 0; i < NAME_SHARDS * header->bucket_count; i++)
+      buckets[i] = relocate(buckets[i], delta);
+
+    for (i = 0, offset = header->names; i < header->name_count; i++)
+    {
+      name = (Name *) (image + offset);
+      name->next = relocate(name->next, delta);
+      offset += IMAGE_NAME_SIZE(strlen((char *) (name + 1)));
+    }
+  }
+
+  /* the shards of the name table outlive pool_init */
+  for (i = 0; i < NAME_SHARDS; i++)
+  {
+    names[i].buckets = relocate(state->names[i].buckets, delta);
+    names[i].size = state->names[i].size;
+    names[i].names = state->names[i].names;
+    names[i].references = state->names[i].references;
+    names[i].bytes_saved = state->names[i].bytes_saved;
+  }
+  free_handle = state->free_handle;
+  linked = state->linked;
+
+#if defined(FS_SIM_THREADS)
+  for (i = 0; i < header->directory_count; i++)
+    INIT_LOCK(&directories[i].lock);
+#endif
+
+  pool_init(state);
+  for (i = 0; i < NAME_SHARDS; i++)
+  {
+    state->names[i].buckets = names[i].buckets;
+    state->names[i].size = names[i].size;
+    state->names[i].names = names[i].names;
+    state->names[i].references = names[i].references;
+    state->names[i].bytes_saved = names[i].bytes_saved;
+  }
+  state->handles = handles;
+  state->handle_size = header->handle_count;
+  state->handle_count = header->handle_count;
+  state->free_handle = free_handle;
+  state->linked = linked;
+  state->sequence = header->sequence;
+  state->image = image;
+  state->image_size = size;
+  state->memory.system_allocations = 0;
+  state->memory.bytes_reserved = size;
+  state->root = &directories[0];
+  state->main.cwd = state->root;
+  state->main.pinned = state->root;
+
+  return state;
+}
+
+/*
+ * image_valid returns 1 if the header of a file is that of a snapshot image
+ * written by the same build, and its sections fit in the file, and 0 if not.
+ *
+ * header: the header.
+ * size: the size of the file.
+ */
+static int image_valid(const Image_header *header, unsigned long size)
+{
+  return !memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) &&
+         header->layout[0] == sizeof(void *) &&
+         header->layout[1] == sizeof(Directory) &&
+         header->layout[2] == sizeof(File) &&
+         header->layout[3] == sizeof(Index_entry) &&
+         header->layout[4] == sizeof(struct fs_state) &&
+         header->layout[5] == sizeof(struct name_index) &&
+         header->layout[6] == DATA_CHUNK_SIZE &&
+         header->layout[7] == sizeof(Inode) &&
+         header->layout[8] == sizeof(Handle) &&
+         header->size == size && header->directory_count > 0 &&
+         header->handle_count > header->directory_count &&
+         header->state >= sizeof(*header) &&
+         header->directories >= header->state + sizeof(struct fs_state) &&
+         header->files >= header->directories +
+                          header->directory_count * sizeof(Directory) &&
+         header->inodes >= header->files +
+                           header->file_count * sizeof(File) &&
+         header->handles >= header->inodes +
+                            header->inode_count * sizeof(Inode) &&
+         header->indexes >= header->handles +
+                            header->handle_count * sizeof(Handle) &&
+         header->entries >= header->indexes +
+                            header->index_count * sizeof(struct name_index) &&
+         header->tables >= header->entries +
+                           header->entry_count * sizeof(Index_entry) &&
+         header->buckets >= header->tables && header->bucket_count > 0 &&
+         (header->bucket_count & (header->bucket_count - 1)) == 0 &&
+         header->names >= header->buckets +
+                          NAME_SHARDS * header->bucket_count *
+                          sizeof(Name *) &&
+         header->data >= header->names && header->data <= size;
+}
+
+/*
+ * journal_append appends a record for a successful touch, mkdir, rm, cp, mv
+ * or ln to the buffer of the journal of a filesystem, if it has one. The
+ * record names the target by its full path, worked out by going up from the
+ * directory it is in, and a cp, mv or ln record names the source before it,
+ * the two paths separated by a null byte. Nothing is appended if either
+ * directory, or any above it, was removed, since the change can then never be
+ * seen. The command then calls journal_commit_due, which writes the record
+ * out with the next group.
+ *
+ * state: the state of the filesystem.
+ * op: JOURNAL_TOUCH, JOURNAL_MKDIR, JOURNAL_RM, JOURNAL_CP, JOURNAL_MV or
+ *     JOURNAL_LINK.
+ * directory: the directory the target is in.
+ * name: the name of the target.
+ * source: the directory the source of cp, mv or ln is in, or NULL for the
+ *         others.
+ * source_name: the name of the source of cp, mv or ln.
+ */
+static void journal_append(struct fs_state *state, int op,
+                           Directory *directory, const char name[],
+                           Directory *source, const char source_name[])
+{
+  struct journal *journal = state->journal;
+  size_t length, source_length = 0, total, start;
+  char *record, *end;
+
+  if (journal == NULL)
+    return;
+
+  MUTEX_LOCK(&state->epoch_lock);
+
+  length = journal_path_length(directory, name);
+  if (source != NULL)
+    source_length = journal_path_length(source, source_name);
+  total = source != NULL ? source_length + 1 + length : length;
+
+  if (length > 0 && (source == NULL || source_length > 0))
+  {
+    MUTEX_LOCK(&journal->lock);
+
+    record = journal_record(journal, op, total, &start);
+    if (record != NULL)
+    {
+      end = record + start + total;
+      journal_path(end, directory, name);
+      if (source != NULL)
+      {
+        end -= length + 1;
+        *end = '\0';
+        journal_path(end, source, source_name);
+      }
+
+      journal_seal(state, record, start + total);
+    }
+
+    MUTEX_UNLOCK(&journal->lock);
+  }
+
+  MUTEX_UNLOCK(&state->epoch_lock);
+}
+
+/*
+ * journal_data appends a record for a successful write_file, append_file,
+ * truncate_file or set_quota, or for the part of a write made before memory
+ * ran out, to the buffer of the journal of a filesystem, if it has one, the
+ * way journal_append does for the other commands. The full path of the file
+ * is followed by a null byte and the offset, or the new size, as an 8-byte
+ * little-endian number, and a write record then holds the bytes written. A
+ * set_quota record holds the limit on files in place of the offset, and the
+ * other two limits in place of the bytes.
+ *
+ * state: the state of the filesystem.
+ * op: JOURNAL_WRITE, JOURNAL_TRUNCATE or JOURNAL_QUOTA.
+ * directory: the directory the file is in.
+ * name: the name of the file.
+ * offset: where the bytes were written, or the new size.
+ * bytes: the bytes written.
+ * length: the number of bytes written, which is 0 for truncate_file.
+ */
+static void journal_data(struct fs_state *state, int op, Directory *directory,
+                         const char name[], unsigned long offset,
+                         const char bytes[], size_t length)
+{
+  struct journal *journal = state->journal;
+  size_t path_length, total, start, i;
+  char *record, *end;
+
+  if (journal == NULL)
+    return;
+
+  MUTEX_LOCK(&state->epoch_lock);
+
+  path_length = journal_path_length(directory, name);
+  total = path_length + 1 + 8 + length;
+
+  if (path_length > 0)
+  {
+    MUTEX_LOCK(&journal->lock);
+
+    record = journal_record(journal, op, total, &start);
+    if (record != NULL)
+    {
+      end = record + start + path_length;
+      journal_path(end, directory, name);
+      *end++ = '\0';
+      for (i = 0; i < 8; i++)
+        *end++ = (char) ((offset >> (8 * i)) & 0xff);
+      if (length > 0)
+        memcpy(end, bytes, length);
+
+      journal_seal(state, record, start + total);
+    }
+
+    MUTEX_UNLOCK(&journal->lock);
+  }
+
+  MUTEX_UNLOCK(&state->epoch_lock);
+}
+
+/*
+ * journal_record makes room for a record at the end of the buffer of a
+ * journal, and fills in its op and length. It returns where the record
+ * starts, or NULL if memory ran out, in which case the journal is marked as
+ * having lost a record. It has to be called with the journal mutex locked.
+ *
+ * journal: the journal.
+ * op: the op of the record.
+ * total: the length of what the record holds.
+ * start: set to where what it holds starts in the record.
+ */
+static char *journal_record(struct journal *journal, int op, size_t total,
+                            size_t *start)
+{
+  /* the op, up to 5 bytes of length, what it holds and the checksum */
+  size_t size = 1 + 5 + total + 4, i;
+  char *record;
+
+  if (journal->used + size > journal->size)
+    journal_reserve(journal, journal->used + size);
+
+  if (journal->used + size > journal->size)
+  {
+    journal->failed = 1;
+    return NULL;
+  }
+
+  record = journal->buffer + journal->used;
+  record[0] = (char) op;
+  i = 1;
+  size = total;
+  do
+  {
+    record[i++] = (char) ((size & 0x7f) | (size > 0x7f ? 0x80 : 0));
+    size >>= 7;
+  } while (size > 0);
+
+  *start = i;
+
+  return record;
+}
+
+/*
+ * journal_seal adds the checksum to a record filled in at the end of the
+ * buffer of the journal of a filesystem, and counts it as the next change. It
+ * has to be called with the journal mutex locked.
+ *
+ * state: the state of the filesystem.
+ * record: the record.
+ * length: the length of the record up to the checksum.
+ */
+static void journal_seal(struct fs_state *state, char *record, size_t length)
+{
+  struct journal *journal = state->journal;
+  unsigned long checksum = hash_bytes(record, length);
+  size_t i;
+
+  for (i = 0; i < 4; i++)
+    record[length + i] = (char) ((checksum >> (8 * i)) & 0xff);
+
+  journal->used += length + 4;
+  state->sequence++;
+}
+
+/*
+ * journal_path_length returns the length of the full path of a name in a
+ * directory, or 0 if the directory, or any above it, was removed. It has to
+ * be called with the epoch mutex locked.
+ *
+ * directory: the directory.
+ * name: the name.
+ */
+static size_t journal_path_length(Directory *directory, const char name[])
+{
+  Directory *curr;
+  size_t length = strlen(name) + 1;
+
+  for (curr = directory; curr != NULL && !curr->removed; curr = curr->parent)
+    if (curr->parent != NULL)
+      length += strlen(curr->name) + 1;
+
+  return curr == NULL ? length : 0;
+}
+
+/*
+ * journal_path writes the full path of a name in a directory right before a
+ * given position, filling in the names from the end of the path back to its
+ * start.
+ *
+ * end: where the path ends.
+ * directory: the directory.
+ * name: the name.
+ */
+static void journal_path(char *end, Directory *directory, const char name[])
+{
+  Directory *curr;
+
+  end -= strlen(name);
+  memcpy(end, name, strlen(name));
+  *--end = '/';
+  for (curr = directory; curr->parent != NULL; curr = curr->parent)
+  {
+    end -= strlen(curr->name);
+    memcpy(end, curr->name, strlen(curr->name));
+    *--end = '/';
+  }
+}
+
+/*
+ * journal_reserve makes the buffer of a journal at least size bytes big,
+ * keeping its contents. If memory runs out, the buffer is left as it is.
+ *
+ * journal: the journal.
+ * size: the number of bytes needed.
+ */
+static void journal_reserve(struct journal *journal, size_t size)
+{
+  char *buffer;
+
+  if (size < journal->size * 2)
+    size = journal->size * 2;
+
+  buffer = malloc(size);
+  if (buffer != NULL)
+  {
+    memcpy(buffer, journal->buffer, journal->used);
+    free(journal->buffer);
+    journal->buffer = buffer;
+    journal->size = size;
+  }
+}
+
+/*
+ * journal_commit writes the records buffered by the journal of a filesystem,
+ * if it has one, to its file and flushes the file to disk with a single
+ * fsync, unless every change made so far was written already. It returns once
+ * they all are, so a command calling it after making its change gets it on
+ * disk before it returns. It returns 0 if records were lost, and 1 otherwise.
+ *
+ * Commands calling it while a group is being written wait for it, adding
+ * their records to the other buffer meanwhile; the first to go on then writes
+ * all of them as the next group, and the others find theirs written. A group
+ * that cannot be written is cut off the file, so the groups before it can
+ * still be replayed, and the journal is taken as failed from then on.
+ *
+ * A journal that has grown past its limit is compacted afterwards, but only
+ * while no session other than the main one is open, since nothing may change
+ * the filesystem while it is being saved.
+ *
+ * state: the state of the filesystem.
+ */
+static int journal_commit(struct fs_state *state)
+{
+  struct journal *journal = state->journal;
+  unsigned long wanted, sequence = 0;
+  char *buffer;
+  size_t size, used = 0;
+  int result, full = 0, written = 1;
+
+  if (journal == NULL)
+    return 1;
+
+  MUTEX_LOCK(&journal->lock);
+  wanted = state->sequence;
+  MUTEX_UNLOCK(&journal->lock);
+
+  MUTEX_LOCK(&journal->commit_lock);
+
+  /* the group written while this one waited may have held its records */
+  if (journal->synced < wanted)
+  {
+    MUTEX_LOCK(&journal->lock);
+    if (!journal->failed)
+    {
+      buffer = journal->buffer;
+      size = journal->size;
+      used = journal->used;
+      journal->buffer = journal->spare;
+      journal->size = journal->spare_size;
+      journal->spare = buffer;
+      journal->spare_size = size;
+      journal->used = 0;
+      sequence = state->sequence;
+    }
+    MUTEX_UNLOCK(&journal->lock);
+
+    if (used > 0)
+    {
+      written = write_all(journal->fd, journal->spare, used) &&
+                fsync(journal->fd) == 0;
+
+      /* later groups must not follow one that may be torn */
+      if (!written)
+      {
+        if (ftruncate(journal->fd, journal->file_size) == 0)
+          lseek(journal->fd, journal->file_size, SEEK_SET);
+      }
+      else
+      {
+        journal->file_size += used;
+        journal->synced = sequence;
+        full = journal->limit > 0 && journal->file_size >= journal->limit;
+      }
+    }
+  }
+
+  MUTEX_LOCK(&journal->lock);
+  if (!written)
+    journal->failed = 1;
+  else if (used > 0)
+    journal->last_group = time(NULL);
+  result = !journal->failed;
+  MUTEX_UNLOCK(&journal->lock);
+
+  MUTEX_UNLOCK(&journal->commit_lock);
+
+  if (full)
+  {
+    MUTEX_LOCK(&state->epoch_lock);
+    full = state->sessions->next == NULL;
+    MUTEX_UNLOCK(&state->epoch_lock);
+
+    if (full)
+      journal_compact(state);
+  }
+
+  return result;
+}
+
+/*
+ * journal_commit_due is called by a command after making its change, and
+ * writes the records buffered by the journal of a filesystem with
+ * journal_commit if enough of them are waiting, or the last group was written
+ * long enough ago, so a command does not pay for a write and an fsync of its
+ * own. It returns 0 if records were lost, and 1 otherwise.
+ *
+ * state: the state of the filesystem.
+ */
+static int journal_commit_due(struct fs_state *state)
+{
+  struct journal *journal = state->journal;
+  int due, result;
+
+  if (journal == NULL)
+    return 1;
+
+  MUTEX_LOCK(&journal->lock);
+  due = journal->used >= JOURNAL_GROUP_SIZE ||
+        difftime(time(NULL), journal->last_group) >= JOURNAL_GROUP_INTERVAL;
+  result = !journal->failed;
+  MUTEX_UNLOCK(&journal->lock);
+
+  if (due)
+    result = journal_commit(state);
+
+  return result;
+}
+
+/*
+ * journal_failed returns 1 if the filesystem has a journal that lost a record
+ * or could not write a group, so no more changes may be made, and 0
+ * otherwise.
+ *
+ * state: the state of the filesystem.
+ */
+static int journal_failed(struct fs_state *state)
+{
+  struct journal *journal = state->journal;
+  int failed = 0;
+
+  if (journal != NULL)
+  {
+    MUTEX_LOCK(&journal->lock);
+    failed = journal->failed;
+    MUTEX_UNLOCK(&journal->lock);
+  }
+
+  return failed;
+}
+
+/*
+ * journal_start starts a new, empty journal file whose first record will have
+ * the sequence number following a given one. The file is written under a
+ * temporary name and renamed into place, so a crash leaves either the old or
+ * the new journal. It returns the file opened for appending, or -1.
+ *
+ * path: the name of the journal file.
+ * sequence: the sequence number of the last change already saved elsewhere.
+ */
+static int journal_start(const char path[], unsigned long sequence)
+{
+  char header[JOURNAL_HEADER_SIZE], *temporary;
+  int fd = -1, i;
+
+  temporary = malloc(strlen(path) + sizeof(".tmp"));
+  if (temporary == NULL)
+    return -1;
+  sprintf(temporary, "%s.tmp", path);
+
+  memcpy(header, JOURNAL_MAGIC, 8);
+  for (i = 0; i < 8; i++)
+    header[8 + i] = (char) (((sequence + 1) >> (8 * i)) & 0xff);
+
+  fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd >= 0)
+  {
+    if (!write_all(fd, header, sizeof(header)) || fsync(fd) != 0 ||
+        rename(temporary, path) != 0 || !sync_directory(path))
+    {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  free(temporary);
+
+  return fd;
+}
+
+/*
+ * journal_replay applies the changes saved in a journal file after the last
+ * one a filesystem holds to it, and cuts off a torn or corrupt tail left by a
+ * crash. The sequence number of the filesystem is advanced past the changes
+ * applied. It returns 0 if the journal cannot be read or starts after changes
+ * missing from the filesystem, and 1 otherwise.
+ *
+ * files: The pointer used to track the current directory in the filesystem,
+ *        which must be the root.
+ * path: the name of the journal file.
+ */
+static int journal_replay(Fs_sim *files, const char path[])
+{
+  struct fs_state *state = (*files)->state;
+  unsigned long sequence = 0, checksum, stored, position;
+  size_t offset = JOURNAL_HEADER_SIZE, length, end, i, j;
+  char *journal = MAP_FAILED, *name;
+  Fs_usage quota;
+  off_t size = -1;
+  int fd, shift, result = 0;
+
+  fd = open(path, O_RDWR);
+  if (fd >= 0)
+    size = lseek(fd, 0, SEEK_END);
+  if (size >= JOURNAL_HEADER_SIZE)
+    journal = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (journal != MAP_FAILED && !memcmp(journal, JOURNAL_MAGIC, 8))
+  {
+    for (i = 0; i < 8; i++)
+      sequence |= (unsigned long) (unsigned char) journal[8 + i] << (8 * i);
+
+    /* the changes before the first record must all be in the filesystem */
+    result = sequence <= state->sequence + 1;
+
+    while (result && offset < (size_t) size)
+    {
+      /* reading the length of the path, 7 bits at a time */
+      length = 0;
+      shift = 0;
+      for (i = offset + 1; i < (size_t) size && shift < 35; i++, shift += 7)
+      {
+        length |= (size_t) (journal[i] & 0x7f) << shift;
+        if (!(journal[i] & 0x80))
+          break;
+      }
+      i++;
+
+      if (i > (size_t) size || length > (size_t) size - i ||
+          (size_t) size - i - length < 4)
+        break;
+
+      checksum = hash_bytes(journal + offset, i - offset + length);
+      stored = 0;
+      for (j = 0; j < 4; j++)
+        stored |= (unsigned long) (unsigned char) journal[i + length + j]
+                  << (8 * j);
+      if (stored != (checksum & 0xffffffffUL))
+        break;
+
+      /* the records already in the snapshot are skipped */
+      if (sequence > state->sequence)
+      {
+        name = malloc(length + 1);
+        if (name == NULL)
+        {
+          result = 0;
+          break;
+        }
+        memcpy(name, journal + i, length);
+        name[length] = '\0';
+
+        if (journal[offset] == JOURNAL_TOUCH)
+          touch(files, name);
+        else if (journal[offset] == JOURNAL_MKDIR)
+          mkdir(files, name);
+        else if (journal[offset] == JOURNAL_CP)
+        {
+          if (strlen(name) < length)
+            cp(files, name, name + strlen(name) + 1);
+        }
+        else if (journal[offset] == JOURNAL_MV)
+        {
+          if (strlen(name) < length)
+            mv(files, name, name + strlen(name) + 1);
+        }
+        else if (journal[offset] == JOURNAL_LINK)
+        {
+          if (strlen(name) < length)
+            ln(files, name, name + strlen(name) + 1);
+        }
+        else if (journal[offset] == JOURNAL_WRITE ||
+                 journal[offset] == JOURNAL_TRUNCATE)
+        {
+          /* the path is followed by the offset or size, and any bytes */
+          end = strlen(name) + 1;
+          if (end + 8 <= length)
+          {
+            position = 0;
+            for (j = 0; j < 8; j++)
+              position |= (unsigned long) (unsigned char) name[end + j]
+                          << (8 * j);
+
+            if (journal[offset] == JOURNAL_WRITE)
+              write_file(files, name, position, name + end + 8,
+                         length - end - 8);
+            else
+              truncate_file(files, name, position);
+          }
+        }
+        else if (journal[offset] == JOURNAL_QUOTA)
+        {
+          /* the path is followed by the three limits */
+          end = strlen(name) + 1;
+          if (end + 24 <= length)
+          {
+            quota.files = 0;
+            quota.directories = 0;
+            quota.name_bytes = 0;
+            for (j = 0; j < 8; j++)
+            {
+              quota.files |= (unsigned long) (unsigned char) name[end + j]
+                             << (8 * j);
+              quota.directories |=
+                (unsigned long) (unsigned char) name[end + 8 + j] << (8 * j);
+              quota.name_bytes |=
+                (unsigned long) (unsigned char) name[end + 16 + j] << (8 * j);
+            }
+            set_quota(files, name, &quota);
+          }
+        }
+        else
+          rm(files, name);
+
+        free(name);
+        state->sequence = sequence;
+      }
+
+      sequence++;
+      offset = i + length + 4;
+    }
+
+    /* the torn tail of the last group written is cut off */
+    if (result && offset < (size_t) size && ftruncate(fd, offset) != 0)
+      result = 0;
+  }
+
+  if (journal != MAP_FAILED)
+    munmap(journal, size);
+  if (fd >= 0)
+    close(fd);
+
+  return result;
+}
+
+/*
+ * hash_bytes computes the FNV-1a hash of a block of bytes, used as the
+ * checksum of journal records.
+ */
+static unsigned long hash_bytes(const char bytes[], size_t length)
+{
+  unsigned long hash = 2166136261UL;
+  size_t i;
+
+  for (i = 0; i < length; i++)
+  {
+    hash ^= (unsigned char) bytes[i];
+    hash *= 16777619UL;
+  }
+
+  return hash;
+}
+
+/*
+ * write_all writes a whole buffer to a file, going on after partial writes.
+ * It returns 1 if everything was written, and 0 otherwise.
+ */
+static int write_all(int fd, const char buffer[], size_t size)
+{
+  ssize_t written;
+
+  while (size > 0)
+  {
+    written = write(fd, buffer, size);
+    if (written <= 0)
+      return 0;
+
+    buffer += written;
+    size -= written;
+  }
+
+  return 1;
+}
+
+/*
+ * sync_directory flushes the directory holding a file to disk, so a rename
+ * into it survives a crash. It returns 1 on success and 0 otherwise.
+ *
+ * path: the name of the file.
+ */
+static int sync_directory(const char path[])
+{
+  char *directory = malloc(strlen(path) + 2), *last;
+  int fd, result = 0;
+
+  if (directory == NULL)
+    return 0;
+
+  strcpy(directory, path);
+  last = strrchr(directory, '/');
+  if (last == NULL)
+    strcpy(directory, ".");
+  else
+    last[last == directory ? 1 : 0] = '\0';
+
+  fd = open(directory, O_RDONLY);
+  if (fd >= 0)
+  {
+    result = fsync(fd) == 0;
+    close(fd);
+  }
+
+  free(directory);
+
+  return result;
+}
+
+/*
+ * journal_attach attaches a journal file, opened for appending, to a
+ * filesystem, so its changes are saved in it from then on. It returns 0 if
+ * memory runs out, and 1 otherwise.
+ *
+ * state: the state of the filesystem.
+ * fd: the journal file.
+ * path: the name of the journal file.
+ * snapshot: the name of the snapshot image file.
+ */
+static int journal_attach(struct fs_state *state, int fd, const char path[],
+                          const char snapshot[])
+{
+  struct journal *journal = malloc(sizeof(*journal));
+
+  if (journal == NULL)
+    return 0;
+
+  journal->fd = fd;
+  journal->path = malloc(strlen(path) + 1);
+  journal->snapshot = malloc(strlen(snapshot) + 1);
+  journal->buffer = malloc(JOURNAL_BUFFER_SIZE);
+  journal->spare = malloc(JOURNAL_BUFFER_SIZE);
+  journal->used = 0;
+  journal->size = JOURNAL_BUFFER_SIZE;
+  journal->spare_size = JOURNAL_BUFFER_SIZE;
+  journal->file_size = (unsigned long) lseek(fd, 0, SEEK_END);
+  journal->synced = state->sequence;
+  journal->last_group = time(NULL);
+  journal->limit = JOURNAL_LIMIT;
+  journal->failed = 0;
+
+  if (journal->path == NULL || journal->snapshot == NULL ||
+      journal->buffer == NULL || journal->spare == NULL)
+  {
+    free(journal->path);
+    free(journal->snapshot);
+    free(journal->buffer);
+    free(journal->spare);
+    free(journal);
+    return 0;
+  }
+
+  strcpy(journal->path, path);
+  strcpy(journal->snapshot, snapshot);
+  INIT_MUTEX(&journal->lock);
+  INIT_MUTEX(&journal->commit_lock);
+  state->journal = journal;
+
+  return 1;
+}
+
+/*
+ * journal_detach writes the records left in the buffer of the journal of a
+ * filesystem, if it has one, closes the journal file and deallocates the
+ * journal.
+ *
+ * state: the state of the filesystem.
+ */
+static void journal_detach(struct fs_state *state)
+{
+  struct journal *journal = state->journal;
+
+  if (journal != NULL)
+  {
+    journal_commit(state);
+    close(journal->fd);
+    DESTROY_MUTEX(&journal->lock);
+    DESTROY_MUTEX(&journal->commit_lock);
+    free(journal->path);
+    free(journal->snapshot);
+    free(journal->buffer);
+    free(journal->spare);
+    free(journal);
+    state->journal = NULL;
+  }
+}
+
+/*
+ * journal_compact saves a filesystem as its new snapshot image and starts its
+ * journal over. The image is renamed into place by save_image before the
+ * journal is replaced, so a crash at any point leaves a snapshot and a
+ * journal that recover_fs can replay. The records still in
+ * the buffer are already in the snapshot, so they are dropped. It returns 1
+ * if the journal was compacted, and 0 otherwise. No other session may change
+ * the filesystem meanwhile.
+ *
+ * state: the state of the filesystem.
+ */
+static int journal_compact(struct fs_state *state)
+{
+  struct journal *journal = state->journal;
+  int result = 0, fd;
+
+  MUTEX_LOCK(&journal->commit_lock);
+
+  if (save_image(state, journal->snapshot))
+  {
+    fd = journal_start(journal->path, state->sequence);
+    if (fd >= 0)
+    {
+      close(journal->fd);
+      journal->fd = fd;
+      journal->file_size = JOURNAL_HEADER_SIZE;
+
+      MUTEX_LOCK(&journal->lock);
+      journal->used = 0;
+      journal->synced = state->sequence;
+      MUTEX_UNLOCK(&journal->lock);
+
+      result = 1;
+    }
+  }
+
+  MUTEX_UNLOCK(&journal->commit_lock);
+
+  return result;
+}
+
+#if defined(FS_SIM_STATS)
+/*
+ * stats_clock returns the time in nanoseconds from an arbitrary starting
+ * point.
+ */
+static unsigned long stats_clock(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (unsigned long) now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+/*
+ * stats_operation counts a call of a command that has just ended in the
+ * statistics of the filesystem of a session, along with the time it took.
+ *
+ * session: the session the command was run for.
+ * operation: FS_STATS_TOUCH to FS_STATS_RM.
+ * result: what the command returned.
+ */
+static void stats_operation(Fs_session *session, int operation, int result)
+{
+  struct fs_state *state = session->state;
+  unsigned long elapsed = stats_clock() - session->started;
+  int bucket = 0;
+
+  /* the bucket of a latency is the position of its highest bit set */
+  while (elapsed > 1 && bucket < FS_STATS_BUCKETS - 1)
+  {
+    elapsed >>= 1;
+    bucket++;
+  }
+
+  MUTEX_LOCK(&state->stats_lock);
+  state->stats.operations[operation].calls++;
+  if (result == 1)
+    state->stats.operations[operation].successes++;
+  else
+    state->stats.operations[operation].failures++;
+  state->stats.operations[operation].latency[bucket]++;
+  MUTEX_UNLOCK(&state->stats_lock);
+}
+
+/*
+ * stats_names counts a name lookup or insert in the statistics of a
+ * filesystem.
+ *
+ * state: the state of the filesystem.
+ * insert: 1 for an insert and 0 for a lookup.
+ * nodes: the number of list nodes it visited.
+ * compares: the number of names it compared.
+ */
+static void stats_names(struct fs_state *state, int insert,
+                        unsigned long nodes, unsigned long compares)
+{
+  MUTEX_LOCK(&state->stats_lock);
+  if (insert)
+  {
+    state->stats.inserts++;
+    state->stats.insert_nodes += nodes;
+    state->stats.insert_compares += compares;
+  }
+  else
+  {
+    state->stats.lookups++;
+    state->stats.lookup_nodes += nodes;
+    state->stats.lookup_compares += compares;
+  }
+  MUTEX_UNLOCK(&state->stats_lock);
+}
+#endif
+
+/*
+ * pool_create allocates the state of a new filesystem with an empty pool. It
+ * returns NULL if memory runs out.
+ */
+static struct fs_state *pool_create(void)
+{
+  struct fs_state *state = malloc(sizeof(*state));
+
+  if (state != NULL)
+    pool_init(state);
+
+  return state;
+}
+
+/*
+ * pool_init sets up the state of a new filesystem with an empty pool.
+ *
+ * state: the state.
+ */
+static void pool_init(struct fs_state *state)
+{
+  int i;
+
+  state->root = NULL;
+  state->image = NULL;
+  state->image_size = 0;
+  for (i = 0; i < POOL_CLASSES; i++)
+    state->free_blocks[i] = NULL;
+  state->slabs = NULL;
+  state->bump = NULL;
+  state->bump_left = 0;
+  state->large = NULL;
+  state->free_chunks = NULL;
+  state->garbage = NULL;
+  state->garbage_tail = NULL;
+  state->reclaim_at = NULL;
+  state->pinned_garbage = NULL;
+  state->deferred_rm = 0;
+  state->path_generation = 1;
+  state->epoch = 1;
+  state->active[0] = 0;
+  state->active[1] = 0;
+  state->sessions = NULL;
+  state->journal = NULL;
+  state->sequence = 0;
+  memset(&state->stats, 0, sizeof(state->stats));
+  state->shared = 0;
+  state->handles = NULL;
+  state->handle_size = 0;
+  state->handle_count = 1;
+  state->free_handle = 0;
+  state->linked = 0;
+  state->walk_threads = 1;
+#if defined(FS_SIM_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+  state->walk_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (state->walk_threads < 1)
+    state->walk_threads = 1;
+  if (state->walk_threads > WALK_MAX_THREADS)
+    state->walk_threads = WALK_MAX_THREADS;
+#endif
+  INIT_MUTEX(&state->pool_lock);
+  INIT_MUTEX(&state->data_lock);
+  INIT_MUTEX(&state->handle_lock);
+  INIT_MUTEX(&state->garbage_lock);
+  INIT_MUTEX(&state->epoch_lock);
+  INIT_MUTEX(&state->stats_lock);
+  INIT_LOCK(&state->clone_lock);
+#if defined(FS_SIM_THREADS)
+  for (i = 0; i < INODE_LOCKS; i++)
+    INIT_LOCK(&state->inode_locks[i]);
+#endif
+  for (i = 0; i < NAME_SHARDS; i++)
+  {
+    state->names[i].buckets = NULL;
+    state->names[i].size = 0;
+    state->names[i].names = 0;
+    state->names[i].references = 0;
+    state->names[i].bytes_saved = 0;
+    INIT_LOCK(&state->names[i].lock);
+  }
+  init_session(&state->main, state, NULL);
+  state->memory.allocations = 0;
+  state->memory.frees = 0;
+  state->memory.system_allocations = 1;
+  state->memory.bytes_in_use = 0;
+  state->memory.peak_bytes = 0;
+  state->memory.bytes_reserved = sizeof(*state);
+}
+
+/*
+ * pool_alloc hands out a block of at least size bytes from the pool of a
+ * filesystem, reusing a freed block of the same size class if there is one.
+ * It returns NULL if memory runs out.
+ *
+ * state: the state of the filesystem.
+ * size: the number of bytes needed.
+ */
+static void *pool_alloc(struct fs_state *state, size_t size)
+{
+  size_t class_index = size > 0 ? (size - 1) / POOL_GRAIN : 0;
+  void *block = NULL;
+
+  MUTEX_LOCK(&state->pool_lock);
+
+  if (class_index < POOL_CLASSES)
+  {
+    size = (class_index + 1) * POOL_GRAIN;
+
+    if (state->free_blocks[class_index] != NULL)
+    {
+      block = state->free_blocks[class_index];
+      state->free_blocks[class_index] = state->free_blocks[class_index]->next;
+    }
+    else
+    {
+      /* the rest of a full slab is left unused, which wastes little */
+      if (state->bump_left < size)
+      {
+        Pool_slab *slab = malloc(POOL_SLAB_SIZE);
+
+        if (slab == NULL)
+        {
+          MUTEX_UNLOCK(&state->pool_lock);
+          return NULL;
+        }
+
+        slab->next = state->slabs;
+        state->slabs = slab;
+        state->bump = (char *) (slab + 1);
+        state->bump_left = POOL_SLAB_SIZE - sizeof(*slab);
+        state->memory.system_allocations++;
+        state->memory.bytes_reserved += POOL_SLAB_SIZE;
+      }
+
+      block = state->bump;
+      state->bump += size;
+      state->bump_left -= size;
+    }
+  }
+  else
+  {
+    Pool_large *large = malloc(sizeof(*large) + size);
+
+    if (large == NULL)
+    {
+      MUTEX_UNLOCK(&state->pool_lock);
+      return NULL;
+    }
+
+    large->prev = NULL;
+    large->next = state->large;
+    large->size = size;
+    if (state->large != NULL)
+      state->large->prev = large;
+    state->large = large;
+    state->memory.system_allocations++;
+    state->memory.bytes_reserved += sizeof(*large) + size;
+    block = large + 1;
+  }
+
+  state->memory.allocations++;
+  state->memory.bytes_in_use += size;
+  if (state->memory.bytes_in_use > state->memory.peak_bytes)
+    state->memory.peak_bytes = state->memory.bytes_in_use;
+
+  MUTEX_UNLOCK(&state->pool_lock);
+
+  return block;
+}
+
+/*
+ * pool_free gives a block back to the pool of a filesystem. Small blocks are
+ * kept on the free list of their size class, and big blocks are given back to
+ * the system.
+ *
+ * state: the state of the filesystem.
+ * block: the block to give back.
+ * size: the number of bytes the block was requested with.
+ */
+static void pool_free(struct fs_state *state, void *block, size_t size)
+{
+  size_t class_index = size > 0 ? (size - 1) / POOL_GRAIN : 0;
+
+  /* blocks of a snapshot image are left alone until it is unmapped */
+  if ((unsigned long) block - (unsigned long) state->image < state->image_size)
+    return;
+
+  MUTEX_LOCK(&state->pool_lock);
+
+  if (class_index < POOL_CLASSES)
+  {
+    Pool_block *free_block = block;
+
+    free_block->next = state->free_blocks[class_index];
+    state->free_blocks[class_index] = free_block;
+    size = (class_index + 1) * POOL_GRAIN;
+  }
+  else
+  {
+    Pool_large *large = (Pool_large *) block - 1;
+
+    if (large->prev != NULL)
+      large->prev->next = large->next;
+    else
+      state->large = large->next;
+    if (large->next != NULL)
+      large->next->prev = large->prev;
+
+    state->memory.bytes_reserved -= sizeof(*large) + size;
+    free(large);
+  }
+
+  state->memory.frees++;
+  state->memory.bytes_in_use -= size;
+
+  MUTEX_UNLOCK(&state->pool_lock);
+}
+
+/*
+ * chunk_alloc hands out a chunk of file data held by one file, from the free
+ * list of chunks of a filesystem, which is refilled a slab at a time. It
+ * returns NULL if memory runs out.
+ *
+ * state: the state of the filesystem.
+ */
+static Data_chunk *chunk_alloc(struct fs_state *state)
+{
+  Data_chunk *chunk;
+  Pool_slab *slab;
+  Pool_block *block;
+  int i;
+
+  MUTEX_LOCK(&state->pool_lock);
+
+  if (state->free_chunks == NULL)
+  {
+    slab = malloc(sizeof(*slab) + DATA_SLAB_CHUNKS * CHUNK_BLOCK_SIZE);
+    if (slab == NULL)
+    {
+      MUTEX_UNLOCK(&state->pool_lock);
+      return NULL;
+    }
+
+    slab->next = state->slabs;
+    state->slabs = slab;
+    state->memory.system_allocations++;
+    state->memory.bytes_reserved += sizeof(*slab) +
+                                    DATA_SLAB_CHUNKS * CHUNK_BLOCK_SIZE;
+
+    for (i = DATA_SLAB_CHUNKS - 1; i >= 0; i--)
+    {
+      block = (Pool_block *) ((char *) (slab + 1) + i * CHUNK_BLOCK_SIZE);
+      block->next = state->free_chunks;
+      state->free_chunks = block;
+    }
+  }
+
+  chunk = (Data_chunk *) state->free_chunks;
+  state->free_chunks = state->free_chunks->next;
+
+  state->memory.allocations++;
+  state->memory.bytes_in_use += CHUNK_BLOCK_SIZE;
+  if (state->memory.bytes_in_use > state->memory.peak_bytes)
+    state->memory.peak_bytes = state->memory.bytes_in_use;
+
+  MUTEX_UNLOCK(&state->pool_lock);
+
+  chunk->references = 1;
+
+  return chunk;
+}
+
+/*
+ * chunk_release gives up a chunk of file data held by a file, putting it on
+ * the free list of chunks once no file holds it.
+ *
+ * state: the state of the filesystem.
+ * chunk: the chunk.
+ */
+static void chunk_release(struct fs_state *state, Data_chunk *chunk)
+{
+  int last;
+
+  MUTEX_LOCK(&state->data_lock);
+  last = --chunk->references == 0;
+  MUTEX_UNLOCK(&state->data_lock);
+
+  /* chunks of a snapshot image are left alone until it is unmapped */
+  if (!last ||
+      (unsigned long) chunk - (unsigned long) state->image < state->image_size)
+    return;
+
+  MUTEX_LOCK(&state->pool_lock);
+  ((Pool_block *) chunk)->next = state->free_chunks;
+  state->free_chunks = (Pool_block *) chunk;
+  state->memory.frees++;
+  state->memory.bytes_in_use -= CHUNK_BLOCK_SIZE;
+  MUTEX_UNLOCK(&state->pool_lock);
+}
+
+/*
+ * pool_destroy deallocates the state of a filesystem with all the slabs and big
+ * blocks of its pool, and the snapshot image it was loaded from, and so every
+ * directory and file of the filesystem.
+ *
+ * state: the state of the filesystem.
+ */
+static void pool_destroy(struct fs_state *state)
+{
+  Pool_slab *slab, *next_slab;
+  Pool_large *large, *next_large;
+  int i;
+
+  for (slab = state->slabs; slab != NULL; slab = next_slab)
+  {
+    next_slab = slab->next;
+    free(slab);
+  }
+
+  for (large = state->large; large != NULL; large = next_large)
+  {
+    next_large = large->next;
+    free(large);
+  }
+
+  DESTROY_MUTEX(&state->pool_lock);
+  DESTROY_MUTEX(&state->data_lock);
+  DESTROY_MUTEX(&state->handle_lock);
+  DESTROY_MUTEX(&state->garbage_lock);
+  DESTROY_MUTEX(&state->epoch_lock);
+  DESTROY_MUTEX(&state->stats_lock);
+  DESTROY_LOCK(&state->clone_lock);
+  for (i = 0; i < NAME_SHARDS; i++)
+    DESTROY_LOCK(&state->names[i].lock);
+
+  /* the state of a loaded filesystem goes away with its image */
+  if (state->image != NULL)
+    munmap(state->image, state->image_size);
+  else
+    free(state);
+}
+
+/*
+ * name_intern returns the copy of a name saved in the name table of a
+ * filesystem, adding it if it is not there yet, and counts one more file or
+ * directory holding it. It returns NULL if memory runs out.
+ *
+ * state: the state of the filesystem.
+ * name: the name.
+ */
+static char *name_intern(struct fs_state *state, const char name[])
+{
+  unsigned long hash = hash_name(name);
+  Name_shard *shard = NAME_SHARD(state, hash);
+  size_t length = strlen(name);
+  Name *curr = NULL;
+
+  WRITE_LOCK(&shard->lock);
+
+  if (shard->names >= shard->size)
+    name_grow(state, shard);
+
+  if (shard->buckets != NULL)
+  {
+    for (curr = *NAME_BUCKET(shard, hash); curr != NULL; curr = curr->next)
+      if (curr->hash == hash && !strcmp((char *) (curr + 1), name))
+        break;
+
+    if (curr == NULL)
+    {
+      curr = pool_alloc(state, sizeof(*curr) + length + 1);
+      if (curr != NULL)
+      {
+        memcpy(curr + 1, name, length + 1);
+        curr->hash = hash;
+        curr->references = 0;
+        curr->next = *NAME_BUCKET(shard, hash);
+        *NAME_BUCKET(shard, hash) = curr;
+      }
+    }
+  }
+
+  if (curr != NULL)
+  {
+    /* a name left in a snapshot image by removed entries has none */
+    if (curr->references++ > 0)
+      shard->bytes_saved += length + 1;
+    else
+      shard->names++;
+    shard->references++;
+  }
+
+  UNLOCK(&shard->lock);
+
+  return curr != NULL ? (char *) (curr + 1) : NULL;
+}
+
+/*
+ * name_find returns the copy of a name saved in the name table of a
+ * filesystem, or NULL if no file or directory has it. The copy is not held,
+ * so the caller must not read it unless something else keeps the name in the
+ * table; the hash value of the name is handed back for that reason.
+ *
+ * state: the state of the filesystem.
+ * name: the name.
+ * hash: set to the hash value of the name.
+ */
+static const char *name_find(struct fs_state *state, const char name[],
+                             unsigned long *hash)
+{
+  Name_shard *shard;
+  Name *curr = NULL;
+  const char *found = NULL;
+
+  *hash = hash_name(name);
+  shard = NAME_SHARD(state, *hash);
+
+  READ_LOCK(&shard->lock);
+
+  if (shard->buckets != NULL)
+    for (curr = *NAME_BUCKET(shard, *hash); curr != NULL; curr = curr->next)
+      if (curr->hash == *hash && !strcmp((char *) (curr + 1), name))
+        break;
+  if (curr != NULL && curr->references > 0)
+    found = (char *) (curr + 1);
+
+  UNLOCK(&shard->lock);
+
+  return found;
+}
+
+/*
+ * name_release counts one file or directory fewer holding a name saved in the
+ * name table of a filesystem, and gives the name back to the pool once none
+ * does.
+ *
+ * state: the state of the filesystem.
+ * name: the copy of the name saved in the table.
+ */
+static void name_release(struct fs_state *state, char *name)
+{
+  Name *record = NAME_RECORD(name), **link;
+  Name_shard *shard = NAME_SHARD(state, record->hash);
+  size_t length = strlen(name);
+
+  WRITE_LOCK(&shard->lock);
+
+  shard->references--;
+  if (--record->references > 0)
+    shard->bytes_saved -= length + 1;
+  else
+  {
+    for (link = NAME_BUCKET(shard, record->hash); *link != record;
+         link = &(*link)->next)
+      ;
+    *link = record->next;
+    shard->names--;
+    pool_free(state, record, sizeof(*record) + length + 1);
+  }
+
+  UNLOCK(&shard->lock);
+}
+
+/*
+ * name_grow doubles the bucket array of a shard of the name table, moving all
+ * names over. If memory runs out, the shard is left as it is and 0 is
+ * returned; its chains just get longer.
+ *
+ * state: the state of the filesystem.
+ * shard: the shard, which must be locked for writing.
+ */
+static int name_grow(struct fs_state *state, Name_shard *shard)
+{
+  unsigned long size = shard->size > 0 ? shard->size * 2 : NAME_INITIAL_SIZE;
+  Name **buckets = pool_alloc(state, size * sizeof(*buckets)), *curr, *next;
+  unsigned long i;
+
+  if (buckets == NULL)
+    return 0;
+
+  memset(buckets, 0, size * sizeof(*buckets));
+  for (i = 0; i < shard->size; i++)
+  {
+    for (curr = shard->buckets[i]; curr != NULL; curr = next)
+    {
+      next = curr->next;
+      curr->next = buckets[(curr->hash / NAME_SHARDS) & (size - 1)];
+      buckets[(curr->hash / NAME_SHARDS) & (size - 1)] = curr;
+    }
+  }
+
+  if (shard->buckets != NULL)
+    pool_free(state, shard->buckets, shard->size * sizeof(*buckets));
+  shard->buckets = buckets;
+  shard->size = size;
+
+  return 1;
+}
+
+/*
+ * hash_name computes the FNV-1a hash of a name for the name table and the
+ * name index.
+ */
+static unsigned long hash_name(const char name[])
+{
+  unsigned long hash = 2166136261UL;
+
+  while (*name != '\0')
+  {
+    hash ^= (unsigned char) *name++;
+    hash *= 16777619UL;
+  }
+
+  return hash;
+}
+
+/*
+ * index_entry_name returns the name of the file or directory an index entry
+ * refers to.
+ */
+static const char *index_entry_name(const Index_entry *entry)
+{
+  if (entry->is_dir)
+    return ((const Directory *) entry->node)->name;
+  else
+    return ((const File *) entry->node)->name;
+}
+
+/*
+ * index_table_size returns the number of buckets a new name index gets for a
+ * directory holding count entries.
+ */
+static unsigned long index_table_size(unsigned long count)
+{
+  unsigned long size = INDEX_INITIAL_SIZE;
+
+  while (size < count)
+    size *= 2;
+
+  return size;
+}
+
+#if !defined(FS_SIM_COMPACT)
+/*
+ * index_build attaches a new name index holding all files and sub directories
+ * to a directory. If memory runs out, the directory is left without an index
+ * and 0 is returned; the linkedlists are always complete, so lookups simply
+ * keep scanning them.
+ *
+ * fs: the directory to index.
+ */
+static int index_build(Fs_sim fs)
+{
+  struct name_index *index = pool_alloc(fs->state, sizeof(*index));
+  unsigned long size = index_table_size(fs->count);
+  File *curr_file;
+  Directory *curr_directory;
+  int ok = 1;
+
+  if (index == NULL)
+    return 0;
+
+  index->state = fs->state;
+  index->table[0] = pool_alloc(fs->state, size * sizeof(Index_entry *));
+  index->table[1] = NULL;
+  index->size[0] = size;
+  index->size[1] = 0;
+  index->used[0] = 0;
+  index->used[1] = 0;
+  index->rehash = -1;
+  index->samples[0] = NULL;
+  index->samples[1] = NULL;
+  index->sample_count[0] = 0;
+  index->sample_count[1] = 0;
+  index->sample_size[0] = 0;
+  index->sample_size[1] = 0;
+
+  if (index->table[0] == NULL)
+  {
+    pool_free(fs->state, index, sizeof(*index));
+    return 0;
+  }
+
+  memset(index->table[0], 0, size * sizeof(Index_entry *));
+
+  for (curr_file = fs->f_head; ok && curr_file != NULL;
+       curr_file = curr_file->next)
+    ok = index_add(index, curr_file, 0, curr_file->name);
+
+  for (curr_directory = fs->sub; ok && curr_directory != NULL;
+       curr_directory = curr_directory->next)
+    ok = index_add(index, curr_directory, 1, curr_directory->name);
+
+  if (ok)
+  {
+    index_sample_build(index, fs->f_head, 0);
+    index_sample_build(index, fs->sub, 1);
+    fs->index = index;
+  }
+  else
+    index_destroy(index);
+
+  return ok;
+}
+
+/*
+ * index_add adds an entry for a file or directory to a name index, starting to
+ * grow the index when it becomes full, and counts it in the gap of the
+ * samples it falls in. It returns 0 if the entry could not be allocated.
+ *
+ * index: the name index.
+ * node: the file or directory to add.
+ * is_dir: 1 if node is a directory and 0 if it is a file.
+ * name: the name of node.
+ */
+static int index_add(struct name_index *index, void *node, int is_dir,
+                     const char name[])
+{
+  Index_entry *entry = pool_alloc(index->state, sizeof(*entry));
+  unsigned long hash = NAME_HASH(name);
+  int t;
+
+  if (entry == NULL)
+    return 0;
+
+  index_step(index);
+
+  /* while growing, new entries always go to the new table */
+  t = index->rehash >= 0 ? 1 : 0;
+
+  entry->hash = hash;
+  entry->is_dir = is_dir;
+  entry->node = node;
+  entry->next = index->table[t][hash & (index->size[t] - 1)];
+  index->table[t][hash & (index->size[t] - 1)] = entry;
+  index->used[t]++;
+
+  if (index->rehash < 0 && index->used[0] > index->size[0])
+  {
+    /* if the bigger table cannot be allocated, chains just get longer */
+    index->table[1] = pool_alloc(index->state,
+                                 index->size[0] * 2 * sizeof(Index_entry *));
+    if (index->table[1] != NULL)
+    {
+      memset(index->table[1], 0, index->size[0] * 2 * sizeof(Index_entry *));
+      index->size[1] = index->size[0] * 2;
+      index->used[1] = 0;
+      index->rehash = 0;
+    }
+  }
+
+  index_sample_add(index, node, is_dir, name);
+
+  return 1;
+}
+
+/*
+ * index_remove removes the entry referring to a file or directory from a name
+ * index, and from its samples.
+ *
+ * index: the name index.
+ * node: the file or directory to remove, just unlinked from its list but
+ *       still pointing to the node that came after it.
+ * name: the name of node.
+ */
+static void index_remove(struct name_index *index, const void *node,
+                         const char name[])
+{
+  unsigned long hash = NAME_HASH(name);
+  int t, done = 0;
+
+  index_step(index);
+
+  for (t = 0; t < 2 && !done; t++)
+  {
+    if (index->table[t] != NULL)
+    {
+      Index_entry **link = &index->table[t][hash & (index->size[t] - 1)];
+
+      while (*link != NULL && (*link)->node != node)
+        link = &(*link)->next;
+
+      if (*link != NULL)
+      {
+        Index_entry *entry = *link;
+
+        *link = entry->next;
+        index_sample_remove(index, node, entry->is_dir, name);
+        pool_free(index->state, entry, sizeof(*entry));
+        index->used[t]--;
+        done = 1;
+      }
+    }
+  }
+}
+
+/*
+ * index_find returns the entry of a name index holding a name, or NULL if the
+ * name is not indexed.
+ *
+ * index: the name index.
+ * arg: the name to look for, which is not needed.
+ * name: the copy of the name saved in the name table, which the entries are
+ *       compared with by pointer and which is never read.
+ * hash: the hash value of the name.
+ */
+static Index_entry *index_find(const struct name_index *index,
+                               const char arg[], const char *name,
+                               unsigned long hash)
+{
+  Index_entry *entry = NULL;
+  int t;
+
+  (void) arg;
+
+  for (t = 0; t < 2 && entry == NULL; t++)
+  {
+    if (index->table[t] != NULL)
+    {
+      entry = index->table[t][hash & (index->size[t] - 1)];
+
+      while (entry != NULL &&
+             (entry->hash != hash || index_entry_name(entry) != name))
+        entry = entry->next;
+    }
+  }
+
+  return entry;
+}
+
+/*
+ * index_step moves the chains of a few buckets of the old table into the new
+ * table while a name index is being grown, and frees the old table when it
+ * becomes empty.
+ *
+ * index: the name index.
+ */
+static void index_step(struct name_index *index)
+{
+  int steps = INDEX_REHASH_STEPS;
+
+  while (index->rehash >= 0 && steps-- > 0)
+  {
+    /* skipping over empty buckets, which are cheap to move */
+    while ((unsigned long) index->rehash < index->size[0] &&
+           index->table[0][index->rehash] == NULL)
+      index->rehash++;
+
+    if ((unsigned long) index->rehash < index->size[0])
+    {
+      Index_entry *entry = index->table[0][index->rehash], *next;
+
+      while (entry != NULL)
+      {
+        next = entry->next;
+        entry->next = index->table[1][entry->hash & (index->size[1] - 1)];
+        index->table[1][entry->hash & (index->size[1] - 1)] = entry;
+        index->used[0]--;
+        index->used[1]++;
+        entry = next;
+      }
+
+      index->table[0][index->rehash++] = NULL;
+    }
+
+    /* the old table is empty, so the new one takes its place */
+    if ((unsigned long) index->rehash >= index->size[0])
+    {
+      pool_free(index->state, index->table[0],
+                index->size[0] * sizeof(Index_entry *));
+      index->table[0] = index->table[1];
+      index->size[0] = index->size[1];
+      index->used[0] = index->used[1];
+      index->table[1] = NULL;
+      index->size[1] = 0;
+      index->used[1] = 0;
+      index->rehash = -1;
+    }
+  }
+}
+
+/*
+ * index_node_name returns the name of a file or directory a name index refers
+ * to.
+ *
+ * node: the file or directory.
+ * is_dir: 1 if node points to a Directory, 0 if it points to a File.
+ */
+static const char *index_node_name(const void *node, int is_dir)
+{
+  return is_dir ? ((const Directory *) node)->name
+                : ((const File *) node)->name;
+}
+
+/*
+ * index_node_next returns the file or directory coming after another one in
+ * its linkedlist, or NULL if it is the last one.
+ *
+ * node: the file or directory.
+ * is_dir: 1 if node points to a Directory, 0 if it points to a File.
+ */
+static void *index_node_next(const void *node, int is_dir)
+{
+  return is_dir ? (void *) ((const Directory *) node)->next
+                : (void *) ((const File *) node)->next;
+}
+
+/*
+ * index_sample_build samples one of the linkedlists of a directory for its
+ * name index, keeping every INDEX_SAMPLE_GAP-th node. If memory runs out, the
+ * list is left without samples.
+ *
+ * index: the name index.
+ * head: the first node of the list, or NULL if it is empty.
+ * is_dir: 1 for the list of sub directories, 0 for the list of files.
+ */
+static void index_sample_build(struct name_index *index, void *head,
+                               int is_dir)
+{
+  Index_sample *samples;
+  unsigned long count = 0, size;
+  void *node;
+
+  for (node = head; node != NULL; node = index_node_next(node, is_dir))
+    count++;
+
+  size = INDEX_SAMPLES(count) + 1;
+  samples = pool_alloc(index->state, size * sizeof(*samples));
+  index->samples[is_dir] = samples;
+  index->sample_count[is_dir] = 0;
+  index->sample_size[is_dir] = samples != NULL ? size : 0;
+
+  if (samples == NULL)
+    return;
+
+  for (node = head, count = 0; node != NULL;
+       node = index_node_next(node, is_dir), count++)
+  {
+    if (count % INDEX_SAMPLE_GAP == 0)
+    {
+      samples[index->sample_count[is_dir]].node = node;
+      samples[index->sample_count[is_dir]++].count = 0;
+    }
+    samples[index->sample_count[is_dir] - 1].count++;
+  }
+}
+
+/*
+ * index_sample_search returns the number of samples of a list whose names are
+ * not greater than a name, found by binary search.
+ *
+ * index: the name index, whose list must have samples.
+ * is_dir: 1 for the list of sub directories, 0 for the list of files.
+ * name: the name.
+ */
+static unsigned long index_sample_search(const struct name_index *index,
+                                         int is_dir, const char name[])
+{
+  const Index_sample *samples = index->samples[is_dir];
+  unsigned long low = 0, high = index->sample_count[is_dir], middle;
+
+  while (low < high)
+  {
+    middle = low + (high - low) / 2;
+    if (strcmp(index_node_name(samples[middle].node, is_dir), name) <= 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  return low;
+}
+
+/*
+ * index_sample_add counts a node just linked into one of the lists of a
+ * directory in the gap of the samples it falls in. A gap growing to twice
+ * INDEX_SAMPLE_GAP nodes is split in two by sampling the node in its middle,
+ * unless memory runs out, in which case it is left long.
+ *
+ * index: the name index.
+ * node: the file or directory, already linked into its list.
+ * is_dir: 1 if node points to a Directory, 0 if it points to a File.
+ * name: the name of node.
+ */
+static void index_sample_add(struct name_index *index, void *node, int is_dir,
+                             const char name[])
+{
+  Index_sample *samples = index->samples[is_dir], *grown;
+  unsigned long count = index->sample_count[is_dir], s, i;
+  void *middle;
+
+  if (samples == NULL)
+    return;
+
+  if (count == 0)
+  {
+    samples[0].node = node;
+    samples[0].count = 1;
+    index->sample_count[is_dir] = 1;
+    return;
+  }
+
+  /* names added in increasing order go straight into the last gap */
+  if (strcmp(name, index_node_name(samples[count - 1].node, is_dir)) > 0)
+    s = count - 1;
+  else
+  {
+    s = index_sample_search(index, is_dir, name);
+    if (s == 0)
+      /* the node became the head of the list, so it starts the first gap */
+      samples[0].node = node;
+    else
+      s--;
+  }
+
+  if (++samples[s].count < 2 * INDEX_SAMPLE_GAP)
+    return;
+
+  if (count == index->sample_size[is_dir])
+  {
+    grown = pool_alloc(index->state, 2 * count * sizeof(*grown));
+    if (grown == NULL)
+      return;
+
+    memcpy(grown, samples, count * sizeof(*grown));
+    pool_free(index->state, samples, count * sizeof(*samples));
+    index->samples[is_dir] = samples = grown;
+    index->sample_size[is_dir] = 2 * count;
+  }
+
+  for (middle = samples[s].node, i = 0; i < INDEX_SAMPLE_GAP; i++)
+    middle = index_node_next(middle, is_dir);
+
+  memmove(&samples[s + 2], &samples[s + 1],
+          (count - s - 1) * sizeof(*samples));
+  samples[s + 1].node = middle;
+  samples[s + 1].count = samples[s].count - INDEX_SAMPLE_GAP;
+  samples[s].count = INDEX_SAMPLE_GAP;
+  index->sample_count[is_dir]++;
+}
+
+/*
+ * index_sample_remove takes a node just unlinked from one of the lists of a
+ * directory out of the gap of the samples it was in. A sampled node is
+ * replaced by the one after it, and a gap becoming short enough is merged
+ * into the one before it.
+ *
+ * index: the name index.
+ * node: the file or directory, still pointing to the node that came after it.
+ * is_dir: 1 if node points to a Directory, 0 if it points to a File.
+ * name: the name of node.
+ */
+static void index_sample_remove(struct name_index *index, const void *node,
+                                int is_dir, const char name[])
+{
+  Index_sample *samples = index->samples[is_dir];
+  unsigned long count = index->sample_count[is_dir], s;
+
+  if (samples == NULL || count == 0)
+    return;
+
+  s = index_sample_search(index, is_dir, name) - 1;
+
+  if (samples[s].node == node)
+  {
+    if (samples[s].count == 1)
+    {
+      memmove(&samples[s], &samples[s + 1],
+              (count - s - 1) * sizeof(*samples));
+      index->sample_count[is_dir]--;
+      return;
+    }
+    samples[s].node = index_node_next(node, is_dir);
+  }
+  samples[s].count--;
+
+  if (s > 0 && samples[s - 1].count + samples[s].count <= INDEX_SAMPLE_GAP)
+  {
+    samples[s - 1].count += samples[s].count;
+    memmove(&samples[s], &samples[s + 1],
+            (count - s - 1) * sizeof(*samples));
+    index->sample_count[is_dir]--;
+  }
+}
+
+/*
+ * index_seek returns the first node of one of the lists of a directory whose
+ * name is greater than a name, or NULL if there is none. The list is walked
+ * from the last sample whose name is not greater, so no more than about
+ * 2 * INDEX_SAMPLE_GAP nodes are visited.
+ *
+ * index: the name index.
+ * head: the first node of the list.
+ * after: the name.
+ * is_dir: 1 for the list of sub directories, 0 for the list of files.
+ */
+static void *index_seek(const struct name_index *index, void *head,
+                        const char after[], int is_dir)
+{
+  void *node = head;
+  unsigned long s;
+
+  if (index->samples[is_dir] != NULL)
+  {
+    s = index_sample_search(index, is_dir, after);
+    if (s > 0)
+      node = index->samples[is_dir][s - 1].node;
+  }
+
+  while (node != NULL && strcmp(index_node_name(node, is_dir), after) <= 0)
+    node = index_node_next(node, is_dir);
+
+  return node;
+}
+
+/*
+ * index_seek_prefix returns the first node of one of the lists of a directory
+ * whose name starts with a prefix, or NULL if there is none. The list is
+ * walked from the last sample whose name is smaller than the prefix, as
+ * index_seek does.
+ *
+ * index: the name index.
+ * head: the first node of the list.
+ * prefix: the prefix, which does not have to be null-terminated.
+ * length: the length of the prefix.
+ * is_dir: 1 for the list of sub directories, 0 for the list of files.
+ */
+static void *index_seek_prefix(const struct name_index *index, void *head,
+                               const char prefix[], size_t length,
+                               int is_dir)
+{
+  const Index_sample *samples = index->samples[is_dir];
+  unsigned long low = 0, high = index->sample_count[is_dir], middle;
+  void *node = head;
+
+  if (samples != NULL)
+  {
+    while (low < high)
+    {
+      middle = low + (high - low) / 2;
+      if (strncmp(index_node_name(samples[middle].node, is_dir), prefix,
+                  length) < 0)
+        low = middle + 1;
+      else
+        high = middle;
+    }
+    if (low > 0)
+      node = samples[low - 1].node;
+  }
+
+  while (node != NULL &&
+         strncmp(index_node_name(node, is_dir), prefix, length) < 0)
+    node = index_node_next(node, is_dir);
+
+  if (node != NULL && strncmp(index_node_name(node, is_dir), prefix, length))
+    node = NULL;
+
+  return node;
+}
 
-          if (new_directory->name != NULL)
-          {
-            strcpy(new_directory->name, arg);
-            new_directory->parent = parent; /* Saving its parent directory*/
-            new_directory->sub = NULL;
-            new_directory->next = curr; /* Linking with same-level directory */
-            new_directory->f_head = NULL;
-
-            if (prev == NULL)
-              (*files)->sub = new_directory;
-            else
-              prev->next = new_directory;
+/*
+ * index_destroy deallocates a name index and all of its entries. The files and
+ * directories it refers to are not touched. rmfs does not need to call it,
+ * since the whole pool is released at once.
+ *
+ * index: the name index, which may be NULL.
+ */
+static void index_destroy(struct name_index *index)
+{
+  Index_entry *entry, *next;
+  unsigned long i;
+  int t;
 
-            result = 1;
-          }
-          else
+  if (index != NULL)
+  {
+    for (t = 0; t < 2; t++)
+    {
+      if (index->table[t] != NULL)
+      {
+        for (i = 0; index->used[t] > 0 && i < index->size[t]; i++)
+        {
+          for (entry = index->table[t][i]; entry != NULL; entry = next)
           {
-            printf("fail to set the directory name!\n");
+            next = entry->next;
+            pool_free(index->state, entry, sizeof(*entry));
           }
         }
-        else
-        {
-          printf("fail to create the new directory!\n");
-        }
+
+        pool_free(index->state, index->table[t],
+                  index->size[t] * sizeof(Index_entry *));
       }
+
+      if (index->samples[t] != NULL)
+        pool_free(index->state, index->samples[t],
+                  index->sample_size[t] * sizeof(Index_sample));
     }
-  }
 
-  return result;
+    pool_free(index->state, index, sizeof(*index));
+  }
 }
-
+#else
 /*
- * cd function is used to simulate the cd command in UNIX. The function would
- * change the current directory of its Fs_sim parameter and navigate to certain
- * directory as told by arg parameter.
- *
- * The function would return 1 if valid arguments passed in and navigation made
- * correctly, and 0 if invalid cases happened. (Explain more under)
+ * index_build attaches a new name index holding all files and sub directories
+ * to a directory, merging its two linkedlists into full blocks in order. If
+ * memory runs out, the directory is left without an index and 0 is returned;
+ * the linkedlists are always complete, so lookups simply keep scanning them.
  *
- * files: The pointer used to track the current directory in the filesystem.
- * arg: A characters pointer points to the name of target directory or certain
- *      patterns of characters which indicate certain types of navigation. 
+ * fs: the directory to index.
  */
-int cd(Fs_sim *files, const char arg[])
+static int index_build(Fs_sim fs)
 {
-  int result = 0;
+  struct name_index *index = pool_alloc(fs->state, sizeof(*index));
+  unsigned long left = fs->count, size;
+  File *curr_file = fs->f_head;
+  Directory *curr_directory = fs->sub;
+  Index_block *block;
+
+  if (index == NULL)
+    return 0;
 
-  if (files != NULL && *files != NULL && arg != NULL)
+  index->state = fs->state;
+  index->blocks = NULL;
+  index->block_count = 0;
+  index->block_size = 0;
+
+  while (left > 0)
   {
-    if (strcmp(arg, "/") && strchr(arg, '/') != NULL)
-      result = 0;
-    /* A single period represents staying in the current directory */
-    else if (!strcmp(arg, "."))
-      result = 1;
-    /* 
-     * Double periods represents changing to the parent directory. No effect if
-     * the current directory is the root.
-     */
-    else if (!strcmp(arg, ".."))
+    /* only the last block is not full, and it has no more room than needed */
+    size = left < INDEX_BLOCK_SIZE ? index_table_size(left) : INDEX_BLOCK_SIZE;
+    if (!index_block_insert(index, index->block_count, size))
     {
-      if ((*files)->parent != NULL)
-        *files = (*files)->parent;
-
-      result = 1;
+      index_destroy(index);
+      return 0;
     }
-    /*
-     * A single forward-slash or empty string indicates moving to the root
-     * directory. No effect if current directory is the root.
-     */
-    else if (!strcmp(arg, "/") || !strcmp(arg, ""))
-    {
-      Directory *root = *files;
-
-      /* Keep jumping to the parent until reach the root which has no parent */
-      while (root->parent != NULL)
-        root = root->parent;
 
-      *files = root;
-      result = 1;
-    }
-    else
+    block = &index->blocks[index->block_count - 1];
+    while (block->count < size && block->count < left)
     {
-      /* 
-       * If arg is a normal valid string, searching for it in the linkedlist of 
-       * sub-directories of the current directory and moving into it if found.
-       */
-      Directory *curr = (*files)->sub;
-      result = 0;
-
-      if (curr != NULL)
+      if (curr_file != NULL &&
+          (curr_directory == NULL ||
+           strcmp(curr_file->name, curr_directory->name) < 0))
       {
-        while (curr != NULL && strcmp(curr->name, arg) != 0)
-          curr = curr->next;
-
-        if (curr != NULL)
-        {
-          result = 1;
-          *files = curr;
-        }
+        index_fill(&block->entries[block->count++], curr_file, 0,
+                   curr_file->name);
+        curr_file = curr_file->next;
+      }
+      else
+      {
+        index_fill(&block->entries[block->count++], curr_directory, 1,
+                   curr_directory->name);
+        curr_directory = curr_directory->next;
       }
     }
+    left -= block->count;
   }
 
-  return result;
+  fs->index = index;
+
+  return 1;
 }
 
 /*
- * ls function is used to simulate the ls command in UNIX. The function would
- * list the files and subdirectories of the current directories, or of its
- * argument, or just the argument if that is a file.
+ * index_add adds an entry for a file or directory to a name index where its
+ * name goes, doubling its block while it is smaller than INDEX_BLOCK_SIZE
+ * entries, and splitting it otherwise. It returns 0 if memory ran out, in
+ * which case the index is left as it was.
  *
- * The function would return 1 if valid arguments passed in and list files
- * /directories correctly, and 0 if invalid cases happened. (Explain more under)
- *
- * files: The pointer used to track the current directory in the filesystem.
- * arg: A characters pointer points to the name of listing target or certain
- *      patterns of characters which indicate certain types of list. 
+ * index: the name index.
+ * node: the file or directory to add.
+ * is_dir: 1 if node is a directory and 0 if it is a file.
+ * name: the name of node.
  */
-int ls(Fs_sim *files, const char arg[])
+static int index_add(struct name_index *index, void *node, int is_dir,
+                     const char name[])
 {
-  int result = 0;
+  Index_block *block;
+  Index_entry *entries;
+  unsigned long b, slot, half;
+
+  index_search(index, name, &b, &slot);
+
+  if (index->block_count == 0 &&
+      !index_block_insert(index, 0, INDEX_INITIAL_SIZE))
+    return 0;
 
-  if (files != NULL && *files != NULL && arg != NULL)
+  block = &index->blocks[b];
+  if (block->count == block->size)
   {
-    if (strcmp(arg, "/") && strchr(arg, '/') != NULL)
-      result = 0;
-    /* 
-     * A single period or empty string represents listing all files and
-     * subdirectories in the current directory.
-     */
-    else if (!strcmp(arg, ".") || !strcmp(arg, ""))
-    {
-      /*
-       * Passing two head pointers of the linkedlists, one is for files and 
-       * another one is for subdirectories. The print_list function would 
-       * assign the output in the format of increasing order. 
-       */
-      print_list((*files)->f_head, (*files)->sub);
-      result = 1;
-    }
-    /* 
-     * Double periods represents listing files and subdirectories in the parent
-     * directory.
-     */
-    else if (!strcmp(arg, ".."))
+    if (block->size < INDEX_BLOCK_SIZE)
     {
-      if ((*files)->parent != NULL)
-        /* Instead, passing heads of files and subdirectories in the parent. */
-        print_list((*files)->parent->f_head, (*files)->parent->sub);
-      else
-        /* If current directory is the root, worked as same as calling "." */
-        print_list((*files)->f_head, (*files)->sub);
+      entries = pool_alloc(index->state,
+                           2 * block->size * sizeof(*entries));
+      if (entries == NULL)
+        return 0;
 
-      result = 1;
+      memcpy(entries, block->entries, block->count * sizeof(*entries));
+      pool_free(index->state, block->entries,
+                block->size * sizeof(*entries));
+      block->entries = entries;
+      block->size *= 2;
     }
-    /* 
-     * A single forward-slash represents listing files and subdirectories in 
-     * the root.
-     */
-    else if (!strcmp(arg, "/"))
+    else if (b == index->block_count - 1 && slot == block->count)
     {
-      Directory *root = *files;
-
-      /* Keep jumping up until reach the root */
-      while (root->parent != NULL)
-        root = root->parent;
-
-      print_list(root->f_head, root->sub);
-      result = 1;
+      /* a name going after all others starts a new block */
+      if (!index_block_insert(index, b + 1, INDEX_INITIAL_SIZE))
+        return 0;
+      b++;
+      slot = 0;
     }
     else
     {
-      /* 
-       * Check if arg is a name existing in the current directory, otherwise, 
-       * simply return 0.
-       */
-      if (check_name(*files, arg))
-      {
-        File *curr_file = (*files)->f_head;
-        Directory *curr_directory = (*files)->sub;
-
-        /* 
-	 * Searching arg in the linkedlist of files, if found, simply print out
-	 * the name of that file.
-	 */
-        while (curr_file != NULL && strcmp(arg, curr_file->name))
-          curr_file = curr_file->next;
-
-        if (curr_file != NULL)
-          printf("%s\n", curr_file->name);
-        /* 
-	 * If arg is not found in the linkedlist of files, check if it is the
-	 * name of a subdirectory. If found, listing all files and 
-	 * subdirecotries in that subdirectory.
-	 */
-        else
-        {
-          while (curr_directory != NULL && strcmp(arg, curr_directory->name))
-            curr_directory = curr_directory->next;
+      if (!index_block_insert(index, b + 1, INDEX_BLOCK_SIZE))
+        return 0;
 
-          print_list(curr_directory->f_head, curr_directory->sub);
-        }
-        result = 1;
+      block = &index->blocks[b];
+      half = block->count / 2;
+      memcpy(block[1].entries, block->entries + half,
+             (block->count - half) * sizeof(*entries));
+      block[1].count = block->count - half;
+      block->count = half;
+      if (slot > half)
+      {
+        b++;
+        slot -= half;
       }
-      else
-        result = 0;
     }
+    block = &index->blocks[b];
   }
 
-  return result;
+  memmove(block->entries + slot + 1, block->entries + slot,
+          (block->count - slot) * sizeof(*block->entries));
+  index_fill(&block->entries[slot], node, is_dir, name);
+  block->count++;
+
+  return 1;
 }
 
 /*
- * pwd function is used to simulate the pwd command in UNIX. The function would
- * print out the full path from the root to the current directory.
+ * index_remove removes the entry referring to a file or directory from a name
+ * index, giving its block back if it was the last one in it, or merging the
+ * block with the next one if it is left a quarter full and has room for it.
  *
- * files: The pointer used to track the current directory in the filesystem.
+ * index: the name index.
+ * node: the file or directory to remove.
+ * name: the name of node.
  */
-void pwd(Fs_sim *files)
+static void index_remove(struct name_index *index, const void *node,
+                         const char name[])
 {
-  if (files != NULL)
-  {
-    /* Simply print out a forward slash if the current directory is the root. */
-    if ((*files)->parent == NULL)
-      printf("/\n");
-    else
-    {
-      /* An array of pointers of chracters is used to save the path */
-      char **path;
-      int levels = 0;
-      Directory *curr = *files;
-      int i;
+  Index_block *block;
+  unsigned long b, slot;
 
-      /* Counting the number of levels from the current directory to the root */
-      while (curr->parent != NULL)
-      {
-        levels++;
-        curr = curr->parent;
-      }
+  if (!index_search(index, name, &b, &slot) ||
+      index->blocks[b].entries[slot].node != node)
+    return;
 
-      /* Using levels to allocate memory for the array to save the path */
-      path = malloc(levels * sizeof(char *));
+  block = &index->blocks[b];
+  block->count--;
+  memmove(block->entries + slot, block->entries + slot + 1,
+          (block->count - slot) * sizeof(*block->entries));
 
-      if (path != NULL)
-      {
-        curr = *files;
+  if (block->count == 0)
+    index_block_delete(index, b);
+  else if (block->count <= INDEX_BLOCK_SIZE / 4 &&
+           b + 1 < index->block_count &&
+           block->count + block[1].count <= block->size)
+  {
+    memcpy(block->entries + block->count, block[1].entries,
+           block[1].count * sizeof(*block->entries));
+    block->count += block[1].count;
+    index_block_delete(index, b + 1);
+  }
+}
 
-        /* 
-	 * Jumping through the path from the current directory to the root and 
-	 * save every directory passing through in the array.
-	 */
-        i = levels - 1;
-        while (curr->parent != NULL)
-        {
-          path[i--] = curr->name;
-          curr = curr->parent;
-        }
+/*
+ * index_find returns the entry of a name index holding a name, or NULL if the
+ * name is not indexed.
+ *
+ * index: the name index.
+ * arg: the name to look for.
+ * name: the copy of the name saved in the name table, which is not needed.
+ * hash: the hash value of the name, which is not needed.
+ */
+static Index_entry *index_find(const struct name_index *index,
+                               const char arg[], const char *name,
+                               unsigned long hash)
+{
+  unsigned long b, slot;
 
-        /* Printing out all names of directories in the path */
-        for (i = 0; i < levels; i++)
-          printf("/%s", path[i]);
-        printf("\n");
+  (void) name;
+  (void) hash;
 
-        free(path);
-      }
-      else
-      {
-        printf("fail to track the path!\n");
-      }
-    }
-  }
+  return index_search(index, arg, &b, &slot) ? &index->blocks[b].entries[slot]
+                                             : NULL;
 }
 
 /*
- * rmfs function is used to clean out the current filesystem. It would remove
- * all things (directories, files) in the filesystem. It deallocates any
- * dynamically-allocated memory, including directories, files and their names.
- * It calls a helper function, destroy_directories, which receives a directory
- * pointer and free all things under that directory and the directory itself.
- * 
- * files: The pointer used to track the current directory in the filesystem.
+ * index_next returns the first file, or the first directory, of a name index
+ * whose name is greater than a name, or NULL if there is none. It is used to
+ * find where a new entry goes in the linkedlists without walking them.
+ *
+ * index: the name index.
+ * name: the name.
+ * is_dir: 1 to look for a directory and 0 to look for a file.
  */
-void rmfs(Fs_sim *files)
+static void *index_next(const struct name_index *index, const char name[],
+                        int is_dir)
 {
-  Fs_sim root;
+  const Index_block *block;
+  unsigned long b, slot;
 
-  /* 
-   * checking the parameter is not NULL and the filesystem has been correctly 
-   * created.
-   */
-  if (files != NULL && *files != NULL)
+  if (index_search(index, name, &b, &slot))
+    slot++;
+
+  for (; b < index->block_count; b++, slot = 0)
   {
-    root = *files;
+    block = &index->blocks[b];
+    for (; slot < block->count; slot++)
+      if (block->entries[slot].is_dir == is_dir)
+        return block->entries[slot].node;
+  }
 
-    /* tracking back from the current directory until reach the root */
-    while (root->parent != NULL)
-      root = root->parent;
+  return NULL;
+}
 
-    /* 
-     * calling the helper function to remove all things under the root and root
-     * itself.
-     */
-    destroy_directories(root);
+/*
+ * index_seek returns the first node of one of the lists of a directory whose
+ * name is greater than a name, or NULL if there is none, found by binary
+ * search in the name index.
+ *
+ * index: the name index.
+ * head: the first node of the list, which is not needed.
+ * after: the name.
+ * is_dir: 1 for the list of sub directories, 0 for the list of files.
+ */
+static void *index_seek(const struct name_index *index, void *head,
+                        const char after[], int is_dir)
+{
+  (void) head;
 
-    /* 
-     * the current directory pointer would be NULL until the next filesystem 
-     * created (calling mkfs). 
-     */
-    *files = NULL;
-  }
+  return index_next(index, after, is_dir);
 }
 
 /*
- * rm function is used to remove a file or a directory from the current
- * directory. The function returns 1 if any file or directory was correctly
- * removed. Otherwise, it returns 0.
- * 
- * files: The pointer used to track the current directory in the filesystem.
+ * index_seek_prefix returns the first node of one of the lists of a directory
+ * whose name starts with a prefix, or NULL if there is none. The first entry
+ * not smaller than the prefix is found by binary search, and the entries
+ * starting with it are gone through from there up to one of the list.
+ *
+ * index: the name index.
+ * head: the first node of the list, which is not needed.
+ * prefix: the prefix, which does not have to be null-terminated.
+ * length: the length of the prefix.
+ * is_dir: 1 for the list of sub directories, 0 for the list of files.
  */
-int rm(Fs_sim *files, const char arg[])
+static void *index_seek_prefix(const struct name_index *index, void *head,
+                               const char prefix[], size_t length,
+                               int is_dir)
 {
-  int result = 0;
+  const Index_block *block;
+  const Index_entry *entry;
+  unsigned long b, slot = 0, high, middle;
 
-  if (files != NULL && *files != NULL && arg != NULL)
+  (void) head;
+
+  /* the first block whose last name is not smaller than the prefix */
+  for (b = 0, high = index->block_count; b < high;)
   {
-    /*
-     * the name of target could not be a single or double period, or an empty
-     * string, or contains forward-slash character. 
-     */
-    if (!strcmp(arg, ".") || !strcmp(arg, "..") || !strcmp(arg, "") ||
-        strchr(arg, '/') != NULL)
-    {
-      result = 0;
-    }
-    /* returns 0 if the target does not exist in the current directory */
-    else if (!check_name(*files, arg))
-    {
-      result = 0;
-    }
+    middle = b + (high - b) / 2;
+    block = &index->blocks[middle];
+    if (strncmp(index_entry_name(&block->entries[block->count - 1]), prefix,
+                length) < 0)
+      b = middle + 1;
     else
-    {
-      File *curr_file = (*files)->f_head;
-      File *prev_file = NULL;
-
-      /* checking whether if the target is a existed file */
-      while (curr_file != NULL && strcmp(arg, curr_file->name))
-      {
-        prev_file = curr_file;
-        curr_file = curr_file->next;
-      }
+      high = middle;
+  }
 
-      /* remove and deallocate the file from the linkedlist if found */
-      if (curr_file != NULL)
-      {
-        if (prev_file != NULL)
-        {
-          prev_file->next = curr_file->next;
-          free(curr_file->name);
-          free(curr_file);
-        }
-        else
-        {
-          /* handling the case if the file is the first one in the linkedlist */
-          (*files)->f_head = curr_file->next;
-          free(curr_file->name);
-          free(curr_file);
-        }
-      }
-      /* 
-       * the case when the target was not found in the linkedlist of files.
-       * Since the helper function, check_name, has been called above, it is for
-       * sure that the target exists in the current directory. Therefore, if it
-       * was not found in the linkedlist of files, it must be a subdirectory.
-       */
+  if (b < index->block_count)
+  {
+    block = &index->blocks[b];
+    for (high = block->count; slot < high;)
+    {
+      middle = slot + (high - slot) / 2;
+      if (strncmp(index_entry_name(&block->entries[middle]), prefix,
+                  length) < 0)
+        slot = middle + 1;
       else
-      {
-        Directory *curr_directory = (*files)->sub;
-        Directory *prev_directory = NULL;
-
-        /* finding out the target in the linkedlist of subdirectories */
-        while (curr_directory != NULL && strcmp(arg, curr_directory->name))
-        {
-          prev_directory = curr_directory;
-          curr_directory = curr_directory->next;
-        }
-
-        /* remove it from the linkedlist */
-        if (prev_directory != NULL)
-          prev_directory->next = curr_directory->next;
-        else
-          /* the case when it is the first subdirectory in the list */
-          (*files)->sub = curr_directory->next;
-
-        /* 
-	 * cutting its connections with any other directory in the same or upper 
-	 * level to avoid any unintended deallocation. 
-	 */
-        curr_directory->next = NULL;
-        curr_directory->parent = NULL;
-
-        /*
-	 * deallocate all things under the target directory and the directory
-	 * itself by calling the helper function.
-	 */
-        destroy_directories(curr_directory);
-      }
+        high = middle;
+    }
+  }
 
-      result = 1;
+  for (; b < index->block_count; b++, slot = 0)
+  {
+    block = &index->blocks[b];
+    for (; slot < block->count; slot++)
+    {
+      entry = &block->entries[slot];
+      if (strncmp(index_entry_name(entry), prefix, length))
+        return NULL;
+      if (entry->is_dir == is_dir)
+        return entry->node;
     }
   }
 
-  return result;
+  return NULL;
 }
 
 /*
- * print_list is used to print files and directories in the format of increasing
- * order.
+ * index_search finds where a name is, or would go, in a name index, by binary
+ * search over the last names of the blocks and then in the block it falls in.
+ * A name greater than all others goes at the end of the last block, and into
+ * block 0 of an empty index. It returns 1 if an entry holds the name, and 0
+ * otherwise.
  *
- * file_head: A file pointer points to the linked list of all files of the
- *            current directory.
- * sub_head:  A directory pointer points to the linked list of all sub 
- *            directories of the current directory. 
+ * index: the name index.
+ * name: the name to look for.
+ * block: set to the block the name is or would go in.
+ * slot: set to the number of entries of the block with smaller names.
  */
-static void print_list(File *file_head, Directory *sub_head)
+static int index_search(const struct name_index *index, const char name[],
+                        unsigned long *block, unsigned long *slot)
 {
-  /*
-   * Since linkedlists of files and subdirectories are already in the increasing
-   * order, simply comparing one pair of them and printing the one coming first
-   * until one linkedlist reaches the end.
-   */
-  while (file_head != NULL && sub_head != NULL)
+  const Index_block *blocks = index->blocks;
+  unsigned long low = 0, high = index->block_count, middle;
+  int order;
+
+  while (low < high)
   {
-    if (strcmp(file_head->name, sub_head->name) < 0)
-    {
-      printf("%s\n", file_head->name);
-      file_head = file_head->next;
-    }
+    middle = low + (high - low) / 2;
+    if (index_compare(name, &blocks[middle].entries[blocks[middle].count - 1])
+        > 0)
+      low = middle + 1;
     else
-    {
-      printf("%s/\n", sub_head->name);
-      sub_head = sub_head->next;
-    }
+      high = middle;
   }
 
-  /* Printing out the rest of the linkedlist which is still not empty */
-  if (file_head != NULL && sub_head == NULL)
+  *block = low;
+  *slot = 0;
+  if (low == index->block_count)
   {
-    while (file_head != NULL)
+    if (low > 0)
     {
-      printf("%s\n", file_head->name);
-      file_head = file_head->next;
+      *block = low - 1;
+      *slot = blocks[low - 1].count;
     }
+    return 0;
   }
-  else if (file_head == NULL && sub_head != NULL)
+
+  /* the name is not greater than the last one of the block */
+  high = blocks[low].count - 1;
+  low = 0;
+  while (low < high)
   {
-    while (sub_head != NULL)
+    middle = low + (high - low) / 2;
+    order = index_compare(name, &blocks[*block].entries[middle]);
+    if (order == 0)
     {
-      printf("%s/\n", sub_head->name);
-      sub_head = sub_head->next;
+      *slot = middle;
+      return 1;
     }
+    else if (order > 0)
+      low = middle + 1;
+    else
+      high = middle;
   }
+
+  *slot = low;
+
+  return index_compare(name, &blocks[*block].entries[low]) == 0;
 }
 
 /*
- * check_name is used to check whether if the current directory already
- * contained a same-name file or directory as the paramter arg. For touch and
- * mkdir commands, new file or directory is only created when none of the files
- * and sub directory in the current directory have the same name as the new one.
- * Also, cd and ls commands relies on check_name to check if there has the
- * target directory or file to navigate to or print out.
- * 
- * The function returns 1 if the file/directory name (arg) is found in the
- * current directory and 0 if not found.
- *
- * fs: a double directory pointer points to the current directory which would be
- *     checked for names.
- * arg: the target name.
+ * index_compare compares a name with the name of an index entry the way
+ * strcmp does. The name of the file or directory itself is only read if the
+ * first INDEX_INLINE bytes of a long name are the same.
  */
-static int check_name(Fs_sim fs, const char arg[])
+static int index_compare(const char name[], const Index_entry *entry)
 {
-  int found = 0;
-  File *curr_file = fs->f_head;
-  Directory *curr_directory = fs->sub;
+  int order;
 
-  /* Searching for arg in the linkedlist of files */
-  if (curr_file != NULL)
-  {
-    while (curr_file != NULL && strcmp(curr_file->name, arg) != 0)
-      curr_file = curr_file->next;
+  if (entry->length < INDEX_INLINE)
+    return strcmp(name, entry->name);
 
-    if (curr_file != NULL)
-      found = 1;
-  }
+  /* if they are the same, name is at least INDEX_INLINE bytes long too */
+  order = strncmp(name, entry->name, INDEX_INLINE);
+  if (order == 0)
+    order = strcmp(name + INDEX_INLINE,
+                   index_entry_name(entry) + INDEX_INLINE);
 
-  /* Searching for arg in the linkedlist of subdirectories */
-  if (curr_directory != NULL)
-  {
-    while (curr_directory != NULL && strcmp(curr_directory->name, arg) != 0)
-      curr_directory = curr_directory->next;
+  return order;
+}
 
-    if (curr_directory != NULL)
-      found = 1;
-  }
+/*
+ * index_fill fills in an index entry.
+ *
+ * entry: the entry.
+ * node: the file or directory it refers to.
+ * is_dir: 1 if node is a directory and 0 if it is a file.
+ * name: the name of node.
+ */
+static void index_fill(Index_entry *entry, void *node, int is_dir,
+                       const char name[])
+{
+  size_t length = strlen(name);
 
-  return found;
+  entry->node = node;
+  entry->is_dir = (unsigned char) is_dir;
+  entry->length = (unsigned char) (length < 255 ? length : 255);
+
+  /* a long name keeps only its first bytes, with no terminator */
+  if (length < INDEX_INLINE)
+    memcpy(entry->name, name, length + 1);
+  else
+    memcpy(entry->name, name, INDEX_INLINE);
 }
 
-/* 
- * destroy_files would destroy the entire linkedlist of files passing by the 
- * file pointer, file_head. It is only used when destroy all things under a
- * targeted directory.
+/*
+ * index_block_insert puts a new empty block in a name index, doubling the
+ * array of blocks if it is full. It returns 0 if memory ran out, in which
+ * case the index is left as it was.
  *
- * file_head: a file pointer points to the first file in the linkedlist which
- *            would be removed. 
+ * index: the name index.
+ * position: the number of blocks to come before the new one.
+ * size: the number of entries the new block has room for.
  */
-static void destroy_files(File *file_head)
+static int index_block_insert(struct name_index *index,
+                              unsigned long position, unsigned long size)
 {
-  File *curr = file_head, *temp;
+  Index_block *blocks;
+  Index_entry *entries;
+  unsigned long grown;
 
-  while (curr != NULL)
+  if (index->block_count == index->block_size)
   {
-    temp = curr;
-    curr = curr->next;
-    free(temp->name);
-    free(temp);
+    grown = index->block_size > 0 ? 2 * index->block_size : 1;
+    blocks = pool_alloc(index->state, grown * sizeof(*blocks));
+    if (blocks == NULL)
+      return 0;
+
+    if (index->block_size > 0)
+    {
+      memcpy(blocks, index->blocks, index->block_count * sizeof(*blocks));
+      pool_free(index->state, index->blocks,
+                index->block_size * sizeof(*blocks));
+    }
+    index->blocks = blocks;
+    index->block_size = grown;
   }
+
+  entries = pool_alloc(index->state, size * sizeof(*entries));
+  if (entries == NULL)
+    return 0;
+
+  memmove(&index->blocks[position + 1], &index->blocks[position],
+          (index->block_count - position) * sizeof(*index->blocks));
+  index->blocks[position].entries = entries;
+  index->blocks[position].count = 0;
+  index->blocks[position].size = size;
+  index->block_count++;
+
+  return 1;
 }
 
-/* 
- * destroy_directories would deallocate all dynamically allocated memory, 
- * including files, subdirectories and their names, under the directory pointed 
- * by top, and the directory itself from the filesystem.
+/*
+ * index_block_delete takes a block out of a name index and gives it back to
+ * the pool.
  *
- * top: a directory pointer points to the top directory of everything which
- *      would be deallocated. 
+ * index: the name index.
+ * position: the number of blocks before it.
  */
-static void destroy_directories(Fs_sim top)
+static void index_block_delete(struct name_index *index,
+                               unsigned long position)
 {
-  /*
-   * If the current directory had subdirectory, recursively calling the function 
-   * to destroy the subdirectory itself and everything under it.
-   */
-  if (top->sub != NULL)
-    destroy_directories(top->sub);
+  pool_free(index->state, index->blocks[position].entries,
+            index->blocks[position].size * sizeof(Index_entry));
+  index->block_count--;
+  memmove(&index->blocks[position], &index->blocks[position + 1],
+          (index->block_count - position) * sizeof(*index->blocks));
+}
 
-  /*
-   * If the current directory is not the last subdirectory in the linkedlist of
-   * subdirectories, recursively calling the function to destroy the next 
-   * subdirectory and everything under it.
-   */
-  if (top->next != NULL)
-    destroy_directories(top->next);
+/*
+ * index_destroy deallocates a name index and its blocks. The files and
+ * directories it refers to are not touched. rmfs does not need to call it,
+ * since the whole pool is released at once.
+ *
+ * index: the name index, which may be NULL.
+ */
+static void index_destroy(struct name_index *index)
+{
+  unsigned long b;
 
-  /*
-   * When there is no more subdirectory or reaching the end of linkedlist of 
-   * subdirectories, deallocating the current directory and all files in it. 
-   */
-  destroy_files(top->f_head);
-  free(top->name);
-  free(top);
+  if (index != NULL)
+  {
+    for (b = 0; b < index->block_count; b++)
+      pool_free(index->state, index->blocks[b].entries,
+                index->blocks[b].size * sizeof(Index_entry));
+    if (index->block_size > 0)
+      pool_free(index->state, index->blocks,
+                index->block_size * sizeof(Index_block));
+    pool_free(index->state, index, sizeof(*index));
+  }
 }
+#endif
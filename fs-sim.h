@@ -1,13 +1,61 @@
+#include <stddef.h>
 #include "fs-sim-datastructure.h"
+#include "fs-sim-session.h"
 
 /* (c) Larry Herman, 2016.  You are allowed to use this code yourself, but
    not to provide it to anyone else. */
 
+/* Saved by run_batch as the result of a line that is not a command */
+#define FS_SIM_UNKNOWN (-2)
+
 void mkfs(Fs_sim *files);
 int touch(Fs_sim *files, const char arg[]);
 int mkdir(Fs_sim *files, const char arg[]);
+int touch_many(Fs_sim *files, const char arg[], const char *names[],
+               size_t count, int status[]);
+int mkdir_many(Fs_sim *files, const char arg[], const char *names[],
+               size_t count, int status[]);
 int cd(Fs_sim *files, const char arg[]);
 int ls(Fs_sim *files, const char arg[]);
+int ls_page(Fs_sim *files, const char arg[], const char after[], size_t limit,
+            char resume[], size_t size);
+int ls_open(Fs_sim *files, const char arg[], Fs_cursor *cursor);
 void pwd(Fs_sim *files);
+int pwd_path(Fs_sim *files, char path[], size_t size);
+int cp(Fs_sim *files, const char source[], const char target[]);
+int mv(Fs_sim *files, const char source[], const char target[]);
+int write_file(Fs_sim *files, const char arg[], unsigned long offset,
+               const char data[], size_t length);
+int append_file(Fs_sim *files, const char arg[], const char data[],
+                size_t length);
+int truncate_file(Fs_sim *files, const char arg[], unsigned long size);
+int read_open(Fs_sim *files, const char arg[], unsigned long offset,
+              unsigned long length, Fs_view *view);
+int ln(Fs_sim *files, const char source[], const char target[]);
+int stat_entry(Fs_sim *files, const char arg[], Fs_entry *entry);
+int stat_id(Fs_sim *files, unsigned long id, Fs_entry *entry);
+int ls_id(Fs_sim *files, unsigned long id);
+int ls_open_id(Fs_sim *files, unsigned long id, Fs_cursor *cursor);
+int read_open_id(Fs_sim *files, unsigned long id, unsigned long offset,
+                 unsigned long length, Fs_view *view);
 void rmfs(Fs_sim *files);
 int rm(Fs_sim *files, const char arg[]);
+void set_deferred_rm(Fs_sim *files, int deferred);
+int reclaim(Fs_sim *files, unsigned long limit);
+int memory_stats(Fs_sim *files, Fs_memory *stats);
+int fs_stats(Fs_sim *files, Fs_stats *stats);
+int print_stats(Fs_sim *files);
+int ls_recursive(Fs_sim *files, const char arg[]);
+int find(Fs_sim *files, const char arg[], const char pattern[]);
+int du(Fs_sim *files, const char arg[], Fs_usage *usage);
+int set_quota(Fs_sim *files, const char arg[], const Fs_usage *limit);
+void set_walk_threads(Fs_sim *files, int threads);
+int save_fs(Fs_sim *files, const char path[]);
+int load_fs(Fs_sim *files, const char path[]);
+int recover_fs(Fs_sim *files, const char snapshot[], const char journal[]);
+int journal_sync(Fs_sim *files);
+int compact_fs(Fs_sim *files);
+void set_journal_limit(Fs_sim *files, unsigned long limit);
+long run_batch(Fs_sim *files, const char commands[], size_t length,
+               int status[], size_t size);
+long run_script(Fs_sim *files, const char path[], int status[], size_t size);
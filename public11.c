@@ -0,0 +1,67 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fs-sim.h"
+#include "fs-sim-host.h"
+#include "file-checksum.h"
+
+/*
+ * Tests copying a tree out to the host with export_fs and back in with
+ * import_fs: the directories, the files and their contents, including a file
+ * held in chunks and one with a hole, come back the same. Copying into a
+ * directory that is not there fails. When built with FS_SIM_THREADS, the
+ * copies are done by several threads.
+ */
+
+
+int main(void)
+{
+  Fs_sim files, copy;
+  char host[] = "/tmp/fs-sim-public11-XXXXXX", command[64];
+  char block[5000];
+  int i;
+
+  for (i = 0; i < (int) sizeof(block); i++)
+    block[i] = (char) ('a' + i % 26);
+
+  mkfs(&files);
+  mkdir(&files, "top");
+  cd(&files, "top");
+  mkdir(&files, "dir1");
+  mkdir(&files, "dir2");
+  mkdir(&files, "dir1/inner");
+  touch(&files, "empty");
+  touch(&files, "small");
+  write_file(&files, "small", 0, "hello\n", 6);
+  touch(&files, "dir1/big");
+  write_file(&files, "dir1/big", 0, block, sizeof(block));
+  touch(&files, "dir1/inner/hole");
+  write_file(&files, "dir1/inner/hole", 9000, "end\n", 4);
+  cd(&files, "/");
+
+  if (mkdtemp(host) == NULL)
+    return 1;
+
+  printf("%d\n", export_fs(&files, "top", host, 4));
+
+  mkfs(&copy);
+  mkdir(&copy, "copy");
+  printf("%d\n", import_fs(&copy, host, "missing", 4));
+  printf("%d\n", import_fs(&copy, host, "copy", 4));
+  ls_recursive(&copy, "copy");
+
+  print_file(&copy, "copy/small");
+  print_file(&copy, "copy/dir1/big");
+  print_file(&copy, "copy/dir1/inner/hole");
+
+  sprintf(command, "rm -rf %s", host);
+  if (system(command) != 0)
+    return 1;
+
+  rmfs(&files);
+  rmfs(&copy);
+
+  return 0;
+}
@@ -0,0 +1,200 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "fs-sim.h"
+#include "file-checksum.h"
+
+/*
+ * Tests saving a filesystem in a snapshot and a journal with recover_fs:
+ *
+ * - Changes made by a process that exits without calling rmfs, both before
+ *   and after the journal was compacted into the snapshot, are all there when
+ *   the filesystem is recovered, once journal_sync has written them. A quota
+ *   saved in the snapshot still limits later changes.
+ * - A torn record at the end of the journal is cut off, and changes made
+ *   after recovering from it are replayed too.
+ * - Once records cannot be written, because the journal file cannot grow,
+ *   journal_sync and every later change fail, and the journal still holds
+ *   every change written before them.
+ */
+
+#define SNAPSHOT "public12.snap"
+#define JOURNAL "public12.jrnl"
+
+static void make_changes(void);
+static void fail_changes(void);
+static void run_child(void (*changes)(void));
+static void print_tree(void);
+static long file_size(const char path[]);
+
+int main(void)
+{
+  FILE *journal;
+  long size;
+
+  remove(SNAPSHOT);
+  remove(JOURNAL);
+
+  run_child(make_changes);
+  print_tree();
+
+  /* half a record, as a crash in the middle of writing one leaves it */
+  size = file_size(JOURNAL);
+  journal = fopen(JOURNAL, "ab");
+  if (journal == NULL)
+    return 1;
+  fwrite("t\012/torn", 1, 7, journal);
+  fclose(journal);
+
+  print_tree();
+  printf("%d\n", file_size(JOURNAL) == size);
+
+  run_child(fail_changes);
+  print_tree();
+
+  remove(SNAPSHOT);
+  remove(JOURNAL);
+
+  return 0;
+}
+
+/*
+ * make_changes makes changes of every kind saved in the journal, compacting
+ * the journal half way, and one that the quota set before compacting stops.
+ */
+static void make_changes(void)
+{
+  Fs_sim files;
+  Fs_usage quota = {5, 0, 0};
+  char block[6000];
+  int i;
+
+  for (i = 0; i < (int) sizeof(block); i++)
+    block[i] = (char) ('0' + i % 10);
+
+  printf("%d\n", recover_fs(&files, SNAPSHOT, JOURNAL));
+  printf("%d", mkdir(&files, "dir"));
+  printf(" %d", touch(&files, "dir/small"));
+  printf(" %d", write_file(&files, "dir/small", 0, "before\n", 7));
+  printf(" %d", touch(&files, "big"));
+  printf(" %d", write_file(&files, "big", 0, block, sizeof(block)));
+  printf(" %d", ln(&files, "big", "dir/big-link"));
+  printf(" %d\n", set_quota(&files, "dir", &quota));
+
+  printf("%d\n", compact_fs(&files));
+
+  printf("%d", cp(&files, "dir", "copy"));
+  printf(" %d", write_file(&files, "copy/small", 0, "after!\n", 7));
+  printf(" %d", append_file(&files, "dir/big-link", "end\n", 4));
+  printf(" %d", truncate_file(&files, "copy/big-link", 100));
+  printf(" %d", mv(&files, "copy/small", "moved"));
+  printf(" %d", rm(&files, "dir/small"));
+  printf(" %d", mkdir(&files, "dir/sub"));
+  printf(" %d", touch(&files, "dir/a"));
+  printf(" %d", touch(&files, "dir/b"));
+  printf(" %d", touch(&files, "dir/c"));
+  printf(" %d", touch(&files, "dir/d"));
+  printf(" %d\n", touch(&files, "dir/over"));
+  printf("%d\n", journal_sync(&files));
+}
+
+/*
+ * fail_changes makes changes after limiting the size of files so the journal
+ * cannot hold the record of a long name, and one more after lifting the limit.
+ * Each is written with journal_sync, so none is left for the next group.
+ */
+static void fail_changes(void)
+{
+  Fs_sim files;
+  struct rlimit limit;
+  char name[200];
+
+  printf("%d\n", recover_fs(&files, SNAPSHOT, JOURNAL));
+  printf("%d", touch(&files, "kept"));
+  printf(" %d", journal_sync(&files));
+
+  signal(SIGXFSZ, SIG_IGN);
+  limit.rlim_cur = file_size(JOURNAL) + 100;
+  limit.rlim_max = RLIM_INFINITY;
+  setrlimit(RLIMIT_FSIZE, &limit);
+
+  memset(name, 'x', sizeof(name) - 1);
+  name[sizeof(name) - 1] = '\0';
+  printf(" %d", touch(&files, name));
+  printf(" %d", journal_sync(&files));
+  printf(" %d", touch(&files, "short"));
+
+  limit.rlim_cur = RLIM_INFINITY;
+  setrlimit(RLIMIT_FSIZE, &limit);
+
+  printf(" %d\n", mkdir(&files, "other"));
+}
+
+/*
+ * run_child makes changes in a child process, which exits without calling
+ * rmfs, as if it crashed.
+ */
+static void run_child(void (*changes)(void))
+{
+  pid_t pid;
+
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0)
+  {
+    changes();
+    fflush(stdout);
+    _exit(0);
+  }
+
+  waitpid(pid, NULL, 0);
+}
+
+/*
+ * print_tree recovers the filesystem and prints all of it.
+ */
+static void print_tree(void)
+{
+  Fs_sim files;
+  Fs_entry entry;
+
+  if (!recover_fs(&files, SNAPSHOT, JOURNAL))
+  {
+    printf("cannot recover\n");
+    return;
+  }
+
+  ls_recursive(&files, "/");
+  print_file(&files, "big");
+  print_file(&files, "dir/big-link");
+  print_file(&files, "copy/big-link");
+  print_file(&files, "moved");
+  if (stat_entry(&files, "big", &entry))
+    printf("big: %lu links\n", entry.links);
+
+  rmfs(&files);
+}
+
+/*
+ * file_size returns the size of a host file, or -1 if it cannot be opened.
+ */
+static long file_size(const char path[])
+{
+  FILE *file = fopen(path, "rb");
+  long size = -1;
+
+  if (file != NULL)
+  {
+    if (fseek(file, 0, SEEK_END) == 0)
+      size = ftell(file);
+    fclose(file);
+  }
+
+  return size;
+}
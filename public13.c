@@ -0,0 +1,106 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include "fs-sim.h"
+
+/*
+ * Tests the cases cp must refuse, and that a copy and the tree it was made
+ * from behave as separate trees:
+ *
+ * - A copy onto a name that exists, of a directory into itself or a
+ *   directory under it, or of something that is not there, fails.
+ * - Changing a copied tree at any depth, or the tree it was copied from, is
+ *   not seen in the other, and removing either leaves the other whole.
+ * - Copying a large tree takes the same few allocations as a small one, and
+ *   so does a change to a small directory deep in the copy.
+ */
+
+static void print_file(Fs_sim *files, const char arg[]);
+
+int main(void)
+{
+  Fs_sim files;
+  Fs_memory before, after;
+  char name[16];
+  int i;
+
+  mkfs(&files);
+  mkdir(&files, "a");
+  mkdir(&files, "a/b");
+  mkdir(&files, "a/b/c");
+  touch(&files, "a/file");
+  touch(&files, "a/b/c/deep");
+  write_file(&files, "a/b/c/deep", 0, "deep\n", 5);
+  touch(&files, "other");
+
+  /* what cp refuses */
+  printf("%d", cp(&files, "a", "other"));
+  printf(" %d", cp(&files, "a", "a/copy"));
+  printf(" %d", cp(&files, "a", "a/b/c/copy"));
+  printf(" %d", cp(&files, "missing", "copy"));
+  printf(" %d\n", cp(&files, "a/file", "a/b"));
+
+  /* a copied tree changed on both sides */
+  printf("%d", cp(&files, "a", "copy"));
+  printf(" %d", write_file(&files, "copy/b/c/deep", 0, "DEEP", 4));
+  printf(" %d", touch(&files, "copy/b/c/new"));
+  printf(" %d", rm(&files, "a/file"));
+  printf(" %d", mkdir(&files, "a/b/c/only-a"));
+  printf(" %d\n", cp(&files, "copy/b", "copy/b2"));
+  ls_recursive(&files, "/");
+  print_file(&files, "a/b/c/deep");
+  print_file(&files, "copy/b/c/deep");
+  print_file(&files, "copy/b2/c/deep");
+
+  printf("%d", rm(&files, "a"));
+  printf(" %d\n", write_file(&files, "copy/b2/c/deep", 4, "!\n", 2));
+  ls_recursive(&files, "/");
+  print_file(&files, "copy/b/c/deep");
+  print_file(&files, "copy/b2/c/deep");
+
+  /* a large tree is shared until it is changed */
+  mkdir(&files, "wide");
+  for (i = 0; i < 500; i++)
+  {
+    sprintf(name, "wide/d%d", i);
+    mkdir(&files, name);
+    sprintf(name, "wide/f%d", i);
+    touch(&files, name);
+  }
+  memory_stats(&files, &before);
+  printf("%d", cp(&files, "wide", "wide-copy"));
+  memory_stats(&files, &after);
+  printf(" %d", after.allocations - before.allocations < 10);
+  printf(" %d", touch(&files, "wide-copy/d7/new"));
+  memory_stats(&files, &before);
+  printf(" %d", before.allocations - after.allocations < 10);
+  printf(" %d", rm(&files, "wide-copy/f3"));
+  printf(" %d", touch(&files, "wide/f3"));
+  printf(" %d\n", touch(&files, "wide-copy/f3"));
+  ls(&files, "wide/d7");
+  ls(&files, "wide-copy/d7");
+
+  rmfs(&files);
+
+  return 0;
+}
+
+/*
+ * print_file prints the contents of a file.
+ */
+static void print_file(Fs_sim *files, const char arg[])
+{
+  Fs_view view;
+  const char *bytes;
+  size_t length;
+
+  printf("%s:", arg);
+  if (read_open(files, arg, 0, 100, &view))
+  {
+    printf(" ");
+    while ((bytes = read_next(&view, &length)) != NULL)
+      fwrite(bytes, 1, length, stdout);
+  }
+  else printf(" not found\n");
+}
+
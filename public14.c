@@ -0,0 +1,96 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include "fs-sim.h"
+#include "file-checksum.h"
+
+/*
+ * Tests saving a filesystem with save_fs and loading it with load_fs. The
+ * image is loaded twice at once, so the second one cannot be mapped where it
+ * was saved from and has its pointers moved: both come back the same as the
+ * filesystem saved, with its names, links, copies, quota and contents, can
+ * be changed without the other seeing it, and leave the image file as it
+ * was, as a third load shows. Saving one of them back over the image it was
+ * loaded from leaves it working as it was, and a fourth load gets what it
+ * saved.
+ */
+
+#define IMAGE "public14.img"
+
+static void print_tree(Fs_sim *files);
+
+int main(void)
+{
+  Fs_sim files, first, second, third, fourth;
+  Fs_usage quota = {3, 0, 0};
+  char block[7000];
+  int i;
+
+  for (i = 0; i < (int) sizeof(block); i++)
+    block[i] = (char) ('A' + i % 26);
+
+  mkfs(&files);
+  mkdir(&files, "dir");
+  mkdir(&files, "dir/sub");
+  touch(&files, "dir/sub/big");
+  write_file(&files, "dir/sub/big", 0, block, sizeof(block));
+  touch(&files, "dir/hole");
+  write_file(&files, "dir/hole", 5000, "end\n", 4);
+  ln(&files, "dir/sub/big", "big-link");
+  cp(&files, "dir", "copy");
+  set_quota(&files, "dir/sub", &quota);
+
+  remove(IMAGE);
+  printf("%d\n", save_fs(&files, IMAGE));
+  rmfs(&files);
+
+  printf("%d", load_fs(&first, IMAGE));
+  printf(" %d\n", load_fs(&second, IMAGE));
+  print_tree(&first);
+  print_tree(&second);
+
+  /* each changed on its own */
+  printf("%d", touch(&first, "only-first"));
+  printf(" %d", write_file(&first, "big-link", 0, "first", 5));
+  printf(" %d", rm(&first, "copy"));
+  printf(" %d", mkdir(&second, "only-second"));
+  printf(" %d", append_file(&second, "copy/sub/big", "second\n", 7));
+  printf(" %d", touch(&second, "dir/sub/one"));
+  printf(" %d", touch(&second, "dir/sub/two"));
+  printf(" %d\n", touch(&second, "dir/sub/three"));
+  print_tree(&first);
+  print_tree(&second);
+
+  printf("%d\n", load_fs(&third, IMAGE));
+  print_tree(&third);
+
+  /* saved over the image it still has mapped */
+  printf("%d\n", save_fs(&second, IMAGE));
+  print_tree(&second);
+  printf("%d\n", load_fs(&fourth, IMAGE));
+  print_tree(&fourth);
+
+  rmfs(&first);
+  rmfs(&second);
+  rmfs(&third);
+  rmfs(&fourth);
+  remove(IMAGE);
+
+  return 0;
+}
+
+/*
+ * print_tree prints everything in the filesystem, and checksums of its files.
+ */
+static void print_tree(Fs_sim *files)
+{
+  Fs_entry entry;
+
+  ls_recursive(files, "/");
+  print_file(files, "/dir/sub/big");
+  print_file(files, "/big-link");
+  print_file(files, "/dir/hole");
+  print_file(files, "/copy/sub/big");
+  if (stat_entry(files, "/big-link", &entry))
+    printf("big-link: %lu links\n", entry.links);
+}
@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include "fs-sim.h"
+
+/*
+ * Tests that a copy of an Fs_sim, whose current directory was removed through
+ * another copy, finds out it was removed, even once the filesystem has reused
+ * the memory of the directories removed with it:
+ *
+ * - Commands run through the copy fail, and pwd says the directory is gone,
+ *   rather than running in a directory made later.
+ * - cd to an absolute path still works from it, and so does rmfs.
+ */
+
+int main(void)
+{
+  Fs_sim a, b;
+  char path[64];
+
+  mkfs(&a);
+  mkdir(&a, "x");
+  mkdir(&a, "x/y");
+  touch(&a, "x/y/old");
+
+  b = a;
+  printf("%d\n", cd(&b, "x/y"));
+  pwd(&b);
+
+  /* the directories below x are deallocated while b is still in y */
+  printf("%d", rm(&a, "x"));
+  printf(" %d", mkdir(&a, "z"));
+  printf(" %d", mkdir(&a, "q"));
+  printf(" %d", touch(&b, "f"));
+  printf(" %d", mkdir(&b, "d"));
+  printf(" %d\n", pwd_path(&b, path, sizeof(path)));
+  pwd(&b);
+  ls_recursive(&a, "/");
+
+  printf("%d\n", cd(&b, "/q"));
+  pwd(&b);
+  printf("%d\n", touch(&b, "f"));
+  ls_recursive(&a, "/");
+
+  rmfs(&a);
+
+  return 0;
+}
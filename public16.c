@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include "fs-sim.h"
+
+/*
+ * Tests the cases mv must refuse, and that a moved tree keeps its contents
+ * and counts against the quotas of where it went:
+ *
+ * - A move onto a name that exists, of a directory into itself or a directory
+ *   under it, of the root, or of something that is not there, fails.
+ * - A directory moved to another directory, or renamed in its own, takes its
+ *   whole tree along, and a current directory inside it stays there.
+ * - A move that would go over a quota fails and leaves the source where it
+ *   was, and a move within the directory is not counted again.
+ */
+
+int main(void)
+{
+  Fs_sim files, inside;
+  Fs_usage quota = {2, 0, 0};
+
+  mkfs(&files);
+  mkdir(&files, "a");
+  mkdir(&files, "a/b");
+  mkdir(&files, "a/b/c");
+  touch(&files, "a/file");
+  touch(&files, "a/b/c/deep");
+  touch(&files, "other");
+
+  /* what mv refuses */
+  printf("%d", mv(&files, "a", "a/b/moved"));
+  printf(" %d", mv(&files, "a", "a/moved"));
+  printf(" %d", mv(&files, "a", "other"));
+  printf(" %d", mv(&files, "missing", "moved"));
+  printf(" %d\n", mv(&files, "/", "moved"));
+
+  /* moving and renaming, with a current directory inside the tree */
+  inside = files;
+  cd(&inside, "a/b/c");
+  printf("%d", mkdir(&files, "to"));
+  printf(" %d", mv(&files, "a/b", "to/b"));
+  printf(" %d", mv(&files, "to/b", "to/renamed"));
+  printf(" %d", mv(&files, "other", "to/renamed/c/other"));
+  printf(" %d\n", touch(&inside, "made-inside"));
+  pwd(&inside);
+  ls_recursive(&files, "/");
+
+  /* moves under a quota */
+  mkdir(&files, "limited");
+  touch(&files, "limited/one");
+  printf("%d", set_quota(&files, "limited", &quota));
+  printf(" %d", mv(&files, "to/renamed", "limited/tree"));
+  printf(" %d", mv(&files, "to/renamed/c/deep", "limited/deep"));
+  printf(" %d", mv(&files, "limited/one", "limited/two"));
+  printf(" %d\n", touch(&files, "limited/three"));
+  ls_recursive(&files, "/");
+
+  rmfs(&files);
+
+  return 0;
+}
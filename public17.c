@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include "fs-sim.h"
+
+/*
+ * Tests the cases ln must refuse, and that the names it makes are all one
+ * file, found by the same inode number:
+ *
+ * - A directory cannot be given another name, nor can a name that exists or
+ *   something that is not there.
+ * - A file written through one of its names is seen through the others, in
+ *   any directory, but not in a copy of it.
+ * - A name moved with mv is still a name of the file, and the file stays
+ *   until its last name is removed, its inode number then going away.
+ */
+
+static void print_file(Fs_sim *files, const char arg[]);
+
+int main(void)
+{
+  Fs_sim files;
+  Fs_entry entry;
+  unsigned long id = 0;
+
+  mkfs(&files);
+  mkdir(&files, "dir");
+  mkdir(&files, "dir/sub");
+  touch(&files, "other");
+
+  /* what ln refuses */
+  printf("%d", ln(&files, "dir", "dir-link"));
+  printf(" %d", ln(&files, "other", "dir/sub"));
+  printf(" %d", ln(&files, "missing", "link"));
+  printf(" %d\n", ln(&files, "/", "root-link"));
+
+  /* names of one file */
+  printf("%d", ln(&files, "other", "link"));
+  printf(" %d", ln(&files, "link", "dir/sub/link"));
+  printf(" %d", write_file(&files, "dir/sub/link", 0, "shared\n", 7));
+  printf(" %d", cp(&files, "dir", "copy"));
+  printf(" %d\n", append_file(&files, "other", "more\n", 5));
+  print_file(&files, "other");
+  print_file(&files, "link");
+  print_file(&files, "dir/sub/link");
+  print_file(&files, "copy/sub/link");
+  if (stat_entry(&files, "other", &entry))
+    id = entry.id;
+  printf("%d\n", stat_entry(&files, "dir/sub/link", &entry) && entry.id == id);
+
+  /* taking the names away one at a time */
+  printf("%d", rm(&files, "other"));
+  printf(" %d", mv(&files, "link", "dir/renamed"));
+  printf(" %d\n", rm(&files, "dir/sub/link"));
+  print_file(&files, "dir/renamed");
+  printf("%d", stat_id(&files, id, &entry));
+  printf(" %d", rm(&files, "dir/renamed"));
+  printf(" %d\n", stat_id(&files, id, &entry));
+  print_file(&files, "dir/renamed");
+  print_file(&files, "copy/sub/link");
+
+  rmfs(&files);
+
+  return 0;
+}
+
+/*
+ * print_file prints how many names a file has and its contents.
+ */
+static void print_file(Fs_sim *files, const char arg[])
+{
+  Fs_entry entry;
+  Fs_view view;
+  const char *bytes;
+  size_t length;
+
+  if (stat_entry(files, arg, &entry) && read_open(files, arg, 0, 100, &view))
+  {
+    printf("%s: %lu links: ", arg, entry.links);
+    while ((bytes = read_next(&view, &length)) != NULL)
+      fwrite(bytes, 1, length, stdout);
+    if (entry.size == 0)
+      printf("\n");
+  }
+  else printf("%s: not found\n", arg);
+}
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include "fs-sim.h"
+
+/*
+ * Tests a directory holding thousands of files and sub directories added and
+ * removed in scrambled order, which in the FS_SIM_COMPACT build spreads its
+ * name index over many blocks, split and merged as they fill and empty:
+ *
+ * - Every name is found, or not, as it was added or removed, and du counts
+ *   them all.
+ * - ls lists names by pattern and a page at a time in order, across blocks.
+ * - A saved and loaded copy can still be changed, its blocks being taken over
+ *   from the image as they fill.
+ */
+
+#define COUNT 3000
+#define STEP 1237
+
+static void check_names(Fs_sim *files, int removed);
+
+int main(void)
+{
+  Fs_sim files, loaded;
+  Fs_usage usage;
+  char name[32], resume[32];
+  int i, j, result = 1;
+
+  mkfs(&files);
+  mkdir(&files, "wide");
+
+  /* STEP and COUNT have no common factor, so every name comes up once */
+  for (i = 0, j = 0; i < COUNT; i++, j = (j + STEP) % COUNT)
+  {
+    sprintf(name, j % 3 ? "wide/f%04d" : "wide/d%04d", j);
+    if ((j % 3 ? touch(&files, name) : mkdir(&files, name)) != 1)
+      result = 0;
+  }
+  printf("%d\n", result);
+  check_names(&files, 0);
+
+  /* removing every fourth name, in another order */
+  for (i = 0, j = 0, result = 1; i < COUNT; i++, j = (j + 7) % COUNT)
+  {
+    if (j % 4 == 0)
+    {
+      sprintf(name, j % 3 ? "wide/f%04d" : "wide/d%04d", j);
+      if (rm(&files, name) != 1)
+        result = 0;
+    }
+  }
+  printf("%d\n", result);
+  check_names(&files, 1);
+  du(&files, "wide", &usage);
+  printf("%lu files, %lu directories\n", usage.files, usage.directories);
+
+  ls(&files, "wide/f123?");
+  ls(&files, "wide/d29*");
+  printf("%d\n", ls_page(&files, "wide", "f2996", 5, resume, sizeof(resume)));
+  printf("%d\n", ls_page(&files, "wide", "d1490", 6, resume, sizeof(resume)));
+  printf("%d %s\n", ls_page(&files, "wide", resume, 3, resume,
+                            sizeof(resume)), resume);
+
+  printf("%d", save_fs(&files, "public18.img"));
+  printf(" %d", load_fs(&loaded, "public18.img"));
+  for (i = 0, j = 0, result = 1; i < COUNT; i++, j = (j + STEP) % COUNT)
+  {
+    sprintf(name, j % 3 ? "wide/f%04d" : "wide/d%04d", j);
+    if (j % 4 == 0 && (j % 3 ? touch(&loaded, name) : mkdir(&loaded, name))
+        != 1)
+      result = 0;
+  }
+  printf(" %d\n", result);
+  check_names(&loaded, 0);
+  ls(&loaded, "wide/f000*");
+
+  rmfs(&loaded);
+  rmfs(&files);
+  remove("public18.img");
+
+  return 0;
+}
+
+/*
+ * check_names prints 1 if every name is found, or not, as it should be, and 0
+ * otherwise.
+ *
+ * removed: 1 if every fourth name was removed, and 0 if all are there.
+ */
+static void check_names(Fs_sim *files, int removed)
+{
+  Fs_entry entry;
+  char name[32];
+  int i, gone, result = 1;
+
+  for (i = 0; i < COUNT; i++)
+  {
+    sprintf(name, i % 3 ? "wide/f%04d" : "wide/d%04d", i);
+    gone = removed && i % 4 == 0;
+    if (stat_entry(files, name, &entry) ? gone || entry.is_dir != (i % 3 == 0)
+                                        : !gone)
+      result = 0;
+  }
+
+  printf("%d\n", result);
+}
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include "fs-sim.h"
+
+/*
+ * Tests listing a directory a page at a time with ls_page, passing the resume
+ * name of each page as the name the next one starts after:
+ *
+ * - All of the entries are listed once and in order across the pages, with
+ *   and without a pattern, and resume is empty after the last page.
+ * - Entries added or removed in between pages do not make it skip or repeat
+ *   any others.
+ * - A resume too small for the name of the last entry of a page makes it
+ *   fail without listing anything, unless no entries are left after the page.
+ */
+
+static void list_pages(Fs_sim *files, const char arg[], size_t limit);
+
+int main(void)
+{
+  Fs_sim files;
+  char name[32], resume[32], small[4];
+  int i;
+
+  mkfs(&files);
+  mkdir(&files, "list");
+  for (i = 0; i < 12; i++)
+  {
+    sprintf(name, i % 3 ? "list/file%02d" : "list/dir%02d", i);
+    if (i % 3)
+      touch(&files, name);
+    else
+      mkdir(&files, name);
+  }
+  touch(&files, "list/a");
+  touch(&files, "list/zz");
+
+  list_pages(&files, "list", 5);
+  list_pages(&files, "list", 14);
+  list_pages(&files, "list/file*", 3);
+  list_pages(&files, "list/dir0?", 2);
+  list_pages(&files, "list/none*", 2);
+
+  /* entries added and removed in between two pages */
+  printf("%d %s\n", ls_page(&files, "list", NULL, 4, resume, sizeof(resume)),
+         resume);
+  rm(&files, "list/dir03");
+  rm(&files, "list/file05");
+  touch(&files, "list/b");
+  touch(&files, "list/file04a");
+  printf("%d %s\n", ls_page(&files, "list", resume, 5, resume,
+                            sizeof(resume)), resume);
+
+  /* a resume name that does not fit */
+  printf("%d\n", ls_page(&files, "list", NULL, 3, small, sizeof(small)));
+  printf("%d\n", ls_page(&files, "list/file*", "file08", 1, small,
+                         sizeof(small)));
+  printf("%d [%s]\n", ls_page(&files, "list/file*", "file10", 5, small,
+                              sizeof(small)), small);
+  printf("%d\n", ls_page(&files, "list", NULL, 0, resume, sizeof(resume)));
+
+  rmfs(&files);
+
+  return 0;
+}
+
+/*
+ * list_pages lists what ls would list for arg a page at a time, printing the
+ * result and the resume name of each page after it.
+ *
+ * files: The filesystem.
+ * arg: What to list.
+ * limit: The largest number of entries on a page.
+ */
+static void list_pages(Fs_sim *files, const char arg[], size_t limit)
+{
+  char resume[32];
+  int result;
+
+  resume[0] = '\0';
+  do
+  {
+    result = ls_page(files, arg, resume, limit, resume, sizeof(resume));
+    printf("-- %d [%s]\n", result, resume);
+  } while (result == 1 && resume[0] != '\0');
+}
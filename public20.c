@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include "fs-sim.h"
+
+/*
+ * Tests commands given paths with several components, which the path cache
+ * of the session remembers the directories of:
+ *
+ * - Absolute and relative paths, with empty components, single periods and
+ *   double periods, lead where they should, and a path through a file or a
+ *   missing name leads nowhere.
+ * - The same relative path from another current directory leads to the
+ *   directory under that one.
+ * - Once a directory on a path was removed or moved, the path no longer leads
+ *   to it, even after a directory made in its place takes its memory, and the
+ *   path leads to the new directory instead.
+ */
+
+static void show(Fs_sim *files, const char arg[]);
+
+int main(void)
+{
+  Fs_sim files;
+
+  mkfs(&files);
+  printf("%d", mkdir(&files, "a"));
+  printf(" %d", mkdir(&files, "a/b"));
+  printf(" %d", mkdir(&files, "/a/b/c"));
+  printf(" %d", mkdir(&files, "x"));
+  printf(" %d", mkdir(&files, "x/b"));
+  printf(" %d", mkdir(&files, "x/b/c"));
+  printf(" %d", touch(&files, "a/b/c/in-a"));
+  printf(" %d", touch(&files, "/x/b/c/in-x"));
+  printf(" %d\n", touch(&files, "a/file"));
+
+  show(&files, "/a/b/c");
+  show(&files, "a//b/./c/");
+  show(&files, "/a/b/../b/c/..");
+  show(&files, "/../../a/b");
+  show(&files, "a/file/c");
+  show(&files, "a/missing/c");
+
+  /* the same relative path, from two current directories */
+  printf("%d\n", cd(&files, "/a"));
+  show(&files, "b/c");
+  printf("%d\n", cd(&files, "../x"));
+  show(&files, "b/c");
+  printf("%d\n", cd(&files, "b/c/../../../a/b"));
+  pwd(&files);
+  printf("%d %d\n", cd(&files, "/a/file"), cd(&files, "c/missing"));
+  pwd(&files);
+
+  /* a directory on a path removed, and made again in its place */
+  show(&files, "/a/b/c");
+  printf("%d", cd(&files, "/"));
+  printf(" %d", rm(&files, "a/b"));
+  printf(" %d\n", cd(&files, "/a/b/c"));
+  show(&files, "/a/b/c");
+  printf("%d", mkdir(&files, "a/b"));
+  printf(" %d", mkdir(&files, "a/b/c"));
+  printf(" %d\n", touch(&files, "a/b/c/made-again"));
+  show(&files, "/a/b/c");
+
+  /* a directory on a path moved, and another moved in its place */
+  printf("%d", mv(&files, "/a/b", "/a/moved"));
+  printf(" %d", mv(&files, "/x/b", "/a/b"));
+  printf(" %d\n", touch(&files, "/a/moved/c/moved-away"));
+  show(&files, "/a/b/c");
+  show(&files, "/a/moved/c");
+  show(&files, "/x/b/c");
+
+  printf("%d\n", cd(&files, "/a/b/c"));
+  pwd(&files);
+
+  rmfs(&files);
+
+  return 0;
+}
+
+/*
+ * show prints the result of listing what a path leads to, after the listing.
+ *
+ * files: The filesystem.
+ * arg: The path.
+ */
+static void show(Fs_sim *files, const char arg[])
+{
+  int result;
+
+  printf("%s:\n", arg);
+  result = ls(files, arg);
+  printf("-- %d\n", result);
+}
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <string.h>
+#include "fs-sim.h"
+
+/*
+ * Tests pwd and pwd_path, which save the path of the current directory as cd
+ * moves around rather than building it for every call:
+ *
+ * - The path follows cd down, up with double periods, to the root, and along
+ *   paths with several components.
+ * - Renaming or moving a directory above the current one changes the path.
+ * - pwd_path fills a buffer just big enough, and fails on one a byte too
+ *   small, cutting the path short but terminating it.
+ * - Neither takes any memory from the filesystem.
+ */
+
+static void show(Fs_sim *files);
+
+int main(void)
+{
+  Fs_sim files;
+  Fs_memory before, after;
+  char path[64], small[8];
+  int i;
+
+  mkfs(&files);
+  show(&files);
+  mkdir(&files, "first");
+  mkdir(&files, "first/second");
+  mkdir(&files, "first/second/third");
+  mkdir(&files, "other");
+
+  printf("%d\n", cd(&files, "first"));
+  show(&files);
+  printf("%d\n", cd(&files, "second/third"));
+  show(&files);
+  printf("%d\n", cd(&files, ".."));
+  show(&files);
+  printf("%d\n", cd(&files, "./../../other/../first/second/third/."));
+  show(&files);
+  printf("%d\n", cd(&files, "missing"));
+  show(&files);
+  printf("%d\n", cd(&files, "/"));
+  show(&files);
+  printf("%d\n", cd(&files, ".."));
+  show(&files);
+
+  /* directories above the current one renamed and moved */
+  printf("%d\n", cd(&files, "first/second/third"));
+  printf("%d\n", mv(&files, "/first", "/renamed"));
+  show(&files);
+  printf("%d\n", mv(&files, "/renamed/second", "/other/second"));
+  show(&files);
+  printf("%d\n", cd(&files, ".."));
+  show(&files);
+
+  /* buffers of every size around the length of the path */
+  printf("%d %s\n", pwd_path(&files, path, strlen("/other/second") + 1),
+         path);
+  printf("%d %s\n", pwd_path(&files, path, strlen("/other/second")), path);
+  printf("%d %s\n", pwd_path(&files, small, sizeof(small)), small);
+  printf("%d %d\n", pwd_path(&files, path, 0), pwd_path(&files, NULL, 10));
+
+  memory_stats(&files, &before);
+  for (i = 0; i < 100; i++)
+  {
+    cd(&files, i % 2 ? "/renamed" : "/other/second");
+    pwd_path(&files, path, sizeof(path));
+  }
+  memory_stats(&files, &after);
+  printf("%s %lu\n", path, after.allocations - before.allocations);
+
+  rmfs(&files);
+
+  return 0;
+}
+
+/*
+ * show prints the path of the current directory with pwd, and as pwd_path
+ * saves it.
+ *
+ * files: The filesystem.
+ */
+static void show(Fs_sim *files)
+{
+  char path[64];
+
+  pwd(files);
+  printf("%d %s\n", pwd_path(files, path, sizeof(path)), path);
+}
@@ -0,0 +1,234 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fs-sim.h"
+
+/*
+ * Tests reading what ls would list one entry at a time through a cursor, and
+ * that ls, which prints through a buffer, still prints the same lines:
+ *
+ * - ls_open and ls_next return the entries of a directory, a file, a
+ *   pattern, the parent directory and the root in increasing order of names,
+ *   with the directories marked, and fail on a missing name.
+ * - A cursor over a copy made by cp, changed since, returns the entries of
+ *   the copy, merged with those it still shares with the tree it was copied
+ *   from.
+ * - A cursor from a session reads the same entries as one from ls_open.
+ * - ls prints exactly the lines read through a cursor, for a directory whose
+ *   listing is many times the size of the buffer and holds a name longer
+ *   than the buffer.
+ */
+
+#define COUNT 3000
+#define LONG_NAME 20000
+#define CAPTURE "public22.out"
+
+static void read_cursor(Fs_sim *files, const char arg[]);
+static char *list_cursor(Fs_sim *files, const char arg[], size_t *length);
+static char *capture_ls(Fs_sim *files, const char arg[], size_t *length);
+
+int main(void)
+{
+  Fs_sim files;
+  Fs_session *session;
+  Fs_cursor cursor;
+  const char *name;
+  char path[32], *long_name, *listed, *printed;
+  size_t listed_length, printed_length;
+  int i, is_dir;
+
+  mkfs(&files);
+  mkdir(&files, "dir");
+  mkdir(&files, "dir/m");
+  touch(&files, "dir/b");
+  mkdir(&files, "dir/a");
+  touch(&files, "dir/z");
+  touch(&files, "dir/n");
+  mkdir(&files, "empty");
+  touch(&files, "top");
+
+  read_cursor(&files, "dir");
+  read_cursor(&files, "dir/b");
+  read_cursor(&files, "dir/?");
+  read_cursor(&files, "empty");
+  read_cursor(&files, "/");
+  read_cursor(&files, "missing");
+  cd(&files, "dir/m");
+  read_cursor(&files, "..");
+  cd(&files, "/");
+
+  /* a changed copy, sharing the rest of its entries with dir */
+  cp(&files, "dir", "copy");
+  rm(&files, "copy/b");
+  touch(&files, "copy/c");
+  mkdir(&files, "copy/y");
+  rm(&files, "dir/z");
+  read_cursor(&files, "copy");
+  read_cursor(&files, "dir");
+
+  session = session_open(&files);
+  session_cd(session, "copy");
+  if (session_ls_open(session, ".", &cursor) == 1)
+  {
+    while ((name = ls_next(&cursor, &is_dir)) != NULL)
+      printf(is_dir ? "%s/ " : "%s ", name);
+    printf("%d\n", ls_next(&cursor, NULL) == NULL);
+    session_ls_close(session, &cursor);
+  }
+  session_close(session);
+
+  /* a listing far bigger than the buffer of ls */
+  mkdir(&files, "wide");
+  for (i = 0; i < COUNT; i++)
+  {
+    sprintf(path, i % 5 ? "wide/file%05d" : "wide/dir%05d", i);
+    if (i % 5)
+      touch(&files, path);
+    else
+      mkdir(&files, path);
+  }
+  long_name = malloc(LONG_NAME + 6);
+  if (long_name == NULL)
+    return 1;
+  strcpy(long_name, "wide/");
+  memset(long_name + 5, 'l', LONG_NAME);
+  long_name[LONG_NAME + 5] = '\0';
+  touch(&files, long_name);
+
+  listed = list_cursor(&files, "wide", &listed_length);
+  printed = capture_ls(&files, "wide", &printed_length);
+  printf("%lu %d\n", (unsigned long) listed_length,
+         listed != NULL && printed != NULL &&
+         listed_length == printed_length &&
+         !memcmp(listed, printed, listed_length));
+
+  free(listed);
+  free(printed);
+  free(long_name);
+  rmfs(&files);
+
+  return 0;
+}
+
+/*
+ * read_cursor prints the entries a cursor set up by ls_open returns on one
+ * line, or the result of ls_open if it fails.
+ *
+ * files: The filesystem.
+ * arg: What to list, as it would be given to ls.
+ */
+static void read_cursor(Fs_sim *files, const char arg[])
+{
+  Fs_cursor cursor;
+  const char *name;
+  int is_dir, result = ls_open(files, arg, &cursor);
+
+  printf("%s: ", arg);
+  if (result == 1)
+  {
+    while ((name = ls_next(&cursor, &is_dir)) != NULL)
+      printf(is_dir ? "%s/ " : "%s ", name);
+    printf("\n");
+  }
+  else printf("%d\n", result);
+}
+
+/*
+ * list_cursor returns the lines ls would print, built from a cursor, with
+ * their length saved in length, or NULL if memory ran out.
+ *
+ * files: The filesystem.
+ * arg: What to list.
+ * length: Where to save the length of the lines.
+ */
+static char *list_cursor(Fs_sim *files, const char arg[], size_t *length)
+{
+  Fs_cursor cursor;
+  const char *name;
+  char *lines = NULL, *grown;
+  size_t used = 0, size = 0, name_length;
+  int is_dir;
+
+  *length = 0;
+  if (ls_open(files, arg, &cursor) == 1)
+  {
+    while ((name = ls_next(&cursor, &is_dir)) != NULL)
+    {
+      name_length = strlen(name);
+      if (used + name_length + 2 > size)
+      {
+        size = 2 * (used + name_length + 2);
+        grown = realloc(lines, size);
+        if (grown == NULL)
+        {
+          free(lines);
+          return NULL;
+        }
+        lines = grown;
+      }
+      memcpy(lines + used, name, name_length);
+      used += name_length;
+      if (is_dir)
+        lines[used++] = '/';
+      lines[used++] = '\n';
+    }
+  }
+
+  *length = used;
+  return lines;
+}
+
+/*
+ * capture_ls returns what ls prints, with its length saved in length, or
+ * NULL if it could not be read back.
+ *
+ * files: The filesystem.
+ * arg: What to list.
+ * length: Where to save the length of what was printed.
+ */
+static char *capture_ls(Fs_sim *files, const char arg[], size_t *length)
+{
+  FILE *capture;
+  char *printed = NULL;
+  long size;
+  int saved, output;
+
+  *length = 0;
+  fflush(stdout);
+  saved = dup(STDOUT_FILENO);
+  output = open(CAPTURE, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (saved < 0 || output < 0)
+    return NULL;
+  dup2(output, STDOUT_FILENO);
+  close(output);
+
+  ls(files, arg);
+
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+
+  capture = fopen(CAPTURE, "rb");
+  if (capture != NULL)
+  {
+    fseek(capture, 0, SEEK_END);
+    size = ftell(capture);
+    rewind(capture);
+    printed = malloc(size > 0 ? size : 1);
+    if (printed != NULL && fread(printed, 1, size, capture) == (size_t) size)
+      *length = size;
+    else
+    {
+      free(printed);
+      printed = NULL;
+    }
+    fclose(capture);
+  }
+  remove(CAPTURE);
+
+  return printed;
+}
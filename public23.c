@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <string.h>
+#include "fs-sim.h"
+
+/*
+ * Tests running commands a whole buffer or script file at a time with
+ * run_batch and run_script:
+ *
+ * - The commands print the same as calling the functions one after another,
+ *   and their results are saved in order, with FS_SIM_UNKNOWN for a line
+ *   that is not a command. Blank lines, tabs and extra spaces are skipped.
+ * - A run of commands in one directory stops using the directory once it was
+ *   removed, or once cd makes the same relative path lead elsewhere.
+ * - Only as many results are saved as there is room for, and none without
+ *   an array, while every command is still run and counted.
+ * - rmfs and mkfs in the middle of a script start a new filesystem, and a
+ *   script file that is not there fails.
+ */
+
+#define SCRIPT "public23.script"
+
+static const char commands[] =
+  "mkdir a\n"
+  "mkdir a/b\n"
+  "touch a/b/one\n"
+  "\t touch   a/b/two  \n"
+  "\n"
+  "ls a/b\n"
+  "rm a/b\n"
+  "touch a/b/three\n"
+  "mkdir a/b\n"
+  "touch a/b/four\n"
+  "ls a/b\n"
+  "cd a\n"
+  "touch b/five\n"
+  "cd b\n"
+  "touch b/six\n"
+  "pwd\n"
+  "frobnicate x\n"
+  "ls\n"
+  "cd /\n"
+  "rm a/b/one\n"
+  "ls a/b";
+
+static const char script[] =
+  "touch kept\n"
+  "rmfs\n"
+  "mkfs\n"
+  "touch new\n"
+  "ls /\n";
+
+static void run_calls(Fs_sim *files);
+static void print_status(long count, const int status[], size_t size);
+
+int main(void)
+{
+  Fs_sim files;
+  FILE *file;
+  int status[32];
+  long count;
+
+  mkfs(&files);
+  count = run_batch(&files, commands, strlen(commands), status, 32);
+  print_status(count, status, 32);
+  rmfs(&files);
+
+  printf("--\n");
+  mkfs(&files);
+  run_calls(&files);
+  rmfs(&files);
+
+  printf("--\n");
+  mkfs(&files);
+  count = run_batch(&files, commands, strlen(commands), status, 3);
+  print_status(count, status, 3);
+  rmfs(&files);
+  mkfs(&files);
+  printf("%ld\n", run_batch(&files, commands, strlen(commands), NULL, 32));
+  rmfs(&files);
+
+  printf("--\n");
+  file = fopen(SCRIPT, "w");
+  if (file == NULL)
+    return 1;
+  fputs(script, file);
+  fclose(file);
+
+  mkfs(&files);
+  count = run_script(&files, SCRIPT, status, 32);
+  print_status(count, status, 32);
+  printf("%ld\n", run_script(&files, "missing.script", status, 32));
+  rmfs(&files);
+  remove(SCRIPT);
+
+  return 0;
+}
+
+/*
+ * run_calls makes the calls the commands stand for, one after another.
+ *
+ * files: The filesystem.
+ */
+static void run_calls(Fs_sim *files)
+{
+  printf("%d", mkdir(files, "a"));
+  printf(" %d", mkdir(files, "a/b"));
+  printf(" %d", touch(files, "a/b/one"));
+  printf(" %d\n", touch(files, "a/b/two"));
+  printf("%d\n", ls(files, "a/b"));
+  printf("%d", rm(files, "a/b"));
+  printf(" %d", touch(files, "a/b/three"));
+  printf(" %d", mkdir(files, "a/b"));
+  printf(" %d\n", touch(files, "a/b/four"));
+  printf("%d\n", ls(files, "a/b"));
+  printf("%d", cd(files, "a"));
+  printf(" %d", touch(files, "b/five"));
+  printf(" %d", cd(files, "b"));
+  printf(" %d\n", touch(files, "b/six"));
+  pwd(files);
+  printf("%d\n", ls(files, ""));
+  printf("%d", cd(files, "/"));
+  printf(" %d\n", rm(files, "a/b/one"));
+  printf("%d\n", ls(files, "a/b"));
+}
+
+/*
+ * print_status prints the number of commands run and the results saved.
+ *
+ * count: The number of commands run.
+ * status: The results.
+ * size: The number of results status has room for.
+ */
+static void print_status(long count, const int status[], size_t size)
+{
+  long i;
+
+  printf("%ld:", count);
+  for (i = 0; i < count && (size_t) i < size; i++)
+    printf(" %d", status[i]);
+  printf("\n");
+}
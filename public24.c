@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <string.h>
+#include "fs-sim.h"
+
+/*
+ * Tests the statistics fs_stats reports. Built with FS_SIM_STATS, every call
+ * of touch, mkdir, cd, ls, pwd and rm is counted as succeeding or failing and
+ * in exactly one latency bucket, and the name lookups and inserts are
+ * counted, each going through only a few list nodes and names once the name
+ * index of a wide directory is used. Built without it, fs_stats and
+ * print_stats fail, and so does the stats command of run_batch.
+ */
+
+#define COUNT 2000
+
+static const char *names[FS_STATS_OPERATIONS] = {
+  "touch", "mkdir", "cd", "ls", "pwd", "rm"
+};
+
+static void print_counts(const Fs_stats *stats);
+
+int main(void)
+{
+  Fs_sim files;
+  Fs_stats stats, wide;
+  char name[32];
+  int status[2], i, result = 1;
+
+  mkfs(&files);
+  mkdir(&files, "dir");
+  mkdir(&files, "dir");
+  mkdir(&files, "dir/sub");
+  touch(&files, "dir/file");
+  touch(&files, "missing/file");
+  cd(&files, "dir/sub");
+  cd(&files, "nowhere");
+  pwd(&files);
+  cd(&files, "/");
+  ls(&files, "dir");
+  ls(&files, "missing");
+  rm(&files, "dir/file");
+  rm(&files, "dir/file");
+
+  if (fs_stats(&files, &stats))
+  {
+    print_counts(&stats);
+
+    /* lookups and inserts in a directory wide enough to be indexed */
+    mkdir(&files, "wide");
+    for (i = 0; i < COUNT; i++)
+    {
+      sprintf(name, "wide/f%04d", (i * 7) % COUNT);
+      if (touch(&files, name) != 1)
+        result = 0;
+    }
+    for (i = 0; i < COUNT; i++)
+    {
+      sprintf(name, "wide/f%04d", i);
+      if (touch(&files, name) != 0)
+        result = 0;
+    }
+    fs_stats(&files, &wide);
+    printf("%d %lu %lu %d %d\n", result, wide.inserts - stats.inserts,
+           wide.lookups - stats.lookups,
+           wide.lookup_nodes - stats.lookup_nodes <
+           4 * (wide.lookups - stats.lookups),
+           wide.insert_compares - stats.insert_compares <
+           4 * (wide.inserts - stats.inserts));
+  }
+  else
+  {
+    memset(&wide, 0, sizeof(wide));
+    printf("%d\n", !memcmp(&stats, &wide, sizeof(stats)));
+    printf("%d\n", print_stats(&files));
+    printf("%ld", run_batch(&files, "pwd\nstats\n", 10, status, 2));
+    printf(" %d %d\n", status[0], status[1]);
+  }
+
+  rmfs(&files);
+
+  return 0;
+}
+
+/*
+ * print_counts prints the calls, successes and failures of each command, and
+ * whether every call was counted in one latency bucket.
+ *
+ * stats: The statistics.
+ */
+static void print_counts(const Fs_stats *stats)
+{
+  unsigned long bucketed;
+  int i, j;
+
+  for (i = 0; i < FS_STATS_OPERATIONS; i++)
+  {
+    for (j = 0, bucketed = 0; j < FS_STATS_BUCKETS; j++)
+      bucketed += stats->operations[i].latency[j];
+    printf("%s: %lu calls, %lu succeeded, %lu failed, %d\n", names[i],
+           stats->operations[i].calls, stats->operations[i].successes,
+           stats->operations[i].failures,
+           bucketed == stats->operations[i].calls);
+  }
+  printf("%d %d\n", stats->lookups > 0, stats->inserts == 3);
+}
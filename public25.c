@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include "fs-sim.h"
+
+/*
+ * Tests creating many files or directories in one directory at once with
+ * touch_many and mkdir_many, against touch and mkdir called once per name on
+ * another filesystem built the same way:
+ *
+ * - Each name gets the result touch or mkdir would give it in the same
+ *   order, including names given twice, names already taken by a file or a
+ *   directory, names that are not allowed, and names over a quota.
+ * - The directory ends up the same, also when it is a copy made by cp that
+ *   still shares entries with the tree it was copied from.
+ * - Thousands of unsorted names merged into a directory already holding
+ *   thousands are all there afterwards, and a missing directory fails.
+ */
+
+#define COUNT 4000
+
+static const char *files_to_make[] = {
+  "m", "b", "", "z", "b", "sub", "a", ".", "..", "x/y", "old", "c"
+};
+
+static const char *directories_to_make[] = {
+  "k", "old", "k", "d", "sub", "/", "e"
+};
+
+static const char *copy_names[] = {
+  "q", "a", "r", "s", "old", "t"
+};
+
+static void build(Fs_sim *files);
+static void print_status(const int status[], size_t count);
+
+int main(void)
+{
+  Fs_sim many, single;
+  Fs_usage quota = {8, 0, 0}, usage;
+  const char *names[COUNT];
+  char buffer[COUNT][8];
+  int status[COUNT];
+  size_t count, i;
+  int result;
+
+  build(&many);
+  build(&single);
+
+  count = sizeof(files_to_make) / sizeof(files_to_make[0]);
+  printf("%d\n", touch_many(&many, "dir", files_to_make, count, status));
+  print_status(status, count);
+  cd(&single, "dir");
+  for (i = 0; i < count; i++)
+    status[i] = touch(&single, files_to_make[i]);
+  print_status(status, count);
+
+  count = sizeof(directories_to_make) / sizeof(directories_to_make[0]);
+  printf("%d\n", mkdir_many(&many, "/dir", directories_to_make, count,
+                            status));
+  print_status(status, count);
+  for (i = 0; i < count; i++)
+    status[i] = mkdir(&single, directories_to_make[i]);
+  print_status(status, count);
+  cd(&single, "/");
+
+  ls(&many, "dir");
+  ls(&single, "dir");
+
+  /* a copy sharing entries with dir, and a quota on it */
+  cp(&many, "dir", "copy");
+  cp(&single, "dir", "copy");
+  set_quota(&many, "copy", &quota);
+  set_quota(&single, "copy", &quota);
+  count = sizeof(copy_names) / sizeof(copy_names[0]);
+  printf("%d\n", touch_many(&many, "copy", copy_names, count, status));
+  print_status(status, count);
+  cd(&single, "copy");
+  for (i = 0; i < count; i++)
+    status[i] = touch(&single, copy_names[i]);
+  print_status(status, count);
+  cd(&single, "/");
+  ls(&many, "copy");
+  ls(&single, "copy");
+  ls(&many, "dir");
+
+  /* thousands of names, half of them taken already */
+  mkdir(&many, "wide");
+  for (i = 0; i < COUNT; i++)
+  {
+    sprintf(buffer[i], "n%04lu", (unsigned long) ((i * 7) % COUNT));
+    names[i] = buffer[i];
+  }
+  printf("%d\n", touch_many(&many, "wide", names, COUNT / 2, status));
+  printf("%d\n", touch_many(&many, "wide", names, COUNT, status));
+  for (i = 0, result = 1; i < COUNT; i++)
+    if (status[i] != (i >= COUNT / 2))
+      result = 0;
+  du(&many, "wide", &usage);
+  printf("%d %lu\n", result, usage.files);
+  ls(&many, "wide/n000?");
+  ls(&many, "wide/n399?");
+
+  printf("%d %d\n", touch_many(&many, "missing", names, 1, status),
+         mkdir_many(&many, "wide/n0001", names, 1, status));
+
+  rmfs(&many);
+  rmfs(&single);
+
+  return 0;
+}
+
+/*
+ * build makes a filesystem with a directory holding a file and a sub
+ * directory.
+ *
+ * files: The filesystem.
+ */
+static void build(Fs_sim *files)
+{
+  mkfs(files);
+  mkdir(files, "dir");
+  touch(files, "dir/old");
+  mkdir(files, "dir/sub");
+}
+
+/*
+ * print_status prints the results saved for some names on one line.
+ *
+ * status: The results.
+ * count: The number of results.
+ */
+static void print_status(const int status[], size_t count)
+{
+  size_t i;
+
+  for (i = 0; i < count; i++)
+    printf(i > 0 ? " %d" : "%d", status[i]);
+  printf("\n");
+}
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include "fs-sim.h"
+
+/*
+ * Tests the name table, which saves every distinct name of the files and
+ * directories of a filesystem once, as memory_stats reports it:
+ *
+ * - Names repeated in many directories are saved once and counted by each
+ *   file and directory holding them, and the bytes a copy per entry would
+ *   take are reported as saved.
+ * - rm, mv and ln count names out and in as they remove, rename and add
+ *   entries, a name is given back once nothing holds it, and removing every
+ *   entry leaves the table as mkfs made it.
+ * - A name held only in another directory, or given back and added again,
+ *   is still looked up correctly.
+ * - A saved and loaded filesystem reports the same names.
+ */
+
+#define IMAGE "public26.img"
+
+static const char *common[] = {"index", "data", "tmp"};
+
+static void print_names(Fs_sim *files, const Fs_memory *start);
+
+int main(void)
+{
+  Fs_sim files, loaded;
+  Fs_memory start;
+  char path[32];
+  int i, j;
+
+  mkfs(&files);
+  memory_stats(&files, &start);
+
+  for (i = 0; i < 10; i++)
+  {
+    sprintf(path, "d%d", i);
+    mkdir(&files, path);
+    for (j = 0; j < 3; j++)
+    {
+      sprintf(path, "d%d/%s", i, common[j]);
+      if (j == 1)
+        mkdir(&files, path);
+      else
+        touch(&files, path);
+    }
+  }
+  print_names(&files, &start);
+
+  /* names held only elsewhere, given back and added again */
+  printf("%d", rm(&files, "d3/index"));
+  printf(" %d", touch(&files, "d3/index"));
+  printf(" %d", touch(&files, "d4/index"));
+  printf(" %d", touch(&files, "d4/unique"));
+  printf(" %d", rm(&files, "d4/unique"));
+  printf(" %d", touch(&files, "d5/unique"));
+  printf(" %d\n", touch(&files, "d5/unique"));
+  print_names(&files, &start);
+
+  /* a rename, a link and a removed directory */
+  printf("%d", mv(&files, "d5/unique", "d6/renamed"));
+  printf(" %d", ln(&files, "d6/renamed", "d7/tmp2"));
+  printf(" %d\n", rm(&files, "d9"));
+  print_names(&files, &start);
+  ls(&files, "d6");
+  ls(&files, "d7");
+
+  printf("%d", save_fs(&files, IMAGE));
+  printf(" %d\n", load_fs(&loaded, IMAGE));
+  print_names(&loaded, &start);
+  rmfs(&loaded);
+  remove(IMAGE);
+
+  for (i = 0; i < 9; i++)
+  {
+    sprintf(path, "d%d", i);
+    rm(&files, path);
+  }
+  reclaim(&files, 0);
+  print_names(&files, &start);
+
+  rmfs(&files);
+
+  return 0;
+}
+
+/*
+ * print_names prints the counts of the name table, less those mkfs started
+ * with.
+ *
+ * files: The filesystem.
+ * start: What memory_stats reported right after mkfs.
+ */
+static void print_names(Fs_sim *files, const Fs_memory *start)
+{
+  Fs_memory stats;
+
+  memory_stats(files, &stats);
+  printf("%lu names, %lu references, %lu bytes saved\n",
+         stats.names - start->names,
+         stats.name_references - start->name_references,
+         stats.name_bytes_saved - start->name_bytes_saved);
+}